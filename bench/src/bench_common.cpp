@@ -0,0 +1,357 @@
+
+#include "bench_common.hpp"
+#include "allocation.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+
+namespace
+{
+
+uint_fast64_t time_iterations(benchmark &benchmark, unsigned int iterations)
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned int iteration = 0; iteration < iterations; iteration++)
+	{
+		benchmark.run();
+	}
+
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Accounts the allocations of the calling thread while it exists.
+ */
+class allocation_counter : public allocation::listener
+{
+	allocation::listener * const previous;
+	int_fast64_t live_bytes;
+
+public:
+	uint_fast64_t allocations;
+	uint_fast64_t bytes_allocated;
+	int_fast64_t peak_bytes;
+
+	allocation_counter() : previous(allocation::set_listener(this)), live_bytes(0), allocations(0),
+			bytes_allocated(0), peak_bytes(0) { }
+
+	~allocation_counter()
+	{
+		allocation::set_listener(previous);
+	}
+
+	virtual void allocated(std::size_t bytes)
+	{
+		allocations++;
+		bytes_allocated += bytes;
+		live_bytes += bytes;
+		if (live_bytes > peak_bytes)
+		{
+			peak_bytes = live_bytes;
+		}
+	}
+
+	virtual void released(std::size_t bytes)
+	{
+		live_bytes -= bytes;
+	}
+};
+
+/**
+ * Returns the value in the given sorted samples that is above the given percentage of them.
+ */
+double percentile(const std::vector<double> &sorted_samples, unsigned int percentage)
+{
+	const unsigned int index = (sorted_samples.size() * percentage + 99) / 100;
+	return sorted_samples[(index > 0)? index - 1 : 0];
+}
+
+void print_json_string(std::ostream &stream, const std::string &text)
+{
+	stream << '"';
+	for (std::string::const_iterator it = text.begin(); it != text.end(); ++it)
+	{
+		if (*it == '"' || *it == '\\')
+		{
+			stream << '\\';
+		}
+
+		stream << *it;
+	}
+
+	stream << '"';
+}
+
+/**
+ * Sum of the given event for all stages.
+ */
+uint_fast64_t total_count(const benchmark_result &result, unsigned int event)
+{
+	uint_fast64_t total = 0;
+	for (unsigned int stage = 0; stage < decode_stats::STAGE_AMOUNT; stage++)
+	{
+		total += result.counters[stage][event];
+	}
+
+	return total;
+}
+
+bool stage_counted(const benchmark_result &result, unsigned int stage)
+{
+	for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+	{
+		if (result.counters[stage][event] != 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Prints a table with a row per stage and a column per event, each value divided by units.
+ */
+void print_counters_table(std::ostream &stream, const benchmark_result &result, double units,
+		const char *unit_name)
+{
+	stream << "  " << std::left << std::setw(20) << unit_name << std::right;
+	for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+	{
+		stream << std::setw(16) << perf_counters::event_name(static_cast<perf_counters::event_e>(event));
+	}
+	stream << std::endl;
+
+	for (unsigned int stage = 0; stage <= decode_stats::STAGE_AMOUNT; stage++)
+	{
+		if (stage < decode_stats::STAGE_AMOUNT && !stage_counted(result, stage))
+		{
+			continue;
+		}
+
+		stream << "  " << std::left << std::setw(20) << ((stage < decode_stats::STAGE_AMOUNT)?
+				decode_stats::stage_name(static_cast<decode_stats::stage_e>(stage)) : "total") << std::right;
+		for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+		{
+			if (!result.counter_available[event])
+			{
+				stream << std::setw(16) << "n/a";
+				continue;
+			}
+
+			const uint_fast64_t value = (stage < decode_stats::STAGE_AMOUNT)?
+					result.counters[stage][event] : total_count(result, event);
+			stream << std::setw(16) << std::fixed << std::setprecision(1) << value / units;
+		}
+		stream << std::endl;
+	}
+}
+
+void print_text_counters(std::ostream &stream, const std::vector<benchmark_result> &results)
+{
+	for (std::vector<benchmark_result>::const_iterator it = results.begin(); it != results.end(); ++it)
+	{
+		if (!it->has_counters || it->mcus == 0 || it->pixels == 0)
+		{
+			continue;
+		}
+
+		stream << std::endl << it->name << " (" << it->mcus << " MCUs, " << it->pixels << " pixels)" << std::endl;
+		print_counters_table(stream, *it, it->mcus, "per MCU");
+		print_counters_table(stream, *it, it->pixels / 1000000.0, "per megapixel");
+	}
+}
+
+void print_json_counters(std::ostream &stream, const benchmark_result &result)
+{
+	stream << ", \"mcus\": " << result.mcus << ", \"counters\": [";
+	bool first = true;
+	for (unsigned int stage = 0; stage < decode_stats::STAGE_AMOUNT; stage++)
+	{
+		for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+		{
+			if (result.counter_available[event] && stage_counted(result, stage))
+			{
+				const uint_fast64_t value = result.counters[stage][event];
+				stream << (first? "" : ", ") << "{\"stage\": ";
+				print_json_string(stream, decode_stats::stage_name(static_cast<decode_stats::stage_e>(stage)));
+				stream << ", \"event\": ";
+				print_json_string(stream, perf_counters::event_name(static_cast<perf_counters::event_e>(event)));
+				stream << ", \"total\": " << value << std::fixed << std::setprecision(3)
+						<< ", \"per_mcu\": " << ((result.mcus != 0)? static_cast<double>(value) / result.mcus : 0)
+						<< ", \"per_megapixel\": " << ((result.pixels != 0)? value / (result.pixels / 1000000.0) : 0)
+						<< '}';
+				first = false;
+			}
+		}
+	}
+	stream << ']';
+}
+
+}
+
+double benchmark_result::megapixels_per_second() const
+{
+	return (median_nanoseconds > 0)? pixels * 1000.0 / median_nanoseconds : 0;
+}
+
+double benchmark_result::peak_bytes_per_megapixel() const
+{
+	return (pixels > 0)? peak_bytes / (pixels / 1000000.0) : 0;
+}
+
+benchmark_result measure(benchmark &benchmark, unsigned int repetitions,
+		uint_fast64_t min_sample_nanoseconds)
+{
+	benchmark_result result;
+	result.name = benchmark.name();
+	result.pixels = benchmark.pixels();
+	result.repetitions = (repetitions > 0)? repetitions : 1;
+	result.has_counters = false;
+	result.mcus = 0;
+
+	const uint_fast64_t warm_up = time_iterations(benchmark, 1);
+	result.iterations = (warm_up >= min_sample_nanoseconds)? 1 :
+			static_cast<unsigned int>(min_sample_nanoseconds / (warm_up + 1) + 1);
+
+	std::vector<double> samples(result.repetitions);
+	for (unsigned int repetition = 0; repetition < result.repetitions; repetition++)
+	{
+		samples[repetition] = static_cast<double>(time_iterations(benchmark, result.iterations)) / result.iterations;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	result.median_nanoseconds = percentile(samples, 50);
+	result.p95_nanoseconds = percentile(samples, 95);
+
+	const allocation_counter counter;
+	benchmark.run();
+	result.allocations = counter.allocations;
+	result.bytes_allocated = counter.bytes_allocated;
+	result.peak_bytes = counter.peak_bytes;
+	return result;
+}
+
+void measure_counters(benchmark &benchmark, const perf_counters &counters, benchmark_result &result)
+{
+	if (!counters.any_available())
+	{
+		return;
+	}
+
+	decode_stats stats;
+	stage_counters listener(counters);
+	stats.listener = &listener;
+
+	if (!benchmark.run_with_stats(stats))
+	{
+		return;
+	}
+	listener.finish();
+
+	result.has_counters = true;
+	result.mcus = stats.mcus_decoded;
+	for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+	{
+		result.counter_available[event] = counters.available(static_cast<perf_counters::event_e>(event));
+		for (unsigned int stage = 0; stage < decode_stats::STAGE_AMOUNT; stage++)
+		{
+			result.counters[stage][event] = listener.values[stage][event];
+		}
+	}
+}
+
+void print_results(std::ostream &stream, report_format::report_format_e format,
+		const std::vector<benchmark_result> &results)
+{
+	switch (format)
+	{
+	case report_format::TEXT:
+		stream << std::left << std::setw(64) << "benchmark" << std::right << std::setw(14) << "median (us)"
+				<< std::setw(14) << "p95 (us)" << std::setw(12) << "MP/s" << std::setw(10) << "allocs"
+				<< std::setw(16) << "peak (B/MP)" << std::endl;
+		for (std::vector<benchmark_result>::const_iterator it = results.begin(); it != results.end(); ++it)
+		{
+			stream << std::left << std::setw(64) << it->name << std::right << std::fixed << std::setprecision(3)
+					<< std::setw(14) << it->median_nanoseconds / 1000 << std::setw(14) << it->p95_nanoseconds / 1000
+					<< std::setw(12) << it->megapixels_per_second() << std::setw(10) << it->allocations
+					<< std::setw(16) << std::setprecision(0) << it->peak_bytes_per_megapixel() << std::endl;
+		}
+		print_text_counters(stream, results);
+		break;
+
+	case report_format::CSV:
+		stream << "benchmark,pixels,repetitions,iterations,median_ns,p95_ns,megapixels_per_second,allocations,"
+				"bytes_allocated,peak_bytes,peak_bytes_per_megapixel" << std::endl;
+		for (std::vector<benchmark_result>::const_iterator it = results.begin(); it != results.end(); ++it)
+		{
+			stream << it->name << ',' << it->pixels << ',' << it->repetitions << ',' << it->iterations << ','
+					<< std::fixed << std::setprecision(1) << it->median_nanoseconds << ',' << it->p95_nanoseconds
+					<< ',' << std::setprecision(3) << it->megapixels_per_second() << ',' << it->allocations << ','
+					<< it->bytes_allocated << ',' << it->peak_bytes << ',' << std::setprecision(1)
+					<< it->peak_bytes_per_megapixel() << std::endl;
+		}
+		break;
+
+	case report_format::JSON:
+		stream << '[' << std::endl;
+		for (std::vector<benchmark_result>::const_iterator it = results.begin(); it != results.end(); ++it)
+		{
+			stream << "  {\"benchmark\": ";
+			print_json_string(stream, it->name);
+			stream << ", \"pixels\": " << it->pixels << ", \"repetitions\": " << it->repetitions
+					<< ", \"iterations\": " << it->iterations << std::fixed << std::setprecision(1)
+					<< ", \"median_ns\": " << it->median_nanoseconds << ", \"p95_ns\": " << it->p95_nanoseconds
+					<< std::setprecision(3) << ", \"megapixels_per_second\": " << it->megapixels_per_second()
+					<< ", \"allocations\": " << it->allocations << ", \"bytes_allocated\": " << it->bytes_allocated
+					<< ", \"peak_bytes\": " << it->peak_bytes << std::setprecision(1)
+					<< ", \"peak_bytes_per_megapixel\": " << it->peak_bytes_per_megapixel();
+			if (it->has_counters)
+			{
+				print_json_counters(stream, *it);
+			}
+			stream << ((it + 1 != results.end())? "}," : "}") << std::endl;
+		}
+		stream << ']' << std::endl;
+		break;
+	}
+}
+
+void print_csv_counters(std::ostream &stream, const std::vector<benchmark_result> &results)
+{
+	stream << "benchmark,stage,event,total,per_mcu,per_megapixel" << std::endl;
+	for (std::vector<benchmark_result>::const_iterator it = results.begin(); it != results.end(); ++it)
+	{
+		if (!it->has_counters || it->mcus == 0 || it->pixels == 0)
+		{
+			continue;
+		}
+
+		for (unsigned int stage = 0; stage < decode_stats::STAGE_AMOUNT; stage++)
+		{
+			for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+			{
+				if (it->counter_available[event] && stage_counted(*it, stage))
+				{
+					const uint_fast64_t value = it->counters[stage][event];
+					stream << it->name << ',' << decode_stats::stage_name(static_cast<decode_stats::stage_e>(stage))
+							<< ',' << perf_counters::event_name(static_cast<perf_counters::event_e>(event))
+							<< ',' << value << ',' << std::fixed << std::setprecision(3)
+							<< static_cast<double>(value) / it->mcus << ','
+							<< value / (it->pixels / 1000000.0) << std::endl;
+				}
+			}
+		}
+	}
+}
+
+null_buffer::int_type null_buffer::overflow(int_type value)
+{
+	return traits_type::not_eof(value);
+}
+
+std::streamsize null_buffer::xsputn(const char *data, std::streamsize size)
+{
+	return size;
+}
@@ -0,0 +1,147 @@
+
+#ifndef BENCH_COMMON_HPP_
+#define BENCH_COMMON_HPP_
+
+#include "bitmaps.hpp"
+#include "decode_stats.hpp"
+#include "perf_counters.hpp"
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * A single case to be measured. Subclasses prepare all their input when constructed, so run
+ * only executes the code under measure.
+ */
+class benchmark
+{
+	std::string _name;
+	uint_fast64_t _pixels;
+
+public:
+	/**
+	 * pixels is the amount of pixels processed on each call to run, used to compute the
+	 * throughput. Cases not working on pixels should count 64 pixels per processed block or any
+	 * other equivalent amount.
+	 */
+	benchmark(const std::string &name, uint_fast64_t pixels) : _name(name), _pixels(pixels) { }
+	virtual ~benchmark() { }
+
+	const std::string &name() const
+	{
+		return _name;
+	}
+
+	uint_fast64_t pixels() const
+	{
+		return _pixels;
+	}
+
+	virtual void run() = 0;
+
+	/**
+	 * Does the same as run, but filling the given stats. Returns false if this case does not
+	 * fill stats, which is the default.
+	 */
+	virtual bool run_with_stats(decode_stats &stats)
+	{
+		return false;
+	}
+};
+
+typedef std::vector<benchmark *> benchmark_list;
+
+struct benchmark_result
+{
+	std::string name;
+	uint_fast64_t pixels;
+
+	/**
+	 * Number of samples taken, and calls to run within each sample.
+	 */
+	unsigned int repetitions;
+	unsigned int iterations;
+
+	/**
+	 * Time per call to run, in nanoseconds.
+	 */
+	double median_nanoseconds;
+	double p95_nanoseconds;
+
+	/**
+	 * Heap allocations made by a single call to run once warmed up, the bytes they requested
+	 * and the maximum amount of those bytes allocated at the same time.
+	 */
+	uint_fast64_t allocations;
+	uint_fast64_t bytes_allocated;
+	uint_fast64_t peak_bytes;
+
+	/**
+	 * True if hardware counters have been taken for each stage in a separate run.
+	 */
+	bool has_counters;
+	bool counter_available[perf_counters::EVENT_AMOUNT];
+	uint_fast64_t mcus;
+	uint_fast64_t counters[decode_stats::STAGE_AMOUNT][perf_counters::EVENT_AMOUNT];
+
+	/**
+	 * Megapixels per second, computed from the median.
+	 */
+	double megapixels_per_second() const;
+
+	/**
+	 * Peak bytes for each megapixel processed.
+	 */
+	double peak_bytes_per_megapixel() const;
+};
+
+/**
+ * Calls run once to warm up and find out how many calls are needed for each sample to last at
+ * least min_sample_nanoseconds. Then takes as many samples as repetitions, and accounts the
+ * allocations of one more call.
+ */
+benchmark_result measure(benchmark &benchmark, unsigned int repetitions,
+		uint_fast64_t min_sample_nanoseconds);
+
+/**
+ * Runs the benchmark once more, filling the counters for each stage in the result if the
+ * benchmark supports stats and any counter is available.
+ */
+void measure_counters(benchmark &benchmark, const perf_counters &counters, benchmark_result &result);
+
+namespace report_format
+{
+	enum report_format_e
+	{
+		TEXT,
+		CSV,
+		JSON
+	};
+}
+
+/**
+ * Prints the results in the given format. Counters are included in the text and JSON formats, but
+ * not in CSV, as they do not fit in the same table. print_csv_counters prints them instead.
+ */
+void print_results(std::ostream &stream, report_format::report_format_e format,
+		const std::vector<benchmark_result> &results);
+
+/**
+ * Prints a CSV table with a row for each stage and event counted in each result.
+ */
+void print_csv_counters(std::ostream &stream, const std::vector<benchmark_result> &results);
+
+/**
+ * Stream buffer discarding everything written into it. Useful to measure encoders without
+ * measuring the storage.
+ */
+class null_buffer : public std::streambuf
+{
+protected:
+	virtual int_type overflow(int_type value);
+	virtual std::streamsize xsputn(const char *data, std::streamsize size);
+};
+
+#endif /* BENCH_COMMON_HPP_ */
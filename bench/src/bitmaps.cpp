@@ -0,0 +1,93 @@
+
+#include "suites.hpp"
+
+#include "bitmaps.hpp"
+#include "synthetic_image.hpp"
+
+namespace
+{
+
+enum
+{
+	SIDE = 512
+};
+
+class get_pixel_benchmark : public benchmark
+{
+	bitmap image;
+
+public:
+	get_pixel_benchmark() : benchmark("bitmaps/getPixel", SIDE * SIDE)
+	{
+		synthetic_image(SIDE, SIDE, synthetic_image::COORDINATES).fill(image);
+	}
+
+	virtual void run()
+	{
+		bitmap::component_value_t values[3];
+		for (unsigned int y = 0; y < SIDE; y++)
+		{
+			for (unsigned int x = 0; x < SIDE; x++)
+			{
+				image.getPixel(x, y, values);
+			}
+		}
+	}
+};
+
+class set_pixel_benchmark : public benchmark
+{
+	bitmap image;
+
+public:
+	set_pixel_benchmark() : benchmark("bitmaps/setPixel", SIDE * SIDE)
+	{
+		synthetic_image(SIDE, SIDE, synthetic_image::COORDINATES).fill(image);
+	}
+
+	virtual void run()
+	{
+		const bitmap::component_value_t values[] = {0.25, 0.5, 0.75};
+		for (unsigned int y = 0; y < SIDE; y++)
+		{
+			for (unsigned int x = 0; x < SIDE; x++)
+			{
+				image.setPixel(x, y, values);
+			}
+		}
+	}
+};
+
+class raw_pixel_benchmark : public benchmark
+{
+	bitmap image;
+
+public:
+	raw_pixel_benchmark() : benchmark("bitmaps/getRawPixel+setRawPixel", SIDE * SIDE)
+	{
+		synthetic_image(SIDE, SIDE, synthetic_image::COORDINATES).fill(image);
+	}
+
+	virtual void run()
+	{
+		unsigned char pixel[3];
+		for (unsigned int y = 0; y < SIDE; y++)
+		{
+			for (unsigned int x = 0; x < SIDE; x++)
+			{
+				image.getRawPixel(x, y, pixel);
+				pixel[0] ^= 0xFF;
+				image.setRawPixel(x, y, pixel);
+			}
+		}
+	}
+};
+
+}
+
+void bitmaps::add_benchmarks(benchmark_list &list)
+{
+	list.push_back(new get_pixel_benchmark());
+	list.push_back(new set_pixel_benchmark());
+	list.push_back(new raw_pixel_benchmark());
+}
@@ -0,0 +1,37 @@
+
+#include "suites.hpp"
+
+#include "bmp.hpp"
+#include "synthetic_image.hpp"
+
+namespace
+{
+
+class encode_image_benchmark : public benchmark
+{
+	bitmap image;
+	null_buffer buffer;
+	std::ostream stream;
+
+public:
+	encode_image_benchmark(unsigned int width, unsigned int height);
+	virtual void run();
+};
+
+encode_image_benchmark::encode_image_benchmark(unsigned int width, unsigned int height) :
+		benchmark("bmp/encode_image", width * height), stream(&buffer)
+{
+	synthetic_image(width, height, synthetic_image::COORDINATES).fill(image);
+}
+
+void encode_image_benchmark::run()
+{
+	bmp::encode_image(image, stream);
+}
+
+}
+
+void bmp::add_benchmarks(benchmark_list &list)
+{
+	list.push_back(new encode_image_benchmark(1024, 1024));
+}
@@ -0,0 +1,58 @@
+
+#include "suites.hpp"
+
+#include "color_conversion.hpp"
+
+#include <random>
+
+namespace
+{
+
+enum
+{
+	BLOCKS_PER_RUN = 256
+};
+
+class ycbcr_to_rgb_benchmark : public benchmark
+{
+	block_matrix ycbcr[BLOCKS_PER_RUN][color_conversion::YCBCR_COMPONENTS];
+	block_matrix rgb[color_conversion::RGB_COMPONENTS];
+
+public:
+	ycbcr_to_rgb_benchmark();
+	virtual void run();
+};
+
+ycbcr_to_rgb_benchmark::ycbcr_to_rgb_benchmark() :
+		benchmark("color_conversion/ycbcr_to_rgb", BLOCKS_PER_RUN * block_matrix::CELLS)
+{
+	std::minstd_rand random;
+	for (unsigned int block = 0; block < BLOCKS_PER_RUN; block++)
+	{
+		for (unsigned int component = 0; component < color_conversion::YCBCR_COMPONENTS; component++)
+		{
+			for (unsigned int row = 0; row < block_matrix::SIDE; row++)
+			{
+				for (unsigned int column = 0; column < block_matrix::SIDE; column++)
+				{
+					ycbcr[block][component].set(column, row, static_cast<int>(random() % 256) - 128);
+				}
+			}
+		}
+	}
+}
+
+void ycbcr_to_rgb_benchmark::run()
+{
+	for (unsigned int block = 0; block < BLOCKS_PER_RUN; block++)
+	{
+		color_conversion::ycbcr_to_rgb(ycbcr[block], rgb);
+	}
+}
+
+}
+
+void color_conversion::add_benchmarks(benchmark_list &list)
+{
+	list.push_back(new ycbcr_to_rgb_benchmark());
+}
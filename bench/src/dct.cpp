@@ -0,0 +1,77 @@
+
+#include "suites.hpp"
+
+#include "block_matrix.hpp"
+
+#include <random>
+
+namespace
+{
+
+enum
+{
+	BLOCKS_PER_RUN = 256
+};
+
+void fill_random_blocks(block_matrix *blocks, int min, int max)
+{
+	std::minstd_rand random;
+	for (unsigned int block = 0; block < BLOCKS_PER_RUN; block++)
+	{
+		for (unsigned int row = 0; row < block_matrix::SIDE; row++)
+		{
+			for (unsigned int column = 0; column < block_matrix::SIDE; column++)
+			{
+				blocks[block].set(column, row, min + static_cast<int>(random() % (max - min + 1)));
+			}
+		}
+	}
+}
+
+class forward_dct_benchmark : public benchmark
+{
+	block_matrix blocks[BLOCKS_PER_RUN];
+	block_matrix result;
+
+public:
+	forward_dct_benchmark() : benchmark("dct/forward", BLOCKS_PER_RUN * block_matrix::CELLS)
+	{
+		fill_random_blocks(blocks, -128, 127);
+	}
+
+	virtual void run()
+	{
+		for (unsigned int block = 0; block < BLOCKS_PER_RUN; block++)
+		{
+			result = blocks[block].extract_dct();
+		}
+	}
+};
+
+class inverse_dct_benchmark : public benchmark
+{
+	block_matrix blocks[BLOCKS_PER_RUN];
+	block_matrix result;
+
+public:
+	inverse_dct_benchmark() : benchmark("dct/inverse", BLOCKS_PER_RUN * block_matrix::CELLS)
+	{
+		fill_random_blocks(blocks, -1024, 1023);
+	}
+
+	virtual void run()
+	{
+		for (unsigned int block = 0; block < BLOCKS_PER_RUN; block++)
+		{
+			result = blocks[block].extract_inverse_dct();
+		}
+	}
+};
+
+}
+
+void dct::add_benchmarks(benchmark_list &list)
+{
+	list.push_back(new forward_dct_benchmark());
+	list.push_back(new inverse_dct_benchmark());
+}
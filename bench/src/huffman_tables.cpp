@@ -0,0 +1,112 @@
+
+#include "suites.hpp"
+
+#include "huffman_tables.hpp"
+
+#include <sstream>
+#include <random>
+
+namespace
+{
+
+enum
+{
+	SYMBOLS_PER_RUN = 1 << 16,
+	SYMBOLS_PER_BLOCK = 16
+};
+
+/**
+ * Decodes symbols encoded with a table that has codes from 3 to 9 bits. Symbols are chosen in a
+ * way that all sizes are equally likely, closer to the distribution found in real scans than
+ * choosing symbols uniformly.
+ */
+class next_symbol_benchmark : public benchmark
+{
+	unsigned char definition[huffman_table::MAX_WORD_SIZE + 255];
+	huffman_table *table;
+	std::istringstream stream;
+
+	void encode(std::string &data);
+
+public:
+	next_symbol_benchmark();
+	virtual ~next_symbol_benchmark();
+	virtual void run();
+};
+
+next_symbol_benchmark::next_symbol_benchmark() :
+		benchmark("huffman/next_symbol", SYMBOLS_PER_RUN / SYMBOLS_PER_BLOCK * 64)
+{
+	unsigned int symbol = 0;
+	for (unsigned int size = 1; size <= huffman_table::MAX_WORD_SIZE; size++)
+	{
+		const unsigned int amount = (size >= 3 && size <= 9)? 1 << (size - 3) : 0;
+		definition[size - 1] = amount;
+		for (unsigned int index = 0; index < amount; index++, symbol++)
+		{
+			definition[huffman_table::MAX_WORD_SIZE + symbol] = symbol;
+		}
+	}
+
+	table = new huffman_table(definition);
+
+	std::string data;
+	encode(data);
+	stream.str(data);
+}
+
+next_symbol_benchmark::~next_symbol_benchmark()
+{
+	delete table;
+}
+
+void next_symbol_benchmark::encode(std::string &data)
+{
+	unsigned int first_code[huffman_table::MAX_WORD_SIZE + 1];
+	unsigned int code = 0;
+	for (unsigned int size = 1; size <= huffman_table::MAX_WORD_SIZE; size++)
+	{
+		first_code[size] = code;
+		code = (code + definition[size - 1]) << 1;
+	}
+
+	std::minstd_rand random;
+	unsigned int buffer = 0;
+	unsigned int buffer_bits = 0;
+
+	for (unsigned int index = 0; index < SYMBOLS_PER_RUN; index++)
+	{
+		const unsigned int size = 3 + random() % 7;
+		buffer = (buffer << size) | (first_code[size] + random() % definition[size - 1]);
+		buffer_bits += size;
+		while (buffer_bits >= 8)
+		{
+			buffer_bits -= 8;
+			data.push_back(static_cast<char>(buffer >> buffer_bits));
+		}
+	}
+
+	if (buffer_bits > 0)
+	{
+		data.push_back(static_cast<char>((buffer << (8 - buffer_bits)) | ((1 << (8 - buffer_bits)) - 1)));
+	}
+}
+
+void next_symbol_benchmark::run()
+{
+	stream.clear();
+	stream.seekg(0);
+	bit_stream bits(&stream);
+
+	for (unsigned int index = 0; index < SYMBOLS_PER_RUN; index++)
+	{
+		table->next_symbol(bits);
+	}
+}
+
+}
+
+void huffman_tables::add_benchmarks(benchmark_list &list)
+{
+	list.push_back(new next_symbol_benchmark());
+}
@@ -0,0 +1,478 @@
+
+#include "suites.hpp"
+
+#include "conf.h"
+
+#include "jpeg.hpp"
+#include "jpeg_encoder.hpp"
+#include "synthetic_image.hpp"
+#include "bmp.hpp"
+#include "mcu_index.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+
+/**
+ * Files decoded on every run, relative to the directory where the benchmark is executed.
+ */
+const char *fixtures[] = {
+	"test/res/black8x8.jpg",
+	"test/res/black_white_8x8.jpg",
+	"test/res/black_white_plain_block_compressed_16x16.jpg",
+	"test/res/black_white_plain_block_compressed_16x16_Y12.jpg",
+	"test/res/cmyk_adobe_32x32.jpg",
+	"test/res/colors_dc16x16.jpg",
+	"test/res/green8x8.jpg",
+	"test/res/red8x8.jpg",
+	"test/res/white8x8.jpg",
+	"test/res/ycck_adobe_32x32.jpg"
+};
+
+/**
+ * Image generated and encoded when the benchmarks are prepared.
+ */
+struct synthetic_entry
+{
+	unsigned int width;
+	unsigned int height;
+	synthetic_image::content_e content;
+	jpeg::sampling_e sampling;
+	unsigned int quality;
+	unsigned int restart_interval;
+	bool progressive;
+	bool grayscale;
+};
+
+const synthetic_entry synthetic_corpus[] = {
+	{1024, 1024, synthetic_image::GRADIENT, jpeg::SAMPLING_420, 75, 0, false, false},
+	{1024, 1024, synthetic_image::FLAT, jpeg::SAMPLING_422, 50, 16, false, false},
+	{1024, 1024, synthetic_image::NOISE, jpeg::SAMPLING_444, 90, 0, false, false},
+	{2048, 2048, synthetic_image::GRADIENT, jpeg::SAMPLING_420, 90, 64, false, false},
+	{1024, 1024, synthetic_image::GRADIENT, jpeg::SAMPLING_420, 75, 0, true, false},
+	{1024, 1024, synthetic_image::GRADIENT, jpeg::SAMPLING_444, 75, 0, false, true}
+};
+
+/**
+ * Only included with --large, as each one takes hundreds of megabytes once decoded.
+ */
+const synthetic_entry large_synthetic_corpus[] = {
+	{16384, 16384, synthetic_image::GRADIENT, jpeg::SAMPLING_420, 75, 256, false, false},
+	{16384, 16384, synthetic_image::NOISE, jpeg::SAMPLING_444, 75, 0, false, false}
+};
+
+std::string synthetic_name(const synthetic_entry &entry)
+{
+	const char *contents[] = {"noise", "gradient", "flat"};
+	const char *samplings[] = {"444", "422", "420"};
+
+	std::ostringstream name;
+	name << entry.width << 'x' << entry.height << '_' << contents[entry.content] << '_'
+			<< (entry.grayscale? "gray" : samplings[entry.sampling]) << "_q" << entry.quality;
+	if (entry.restart_interval != 0)
+	{
+		name << "_r" << entry.restart_interval;
+	}
+
+	if (entry.progressive)
+	{
+		name << "_progressive";
+	}
+
+	return name.str();
+}
+
+std::string encode_synthetic(const synthetic_entry &entry)
+{
+	jpeg::encode_options options;
+	options.sampling = entry.sampling;
+	options.quality = entry.quality;
+	options.restart_interval = entry.restart_interval;
+	options.progressive = entry.progressive;
+	options.grayscale = entry.grayscale;
+
+	return synthetic_image(entry.width, entry.height, entry.content).encode(options);
+}
+
+/**
+ * Decodes a whole JPEG file held in memory and encodes it as a BMP file, as jpg2bmp does.
+ */
+class decode_to_bmp_benchmark : public benchmark
+{
+	std::istringstream input;
+	null_buffer buffer;
+	std::ostream output;
+
+public:
+	decode_to_bmp_benchmark(const std::string &name, const std::string &file, uint_fast64_t pixels) :
+			benchmark("jpeg/decode_to_bmp/" + name, pixels), input(file), output(&buffer) { }
+
+	virtual void run();
+	virtual bool run_with_stats(decode_stats &stats);
+};
+
+void decode_to_bmp_benchmark::run()
+{
+	input.clear();
+	input.seekg(0);
+
+	bitmap image;
+	jpeg::decode_image(image, input);
+	bmp::encode_image(image, output);
+}
+
+bool decode_to_bmp_benchmark::run_with_stats(decode_stats &stats)
+{
+	input.clear();
+	input.seekg(0);
+
+	jpeg::decode_options decode_options;
+	decode_options.stats = &stats;
+
+	bitmap image;
+	jpeg::decode_image(image, input, decode_options);
+
+	bmp::encode_options encode_options;
+	encode_options.stats = &stats;
+	bmp::encode_image(image, output, encode_options);
+	return true;
+}
+
+/**
+ * Decodes a small region of a JPEG file held in memory, optionally starting from an MCU index
+ * built when the benchmark is prepared.
+ */
+class decode_region_benchmark : public benchmark
+{
+	std::istringstream input;
+	jpeg::decode_options options;
+	mcu_index index;
+
+public:
+	decode_region_benchmark(const std::string &name, const std::string &file, const jpeg::region &crop,
+			bool indexed) : benchmark(std::string(indexed? "jpeg/decode_indexed_region/" : "jpeg/decode_region/") + name,
+			crop.width * crop.height), input(file)
+	{
+		options.crop = crop;
+		if (indexed)
+		{
+			jpeg::build_index(input, index);
+			options.index = &index;
+		}
+	}
+
+	virtual void run()
+	{
+		input.clear();
+		input.seekg(0);
+
+		bitmap image;
+		jpeg::decode_image(image, input, options);
+	}
+};
+
+/**
+ * Decodes only the luminance of a JPEG file held in memory.
+ */
+class luminance_benchmark : public benchmark
+{
+	std::istringstream input;
+	jpeg::decode_options options;
+
+public:
+	luminance_benchmark(const std::string &name, const std::string &file, uint_fast64_t pixels) :
+			benchmark("jpeg/decode_luminance/" + name, pixels), input(file)
+	{
+		options.luminance_only = true;
+	}
+
+	virtual void run()
+	{
+		input.clear();
+		input.seekg(0);
+
+		bitmap image;
+		jpeg::decode_image(image, input, options);
+	}
+};
+
+/**
+ * Decodes a JPEG file held in memory into a bitmap in the given output format.
+ */
+class output_format_benchmark : public benchmark
+{
+	std::istringstream input;
+	jpeg::decode_options options;
+
+public:
+	output_format_benchmark(const std::string &name, const std::string &file, uint_fast64_t pixels,
+			jpeg::output_format_e format, const char *format_name) :
+			benchmark(std::string("jpeg/decode_") + format_name + "/" + name, pixels), input(file)
+	{
+		options.output_format = format;
+	}
+
+	virtual void run()
+	{
+		input.clear();
+		input.seekg(0);
+
+		bitmap image;
+		jpeg::decode_image(image, input, options);
+	}
+};
+
+/**
+ * Provides I420 planes for any image, allocated once and reused by each run.
+ */
+class reused_planar_allocator : public jpeg::planar_allocator
+{
+	std::vector<unsigned char> data;
+
+public:
+	virtual void allocate(jpeg::planar_image &image)
+	{
+		const unsigned int chroma_width = (image.width + 1) / 2;
+		const unsigned int chroma_height = (image.height + 1) / 2;
+		const std::size_t luminance_size = static_cast<std::size_t>(image.width) * image.height;
+		const std::size_t chroma_size = static_cast<std::size_t>(chroma_width) * chroma_height;
+		data.resize(luminance_size + 2 * chroma_size);
+
+		image.planes[0] = &data[0];
+		image.planes[1] = &data[luminance_size];
+		image.planes[2] = &data[luminance_size + chroma_size];
+		image.strides[0] = image.width;
+		image.strides[1] = chroma_width;
+		image.strides[2] = chroma_width;
+	}
+};
+
+/**
+ * Decodes a 4:2:0 JPEG file held in memory into planes, without upsampling nor converting it.
+ */
+class planar_benchmark : public benchmark
+{
+	std::istringstream input;
+	reused_planar_allocator allocator;
+	jpeg::decode_options options;
+
+public:
+	planar_benchmark(const std::string &name, const std::string &file, uint_fast64_t pixels) :
+			benchmark("jpeg/decode_planar/" + name, pixels), input(file)
+	{
+		options.planar = &allocator;
+	}
+
+	virtual void run()
+	{
+		input.clear();
+		input.seekg(0);
+
+		bitmap image;
+		jpeg::decode_image(image, input, options);
+	}
+};
+
+/**
+ * Checks a whole JPEG file held in memory without reconstructing it.
+ */
+class validate_benchmark : public benchmark
+{
+	std::istringstream input;
+
+public:
+	validate_benchmark(const std::string &name, const std::string &file, uint_fast64_t pixels) :
+			benchmark("jpeg/validate/" + name, pixels), input(file) { }
+
+	virtual void run()
+	{
+		input.clear();
+		input.seekg(0);
+		jpeg::validate(input);
+	}
+};
+
+/**
+ * Decodes a progressive JPEG file held in memory only until its preview is available.
+ */
+class preview_benchmark : public benchmark, public jpeg::preview_listener
+{
+	std::istringstream input;
+	jpeg::decode_options options;
+
+public:
+	preview_benchmark(const std::string &name, const std::string &file, uint_fast64_t pixels) :
+			benchmark("jpeg/decode_preview/" + name, pixels), input(file)
+	{
+		options.preview = this;
+	}
+
+	virtual void run()
+	{
+		input.clear();
+		input.seekg(0);
+
+		bitmap image;
+		jpeg::decode_image(image, input, options);
+	}
+
+	virtual bool preview(const bitmap &bitmap)
+	{
+		return false;
+	}
+};
+
+/**
+ * Feeds a JPEG file held in memory to an incremental decoder in chunks, as received from a
+ * network connection.
+ */
+class incremental_benchmark : public benchmark
+{
+	std::string file;
+	std::size_t chunk_size;
+
+public:
+	incremental_benchmark(const std::string &name, const std::string &file, uint_fast64_t pixels,
+			std::size_t chunk_size) : benchmark("jpeg/decode_incremental/" + name, pixels), file(file),
+			chunk_size(chunk_size) { }
+
+	virtual void run()
+	{
+		jpeg::incremental_decoder decoder;
+		for (std::size_t offset = 0; offset < file.size(); offset += chunk_size)
+		{
+			const std::size_t size = (file.size() - offset < chunk_size)? file.size() - offset : chunk_size;
+			decoder.feed(reinterpret_cast<const unsigned char *>(file.data()) + offset, size);
+		}
+	}
+};
+
+class encode_benchmark : public benchmark
+{
+	synthetic_entry entry;
+
+public:
+	encode_benchmark(const synthetic_entry &entry) :
+			benchmark("jpeg/encode_image/" + synthetic_name(entry), entry.width * entry.height), entry(entry) { }
+
+	virtual void run()
+	{
+		encode_synthetic(entry);
+	}
+};
+
+void add_synthetic_benchmarks(benchmark_list &list, const synthetic_entry *entries, unsigned int amount)
+{
+	for (unsigned int index = 0; index < amount; index++)
+	{
+		const synthetic_entry &entry = entries[index];
+		const uint_fast64_t pixels = static_cast<uint_fast64_t>(entry.width) * entry.height;
+		list.push_back(new decode_to_bmp_benchmark(synthetic_name(entry), encode_synthetic(entry), pixels));
+	}
+}
+
+}
+
+void jpeg::add_benchmarks(benchmark_list &list)
+{
+	for (unsigned int index = 0; index < sizeof(fixtures) / sizeof(fixtures[0]); index++)
+	{
+		std::ifstream file(fixtures[index], std::ios::in | std::ios::binary);
+		if (!file.good())
+		{
+			std::cerr << "Unable to open " << fixtures[index] << ". Skipped" << std::endl;
+			continue;
+		}
+
+		std::ostringstream content;
+		content << file.rdbuf();
+
+		try
+		{
+			std::istringstream stream(content.str());
+			bitmap image;
+			jpeg::decode_image(image, stream);
+
+			const std::string path(fixtures[index]);
+			list.push_back(new decode_to_bmp_benchmark(path.substr(path.rfind('/') + 1), content.str(),
+					image.width * image.height));
+		}
+		catch (jpeg::invalid_file_format &)
+		{
+			std::cerr << "Unable to decode " << fixtures[index] << ". Skipped" << std::endl;
+		}
+	}
+
+	add_synthetic_benchmarks(list, synthetic_corpus, sizeof(synthetic_corpus) / sizeof(synthetic_corpus[0]));
+
+	// Compared with decoding the whole image, this shows how much is left besides huffman decoding
+	const synthetic_entry &largest = synthetic_corpus[3];
+	const std::string largest_file = encode_synthetic(largest);
+	const jpeg::region middle(largest.width / 2 - 128, largest.height / 2 - 128, 256, 256);
+	const jpeg::region bottom(largest.width - 256, largest.height - 256, 256, 256);
+	list.push_back(new decode_region_benchmark(synthetic_name(largest) + "_256x256", largest_file, middle, false));
+	list.push_back(new decode_region_benchmark(synthetic_name(largest) + "_256x256_bottom", largest_file, bottom, false));
+	list.push_back(new decode_region_benchmark(synthetic_name(largest) + "_256x256_bottom", largest_file, bottom, true));
+	// Compared with decoding the whole image, this is the cost of rejecting a corrupt upload
+	const synthetic_entry &noise = synthetic_corpus[2];
+	list.push_back(new validate_benchmark(synthetic_name(noise), encode_synthetic(noise), noise.width * noise.height));
+	list.push_back(new validate_benchmark(synthetic_name(largest), largest_file, largest.width * largest.height));
+	// Compared with decoding the whole image, this is what chrominance costs besides huffman decoding
+	list.push_back(new luminance_benchmark(synthetic_name(noise), encode_synthetic(noise), noise.width * noise.height));
+	// Compared with decoding the whole image, this is what upsampling and colour conversion cost
+	const synthetic_entry &gradient = synthetic_corpus[0];
+	list.push_back(new planar_benchmark(synthetic_name(gradient), encode_synthetic(gradient),
+			gradient.width * gradient.height));
+	// Compared with decoding the whole image, these are the costs of each packed layout
+	list.push_back(new output_format_benchmark(synthetic_name(gradient), encode_synthetic(gradient),
+			gradient.width * gradient.height, jpeg::OUTPUT_BGRX8888, "bgrx8888"));
+	list.push_back(new output_format_benchmark(synthetic_name(gradient), encode_synthetic(gradient),
+			gradient.width * gradient.height, jpeg::OUTPUT_RGB565, "rgb565"));
+	// Compared with decoding the whole image, this is the cost of resuming on each chunk
+	list.push_back(new incremental_benchmark(synthetic_name(gradient) + "_chunks_4096", encode_synthetic(gradient),
+			gradient.width * gradient.height, 4096));
+
+	// Compared with decoding the whole progressive image, this is how soon a gallery shows something
+	const synthetic_entry &progressive = synthetic_corpus[4];
+	list.push_back(new preview_benchmark(synthetic_name(progressive), encode_synthetic(progressive),
+			progressive.width * progressive.height));
+	list.push_back(new encode_benchmark(synthetic_corpus[0]));
+}
+
+void jpeg::add_large_benchmarks(benchmark_list &list)
+{
+	add_synthetic_benchmarks(list, large_synthetic_corpus,
+			sizeof(large_synthetic_corpus) / sizeof(large_synthetic_corpus[0]));
+}
+
+bool jpeg::write_corpus(const std::string &directory, bool large)
+{
+	std::vector<synthetic_entry> entries(synthetic_corpus,
+			synthetic_corpus + sizeof(synthetic_corpus) / sizeof(synthetic_corpus[0]));
+	if (large)
+	{
+		entries.insert(entries.end(), large_synthetic_corpus,
+				large_synthetic_corpus + sizeof(large_synthetic_corpus) / sizeof(large_synthetic_corpus[0]));
+	}
+
+	for (std::vector<synthetic_entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+	{
+		const std::string path = directory + PROJECT_PATH_FOLDER_SEPARATOR + synthetic_name(*it) + ".jpg";
+		std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+		const std::string content = encode_synthetic(*it);
+		file.write(content.data(), content.size());
+
+		if (!file.good())
+		{
+			std::cerr << "Unable to write " << path << std::endl;
+			return false;
+		}
+
+		std::cout << path << std::endl;
+	}
+
+	return true;
+}
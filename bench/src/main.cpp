@@ -0,0 +1,154 @@
+
+#include "suites.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace
+{
+
+void print_usage(const char *program)
+{
+	std::cerr << "Syntax: " << program << " [--csv | --json] [--repetitions <amount>] [--filter <text>] [--large] [--counters]"
+			" [--counters-csv <file>] [--assert-no-allocations]" << std::endl
+			<< "       " << program << " --write-corpus <directory> [--large]" << std::endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	report_format::report_format_e format = report_format::TEXT;
+	unsigned int repetitions = 21;
+	const char *filter = NULL;
+	const char *corpus_directory = NULL;
+	bool large = false;
+	bool counters = false;
+	const char *counters_csv_path = NULL;
+	bool assert_no_allocations = false;
+
+	for (int index = 1; index < argc; index++)
+	{
+		if (strcmp(argv[index], "--csv") == 0)
+		{
+			format = report_format::CSV;
+		}
+		else if (strcmp(argv[index], "--json") == 0)
+		{
+			format = report_format::JSON;
+		}
+		else if (strcmp(argv[index], "--repetitions") == 0 && index + 1 < argc)
+		{
+			repetitions = atoi(argv[++index]);
+		}
+		else if (strcmp(argv[index], "--filter") == 0 && index + 1 < argc)
+		{
+			filter = argv[++index];
+		}
+		else if (strcmp(argv[index], "--large") == 0)
+		{
+			large = true;
+		}
+		else if (strcmp(argv[index], "--counters") == 0)
+		{
+			counters = true;
+		}
+		else if (strcmp(argv[index], "--counters-csv") == 0 && index + 1 < argc)
+		{
+			counters = true;
+			counters_csv_path = argv[++index];
+		}
+		else if (strcmp(argv[index], "--assert-no-allocations") == 0)
+		{
+			assert_no_allocations = true;
+		}
+		else if (strcmp(argv[index], "--write-corpus") == 0 && index + 1 < argc)
+		{
+			corpus_directory = argv[++index];
+		}
+		else
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (corpus_directory != NULL)
+	{
+		return jpeg::write_corpus(corpus_directory, large)? 0 : 1;
+	}
+
+	benchmark_list list;
+	huffman_tables::add_benchmarks(list);
+	dct::add_benchmarks(list);
+	color_conversion::add_benchmarks(list);
+	bitmaps::add_benchmarks(list);
+	bmp::add_benchmarks(list);
+	jpeg::add_benchmarks(list);
+	if (large)
+	{
+		jpeg::add_large_benchmarks(list);
+	}
+
+	// Samples shorter than this are dominated by the clock resolution
+	const uint_fast64_t min_sample_nanoseconds = 10000000;
+
+	// Counters are read in a separate run, as reading them on every stage change takes its time
+	perf_counters hardware_counters;
+	if (counters && !(decode_stats::ENABLED && hardware_counters.any_available()))
+	{
+		std::cerr << "Hardware counters are not available. Only wall-clock time is reported" << std::endl;
+		counters = false;
+	}
+
+	std::vector<benchmark_result> results;
+	for (benchmark_list::iterator it = list.begin(); it != list.end(); ++it)
+	{
+		if (!filter || (*it)->name().find(filter) != std::string::npos)
+		{
+			results.push_back(measure(**it, repetitions, min_sample_nanoseconds));
+			if (counters)
+			{
+				measure_counters(**it, hardware_counters, results.back());
+			}
+		}
+
+		delete *it;
+	}
+
+	print_results(std::cout, format, results);
+
+	// Counters have their own table, which would not fit in the CSV output
+	if (counters && counters_csv_path != NULL)
+	{
+		std::ofstream counters_csv(counters_csv_path);
+		print_csv_counters(counters_csv, results);
+		if (!counters_csv.good())
+		{
+			std::cerr << "Unable to write counters into " << counters_csv_path << std::endl;
+			return 1;
+		}
+	}
+	else if (counters && format == report_format::CSV)
+	{
+		std::cerr << "Counters are only written in CSV with --counters-csv <file>" << std::endl;
+	}
+
+	// Allocations once warmed up make the throughput depend on the heap state
+	unsigned int allocating = 0;
+	if (assert_no_allocations)
+	{
+		for (std::vector<benchmark_result>::const_iterator it = results.begin(); it != results.end(); ++it)
+		{
+			if (it->allocations != 0)
+			{
+				std::cerr << it->name << " made " << it->allocations << " allocations after warm-up" << std::endl;
+				allocating++;
+			}
+		}
+	}
+
+	return (allocating != 0)? 1 : 0;
+}
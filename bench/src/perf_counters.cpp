@@ -0,0 +1,255 @@
+
+#include "perf_counters.hpp"
+
+#if defined(PROJECT_PLATFORM_UNIX) && defined(__linux__)
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+# include <cstring>
+# define PERF_COUNTERS_AVAILABLE
+#endif
+
+#ifdef PERF_COUNTERS_AVAILABLE
+
+namespace
+{
+
+int open_event(perf_counters::event_e event, int leader)
+{
+	struct perf_event_attr attributes;
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	switch (event)
+	{
+	case perf_counters::CYCLES:
+		attributes.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+
+	case perf_counters::INSTRUCTIONS:
+		attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+
+	case perf_counters::BRANCH_MISSES:
+		attributes.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+
+	case perf_counters::L1D_MISSES:
+		attributes.type = PERF_TYPE_HW_CACHE;
+		attributes.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		break;
+
+	case perf_counters::LLC_MISSES:
+		attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+
+	case perf_counters::PAGE_FAULTS:
+		attributes.type = PERF_TYPE_SOFTWARE;
+		attributes.config = PERF_COUNT_SW_PAGE_FAULTS;
+		break;
+
+	default:
+		return -1;
+	}
+
+	// Only this thread, on any processor
+	return syscall(__NR_perf_event_open, &attributes, 0, -1, leader, 0);
+}
+
+}
+
+perf_counters::perf_counters() : leader(-1), grouped(0)
+{
+	for (unsigned int event = 0; event < EVENT_AMOUNT; event++)
+	{
+		descriptors[event] = open_event(static_cast<event_e>(event), leader);
+		if (descriptors[event] >= 0)
+		{
+			if (leader < 0)
+			{
+				leader = descriptors[event];
+			}
+			positions[event] = grouped++;
+		}
+	}
+}
+
+perf_counters::~perf_counters()
+{
+	for (unsigned int event = 0; event < EVENT_AMOUNT; event++)
+	{
+		if (descriptors[event] >= 0)
+		{
+			close(descriptors[event]);
+		}
+	}
+}
+
+void perf_counters::read(uint_fast64_t *values) const
+{
+	// Amount of events, time enabled, time running and then the value of each event
+	enum
+	{
+		AMOUNT,
+		TIME_ENABLED,
+		TIME_RUNNING,
+		FIRST_VALUE
+	};
+
+	uint64_t group[FIRST_VALUE + EVENT_AMOUNT];
+	const ssize_t expected_size = (FIRST_VALUE + grouped) * sizeof(uint64_t);
+	const bool valid = leader >= 0 && ::read(leader, group, sizeof(group)) == expected_size &&
+			group[AMOUNT] == grouped;
+
+	// Events were only counted for part of the time if the group was multiplexed
+	const double scale = (valid && group[TIME_RUNNING] != 0)?
+			static_cast<double>(group[TIME_ENABLED]) / group[TIME_RUNNING] : 1;
+
+	for (unsigned int event = 0; event < EVENT_AMOUNT; event++)
+	{
+		values[event] = (valid && descriptors[event] >= 0)?
+				static_cast<uint_fast64_t>(group[FIRST_VALUE + positions[event]] * scale) : 0;
+	}
+}
+
+#else // PERF_COUNTERS_AVAILABLE
+
+perf_counters::perf_counters() : leader(-1), grouped(0)
+{
+	for (unsigned int event = 0; event < EVENT_AMOUNT; event++)
+	{
+		descriptors[event] = -1;
+	}
+}
+
+perf_counters::~perf_counters() { }
+
+void perf_counters::read(uint_fast64_t *values) const
+{
+	for (unsigned int event = 0; event < EVENT_AMOUNT; event++)
+	{
+		values[event] = 0;
+	}
+}
+
+#endif // PERF_COUNTERS_AVAILABLE
+
+bool perf_counters::available(event_e event) const
+{
+	return descriptors[event] >= 0;
+}
+
+bool perf_counters::any_available() const
+{
+	for (unsigned int event = 0; event < EVENT_AMOUNT; event++)
+	{
+		if (descriptors[event] >= 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const char *perf_counters::event_name(event_e event)
+{
+	switch (event)
+	{
+	case CYCLES:
+		return "cycles";
+
+	case INSTRUCTIONS:
+		return "instructions";
+
+	case BRANCH_MISSES:
+		return "branch misses";
+
+	case L1D_MISSES:
+		return "L1D misses";
+
+	case LLC_MISSES:
+		return "LLC misses";
+
+	case PAGE_FAULTS:
+		return "page faults";
+
+	default:
+		return "unknown";
+	}
+}
+
+stage_counters::stage_counters(const perf_counters &counters) : counters(counters)
+{
+	counters.read(last);
+	for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+	{
+		unsampled[event] = 0;
+		for (unsigned int stage = 0; stage < decode_stats::STAGE_AMOUNT; stage++)
+		{
+			values[stage][event] = 0;
+		}
+	}
+}
+
+void stage_counters::take(uint_fast64_t *difference)
+{
+	uint_fast64_t now[perf_counters::EVENT_AMOUNT];
+	counters.read(now);
+
+	for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+	{
+		// Scaled values of a multiplexed group may go slightly back
+		difference[event] = (now[event] > last[event])? now[event] - last[event] : 0;
+		last[event] = now[event];
+	}
+}
+
+void stage_counters::stage_finished(decode_stats::stage_e stage)
+{
+	uint_fast64_t difference[perf_counters::EVENT_AMOUNT];
+	take(difference);
+
+	if (stage != decode_stats::STAGE_AMOUNT)
+	{
+		for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+		{
+			values[stage][event] += difference[event];
+		}
+	}
+}
+
+void stage_counters::unsampled_finished()
+{
+	uint_fast64_t difference[perf_counters::EVENT_AMOUNT];
+	take(difference);
+
+	for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+	{
+		unsampled[event] += difference[event];
+	}
+}
+
+void stage_counters::finish()
+{
+	for (unsigned int event = 0; event < perf_counters::EVENT_AMOUNT; event++)
+	{
+		uint_fast64_t sampled = 0;
+		for (unsigned int stage = 0; stage < decode_stats::STAGE_AMOUNT; stage++)
+		{
+			sampled += values[stage][event];
+		}
+
+		for (unsigned int stage = 0; stage < decode_stats::STAGE_AMOUNT && sampled != 0; stage++)
+		{
+			values[stage][event] += static_cast<uint_fast64_t>(
+					static_cast<double>(unsampled[event]) * values[stage][event] / sampled);
+		}
+		unsampled[event] = 0;
+	}
+}
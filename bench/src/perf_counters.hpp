@@ -0,0 +1,84 @@
+
+#ifndef PERF_COUNTERS_HPP_
+#define PERF_COUNTERS_HPP_
+
+#include "conf.h"
+#include "decode_stats.hpp"
+
+#include <stdint.h>
+
+/**
+ * Hardware counters for this thread, read through perf_event_open on Linux. All events are
+ * opened as a single group, so that they are read with a single call and counted over the same
+ * periods. If the processor cannot count all of them at once, the kernel multiplexes the group and
+ * the values read are scaled to the whole time. Events the kernel or the processor cannot count
+ * are left out, and they are always read as 0. Nothing is available on other platforms.
+ */
+class perf_counters
+{
+public:
+	enum event_e
+	{
+		CYCLES,
+		INSTRUCTIONS,
+		BRANCH_MISSES,
+		L1D_MISSES,
+		LLC_MISSES,
+		PAGE_FAULTS,
+		EVENT_AMOUNT
+	};
+
+private:
+	int descriptors[EVENT_AMOUNT];
+
+	// The first event opened leads the group. Values are read in the order events joined it
+	int leader;
+	unsigned int positions[EVENT_AMOUNT];
+	unsigned int grouped;
+
+	// Not copyable, as it owns the descriptors
+	perf_counters(const perf_counters &);
+	perf_counters &operator=(const perf_counters &);
+
+public:
+	perf_counters();
+	~perf_counters();
+
+	bool available(event_e event) const;
+	bool any_available() const;
+
+	/**
+	 * Fills values with the current count of each event, since the counters were opened.
+	 */
+	void read(uint_fast64_t *values) const;
+
+	static const char *event_name(event_e event);
+};
+
+/**
+ * Accumulates the counted events in the stage that was being measured when they happened. Events
+ * counted in rows of MCUs not measured per stage are split among the stages in the same
+ * proportion as the rest once finish is called.
+ */
+class stage_counters : public decode_stats::stage_listener
+{
+	const perf_counters &counters;
+	uint_fast64_t last[perf_counters::EVENT_AMOUNT];
+	uint_fast64_t unsampled[perf_counters::EVENT_AMOUNT];
+
+	void take(uint_fast64_t *difference);
+
+public:
+	uint_fast64_t values[decode_stats::STAGE_AMOUNT][perf_counters::EVENT_AMOUNT];
+
+	stage_counters(const perf_counters &counters);
+	virtual void stage_finished(decode_stats::stage_e stage);
+	virtual void unsampled_finished();
+
+	/**
+	 * Splits the events counted in rows not measured per stage.
+	 */
+	void finish();
+};
+
+#endif /* PERF_COUNTERS_HPP_ */
@@ -0,0 +1,37 @@
+
+#ifndef SUITES_HPP_
+#define SUITES_HPP_
+
+#include "bench_common.hpp"
+
+/**
+ * Each suite appends its benchmarks to the given list. The caller takes their ownership.
+ */
+#define BENCHMARK_SUITE_DECLARATION(NS) \
+	namespace NS \
+	{ \
+		void add_benchmarks(benchmark_list &list); \
+	}
+
+BENCHMARK_SUITE_DECLARATION(huffman_tables)
+BENCHMARK_SUITE_DECLARATION(dct)
+BENCHMARK_SUITE_DECLARATION(color_conversion)
+BENCHMARK_SUITE_DECLARATION(bitmaps)
+BENCHMARK_SUITE_DECLARATION(bmp)
+BENCHMARK_SUITE_DECLARATION(jpeg)
+
+namespace jpeg
+{
+	/**
+	 * Adds decoding benchmarks for images of 16384x16384 pixels.
+	 */
+	void add_large_benchmarks(benchmark_list &list);
+
+	/**
+	 * Writes the synthetic images decoded in the benchmarks as JPEG files in the given directory,
+	 * so they can be used with other tools. Returns false if any of them cannot be written.
+	 */
+	bool write_corpus(const std::string &directory, bool large);
+}
+
+#endif /* SUITES_HPP_ */
@@ -0,0 +1,23 @@
+#include "adobe.hpp"
+#include <cstring>
+
+adobe::info::info(const unsigned char *segment)
+{
+	memcpy(raw_info, segment, sizeof(raw_info));
+}
+
+bool adobe::info::is_valid() const
+{
+	// Unlike JFIF, the identifier has no null terminator
+	return memcmp(raw_info, "Adobe", 5) == 0 && raw_info[11] <= YCCK;
+}
+
+uint_fast16_t adobe::info::version() const
+{
+	return (raw_info[5] << 8) | raw_info[6];
+}
+
+adobe::transform_e adobe::info::transform() const
+{
+	return static_cast<adobe::transform_e>(raw_info[11]);
+}
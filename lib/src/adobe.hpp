@@ -0,0 +1,44 @@
+
+#ifndef ADOBE_HPP_
+#define ADOBE_HPP_
+
+#include <stdint.h>
+
+namespace adobe
+{
+	/**
+	 * Colour transform applied to the components of the frame before encoding them.
+	 */
+	enum transform_e
+	{
+		NO_TRANSFORM = 0, // RGB for 3 components, CMYK for 4
+		YCBCR = 1,
+		YCCK = 2 // Cyan, magenta and yellow transformed as if they were red, green and blue, plus black
+	};
+
+	/**
+	 * Content of the APP14 segment written by Adobe applications.
+	 */
+	struct info
+	{
+		enum info_size_e
+		{
+			SIZE_IN_FILE = 12
+		};
+
+	private:
+		unsigned char raw_info[SIZE_IN_FILE];
+
+	public:
+		/**
+		 * Takes the first SIZE_IN_FILE bytes of the given APP14 segment content.
+		 */
+		info(const unsigned char *segment);
+
+		bool is_valid() const;
+		uint_fast16_t version() const;
+		transform_e transform() const;
+	};
+}
+
+#endif /* ADOBE_HPP_ */
@@ -0,0 +1,32 @@
+
+#include "allocation.hpp"
+
+namespace
+{
+
+thread_local allocation::listener *current_listener = NULL;
+
+}
+
+allocation::listener *allocation::set_listener(listener *listener)
+{
+	allocation::listener *previous = current_listener;
+	current_listener = listener;
+	return previous;
+}
+
+void allocation::notify_allocated(std::size_t bytes)
+{
+	if (current_listener != NULL)
+	{
+		current_listener->allocated(bytes);
+	}
+}
+
+void allocation::notify_released(std::size_t bytes)
+{
+	if (current_listener != NULL)
+	{
+		current_listener->released(bytes);
+	}
+}
@@ -0,0 +1,119 @@
+
+#ifndef ALLOCATION_HPP_
+#define ALLOCATION_HPP_
+
+#include <cstddef>
+#include <new>
+
+/**
+ * Every heap allocation made by the library goes through this functions, so that they can be
+ * accounted. Allocations and releases are notified to the listener set in the calling thread,
+ * if any. Memory is not tracked after being allocated, so memory released by a thread other than
+ * the one allocating it is notified to the listener of the releasing thread. Shared tables, as
+ * the ones in table_cache, may be released by any thread.
+ */
+namespace allocation
+{
+	class listener
+	{
+	public:
+		virtual ~listener() { }
+
+		virtual void allocated(std::size_t bytes) = 0;
+		virtual void released(std::size_t bytes) = 0;
+	};
+
+	/**
+	 * Sets the listener for the calling thread, or removes it if NULL. Returns the previous one,
+	 * which should be set back when done.
+	 */
+	listener *set_listener(listener *listener);
+
+	void notify_allocated(std::size_t bytes);
+	void notify_released(std::size_t bytes);
+
+	template<class TYPE>
+	TYPE *new_array(std::size_t amount)
+	{
+		TYPE *array = new TYPE[amount];
+		notify_allocated(amount * sizeof(TYPE));
+		return array;
+	}
+
+	/**
+	 * Releases an array returned by new_array. amount must be the same given to new_array.
+	 */
+	template<class TYPE>
+	void delete_array(TYPE *array, std::size_t amount)
+	{
+		if (array != NULL)
+		{
+			notify_released(amount * sizeof(TYPE));
+			delete[] array;
+		}
+	}
+
+	/**
+	 * Accounts an object just created with new, and returns it. E.g.: counted(new type(arguments))
+	 */
+	template<class TYPE>
+	TYPE *counted(TYPE *object)
+	{
+		notify_allocated(sizeof(TYPE));
+		return object;
+	}
+
+	/**
+	 * Releases an object returned by counted.
+	 */
+	template<class TYPE>
+	void delete_object(TYPE *object)
+	{
+		if (object != NULL)
+		{
+			notify_released(sizeof(TYPE));
+			delete object;
+		}
+	}
+
+	/**
+	 * Standard allocator for containers, so that their memory is accounted as well.
+	 */
+	template<class TYPE>
+	struct container_allocator
+	{
+		typedef TYPE value_type;
+
+		container_allocator() { }
+
+		template<class OTHER>
+		container_allocator(const container_allocator<OTHER> &other) { }
+
+		TYPE *allocate(std::size_t amount)
+		{
+			TYPE *data = static_cast<TYPE *>(::operator new(amount * sizeof(TYPE)));
+			notify_allocated(amount * sizeof(TYPE));
+			return data;
+		}
+
+		void deallocate(TYPE *data, std::size_t amount)
+		{
+			notify_released(amount * sizeof(TYPE));
+			::operator delete(data);
+		}
+	};
+
+	template<class TYPE, class OTHER>
+	bool operator==(const container_allocator<TYPE> &, const container_allocator<OTHER> &)
+	{
+		return true;
+	}
+
+	template<class TYPE, class OTHER>
+	bool operator!=(const container_allocator<TYPE> &, const container_allocator<OTHER> &)
+	{
+		return false;
+	}
+}
+
+#endif /* ALLOCATION_HPP_ */
@@ -1,15 +1,73 @@
 
 #include "bitmaps.hpp"
+#include "allocation.hpp"
+
+bool bitmap::find_component(bitmap_component::type_e type, unsigned int &index) const
+{
+	for (unsigned int position = 0; position < components_amount; position++)
+	{
+		if (components[position].type == type)
+		{
+			index = position;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+namespace
+{
+
+/**
+ * Looks for the first component of the given type and checks that it has the given size and
+ * starts at a byte boundary. Returns true and sets offset to its first byte within the pixel if so.
+ */
+bool find_aligned_component(const bitmap &bitmap, bitmap_component::type_e type, unsigned int size,
+		unsigned int &offset)
+{
+	unsigned int bits = 0;
+	for (unsigned int position = 0; position < bitmap.components_amount; position++)
+	{
+		const unsigned int component_bits = bitmap.components[position].bits_per_pixel;
+		if (bitmap.components[position].type == type)
+		{
+			if (component_bits == size && (bits & 7) == 0)
+			{
+				offset = bits >> 3;
+				return true;
+			}
+
+			return false;
+		}
+
+		bits += component_bits;
+	}
+
+	return false;
+}
+
+}
+
+bool bitmap::find_byte_component(bitmap_component::type_e type, unsigned int &offset) const
+{
+	return find_aligned_component(*this, type, 8, offset);
+}
+
+bool bitmap::find_word_component(bitmap_component::type_e type, unsigned int &offset) const
+{
+	return find_aligned_component(*this, type, 16, offset);
+}
 
 void bitmap::getRawPixel(int x, int y, unsigned char * const pixel) const
 {
 	if (x >= 0 && static_cast<unsigned int>(x) < width && y >= 0 && static_cast<unsigned int>(y) < height)
 	{
-		unsigned int position = y * bytes_per_scanline + x * bytes_per_pixel;
+		const unsigned char *position = scanline(y) + x * bytes_per_pixel;
 
 		for (unsigned int index = 0; index < bytes_per_pixel; index++)
 		{
-			pixel[index] = data[position++];
+			pixel[index] = *(position++);
 		}
 	}
 	else
@@ -25,18 +83,18 @@ void bitmap::setRawPixel(int x, int y, const unsigned char *pixel) const
 {
 	if (x >= 0 && static_cast<unsigned int>(x) < width && y >= 0 && static_cast<unsigned int>(y) < height)
 	{
-		unsigned int position = y * bytes_per_scanline + x * bytes_per_pixel;
+		unsigned char *position = scanline(y) + x * bytes_per_pixel;
 
 		for (unsigned int index = 0; index < bytes_per_pixel; index++)
 		{
-			data[position++] = pixel[index];
+			*(position++) = pixel[index];
 		}
 	}
 }
 
 void bitmap::getPixel(int x, int y, component_value_t *values) const
 {
-	unsigned char *pixel_buffer = new unsigned char[bytes_per_pixel];
+	unsigned char *pixel_buffer = allocation::new_array<unsigned char>(bytes_per_pixel);
 	getRawPixel(x, y, pixel_buffer);
 
 	unsigned int uint_value;
@@ -102,12 +160,12 @@ void bitmap::getPixel(int x, int y, component_value_t *values) const
 		values[index] = float_value / ((1 << bits) - 1);
 	}
 
-	delete []pixel_buffer;
+	allocation::delete_array(pixel_buffer, bytes_per_pixel);
 }
 
 void bitmap::setPixel(int x, int y, const component_value_t *values) const
 {
-	unsigned char *pixel_buffer = new unsigned char[bytes_per_pixel];
+	unsigned char *pixel_buffer = allocation::new_array<unsigned char>(bytes_per_pixel);
 	unsigned int uint_value;
 	unsigned char used_bits = 0;
 	unsigned char used_bytes = 0;
@@ -186,5 +244,5 @@ void bitmap::setPixel(int x, int y, const component_value_t *values) const
 
 	setRawPixel(x, y, pixel_buffer);
 
-	delete []pixel_buffer;
+	allocation::delete_array(pixel_buffer, bytes_per_pixel);
 }
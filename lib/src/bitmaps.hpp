@@ -6,7 +6,7 @@
 
 struct bitmap_component
 {
-	enum
+	enum type_e
 	{
 		ALPHA, // 0=opaque, (1 << bits_per_pixel)-1=transparent
 		RED,
@@ -15,6 +15,10 @@ struct bitmap_component
 		LUMINANCE, //Y from YUV or YCbCr
 		CHROMINANCE_BLUE,
 		CHROMINANCE_RED,
+		CYAN, // 0=no ink, (1 << bits_per_pixel)-1=full ink, as magenta, yellow and black
+		MAGENTA,
+		YELLOW,
+		BLACK
 	} type;
 
 	unsigned int bits_per_pixel;
@@ -63,6 +67,41 @@ struct bitmap
 	shared_array<bitmap_component> components;
 	shared_array<unsigned char> data;
 
+	/**
+	 * If true, the last scanline is the first one in data, as it is found in most BMP files.
+	 */
+	bool bottom_up;
+
+	bitmap() : width(0), height(0), bytes_per_scanline(0), bytes_per_pixel(0), components_amount(0),
+			bottom_up(false) { }
+
+	/**
+	 * Returns the position where the given row starts within data.
+	 */
+	unsigned char *scanline(unsigned int row) const
+	{
+		return data.get() + static_cast<std::size_t>(bottom_up? height - 1 - row : row) * bytes_per_scanline;
+	}
+
+	/**
+	 * Looks for the first component of the given type. Returns true and sets index to its
+	 * position within components if found.
+	 */
+	bool find_component(bitmap_component::type_e type, unsigned int &index) const;
+
+	/**
+	 * Looks for the first component of the given type and checks that it takes a whole byte
+	 * within the pixel, which means that it can be read or written directly in data. Returns
+	 * true and sets offset to the position of that byte within the pixel if so.
+	 */
+	bool find_byte_component(bitmap_component::type_e type, unsigned int &offset) const;
+
+	/**
+	 * Same as find_byte_component, but for components of 16 bits taking 2 whole bytes, the
+	 * least significant one first, as getPixel and setPixel read and write them.
+	 */
+	bool find_word_component(bitmap_component::type_e type, unsigned int &offset) const;
+
 	void getRawPixel(int x, int y, unsigned char * const pixel) const;
 
 	/**
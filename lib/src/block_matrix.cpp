@@ -93,6 +93,28 @@ block_matrix &block_matrix::operator/=(const element_t value)
 	return *this;
 }
 
+block_matrix block_matrix::multiply_cells(const block_matrix &other) const
+{
+	block_matrix result;
+
+	for (cell_count_fast_t index=0; index < CELLS; index++)
+	{
+		result.matrix[index] = matrix[index] * other.matrix[index];
+	}
+
+	return result;
+}
+
+block_matrix &block_matrix::clamp(const element_t min, const element_t max)
+{
+	for (cell_count_fast_t index=0; index < CELLS; index++)
+	{
+		matrix[index] = (matrix[index] < min)? min : ((matrix[index] > max)? max : matrix[index]);
+	}
+
+	return *this;
+}
+
 block_matrix block_matrix::operator+(const block_matrix &other) const
 {
 	block_matrix result;
@@ -125,64 +147,59 @@ const block_matrix::element_t dct_constant_c0 = sqrt(1.0 / block_matrix::SIDE);
 const block_matrix::element_t dct_constant_cn0 = sqrt(2.0 / block_matrix::SIDE);
 const block_matrix::element_t dct_multiplying_arg = PI / (2 * block_matrix::SIDE);
 
-void apply_dct_single_element(block_matrix &dest, const block_matrix &orig,
-		const block_matrix::side_index_fast_t u, const block_matrix::side_index_fast_t v)
+/**
+ * Both DCT directions are separable: the 2D transformation is the 1D one applied to all rows and
+ * then to all columns. Cosines are computed once, already multiplied by their constant.
+ * factors[x][u] is c(u) * cos((2x + 1) * u * PI / 16).
+ */
+struct dct_factors
 {
-	const block_matrix::element_t cu = (u == 0)? dct_constant_c0 : dct_constant_cn0;
-	const block_matrix::element_t cv = (v == 0)? dct_constant_c0 : dct_constant_cn0;
-	const block_matrix::element_t c = cu * cv;
+	block_matrix::element_t factors[block_matrix::SIDE][block_matrix::SIDE];
 
-	block_matrix::element_t result = 0;
-	for (block_matrix::side_count_fast_t y = 0; y < block_matrix::SIDE; y++)
+	dct_factors()
 	{
-		for (block_matrix::side_count_fast_t x = 0; x < block_matrix::SIDE; x++)
+		for (unsigned int x = 0; x < block_matrix::SIDE; x++)
 		{
-			const block_matrix::element_t h_cos_arg = (2 * x + 1) * u;
-			const block_matrix::element_t v_cos_arg = (2 * y + 1) * v;
-			const block_matrix::element_t element = orig.get(x,y) *
-					cos(dct_multiplying_arg * h_cos_arg) * cos(dct_multiplying_arg * v_cos_arg);
-			result += element;
+			for (unsigned int u = 0; u < block_matrix::SIDE; u++)
+			{
+				const block_matrix::element_t c = (u == 0)? dct_constant_c0 : dct_constant_cn0;
+				factors[x][u] = c * cos(dct_multiplying_arg * (2 * x + 1) * u);
+			}
 		}
 	}
+};
 
-	result *= c;
-	dest.set(u, v, result);
+const dct_factors dct;
 }
 
-void apply_inverse_dct_single_element(block_matrix &dest, const block_matrix &orig,
-		const block_matrix::side_index_fast_t u, const block_matrix::side_index_fast_t v)
+block_matrix block_matrix::extract_dct() const
 {
-	block_matrix::element_t result = 0;
-	for (block_matrix::side_count_fast_t y = 0; y < block_matrix::SIDE; y++)
+	// Rows first: partial[y][u] is the 1D DCT of row y
+	element_t partial[CELLS];
+	for (unsigned int y = 0; y < SIDE; y++)
 	{
-		for (block_matrix::side_count_fast_t x = 0; x < block_matrix::SIDE; x++)
+		for (unsigned int u = 0; u < SIDE; u++)
 		{
-			const block_matrix::element_t cx = (x == 0)? dct_constant_c0 : dct_constant_cn0;
-			const block_matrix::element_t cy = (y == 0)? dct_constant_c0 : dct_constant_cn0;
-			const block_matrix::element_t c = cx * cy;
-
-			const block_matrix::element_t h_cos_arg = (2 * u + 1) * x;
-			const block_matrix::element_t v_cos_arg = (2 * v + 1) * y;
-			const block_matrix::element_t element = c * orig.get(x,y) *
-					cos(dct_multiplying_arg * h_cos_arg) * cos(dct_multiplying_arg * v_cos_arg);
-			result += element;
+			element_t sum = 0;
+			for (unsigned int x = 0; x < SIDE; x++)
+			{
+				sum += matrix[y * SIDE + x] * dct.factors[x][u];
+			}
+			partial[y * SIDE + u] = sum;
 		}
 	}
 
-	//result *= c;
-	dest.set(u, v, result);
-}
-}
-
-block_matrix block_matrix::extract_dct() const
-{
 	block_matrix result;
-
-	for (block_matrix::side_count_fast_t v = 0; v < block_matrix::SIDE; v++)
+	for (unsigned int v = 0; v < SIDE; v++)
 	{
-		for (block_matrix::side_count_fast_t u = 0; u < block_matrix::SIDE; u++)
+		for (unsigned int u = 0; u < SIDE; u++)
 		{
-			apply_dct_single_element(result, *this, u, v);
+			element_t sum = 0;
+			for (unsigned int y = 0; y < SIDE; y++)
+			{
+				sum += partial[y * SIDE + u] * dct.factors[y][v];
+			}
+			result.matrix[v * SIDE + u] = sum;
 		}
 	}
 
@@ -191,13 +208,32 @@ block_matrix block_matrix::extract_dct() const
 
 block_matrix block_matrix::extract_inverse_dct() const
 {
-	block_matrix result;
+	// Rows first: partial[v][x] is the 1D inverse DCT of row v
+	element_t partial[CELLS];
+	for (unsigned int v = 0; v < SIDE; v++)
+	{
+		for (unsigned int x = 0; x < SIDE; x++)
+		{
+			element_t sum = 0;
+			for (unsigned int u = 0; u < SIDE; u++)
+			{
+				sum += matrix[v * SIDE + u] * dct.factors[x][u];
+			}
+			partial[v * SIDE + x] = sum;
+		}
+	}
 
-	for (block_matrix::side_count_fast_t v = 0; v < block_matrix::SIDE; v++)
+	block_matrix result;
+	for (unsigned int y = 0; y < SIDE; y++)
 	{
-		for (block_matrix::side_count_fast_t u = 0; u < block_matrix::SIDE; u++)
+		for (unsigned int x = 0; x < SIDE; x++)
 		{
-			apply_inverse_dct_single_element(result, *this, u, v);
+			element_t sum = 0;
+			for (unsigned int v = 0; v < SIDE; v++)
+			{
+				sum += partial[v * SIDE + x] * dct.factors[y][v];
+			}
+			result.matrix[y * SIDE + x] = sum;
 		}
 	}
 
@@ -45,6 +45,17 @@ public:
 	block_matrix &operator-=(const element_t value);
 	block_matrix &operator/=(const element_t value);
 
+	/**
+	 * Creates a new block_matrix whose cells are the product of the cells at the same position in
+	 * both. This is not the matrix product.
+	 */
+	block_matrix multiply_cells(const block_matrix &other) const;
+
+	/**
+	 * Limits all cells to the given range.
+	 */
+	block_matrix &clamp(const element_t min, const element_t max);
+
 	/**
 	 * Creates a new block_matrix instance whose values is the Discrete Cosinus Transformation (DCT)
 	 * of this block_matrix.
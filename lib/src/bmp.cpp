@@ -1,6 +1,13 @@
 
 #include "bmp.hpp"
 #include "stream_utils.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+
+#include <vector>
+#include <cstring>
+#include <iterator>
+#include <limits>
 
 bmp_header::bmp_header(std::istream &stream)
 {
@@ -10,64 +17,537 @@ bmp_header::bmp_header(std::istream &stream)
 	bitmap_offset = read_little_endian_unsigned_int(stream, 4);
 }
 
+bmp_header::bmp_header(const unsigned char *buffer)
+{
+	signature[0] = buffer[0];
+	signature[1] = buffer[1];
+	file_size = load_little_endian_unsigned_int(buffer + 2, 4);
+	bitmap_offset = load_little_endian_unsigned_int(buffer + 10, 4);
+}
+
+void bmp_header::store(unsigned char *buffer) const
+{
+	*(buffer++) = signature[0];
+	*(buffer++) = signature[1];
+	buffer = store_little_endian_unsigned_int(buffer, file_size, 4);
+	buffer = store_little_endian_unsigned_int(buffer, 0, 4);
+	store_little_endian_unsigned_int(buffer, bitmap_offset, 4);
+}
+
 void bmp_header::write_into_stream(std::ostream &stream) const
 {
-	stream.write(signature, 2);
-	write_little_endian_unsigned_int(stream, file_size, 4);
-	write_little_endian_unsigned_int(stream, 0, 4);
-	write_little_endian_unsigned_int(stream, bitmap_offset, 4);
+	unsigned char buffer[HEADER_SIZE];
+	store(buffer);
+	stream.write(reinterpret_cast<const char *>(buffer), HEADER_SIZE);
+}
+
+dib_header::dib_header(const unsigned char *buffer)
+{
+	header_size = load_little_endian_unsigned_int(buffer, sizeof(header_size));
+	width = load_little_endian_unsigned_int(buffer + 4, sizeof(width));
+	height = load_little_endian_unsigned_int(buffer + 8, sizeof(height));
+	color_planes = load_little_endian_unsigned_int(buffer + 12, sizeof(color_planes));
+	bits_per_pixel = load_little_endian_unsigned_int(buffer + 14, sizeof(bits_per_pixel));
+	compression_method = static_cast<decltype(compression_method)>(load_little_endian_unsigned_int(buffer + 16, 4));
+	raw_data_size = load_little_endian_unsigned_int(buffer + 20, sizeof(raw_data_size));
+	h_pixel_per_meter = load_little_endian_unsigned_int(buffer + 24, sizeof(h_pixel_per_meter));
+	v_pixel_per_meter = load_little_endian_unsigned_int(buffer + 28, sizeof(v_pixel_per_meter));
+	colors_in_palette = load_little_endian_unsigned_int(buffer + 32, sizeof(colors_in_palette));
+	important_colors = load_little_endian_unsigned_int(buffer + 36, sizeof(important_colors));
+}
+
+void dib_header::store(unsigned char *buffer) const
+{
+	buffer = store_little_endian_unsigned_int(buffer, header_size, sizeof(header_size));
+	buffer = store_little_endian_unsigned_int(buffer, width, sizeof(width));
+	buffer = store_little_endian_unsigned_int(buffer, height, sizeof(height));
+	buffer = store_little_endian_unsigned_int(buffer, color_planes, sizeof(color_planes));
+	buffer = store_little_endian_unsigned_int(buffer, bits_per_pixel, sizeof(bits_per_pixel));
+	buffer = store_little_endian_unsigned_int(buffer, compression_method, sizeof(compression_method));
+	buffer = store_little_endian_unsigned_int(buffer, raw_data_size, sizeof(raw_data_size));
+	buffer = store_little_endian_unsigned_int(buffer, h_pixel_per_meter, sizeof(h_pixel_per_meter));
+	buffer = store_little_endian_unsigned_int(buffer, v_pixel_per_meter, sizeof(v_pixel_per_meter));
+	buffer = store_little_endian_unsigned_int(buffer, colors_in_palette, sizeof(colors_in_palette));
+	store_little_endian_unsigned_int(buffer, important_colors, sizeof(important_colors));
 }
 
 void dib_header::write_into_stream(std::ostream &stream) const
 {
-	write_little_endian_unsigned_int(stream, header_size, sizeof(header_size));
-	write_little_endian_unsigned_int(stream, width, sizeof(width));
-	write_little_endian_unsigned_int(stream, height, sizeof(height));
-	write_little_endian_unsigned_int(stream, color_planes, sizeof(color_planes));
-	write_little_endian_unsigned_int(stream, bits_per_pixel, sizeof(bits_per_pixel));
-	write_little_endian_unsigned_int(stream, compression_method, sizeof(compression_method));
-	write_little_endian_unsigned_int(stream, raw_data_size, sizeof(raw_data_size));
-	write_little_endian_unsigned_int(stream, h_pixel_per_meter, sizeof(h_pixel_per_meter));
-	write_little_endian_unsigned_int(stream, v_pixel_per_meter, sizeof(v_pixel_per_meter));
-	write_little_endian_unsigned_int(stream, colors_in_palette, sizeof(colors_in_palette));
-	write_little_endian_unsigned_int(stream, important_colors, sizeof(important_colors));
+	unsigned char buffer[HEADER_SIZE];
+	store(buffer);
+	stream.write(reinterpret_cast<const char *>(buffer), HEADER_SIZE);
 }
 
-void bmp::encode_image(bitmap &bitmap, std::ostream &stream)
+namespace
+{
+
+enum
+{
+	BGR_BLUE = 0,
+	BGR_GREEN = 1,
+	BGR_RED = 2,
+	BGR_COMPONENTS = 3
+};
+
+enum
 {
-	const unsigned int component_amount = bitmap.components_amount;
+	// 256 entries of blue, green, red and a reserved byte
+	GRAY_PALETTE_SIZE = 256 * 4
+};
 
-	// Currently only RGB is supported and it is assumed in the bitmap data
-	const uint_fast32_t bytes_per_line = bitmap.bytes_per_pixel * bitmap.width;
-	const uint_fast32_t raw_data_size = bytes_per_line * bitmap.height;
+const bitmap_component::type_e bgr_types[BGR_COMPONENTS] =
+		{bitmap_component::BLUE, bitmap_component::GREEN, bitmap_component::RED};
+
+/**
+ * Position of blue, green and red within the pixels of a bitmap. Bitmaps without them but with
+ * luminance are gray, and only its position is kept, as the first one.
+ */
+struct bgr_layout
+{
+	/**
+	 * True if all of them take a whole byte, and then offsets can be used instead of indexes.
+	 */
+	bool byte_aligned;
+	unsigned int offsets[BGR_COMPONENTS];
+	unsigned int indexes[BGR_COMPONENTS];
+
+	/**
+	 * If true, the file is written with 8 bits per pixel and a gray palette.
+	 */
+	bool gray;
+
+	bgr_layout(const bitmap &bitmap) : byte_aligned(true), gray(false)
+	{
+		for (unsigned int position = 0; position < BGR_COMPONENTS; position++)
+		{
+			if (!bitmap.find_component(bgr_types[position], indexes[position]))
+			{
+				gray = true;
+			}
+
+			byte_aligned = byte_aligned && bitmap.find_byte_component(bgr_types[position], offsets[position]);
+		}
+
+		if (gray)
+		{
+			if (!bitmap.find_component(bitmap_component::LUMINANCE, indexes[0]))
+			{
+				throw bmp::unsupported_operation();
+			}
+
+			byte_aligned = bitmap.find_byte_component(bitmap_component::LUMINANCE, offsets[0]);
+		}
+	}
+
+	unsigned int bits_per_pixel() const
+	{
+		return gray? 8 : 24;
+	}
+};
+
+void fill_scanline_from_bytes(const bitmap &bitmap, const unsigned int row,
+		const unsigned int offsets[BGR_COMPONENTS], unsigned char *scanline)
+{
+	const unsigned char *pixel = bitmap.scanline(row);
+	const unsigned int bytes_per_pixel = bitmap.bytes_per_pixel;
+	const unsigned int blue_offset = offsets[BGR_BLUE];
+	const unsigned int green_offset = offsets[BGR_GREEN];
+	const unsigned int red_offset = offsets[BGR_RED];
+
+	for (unsigned int column = bitmap.width; column > 0; column--)
+	{
+		scanline[0] = pixel[blue_offset];
+		scanline[1] = pixel[green_offset];
+		scanline[2] = pixel[red_offset];
+
+		scanline += 3;
+		pixel += bytes_per_pixel;
+	}
+}
+
+void fill_scanline_from_pixels(const bitmap &bitmap, const unsigned int row,
+		const unsigned int indexes[BGR_COMPONENTS], bitmap::component_value_t *components,
+		unsigned char *scanline)
+{
+	for (unsigned int column = 0; column < bitmap.width; column++)
+	{
+		bitmap.getPixel(column, row, components);
+
+		for (unsigned int position = 0; position < BGR_COMPONENTS; position++)
+		{
+			const bitmap::component_value_t value = components[indexes[position]];
+			*(scanline++) = (value > 0 && value < 1)? value * 0xFF : ((value < 0.5)? 0 : 0xFF);
+		}
+	}
+}
+
+void fill_gray_scanline(const bitmap &bitmap, const bgr_layout &layout, const unsigned int row,
+		bitmap::component_value_t *components, unsigned char *scanline)
+{
+	if (layout.byte_aligned)
+	{
+		const unsigned char *pixel = bitmap.scanline(row) + layout.offsets[0];
+		const unsigned int bytes_per_pixel = bitmap.bytes_per_pixel;
+		for (unsigned int column = bitmap.width; column > 0; column--)
+		{
+			*(scanline++) = *pixel;
+			pixel += bytes_per_pixel;
+		}
+
+		return;
+	}
+
+	for (unsigned int column = 0; column < bitmap.width; column++)
+	{
+		bitmap.getPixel(column, row, components);
+		const bitmap::component_value_t value = components[layout.indexes[0]];
+		*(scanline++) = (value > 0 && value < 1)? value * 0xFF : ((value < 0.5)? 0 : 0xFF);
+	}
+}
+
+/**
+ * Fills the given BGR scanline, or gray one if the layout is gray, with the pixels in the given
+ * bitmap row. components is a buffer with room for all bitmap components, only used if the
+ * layout is not byte aligned.
+ */
+void fill_scanline(const bitmap &bitmap, const bgr_layout &layout, const unsigned int row,
+		bitmap::component_value_t *components, unsigned char *scanline)
+{
+	if (layout.gray)
+	{
+		fill_gray_scanline(bitmap, layout, row, components, scanline);
+	}
+	else if (layout.byte_aligned)
+	{
+		fill_scanline_from_bytes(bitmap, row, layout.offsets, scanline);
+	}
+	else
+	{
+		fill_scanline_from_pixels(bitmap, row, layout.indexes, components, scanline);
+	}
+}
+
+/**
+ * Stores both headers for a 24 bits file with the given size, or a 8 bits one if gray, whose
+ * palette is expected just after the headers. Returns the size of the whole file.
+ */
+uint_fast32_t store_headers(unsigned char *headers, uint_fast32_t width, uint_fast32_t height, bool top_down,
+		bool gray)
+{
+	const unsigned int bits_per_pixel = gray? 8 : 24;
+	const uint_fast32_t raw_data_size = bmp::scanline_size(width, bits_per_pixel) * height;
 
 	dib_header dib_header;
-	dib_header.bits_per_pixel = 8 * component_amount; // TODO: This is not true for gray-scaled and other configurations
-	dib_header.width = bitmap.width;
-	dib_header.height = bitmap.height;
+	dib_header.bits_per_pixel = bits_per_pixel;
+	dib_header.width = width;
+	dib_header.height = top_down? -static_cast<int32_t>(height) : height;
 	dib_header.raw_data_size = raw_data_size;
+	dib_header.colors_in_palette = gray? 256 : 0;
 
 	bmp_header bmp_header;
-	bmp_header.bitmap_offset = dib_header.header_size + bmp_header::HEADER_SIZE;
+	bmp_header.bitmap_offset = dib_header.header_size + bmp_header::HEADER_SIZE + (gray? GRAY_PALETTE_SIZE : 0);
 	bmp_header.file_size = bmp_header.bitmap_offset + raw_data_size;
 
-	bmp_header.write_into_stream(stream);
-	dib_header.write_into_stream(stream);
+	bmp_header.store(headers);
+	dib_header.store(headers + bmp_header::HEADER_SIZE);
 
-	bitmap::component_value_t components[bitmap.components_amount];
+	return bmp_header.file_size;
+}
 
-	for (int_fast32_t row = dib_header.height - 1; row >= 0; row--)
+/**
+ * Stores the GRAY_PALETTE_SIZE bytes of a palette where each index is its own gray level.
+ */
+void store_gray_palette(unsigned char *palette)
+{
+	for (unsigned int index = 0; index < 256; index++)
 	{
-		for (int_fast32_t column = 0; column < dib_header.width; column++)
-		{
-			bitmap.getPixel(column, row, components);
+		*(palette++) = index;
+		*(palette++) = index;
+		*(palette++) = index;
+		*(palette++) = 0;
+	}
+}
+
+/**
+ * Works out the components of a pixel from the masks for red, green and blue. Components are
+ * sorted from the less significant bits to the most ones, as bitmap expects. Masks must be
+ * contiguous and there cannot be gaps between them.
+ */
+void components_from_masks(bitmap &bitmap, const uint32_t masks[BGR_COMPONENTS], unsigned int bits_per_pixel)
+{
+	shared_array<bitmap_component> components = shared_array<bitmap_component>::allocate(BGR_COMPONENTS);
+	bool used[BGR_COMPONENTS] = {false, false, false};
 
-			for (int_fast32_t component_index = static_cast<int_fast32_t>(component_amount - 1); component_index >= 0; component_index--)
+	unsigned int shift = 0;
+	for (unsigned int index = 0; index < BGR_COMPONENTS; index++)
+	{
+		int found = -1;
+		for (unsigned int position = 0; position < BGR_COMPONENTS; position++)
+		{
+			if (!used[position] && masks[position] != 0 && ((masks[position] >> shift) & 1) != 0)
 			{
-				const bitmap::component_value_t value = components[component_index];
-				unsigned int int_value = (value > 0 && value < 1)? value * 0xFF : ((value < 0.5)? 0 : 0xFF);
-				write_little_endian_unsigned_int(stream, int_value, 1);
+				found = position;
 			}
 		}
+
+		if (found < 0)
+		{
+			throw bmp::unsupported_operation();
+		}
+
+		const uint32_t mask = masks[found] >> shift;
+		unsigned int bits = 0;
+		while (bits < 32 && ((mask >> bits) & 1) != 0)
+		{
+			bits++;
+		}
+
+		if (bits < 32 && (mask >> bits) != 0)
+		{
+			throw bmp::unsupported_operation();
+		}
+
+		used[found] = true;
+		components[index].type = bgr_types[found];
+		components[index].bits_per_pixel = bits;
+		shift += bits;
+	}
+
+	if (shift > bits_per_pixel)
+	{
+		throw bmp::invalid_file_format();
+	}
+
+	bitmap.components = components;
+	bitmap.components_amount = BGR_COMPONENTS;
+}
+
+/**
+ * Reads the headers of a whole BMP file in memory and sets up everything in the bitmap but its
+ * data. Returns the position of the pixel array within the file.
+ */
+uint_fast32_t decode_layout(bitmap &bitmap, const unsigned char *file, uint_fast64_t file_size)
+{
+	if (file_size < bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE)
+	{
+		throw bmp::invalid_file_format();
+	}
+
+	const bmp_header header(file);
+	if (header.signature[0] != 'B' || header.signature[1] != 'M')
+	{
+		throw bmp::invalid_file_format();
+	}
+
+	const dib_header info(file + bmp_header::HEADER_SIZE);
+	if (info.header_size < dib_header::HEADER_SIZE)
+	{
+		// OS/2 headers are not supported
+		throw bmp::unsupported_operation();
+	}
+
+	// The height of top-down images is negative, but its opposite must be representable as well
+	if (info.width <= 0 || info.height == 0 || info.height == std::numeric_limits<int32_t>::min() || info.color_planes != 1)
+	{
+		throw bmp::invalid_file_format();
+	}
+
+	// Pixels can not overlap the headers nor start beyond the end of the file
+	if (header.bitmap_offset < static_cast<uint_fast64_t>(bmp_header::HEADER_SIZE) + info.header_size ||
+			header.bitmap_offset > file_size)
+	{
+		throw bmp::invalid_file_format();
 	}
+
+	uint32_t masks[BGR_COMPONENTS];
+	switch (info.compression_method)
+	{
+	case dib_header::BI_RGB:
+		if (info.bits_per_pixel == 16)
+		{
+			masks[BGR_RED] = 0x7C00;
+			masks[BGR_GREEN] = 0x03E0;
+			masks[BGR_BLUE] = 0x001F;
+		}
+		else if (info.bits_per_pixel == 24 || info.bits_per_pixel == 32)
+		{
+			masks[BGR_RED] = 0xFF0000;
+			masks[BGR_GREEN] = 0x00FF00;
+			masks[BGR_BLUE] = 0x0000FF;
+		}
+		else
+		{
+			throw bmp::unsupported_operation();
+		}
+		break;
+
+	case dib_header::BI_BITFIELDS:
+	case dib_header::BI_ALPHABITFIELDS:
+		// Masks are just after the basic header, either within a newer header or after it
+		if ((info.bits_per_pixel != 16 && info.bits_per_pixel != 32) ||
+				file_size < bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE + 12)
+		{
+			throw bmp::unsupported_operation();
+		}
+
+		masks[BGR_RED] = load_little_endian_unsigned_int(file + bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE, 4);
+		masks[BGR_GREEN] = load_little_endian_unsigned_int(file + bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE + 4, 4);
+		masks[BGR_BLUE] = load_little_endian_unsigned_int(file + bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE + 8, 4);
+		break;
+
+	default:
+		throw bmp::unsupported_operation();
+	}
+
+	// Computed without truncation, as a huge width could wrap the stride around to a few bytes
+	const uint_fast64_t height = (info.height < 0)? -static_cast<int_fast64_t>(info.height) : info.height;
+	const uint_fast64_t scanline_bytes = ((static_cast<uint_fast64_t>(info.width) * info.bits_per_pixel + 31) >> 5) << 2;
+	if (scanline_bytes > std::numeric_limits<unsigned int>::max() ||
+			static_cast<uint_fast64_t>(info.width) * (info.bits_per_pixel / 8) > scanline_bytes)
+	{
+		throw bmp::invalid_file_format();
+	}
+
+	const uint_fast64_t end_of_pixels = scanline_bytes * height + header.bitmap_offset;
+	if (end_of_pixels > file_size)
+	{
+		throw bmp::invalid_file_format();
+	}
+
+	components_from_masks(bitmap, masks, info.bits_per_pixel);
+
+	bitmap.width = info.width;
+	bitmap.height = height;
+	bitmap.bottom_up = info.height > 0;
+	bitmap.bytes_per_pixel = info.bits_per_pixel / 8;
+	bitmap.bytes_per_scanline = scanline_bytes;
+
+	return header.bitmap_offset;
+}
+
+}
+
+uint_fast32_t bmp::scanline_size(uint_fast32_t width, unsigned int bits_per_pixel)
+{
+	return ((width * bits_per_pixel + 31) >> 5) << 2;
+}
+
+void bmp::encode_image(bitmap &bitmap, std::ostream &stream)
+{
+	encode_image(bitmap, stream, encode_options());
+}
+
+void bmp::encode_image(bitmap &bitmap, std::ostream &stream, const encode_options &options)
+{
+	trace::span encode_span("bmp::encode_image", "stage");
+	DECODE_STATS_ALLOCATIONS(meter, options.stats);
+	DECODE_STATS_CLOCK(clock, options.stats, BMP_ENCODE);
+	const bgr_layout layout(bitmap);
+
+	unsigned char headers[bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE + GRAY_PALETTE_SIZE];
+	store_headers(headers, bitmap.width, bitmap.height, options.top_down, layout.gray);
+	store_gray_palette(headers + bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE);
+	stream.write(reinterpret_cast<const char *>(headers), sizeof(headers) - (layout.gray? 0 : GRAY_PALETTE_SIZE));
+
+	// Padding bytes are set once here and never touched again
+	const uint_fast32_t bytes_per_line = scanline_size(bitmap.width, layout.bits_per_pixel());
+	std::vector<unsigned char, allocation::container_allocator<unsigned char> > scanline(bytes_per_line, 0);
+	std::vector<bitmap::component_value_t, allocation::container_allocator<bitmap::component_value_t> >
+			components(bitmap.components_amount);
+
+	for (uint_fast32_t step = 0; step < bitmap.height; step++)
+	{
+		const uint_fast32_t row = options.top_down? step : bitmap.height - 1 - step;
+		fill_scanline(bitmap, layout, row, components.data(), scanline.data());
+		stream.write(reinterpret_cast<const char *>(scanline.data()), bytes_per_line);
+	}
+}
+
+void bmp::encode_image(bitmap &bitmap, const char *path, const encode_options &options)
+{
+	trace::span encode_span("bmp::encode_image", "stage");
+	DECODE_STATS_ALLOCATIONS(meter, options.stats);
+	DECODE_STATS_CLOCK(clock, options.stats, BMP_ENCODE);
+	const bgr_layout layout(bitmap);
+
+	unsigned char headers[bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE + GRAY_PALETTE_SIZE];
+	const uint_fast32_t file_size = store_headers(headers, bitmap.width, bitmap.height, options.top_down,
+			layout.gray);
+	store_gray_palette(headers + bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE);
+	const std::size_t headers_size = sizeof(headers) - (layout.gray? 0 : GRAY_PALETTE_SIZE);
+
+	// Written back by the kernel once unmapped. Padding is already 0 in the new file.
+	mapped_file file(path, mapped_file::CREATE, file_size);
+	memcpy(file.data(), headers, headers_size);
+
+	const uint_fast32_t bytes_per_line = scanline_size(bitmap.width, layout.bits_per_pixel());
+	unsigned char *scanline = file.data() + headers_size;
+	std::vector<bitmap::component_value_t, allocation::container_allocator<bitmap::component_value_t> >
+			components(bitmap.components_amount);
+
+	for (uint_fast32_t step = 0; step < bitmap.height; step++)
+	{
+		const uint_fast32_t row = options.top_down? step : bitmap.height - 1 - step;
+		fill_scanline(bitmap, layout, row, components.data(), scanline);
+		scanline += bytes_per_line;
+	}
+}
+
+void bmp::map_output(bitmap &bitmap, const char *path, unsigned int width, unsigned int height, bool gray)
+{
+	unsigned char headers[bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE + GRAY_PALETTE_SIZE];
+	const uint_fast32_t file_size = store_headers(headers, width, height, false, gray);
+	store_gray_palette(headers + bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE);
+	const std::size_t headers_size = sizeof(headers) - (gray? 0 : GRAY_PALETTE_SIZE);
+
+	// Allocated before the mapping, so that nothing is left behind if it fails
+	const unsigned int components_amount = gray? 1 : BGR_COMPONENTS;
+	shared_array<bitmap_component> components = shared_array<bitmap_component>::allocate(components_amount);
+	for (unsigned int position = 0; position < components_amount; position++)
+	{
+		components[position].type = gray? bitmap_component::LUMINANCE : bgr_types[position];
+		components[position].bits_per_pixel = 8;
+	}
+
+	mapped_file *file = new mapped_file(path, mapped_file::CREATE, file_size);
+	memcpy(file->data(), headers, headers_size);
+
+	bitmap.width = width;
+	bitmap.height = height;
+	bitmap.bytes_per_pixel = components_amount;
+	bitmap.bytes_per_scanline = scanline_size(width, gray? 8 : 24);
+	bitmap.components_amount = components_amount;
+	bitmap.components = components;
+	bitmap.bottom_up = true;
+	bitmap.data = shared_array<unsigned char>::wrap(file->data() + headers_size, file);
+}
+
+void bmp::decode_image(bitmap &bitmap, std::istream &stream)
+{
+	const std::vector<char> file((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+	const unsigned char *file_data = reinterpret_cast<const unsigned char *>(file.data());
+
+	const uint_fast32_t offset = decode_layout(bitmap, file_data, file.size());
+	const uint_fast32_t data_size = bitmap.bytes_per_scanline * bitmap.height;
+
+	bitmap.data = shared_array<unsigned char>::allocate(data_size);
+	memcpy(bitmap.data.get(), file_data + offset, data_size);
+}
+
+void bmp::map_image(bitmap &bitmap, const char *path)
+{
+	mapped_file *file = new mapped_file(path);
+
+	uint_fast32_t offset;
+	try
+	{
+		offset = decode_layout(bitmap, file->data(), file->size());
+	}
+	catch (...)
+	{
+		delete file;
+		throw;
+	}
+
+	bitmap.data = shared_array<unsigned char>::wrap(file->data() + offset, file);
 }
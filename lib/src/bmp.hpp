@@ -6,6 +6,7 @@
 #include <iostream>
 
 #include "bitmaps.hpp"
+#include "decode_stats.hpp"
 
 struct bmp_header
 {
@@ -26,6 +27,16 @@ struct bmp_header
 	bmp_header() : signature({'B','M'}) { }
 
 	bmp_header(std::istream &stream);
+
+	/**
+	 * Loads the header from the first HEADER_SIZE bytes of the given buffer.
+	 */
+	bmp_header(const unsigned char *buffer);
+
+	/**
+	 * Stores the HEADER_SIZE bytes of this header in the given buffer.
+	 */
+	void store(unsigned char *buffer) const;
 	void write_into_stream(std::ostream &stream) const;
 };
 
@@ -64,6 +75,16 @@ struct dib_header
 			important_colors(0)
 	{ }
 
+	/**
+	 * Loads the header from the first HEADER_SIZE bytes of the given buffer. Any extra field in
+	 * newer versions of the header is not loaded.
+	 */
+	dib_header(const unsigned char *buffer);
+
+	/**
+	 * Stores the HEADER_SIZE bytes of this header in the given buffer.
+	 */
+	void store(unsigned char *buffer) const;
 	void write_into_stream(std::ostream &stream) const;
 };
 
@@ -74,7 +95,83 @@ namespace bmp
 	 */
 	class unsupported_operation { };
 
+	/**
+	 * Thrown when the file to decode is not a BMP file or it is truncated.
+	 */
+	class invalid_file_format { };
+
+	/**
+	 * Optional settings for encode_image.
+	 */
+	struct encode_options
+	{
+		/**
+		 * If true, scanlines are written from top to bottom and the height in the header is
+		 * negative. Otherwise they are written bottom-up as most readers expect.
+		 */
+		bool top_down;
+
+		/**
+		 * If not NULL, the time spent encoding is added to its BMP_ENCODE stage.
+		 */
+		decode_stats *stats;
+
+		encode_options() : top_down(false), stats(NULL) { }
+	};
+
+	/**
+	 * Returns the amount of bytes that a scanline takes in a BMP file, including the padding
+	 * required to align each scanline to 4 bytes.
+	 */
+	uint_fast32_t scanline_size(uint_fast32_t width, unsigned int bits_per_pixel);
+
+	/**
+	 * Writes the given bitmap as a 24 bits BMP file. Bitmaps without red, green and blue but with
+	 * a luminance component are written as 8 bits BMP files with a gray palette. Otherwise
+	 * unsupported_operation is thrown.
+	 */
 	void encode_image(bitmap &bitmap, std::ostream &stream);
+	void encode_image(bitmap &bitmap, std::ostream &stream, const encode_options &options);
+
+	/**
+	 * Same as encode_image, but the file in the given path is created with its final size and
+	 * mapped in memory, so scanlines are written directly at their position in the file.
+	 *
+	 * mapped_file::unable_to_map is thrown if the file cannot be created.
+	 */
+	void encode_image(bitmap &bitmap, const char *path, const encode_options &options = encode_options());
+
+	/**
+	 * Creates a 24 bits BMP file for an image with the given size and maps it in memory. The
+	 * bitmap is set up to point to the pixel array within the file, with blue, green and red
+	 * components and bottom-up scanlines, so anything stored in the bitmap is placed at its final
+	 * position in the file. The file is complete once the bitmap data is released.
+	 *
+	 * If gray is true, the file has 8 bits per pixel and a gray palette, and the bitmap a single
+	 * luminance component instead.
+	 *
+	 * mapped_file::unable_to_map is thrown if the file cannot be created.
+	 */
+	void map_output(bitmap &bitmap, const char *path, unsigned int width, unsigned int height, bool gray = false);
+
+	/**
+	 * Reads a whole BMP file from the stream and copies its pixels into the bitmap.
+	 *
+	 * Only uncompressed files are supported: 16, 24 and 32 bits BI_RGB and 16 and 32 bits
+	 * BI_BITFIELDS whose masks are contiguous. Any other file will throw unsupported_operation.
+	 * Alpha, if present, is ignored.
+	 */
+	void decode_image(bitmap &bitmap, std::istream &stream);
+
+	/**
+	 * Same as decode_image, but the file is mapped in memory and the bitmap data points directly
+	 * to the pixels within the mapping. Nothing is copied; the bitmap keeps the scanline size and
+	 * order of the file and pages are loaded when accessed. Writing into the bitmap never changes
+	 * the file.
+	 *
+	 * mapped_file::unable_to_map is thrown if the file cannot be mapped.
+	 */
+	void map_image(bitmap &bitmap, const char *path);
 }
 
 #endif /* BMP_HPP_ */
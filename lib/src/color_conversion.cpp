@@ -0,0 +1,51 @@
+
+#include "color_conversion.hpp"
+
+void color_conversion::ycbcr_to_rgb(const block_matrix ycbcr[YCBCR_COMPONENTS], block_matrix rgb[RGB_COMPONENTS])
+{
+	block_matrix luminance = ycbcr[Y];
+	luminance += 128;
+
+	rgb[RED] = luminance + (ycbcr[CR] * 1.402);
+	rgb[GREEN] = luminance - (ycbcr[CB] * 0.344136) - (ycbcr[CR] * 0.71414);
+	rgb[BLUE] = luminance + (ycbcr[CB] * 1.772);
+}
+
+void color_conversion::cmyk_to_ink(const block_matrix cmyk[CMYK_COMPONENTS], bool inverted,
+		block_matrix ink[CMYK_COMPONENTS])
+{
+	for (unsigned int component = 0; component < CMYK_COMPONENTS; component++)
+	{
+		// Inverted values are 127 - value once centered on 0, instead of 128 + value
+		ink[component] = cmyk[component] * (inverted? -1 : 1);
+		ink[component] += inverted? 127 : 128;
+		ink[component].clamp(0, 255);
+	}
+}
+
+void color_conversion::ycck_to_ink(const block_matrix ycck[CMYK_COMPONENTS], block_matrix ink[CMYK_COMPONENTS])
+{
+	ycbcr_to_rgb(ycck, ink);
+	for (unsigned int component = 0; component < BLACK; component++)
+	{
+		ink[component].clamp(0, 255);
+	}
+
+	ink[BLACK] = ycck[BLACK] * -1;
+	ink[BLACK] += 127;
+	ink[BLACK].clamp(0, 255);
+}
+
+void color_conversion::ink_to_rgb(const block_matrix ink[CMYK_COMPONENTS], block_matrix rgb[RGB_COMPONENTS])
+{
+	// Each ink lets through the light that black has not absorbed
+	block_matrix light = ink[BLACK] * (-1.0 / 255);
+	light += 1;
+
+	for (unsigned int component = 0; component < RGB_COMPONENTS; component++)
+	{
+		rgb[component] = ink[component] * -1;
+		rgb[component] += 255;
+		rgb[component] = rgb[component].multiply_cells(light);
+	}
+}
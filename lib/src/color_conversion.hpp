@@ -0,0 +1,62 @@
+
+#ifndef COLOR_CONVERSION_HPP_
+#define COLOR_CONVERSION_HPP_
+
+#include "block_matrix.hpp"
+
+namespace color_conversion
+{
+	enum ycbcr_component_e
+	{
+		Y = 0,
+		CB = 1,
+		CR = 2,
+		YCBCR_COMPONENTS = 3
+	};
+
+	enum rgb_component_e
+	{
+		RED = 0,
+		GREEN = 1,
+		BLUE = 2,
+		RGB_COMPONENTS = 3
+	};
+
+	enum cmyk_component_e
+	{
+		CYAN = 0,
+		MAGENTA = 1,
+		YELLOW = 2,
+		BLACK = 3,
+		CMYK_COMPONENTS = 4
+	};
+
+	/**
+	 * Converts the luminance, blue chrominance and red chrominance blocks, as they come out of
+	 * the inverse DCT (centered on 0), into red, green and blue blocks with values expected to be
+	 * between 0 and 255. Values are not clamped.
+	 */
+	void ycbcr_to_rgb(const block_matrix ycbcr[YCBCR_COMPONENTS], block_matrix rgb[RGB_COMPONENTS]);
+
+	/**
+	 * Converts the cyan, magenta, yellow and black blocks, as they come out of the inverse DCT,
+	 * into ink amounts between 0 and 255, where 255 is full ink. If inverted, 255 is no ink in
+	 * the file, as Adobe applications write them.
+	 */
+	void cmyk_to_ink(const block_matrix cmyk[CMYK_COMPONENTS], bool inverted, block_matrix ink[CMYK_COMPONENTS]);
+
+	/**
+	 * Converts YCCK blocks, as they come out of the inverse DCT, into ink amounts as cmyk_to_ink
+	 * does. The first three hold cyan, magenta and yellow transformed as if they were red, green
+	 * and blue, while black is inverted.
+	 */
+	void ycck_to_ink(const block_matrix ycck[CMYK_COMPONENTS], block_matrix ink[CMYK_COMPONENTS]);
+
+	/**
+	 * Converts ink amounts into red, green and blue blocks between 0 and 255, as the inks would
+	 * look on white paper without any colour profile.
+	 */
+	void ink_to_rgb(const block_matrix ink[CMYK_COMPONENTS], block_matrix rgb[RGB_COMPONENTS]);
+}
+
+#endif /* COLOR_CONVERSION_HPP_ */
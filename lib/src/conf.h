@@ -18,6 +18,10 @@
  * PROJECT_PLATFORM_UNIX
  *     Declared in case this program is compiled for Unix variants.
  *
+ * PROJECT_DECODE_STATS
+ *     Declared to measure the time spent in each stage when decoding and encoding images. When
+ *     not declared, no measurement code is compiled at all and decode_stats remains empty.
+ *
  */
 
 #ifndef CONF_H_
@@ -0,0 +1,93 @@
+
+#include "decode_stats.hpp"
+
+decode_stats::decode_stats() : listener(NULL)
+{
+	reset();
+}
+
+void decode_stats::reset()
+{
+	for (unsigned int stage = 0; stage < STAGE_AMOUNT; stage++)
+	{
+		stage_nanoseconds[stage] = 0;
+	}
+
+	mcus_decoded = 0;
+	blocks_decoded = 0;
+	dc_only_blocks = 0;
+	bits_consumed = 0;
+	bytes_unstuffed = 0;
+	allocations = 0;
+	bytes_allocated = 0;
+	live_bytes = 0;
+	peak_bytes = 0;
+}
+
+uint_fast64_t decode_stats::total_nanoseconds() const
+{
+	uint_fast64_t total = 0;
+	for (unsigned int stage = 0; stage < STAGE_AMOUNT; stage++)
+	{
+		total += stage_nanoseconds[stage];
+	}
+
+	return total;
+}
+
+const char *decode_stats::stage_name(stage_e stage)
+{
+	switch (stage)
+	{
+	case MARKER_PARSING:
+		return "marker parsing";
+
+	case HUFFMAN_DECODE:
+		return "huffman decode";
+
+	case DEQUANTIZATION:
+		return "dequantization";
+
+	case IDCT:
+		return "IDCT";
+
+	case UPSAMPLING:
+		return "upsampling";
+
+	case COLOR_CONVERSION:
+		return "color conversion";
+
+	case PIXEL_STORE:
+		return "pixel store";
+
+	case BMP_ENCODE:
+		return "BMP encode";
+
+	default:
+		return "unknown";
+	}
+}
+
+void decode_stats::print(std::ostream &stream) const
+{
+	// Stage times and work counters would all be 0
+	if (ENABLED)
+	{
+		for (unsigned int stage = 0; stage < STAGE_AMOUNT; stage++)
+		{
+			stream << ' ' << stage_name(static_cast<stage_e>(stage)) << ": "
+					<< stage_nanoseconds[stage] << " ns" << std::endl;
+		}
+
+		stream << " total: " << total_nanoseconds() << " ns" << std::endl
+				<< " MCUs decoded: " << mcus_decoded << std::endl
+				<< " blocks decoded: " << blocks_decoded << std::endl
+				<< " DC only blocks: " << dc_only_blocks << std::endl
+				<< " bits consumed: " << bits_consumed << std::endl
+				<< " bytes unstuffed: " << bytes_unstuffed << std::endl;
+	}
+
+	stream << " allocations: " << allocations << std::endl
+			<< " bytes allocated: " << bytes_allocated << std::endl
+			<< " peak bytes: " << peak_bytes << std::endl;
+}
@@ -0,0 +1,379 @@
+
+#ifndef DECODE_STATS_HPP_
+#define DECODE_STATS_HPP_
+
+#include "conf.h"
+#include "allocation.hpp"
+
+#include <stdint.h>
+#include <iostream>
+
+#ifdef PROJECT_DECODE_STATS
+# include <chrono>
+#endif // PROJECT_DECODE_STATS
+
+/**
+ * Time spent in each stage of a decode and some counters about the work done. Stage times and
+ * work counters are only filled when this project is compiled with PROJECT_DECODE_STATS,
+ * otherwise they remain 0. Allocations are always counted.
+ */
+struct decode_stats
+{
+	enum stage_e
+	{
+		MARKER_PARSING,
+		HUFFMAN_DECODE,
+		DEQUANTIZATION,
+		IDCT,
+		UPSAMPLING,
+		COLOR_CONVERSION,
+		PIXEL_STORE,
+		BMP_ENCODE,
+		STAGE_AMOUNT
+	};
+
+#ifdef PROJECT_DECODE_STATS
+	static const bool ENABLED = true;
+#else // PROJECT_DECODE_STATS
+	static const bool ENABLED = false;
+#endif // PROJECT_DECODE_STATS
+
+	/**
+	 * Receives every stage change while measuring, so that other measurements (like hardware
+	 * counters) can be attributed to stages too.
+	 */
+	class stage_listener
+	{
+	public:
+		virtual ~stage_listener() { }
+
+		/**
+		 * Called when the given stage ends, or with STAGE_AMOUNT when measuring starts or
+		 * resumes and nothing was being measured before.
+		 */
+		virtual void stage_finished(stage_e stage) = 0;
+
+		/**
+		 * Called when a row of MCUs not measured per stage ends. Everything since the previous
+		 * notification belongs to that row, split among its stages in an unknown way.
+		 */
+		virtual void unsampled_finished() { }
+	};
+
+	uint_fast64_t stage_nanoseconds[STAGE_AMOUNT];
+
+	/**
+	 * Number of MCUs read from the scan data.
+	 */
+	uint_fast64_t mcus_decoded;
+
+	/**
+	 * Number of 8x8 blocks read from the scan data, and how many of them only had DC coefficient.
+	 */
+	uint_fast64_t blocks_decoded;
+	uint_fast64_t dc_only_blocks;
+
+	/**
+	 * Number of bits consumed from the scan data, and number of 0x00 bytes skipped after 0xFF.
+	 */
+	uint_fast64_t bits_consumed;
+	uint_fast64_t bytes_unstuffed;
+
+	/**
+	 * Heap allocations made through the allocation functions, the bytes they requested, and the
+	 * maximum amount of bytes allocated and not released at the same time. Memory released
+	 * without being allocated while measuring (like a previous bitmap) is subtracted, so
+	 * live_bytes can be negative.
+	 */
+	uint_fast64_t allocations;
+	uint_fast64_t bytes_allocated;
+	int_fast64_t live_bytes;
+	int_fast64_t peak_bytes;
+
+	/**
+	 * Optional listener, NULL by default. It is kept when the stats are reset.
+	 */
+	stage_listener *listener;
+
+	decode_stats();
+
+	void reset();
+	uint_fast64_t total_nanoseconds() const;
+	static const char *stage_name(stage_e stage);
+	void print(std::ostream &stream) const;
+};
+
+/**
+ * Accounts in the given stats all allocations made by the calling thread while it exists. Any
+ * listener set before keeps being notified too.
+ */
+class allocation_meter : public allocation::listener
+{
+	decode_stats * const stats;
+	allocation::listener * const previous;
+
+public:
+	allocation_meter(decode_stats *stats) : stats(stats),
+			previous((stats != NULL)? allocation::set_listener(this) : NULL) { }
+
+	~allocation_meter()
+	{
+		if (stats != NULL)
+		{
+			allocation::set_listener(previous);
+		}
+	}
+
+	virtual void allocated(std::size_t bytes)
+	{
+		stats->allocations++;
+		stats->bytes_allocated += bytes;
+		stats->live_bytes += bytes;
+		if (stats->live_bytes > stats->peak_bytes)
+		{
+			stats->peak_bytes = stats->live_bytes;
+		}
+
+		if (previous != NULL)
+		{
+			previous->allocated(bytes);
+		}
+	}
+
+	virtual void released(std::size_t bytes)
+	{
+		stats->live_bytes -= bytes;
+
+		if (previous != NULL)
+		{
+			previous->released(bytes);
+		}
+	}
+};
+
+// Allocations are counted in every build, as the allocation functions always notify them
+#define DECODE_STATS_ALLOCATIONS(NAME, STATS) allocation_meter NAME(STATS)
+
+#ifdef PROJECT_DECODE_STATS
+
+/**
+ * Accumulates the time elapsed in the current stage when a new stage is entered. It does nothing
+ * if there is no decode_stats to fill. It must be paused while another clock is measuring the
+ * same stats, so that no time is counted twice.
+ */
+class stage_clock
+{
+	typedef std::chrono::steady_clock clock;
+
+	decode_stats * const stats;
+	decode_stats::stage_e current;
+	bool running;
+	bool enabled;
+	clock::time_point start;
+
+	void notify(decode_stats::stage_e finished)
+	{
+		if (stats->listener != NULL)
+		{
+			stats->listener->stage_finished(finished);
+		}
+	}
+
+public:
+	stage_clock(decode_stats *stats, decode_stats::stage_e stage) : stats(stats), current(stage), running(true),
+			enabled(true)
+	{
+		if (stats != NULL)
+		{
+			notify(decode_stats::STAGE_AMOUNT);
+			start = clock::now();
+		}
+	}
+
+	~stage_clock()
+	{
+		pause();
+	}
+
+	void enter(decode_stats::stage_e stage)
+	{
+		if (stats != NULL && enabled)
+		{
+			const clock::time_point now = clock::now();
+			if (running)
+			{
+				stats->stage_nanoseconds[current] +=
+						std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+			}
+			notify(running? current : decode_stats::STAGE_AMOUNT);
+
+			start = now;
+			current = stage;
+			running = true;
+		}
+	}
+
+	/**
+	 * Stops measuring until a stage is entered again.
+	 */
+	void pause()
+	{
+		enter(current);
+		running = false;
+	}
+
+	/**
+	 * Stops measuring and ignores every stage entered until enabled again.
+	 */
+	void disable()
+	{
+		pause();
+		enabled = false;
+	}
+
+	void enable(decode_stats::stage_e stage)
+	{
+		enabled = true;
+		enter(stage);
+	}
+};
+
+/**
+ * Reading the clock at every stage change of every block costs about as much as some of the
+ * stages measured. So only one row of MCUs out of SAMPLING_PERIOD is measured per stage, while
+ * the other rows are measured as a whole and their time is split among the stages as it was in
+ * the measured rows. The stage listener is only told when each row not measured ends.
+ */
+class row_sampler
+{
+	typedef std::chrono::steady_clock clock;
+
+	enum
+	{
+		SAMPLING_PERIOD = 8
+	};
+
+	decode_stats * const stats;
+	unsigned int rows;
+	bool sampled;
+	clock::time_point start;
+	uint_fast64_t row_start_nanoseconds[decode_stats::STAGE_AMOUNT];
+	uint_fast64_t sampled_nanoseconds[decode_stats::STAGE_AMOUNT];
+	uint_fast64_t skipped_nanoseconds;
+
+	void finish_row()
+	{
+		if (rows == 0)
+		{
+			return;
+		}
+
+		if (sampled)
+		{
+			for (unsigned int index = 0; index < decode_stats::STAGE_AMOUNT; index++)
+			{
+				sampled_nanoseconds[index] += stats->stage_nanoseconds[index] - row_start_nanoseconds[index];
+			}
+		}
+		else
+		{
+			skipped_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+			if (stats->listener != NULL)
+			{
+				stats->listener->unsampled_finished();
+			}
+		}
+	}
+
+public:
+	row_sampler(decode_stats *stats) : stats(stats), rows(0), sampled(false), skipped_nanoseconds(0)
+	{
+		for (unsigned int index = 0; index < decode_stats::STAGE_AMOUNT; index++)
+		{
+			sampled_nanoseconds[index] = 0;
+		}
+	}
+
+	/**
+	 * Ends the previous row, if any, and starts a new one, measured by the given clock from the
+	 * given stage if sampled. Returns the stats to be given to everything called for the row,
+	 * which is NULL if the row is not sampled.
+	 */
+	decode_stats *begin_row(stage_clock &row_clock, decode_stats::stage_e stage)
+	{
+		if (stats == NULL)
+		{
+			return NULL;
+		}
+
+		row_clock.pause();
+		finish_row();
+
+		sampled = rows++ % SAMPLING_PERIOD == 0;
+		if (sampled)
+		{
+			for (unsigned int index = 0; index < decode_stats::STAGE_AMOUNT; index++)
+			{
+				row_start_nanoseconds[index] = stats->stage_nanoseconds[index];
+			}
+			row_clock.enable(stage);
+			return stats;
+		}
+
+		row_clock.disable();
+		start = clock::now();
+		return NULL;
+	}
+
+	/**
+	 * Ends the last row and splits the time of the rows not sampled among the stages. The clock
+	 * is measuring the given stage afterwards.
+	 */
+	void finish(stage_clock &row_clock, decode_stats::stage_e stage)
+	{
+		if (stats == NULL)
+		{
+			return;
+		}
+
+		row_clock.pause();
+		finish_row();
+		rows = 0;
+
+		uint_fast64_t sampled_total = 0;
+		for (unsigned int index = 0; index < decode_stats::STAGE_AMOUNT; index++)
+		{
+			sampled_total += sampled_nanoseconds[index];
+		}
+
+		for (unsigned int index = 0; index < decode_stats::STAGE_AMOUNT && sampled_total != 0; index++)
+		{
+			stats->stage_nanoseconds[index] += static_cast<uint_fast64_t>(
+					static_cast<double>(skipped_nanoseconds) * sampled_nanoseconds[index] / sampled_total);
+		}
+
+		row_clock.enable(stage);
+	}
+};
+
+# define DECODE_STATS_CLOCK(NAME, STATS, STAGE) stage_clock NAME(STATS, decode_stats::STAGE)
+# define DECODE_STATS_ENTER(NAME, STAGE) NAME.enter(decode_stats::STAGE)
+# define DECODE_STATS_PAUSE(NAME) NAME.pause()
+# define DECODE_STATS_SAMPLER(NAME, STATS) row_sampler NAME(STATS)
+# define DECODE_STATS_BEGIN_ROW(SAMPLER, CLOCK, STAGE, ROW_STATS) ROW_STATS = SAMPLER.begin_row(CLOCK, decode_stats::STAGE)
+# define DECODE_STATS_FINISH_ROWS(SAMPLER, CLOCK, STAGE) SAMPLER.finish(CLOCK, decode_stats::STAGE)
+# define DECODE_STATS_ADD(STATS, COUNTER, AMOUNT) do { if ((STATS) != NULL) (STATS)->COUNTER += (AMOUNT); } while(0)
+
+#else // PROJECT_DECODE_STATS
+
+# define DECODE_STATS_CLOCK(NAME, STATS, STAGE)
+# define DECODE_STATS_ENTER(NAME, STAGE)
+# define DECODE_STATS_PAUSE(NAME)
+# define DECODE_STATS_SAMPLER(NAME, STATS)
+# define DECODE_STATS_BEGIN_ROW(SAMPLER, CLOCK, STAGE, ROW_STATS)
+# define DECODE_STATS_FINISH_ROWS(SAMPLER, CLOCK, STAGE)
+# define DECODE_STATS_ADD(STATS, COUNTER, AMOUNT)
+
+#endif // PROJECT_DECODE_STATS
+
+#endif /* DECODE_STATS_HPP_ */
@@ -0,0 +1,99 @@
+
+#include "exif.hpp"
+#include <cstring>
+
+namespace
+{
+
+enum
+{
+	TIFF_HEADER_SIZE = 8,
+	IFD_ENTRY_SIZE = 12,
+	ORIENTATION_TAG = 0x0112,
+	SHORT_TYPE = 3
+};
+
+uint_fast32_t read_unsigned(const unsigned char *position, unsigned int bytes, bool little_endian)
+{
+	uint_fast32_t value = 0;
+	for (unsigned int index = 0; index < bytes; index++)
+	{
+		value = (value << 8) | position[little_endian? bytes - 1 - index : index];
+	}
+
+	return value;
+}
+
+}
+
+exif::info::info(const unsigned char *segment, std::size_t size) : valid(false), _orientation(TOP_LEFT)
+{
+	if (!is_exif(segment, size) || size < HEADER_SIZE + TIFF_HEADER_SIZE)
+	{
+		return;
+	}
+
+	// Offsets within the TIFF structure are counted from its byte order mark
+	const unsigned char *tiff = segment + HEADER_SIZE;
+	const std::size_t tiff_size = size - HEADER_SIZE;
+
+	bool little_endian;
+	if (tiff[0] == 'I' && tiff[1] == 'I')
+	{
+		little_endian = true;
+	}
+	else if (tiff[0] == 'M' && tiff[1] == 'M')
+	{
+		little_endian = false;
+	}
+	else
+	{
+		return;
+	}
+
+	const uint_fast32_t ifd = read_unsigned(tiff + 4, 4, little_endian);
+	if (read_unsigned(tiff + 2, 2, little_endian) != 42 || ifd < TIFF_HEADER_SIZE || ifd > tiff_size - 2)
+	{
+		return;
+	}
+
+	const unsigned int entries = read_unsigned(tiff + ifd, 2, little_endian);
+	if (entries > (tiff_size - ifd - 2) / IFD_ENTRY_SIZE)
+	{
+		return;
+	}
+
+	for (unsigned int index = 0; index < entries; index++)
+	{
+		const unsigned char *entry = tiff + ifd + 2 + index * IFD_ENTRY_SIZE;
+		if (read_unsigned(entry, 2, little_endian) == ORIENTATION_TAG)
+		{
+			// A single short fits in the value field, in its first 2 bytes
+			const uint_fast32_t value = read_unsigned(entry + 8, 2, little_endian);
+			if (read_unsigned(entry + 2, 2, little_endian) != SHORT_TYPE ||
+					read_unsigned(entry + 4, 4, little_endian) != 1 || value < TOP_LEFT || value > LEFT_BOTTOM)
+			{
+				return;
+			}
+
+			_orientation = static_cast<orientation_e>(value);
+		}
+	}
+
+	valid = true;
+}
+
+bool exif::info::is_exif(const unsigned char *segment, std::size_t size)
+{
+	return size >= HEADER_SIZE && memcmp(segment, "Exif\0\0", HEADER_SIZE) == 0;
+}
+
+bool exif::info::is_valid() const
+{
+	return valid;
+}
+
+exif::orientation_e exif::info::orientation() const
+{
+	return valid? _orientation : TOP_LEFT;
+}
@@ -0,0 +1,64 @@
+
+#ifndef EXIF_HPP_
+#define EXIF_HPP_
+
+#include <stdint.h>
+#include <cstddef>
+
+namespace exif
+{
+	/**
+	 * Where the first row and the first column of the stored image are when it is shown, as the
+	 * orientation tag (0x0112) defines it.
+	 */
+	enum orientation_e
+	{
+		TOP_LEFT = 1, // Shown as stored
+		TOP_RIGHT = 2, // Mirrored horizontally
+		BOTTOM_RIGHT = 3, // Rotated 180 degrees
+		BOTTOM_LEFT = 4, // Mirrored vertically
+		LEFT_TOP = 5, // Transposed: rows become columns
+		RIGHT_TOP = 6, // Rotated 90 degrees clockwise
+		RIGHT_BOTTOM = 7, // Transposed and rotated 180 degrees
+		LEFT_BOTTOM = 8 // Rotated 90 degrees counterclockwise
+	};
+
+	/**
+	 * Tags read from the first IFD of the APP1 segment written by cameras and phones.
+	 */
+	struct info
+	{
+		enum info_size_e
+		{
+			HEADER_SIZE = 6 // "Exif" and 2 null bytes before the TIFF structure
+		};
+
+	private:
+		bool valid;
+		orientation_e _orientation;
+
+	public:
+		/**
+		 * Parses the given APP1 segment content. Nothing is kept from it.
+		 */
+		info(const unsigned char *segment, std::size_t size);
+
+		/**
+		 * True if the segment starts with the EXIF header. Other APP1 segments, like XMP, do not.
+		 */
+		static bool is_exif(const unsigned char *segment, std::size_t size);
+
+		/**
+		 * True if the segment is EXIF and its first IFD is within the segment, with a known
+		 * orientation if it has any.
+		 */
+		bool is_valid() const;
+
+		/**
+		 * TOP_LEFT if the segment has no orientation tag or is not valid.
+		 */
+		orientation_e orientation() const;
+	};
+}
+
+#endif /* EXIF_HPP_ */
@@ -1,26 +1,65 @@
 
 #include "huffman_tables.hpp"
+#include "allocation.hpp"
 
 huffman_table::huffman_table(std::istream &stream)
 {
-	stream.read(reinterpret_cast<char *>(symbols_per_size), MAX_WORD_SIZE);
+	unsigned char definition[MAX_WORD_SIZE + MAX_SYMBOL_AMOUNT];
+	stream.read(reinterpret_cast<char *>(definition), MAX_WORD_SIZE);
 
 	unsigned int all_symbol_amount = 0;
 	for (uint_fast8_t index = 0; index < MAX_WORD_SIZE; index++)
 	{
-		all_symbol_amount += symbols_per_size[index];
+		all_symbol_amount += definition[index];
 	}
 
-	unsigned char *all_symbols = new unsigned char[all_symbol_amount];
-	stream.read(reinterpret_cast<char *>(all_symbols), all_symbol_amount);
+	stream.read(reinterpret_cast<char *>(definition + MAX_WORD_SIZE), all_symbol_amount);
+	build(definition);
+}
+
+huffman_table::huffman_table(const unsigned char *definition)
+{
+	build(definition);
+}
+
+void huffman_table::build(const unsigned char *definition)
+{
+	unsigned int all_symbol_amount = 0;
+	for (uint_fast8_t index = 0; index < MAX_WORD_SIZE; index++)
+	{
+		symbols_per_size[index] = definition[index];
+		all_symbol_amount += definition[index];
+	}
+
+	unsigned char *all_symbols = allocation::new_array<unsigned char>(all_symbol_amount);
+	for (unsigned int index = 0; index < all_symbol_amount; index++)
+	{
+		all_symbols[index] = definition[MAX_WORD_SIZE + index];
+	}
 
 	symbols = all_symbols;
 	_symbol_amount = all_symbol_amount;
+
+	int_fast32_t code = 0;
+	symbol_index_t index = 0;
+	first_code[0] = 0;
+	last_code[0] = -1;
+	first_index[0] = 0;
+	for (unsigned int size = 1; size <= MAX_WORD_SIZE; size++)
+	{
+		const unsigned int amount = symbols_per_size[size - 1];
+		first_code[size] = code;
+		first_index[size] = index;
+		last_code[size] = (amount != 0)? code + amount - 1 : -1;
+
+		code = (code + amount) << 1;
+		index += amount;
+	}
 }
 
 huffman_table::~huffman_table()
 {
-	delete[] symbols;
+	allocation::delete_array(symbols, _symbol_amount);
 }
 
 huffman_table::symbol_count_t huffman_table::symbol_amount() const
@@ -33,55 +72,19 @@ uint_fast16_t huffman_table::expected_byte_size() const
 	return _symbol_amount + MAX_WORD_SIZE + 3;
 }
 
-huffman_table::symbol_entry_limit_t huffman_table::start_entry_for_size(const unsigned int size) const
+huffman_table::symbol_value_t huffman_table::next_symbol(bit_stream &bit_stream) const
+		throw(std::invalid_argument, unsupported_feature, unexpected_end_of_stream)
 {
-	symbol_entry_limit_t entry = 0;
-	for (unsigned int size_index = 1; size_index < size; size_index++)
+	int_fast32_t code = 0;
+	for (unsigned int size = 1; size <= MAX_WORD_SIZE; size++)
 	{
-		const unsigned int symbols = symbols_per_size[size_index - 1];
-		entry += symbols * (1 << (MAX_WORD_SIZE - size_index));
-	}
-
-	return entry;
-}
-
-bool huffman_table::find_symbol(const symbol_entry_t &entry, const unsigned int size, symbol_value_t &symbol) const
-{
-	const symbol_entry_limit_t start_for_this_size = start_entry_for_size(size);
-	const symbol_entry_limit_t start_for_next_size = start_entry_for_size(size + 1);
-
-	if (start_for_this_size > entry || start_for_next_size <= entry)
-	{
-		return false;
-	}
-
-	const symbols_per_size_t relative = (entry - start_for_this_size) >> (MAX_WORD_SIZE - size);
-	symbol_index_t index = relative;
-	for (unsigned int i = 1; i < size; i++)
-	{
-		index += symbols_per_size[i - 1];
-	}
-
-	symbol = symbols[index];
-	return true;
-}
-
-huffman_table::symbol_value_t huffman_table::next_symbol(bit_stream &bit_stream) const throw(std::invalid_argument)
-{
-	unsigned int size = 0;
-	symbol_entry_t entry = 0;
-	while (++size <= MAX_WORD_SIZE)
-	{
-		entry |= ((unsigned int) bit_stream.next_bit()) << (MAX_WORD_SIZE - size);
-		symbol_value_t symbol;
-		if (find_symbol(entry, size, symbol))
+		code = (code << 1) | bit_stream.next_bit();
+		if (code <= last_code[size])
 		{
-			return symbol;
+			return symbols[first_index[size] + code - first_code[size]];
 		}
 	}
 
 	throw std::invalid_argument("Symbol not found in huffman table");
 }
 
-
-
@@ -11,7 +11,11 @@ class huffman_table
 public:
 	enum
 	{
-		MAX_WORD_SIZE = 16
+		MAX_WORD_SIZE = 16,
+		MAX_SYMBOL_AMOUNT = MAX_WORD_SIZE * 255,
+
+		// Symbols are bytes, so a table in a DHT segment defines each one at most once
+		MAX_DEFINED_SYMBOLS = 256
 	};
 	typedef bounded_integer<0, (1 << MAX_WORD_SIZE) - 1>::fast symbol_entry_t;
 	typedef bounded_integer<0, 1 << MAX_WORD_SIZE>::fast symbol_entry_limit_t;
@@ -25,20 +29,36 @@ private:
 	const symbol_value_t *symbols;
 	symbol_count_t _symbol_amount;
 
-	symbol_entry_limit_t start_entry_for_size(const unsigned int size) const;
-	bool find_symbol(const symbol_entry_t &entry, const unsigned int size, symbol_value_t &symbol) const;
+	/**
+	 * Canonical decoding tables, built once when the table is defined. For each code size,
+	 * codes from first_code to last_code (both included) are valid and its symbol is found at
+	 * symbols[first_index + code - first_code]. last_code is -1 for sizes without codes.
+	 */
+	int_fast32_t first_code[MAX_WORD_SIZE + 1];
+	int_fast32_t last_code[MAX_WORD_SIZE + 1];
+	symbol_index_t first_index[MAX_WORD_SIZE + 1];
+
+	void build(const unsigned char *definition);
 
 public:
 	huffman_table(std::istream &stream);
+
+	/**
+	 * Builds the table from its definition as it is found in a DHT segment: MAX_WORD_SIZE bytes
+	 * with the amount of symbols for each size, followed by all the symbols.
+	 */
+	huffman_table(const unsigned char *definition);
 	~huffman_table();
 	symbol_count_t symbol_amount() const;
 	uint_fast16_t expected_byte_size() const;
 
 	/**
 	 * Checks the stream, determines the symbol and retuns it.
-	 * std::invalid_argument will be thrown if the huffman code is not present in the table.
+	 * std::invalid_argument will be thrown if the huffman code is not present in the table. Any
+	 * exception thrown by the bit stream is left to pass.
 	 */
-	symbol_value_t next_symbol(bit_stream &bit_stream) const throw(std::invalid_argument);
+	symbol_value_t next_symbol(bit_stream &bit_stream) const
+			throw(std::invalid_argument, unsupported_feature, unexpected_end_of_stream);
 };
 
 #endif /* HUFFMAN_TABLES_HPP_ */
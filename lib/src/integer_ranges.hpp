@@ -80,9 +80,11 @@ private:
         return *this;
     }
 
-    static_integer_range<MIN,MAX,TYPE> &operator++(int unused) // Postfix (x++)
+    static_integer_range<MIN,MAX,TYPE> operator++(int unused) // Postfix (x++)
     {
-        return operator++();
+        const static_integer_range<MIN,MAX,TYPE> previous = *this;
+        operator++();
+        return previous;
     }
 
     static_integer_range<MIN,MAX,TYPE> &operator--() // Prefix (--x)
@@ -96,9 +98,11 @@ private:
         return *this;
     }
 
-    static_integer_range<MIN,MAX,TYPE> &operator--(int unused) // Postfix (x--)
+    static_integer_range<MIN,MAX,TYPE> operator--(int unused) // Postfix (x--)
     {
-        return operator--();
+        const static_integer_range<MIN,MAX,TYPE> previous = *this;
+        operator--();
+        return previous;
     }
 
     static_integer_range<MIN,MAX,TYPE> &operator+=(TYPE value)
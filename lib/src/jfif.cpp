@@ -10,10 +10,15 @@ jfif::info::info(std::istream &stream)
 	stream.read(char_info, size);
 }
 
+jfif::info::info(const unsigned char *segment)
+{
+	memcpy(raw_info, segment, sizeof(raw_info));
+}
+
 bool jfif::info::is_valid() const
 {
-	std::cout << "Chain to contrast: " << reinterpret_cast<const char *>(raw_info) << std::endl;
-	return strcmp(reinterpret_cast<const char *>(raw_info), "JFIF") == 0;
+	// Identifier includes its null terminator
+	return memcmp(raw_info, "JFIF", 5) == 0;
 }
 
 uint_fast8_t jfif::info::major_version() const
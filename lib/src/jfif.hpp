@@ -27,6 +27,11 @@ namespace jfif
 	public:
 		info(std::istream &stream);
 
+		/**
+		 * Takes the first SIZE_IN_FILE bytes of the given APP0 segment content.
+		 */
+		info(const unsigned char *segment);
+
 		bool is_valid() const;
 		uint_fast8_t major_version() const;
 		uint_fast8_t minor_version() const;
@@ -1,11 +1,67 @@
 
 #include "jpeg.hpp"
+#include "allocation.hpp"
 #include "stream_utils.hpp"
 #include "huffman_tables.hpp"
 #include "block_matrix.hpp"
 #include "jpeg_markers.hpp"
 #include "jfif.hpp"
-#include "stream_utils.hpp"
+#include "adobe.hpp"
+#include "exif.hpp"
+#include "decode_stats.hpp"
+#include "color_conversion.hpp"
+#include "trace.hpp"
+#include "progressive_scan.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <new>
+
+/**
+ * Each call made by an incremental decode parses the headers again, but only decodes the MCUs not
+ * stored yet, starting from the last decoder state saved. States are saved at the start of each
+ * row and every SAVE_PERIOD MCUs within it, so a call never decodes again more than that.
+ */
+struct jpeg::scan_resume
+{
+	enum
+	{
+		SAVE_PERIOD = 8
+	};
+
+	/**
+	 * True once the bitmap is set up, so that later calls only add rows to it.
+	 */
+	bool started;
+
+	/**
+	 * Rows of MCUs, and MCUs of the following row, decoded before the state.
+	 */
+	unsigned int complete_rows;
+	unsigned int row_mcus;
+	mcu_index::entry state;
+
+	/**
+	 * Rows of the bitmap stored so far.
+	 */
+	unsigned int available_rows;
+
+	/**
+	 * True once the end of image is read.
+	 */
+	bool finished;
+
+	scan_resume() : started(false), complete_rows(0), row_mcus(0), available_rows(0), finished(false) { }
+
+	/**
+	 * True once a state after the first MCU is saved.
+	 */
+	bool saved() const
+	{
+		return complete_rows > 0 || row_mcus > 0;
+	}
+};
 
 // Assumed for 8x8 matrixes
 const quantization_table::cell_index_fast_t zigzag_level_baseline[] =
@@ -26,13 +82,23 @@ quantization_table::quantization_table(std::istream &stream)
 {
 	unsigned char zigzag[CELL_AMOUNT];
 	stream.read(reinterpret_cast<char *>(zigzag), sizeof(zigzag));
+	build(zigzag, false);
+}
+
+quantization_table::quantization_table(const unsigned char *zigzag, bool wide_values)
+{
+	build(zigzag, wide_values);
+}
 
+void quantization_table::build(const unsigned char *zigzag, bool wide_values)
+{
 	cell_count_fast_t k = 0;
 	for (side_count_fast_t y = 0; y < SIDE; y++)
 	{
 		for (side_count_fast_t x = 0; x < SIDE; x++)
 		{
-			matrix[k++] = zigzag[zigzag_position(x, y)];
+			const cell_index_fast_t position = zigzag_position(x, y);
+			matrix[k++] = wide_values? (zigzag[2 * position] << 8) | zigzag[2 * position + 1] : zigzag[position];
 		}
 	}
 }
@@ -66,15 +132,41 @@ void quantization_table::multiply_block(block_matrix &block) const
 	}
 }
 
-frame_info::frame_info(std::istream &stream, const table_list<quantization_table> &tables)
+void quantization_table::multiply_block(block_matrix &block, block_matrix::element_t scale) const
+{
+	cell_count_fast_t index = 0;
+	for (block_matrix::side_count_fast_t row = 0; row < block_matrix::SIDE; row++)
+	{
+		for (block_matrix::side_count_fast_t column = 0; column < block_matrix::SIDE; column++)
+		{
+			block_matrix::element_t value = block.get(column, row);
+			value *= matrix[index++] * scale;
+			block.set(column, row, value);
+		}
+	}
+}
+
+unsigned int quantization_table::dc_multiplier() const
+{
+	return matrix[0];
+}
+
+frame_info::frame_info(std::istream &stream, const table_list<quantization_table> &tables, bool progressive) :
+		progressive(progressive)
 {
 	precision = stream.get();
 	height = read_big_endian_unsigned_int(stream, 2);
 	width = read_big_endian_unsigned_int(stream, 2);
 
 	channels_amount = stream.get();
-	channels = new frame_channel[channels_amount];
+	if (channels_amount == 0)
+	{
+		throw jpeg::invalid_file_format();
+	}
+
+	channels = allocation::new_array<frame_channel>(channels_amount);
 
+	bool valid = true;
 	for (uint_fast8_t channel_index = 0; channel_index < channels_amount; channel_index++)
 	{
 		// Due to I am unable to find proper specifications I am not fully sure to be extracting the
@@ -87,10 +179,41 @@ frame_info::frame_info(std::istream &stream, const table_list<quantization_table
 		const uint_fast8_t samples = stream.get();
 		channel.horizontal_sample = (samples >> 4) & 0x0F;
 		channel.vertical_sample = samples & 0x0F;
+		valid = valid && channel.horizontal_sample != 0 && channel.vertical_sample != 0 &&
+				channel.horizontal_sample <= frame_channel::MAX_SAMPLING_FACTOR &&
+				channel.vertical_sample <= frame_channel::MAX_SAMPLING_FACTOR;
 
 		const uint_fast8_t quantization_table_index = stream.get();
-		channel.table = tables.list[quantization_table_index];
+		if (quantization_table_index < table_list<quantization_table>::MAX_TABLES)
+		{
+			channel.table_id = quantization_table_index;
+			channel.table = tables.list[quantization_table_index];
+		}
+		else
+		{
+			channel.table = NULL;
+			valid = false;
+		}
 	}
+
+	// The destructor is not called when throwing from here
+	if (!valid)
+	{
+		allocation::delete_array(channels, channels_amount);
+		throw jpeg::invalid_file_format();
+	}
+
+	// A single component is never interleaved, so its MCU is a block whatever sampling it declares
+	if (channels_amount == 1)
+	{
+		channels[0].horizontal_sample = 1;
+		channels[0].vertical_sample = 1;
+	}
+}
+
+frame_info::~frame_info()
+{
+	allocation::delete_array(channels, channels_amount);
 }
 
 uint_fast16_t frame_info::expected_byte_size() const
@@ -102,7 +225,12 @@ scan_info::scan_info(std::istream &stream, const table_list<huffman_table> &dc_t
 		const table_list<huffman_table> &ac_tables)
 {
 	channels_amount = stream.get();
-	channels = new scan_channel[channels_amount];
+	if (channels_amount == 0)
+	{
+		throw jpeg::invalid_file_format();
+	}
+
+	channels = allocation::new_array<scan_channel>(channels_amount);
 
 	for (uint_fast8_t channel_index = 0; channel_index < channels_amount; channel_index++)
 	{
@@ -113,15 +241,23 @@ scan_info::scan_info(std::istream &stream, const table_list<huffman_table> &dc_t
 		scan_channel &channel = channels[channel_index];
 		channel.channel_type = static_cast<frame_channel::channel_type_e>(stream.get());
 
+		// DC table in the high nibble and AC table in the low one
 		const uint_fast8_t table_ref = stream.get();
-		const table_list<huffman_table>::index_fast_t table_index = table_ref & 0x0F;
-		channel.dc_table = dc_tables.list[table_index];
-		channel.ac_table = ac_tables.list[table_index];
+		channel.dc_table = dc_tables.list[(table_ref >> 4) & 0x0F];
+		channel.ac_table = ac_tables.list[table_ref & 0x0F];
 	}
 
-	// This is always 0x00 0x3F 0x00, but I do not know why
-	char ignore_buffer[3];
-	stream.read(ignore_buffer, 3);
+	spectral_start = stream.get();
+	spectral_end = stream.get();
+
+	const uint_fast8_t approximation = stream.get();
+	approximation_high = (approximation >> 4) & 0x0F;
+	approximation_low = approximation & 0x0F;
+}
+
+scan_info::~scan_info()
+{
+	allocation::delete_array(channels, channels_amount);
 }
 
 uint_fast16_t scan_info::expected_byte_size() const
@@ -129,412 +265,2548 @@ uint_fast16_t scan_info::expected_byte_size() const
 	return 6 + 2 * channels_amount;
 }
 
-namespace {
-
-void setImageBlock(const bitmap &bitmap, int x_pos, int y_pos, const block_matrix * const components)
+void scan_info::find_components(const frame_info &frame, bool needs_dc_table, bool needs_ac_table,
+		unsigned int *components) const
 {
-	const unsigned int width = bitmap.width;
-	const unsigned int height = bitmap.height;
-	const unsigned int component_amount = bitmap.components_amount;
-
-	bitmap::component_value_t *component_buffer = new bitmap::component_value_t[component_amount];
-
-	for (block_matrix::side_count_fast_t row = 0; row < block_matrix::SIDE; row++)
+	for (channel_count_t channel = 0; channel < channels_amount; channel++)
 	{
-		const int bitmap_row = row + y_pos;
-		if (bitmap_row >= 0 && static_cast<unsigned int>(bitmap_row) < height)
+		const scan_channel &scan_channel = channels[channel];
+		frame_info::channel_count_t index = 0;
+		while (index < frame.channels_amount && frame.channels[index].channel_type != scan_channel.channel_type)
 		{
-			for (block_matrix::side_count_fast_t column = 0; column < block_matrix::SIDE; column++)
-			{
-				const int bitmap_column = column + x_pos;
-				if (bitmap_column >= 0 && static_cast<unsigned int>(bitmap_column) < width)
-				{
-					for (unsigned int index = 0; index < component_amount; index++)
-					{
-						component_buffer[index] = components[index].get(column, row);
-					}
-					bitmap.setPixel(bitmap_column, bitmap_row, component_buffer);
-				}
-			}
+			index++;
+		}
+
+		if (index == frame.channels_amount || (needs_dc_table && scan_channel.dc_table == NULL) ||
+				(needs_ac_table && scan_channel.ac_table == NULL))
+		{
+			throw jpeg::invalid_file_format();
 		}
-	}
 
-	delete []component_buffer;
+		components[channel] = index;
+	}
 }
 
-void decode_scan_data(bitmap &bitmap, scan_bit_stream &stream, frame_info &frame, scan_info &scan)
-{
-	unsigned int pixels = frame.width;
-	pixels *= frame.height;
+namespace {
 
-	uint_fast16_t x_position = 0;
-	uint_fast16_t y_position = 0;
+enum
+{
+	RGB_RED = 0,
+	RGB_GREEN = 1,
+	RGB_BLUE = 2,
+	RGB_COMPONENTS = 3
+};
+
+const bitmap_component::type_e rgb_types[RGB_COMPONENTS] =
+		{bitmap_component::RED, bitmap_component::GREEN, bitmap_component::BLUE};
+
+/**
+ * Components of each output format, used both to allocate bitmaps in that format and to find
+ * out whether a given bitmap is in any of them.
+ */
+struct packed_format
+{
+	jpeg::output_format_e format;
+	unsigned int bytes_per_pixel;
+	unsigned int components_amount;
+	bitmap_component components[4];
+};
+
+const packed_format packed_formats[] = {
+	{jpeg::OUTPUT_RGB888, 3, 3, {{bitmap_component::RED, 8}, {bitmap_component::GREEN, 8}, {bitmap_component::BLUE, 8}}},
+	{jpeg::OUTPUT_BGR888, 3, 3, {{bitmap_component::BLUE, 8}, {bitmap_component::GREEN, 8}, {bitmap_component::RED, 8}}},
+	{jpeg::OUTPUT_RGBA8888, 4, 4, {{bitmap_component::RED, 8}, {bitmap_component::GREEN, 8},
+			{bitmap_component::BLUE, 8}, {bitmap_component::ALPHA, 8}}},
+	{jpeg::OUTPUT_BGRX8888, 4, 3, {{bitmap_component::BLUE, 8}, {bitmap_component::GREEN, 8}, {bitmap_component::RED, 8}}},
+	{jpeg::OUTPUT_RGB565, 2, 3, {{bitmap_component::BLUE, 5}, {bitmap_component::GREEN, 6}, {bitmap_component::RED, 5}}},
+	{jpeg::OUTPUT_RGB161616, 6, 3, {{bitmap_component::RED, 16}, {bitmap_component::GREEN, 16},
+			{bitmap_component::BLUE, 16}}}
+};
+
+enum
+{
+	PACKED_FORMATS = sizeof(packed_formats) / sizeof(packed_formats[0])
+};
 
-	unsigned int matrices_per_iteration = 0;
-	unsigned int h_matrices_per_iteration = 1;
-	unsigned int v_matrices_per_iteration = 1;
-	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+/**
+ * Returns the entry in packed_formats whose components are exactly the ones in the bitmap, or NULL.
+ */
+const packed_format *find_packed_format(const bitmap &bitmap)
+{
+	for (unsigned int index = 0; index < PACKED_FORMATS; index++)
 	{
-		const frame_channel &channel = frame.channels[index];
-		const frame_channel::uint_fast4_t h_sample = channel.horizontal_sample;
-		const frame_channel::uint_fast4_t v_sample = channel.vertical_sample;
-
-		matrices_per_iteration += h_sample * v_sample;
-
-		if (h_sample > h_matrices_per_iteration)
+		const packed_format &candidate = packed_formats[index];
+		bool matching = candidate.bytes_per_pixel == bitmap.bytes_per_pixel &&
+				candidate.components_amount == bitmap.components_amount;
+		for (unsigned int component = 0; matching && component < candidate.components_amount; component++)
 		{
-			h_matrices_per_iteration = h_sample;
+			matching = candidate.components[component].type == bitmap.components[component].type &&
+					candidate.components[component].bits_per_pixel == bitmap.components[component].bits_per_pixel;
 		}
 
-		if (v_sample > v_matrices_per_iteration)
+		if (matching)
 		{
-			v_matrices_per_iteration = v_sample;
+			return &candidate;
 		}
 	}
 
-	shared_array<block_matrix> matrices = shared_array<block_matrix>::make(new block_matrix[matrices_per_iteration]);
-	shared_array<int> dc_values = shared_array<int>::make(new int[scan.channels_amount]);
-	for (scan_info::channel_count_t index = 0; index < scan.channels_amount; index++)
+	return NULL;
+}
+
+/**
+ * Format of the bitmap allocated when no allocator is given: the requested one or, by default,
+ * RGB888 for colour images and NULL for grayscale ones, which take a single luminance byte. If
+ * wide, for samples of more than 8 bits, the defaults are RGB161616 and 2 luminance bytes.
+ */
+const packed_format *default_packed_format(jpeg::output_format_e format, bool gray, bool wide)
+{
+	if (format == jpeg::OUTPUT_DEFAULT)
 	{
-		dc_values[index] = 0;
+		if (gray)
+		{
+			return NULL;
+		}
+		format = wide? jpeg::OUTPUT_RGB161616 : jpeg::OUTPUT_RGB888;
 	}
 
-	while (y_position < frame.height)
+	for (unsigned int index = 0; index < PACKED_FORMATS; index++)
 	{
-		unsigned int matrix_index = 0;
+		if (packed_formats[index].format == format)
+		{
+			return &packed_formats[index];
+		}
+	}
 
-		for (scan_info::channel_count_t channel=0; channel<scan.channels_amount; channel++)
+	return NULL;
+}
+
+/**
+ * Position of red, green and blue within the pixels of the bitmap where the image is decoded, and
+ * of its luminance for grayscale images.
+ */
+struct rgb_layout
+{
+	/**
+	 * True if all of them take a whole byte, and then offsets can be used instead of indexes.
+	 */
+	bool byte_aligned;
+	unsigned int offsets[RGB_COMPONENTS];
+
+	/**
+	 * Index for each component within the bitmap components, or -1 if not present.
+	 */
+	int indexes[RGB_COMPONENTS];
+
+	/**
+	 * True if the bitmap has a luminance component taking a whole byte. Grayscale images are
+	 * stored there instead of in red, green and blue.
+	 */
+	bool luminance;
+	unsigned int luminance_offset;
+
+	/**
+	 * True if red, green and blue take 2 whole bytes each instead, and then word_offsets are used.
+	 * The same for a luminance component of 2 bytes. Values are multiplied by word_scale to take
+	 * the whole 16 bits range.
+	 */
+	bool word_aligned;
+	unsigned int word_offsets[RGB_COMPONENTS];
+	bool word_luminance;
+	unsigned int word_luminance_offset;
+	block_matrix::element_t word_scale;
+
+	/**
+	 * Output format that the bitmap is in, or NULL if it is in none of them.
+	 */
+	const packed_format *packed;
+
+	/**
+	 * True if the bitmap has cyan, magenta, yellow and black components taking a whole byte each.
+	 * CMYK and YCCK images are stored there instead of in red, green and blue.
+	 */
+	bool cmyk;
+	unsigned int cmyk_offsets[color_conversion::CMYK_COMPONENTS];
+
+	/**
+	 * Size of the image as blocks are positioned, which is the bitmap size with width and height
+	 * swapped if transposed.
+	 */
+	unsigned int width;
+	unsigned int height;
+
+	/**
+	 * How positions within the image are moved to the bitmap, following the EXIF orientation:
+	 * rows become columns if transposed, and then the columns and the rows of the bitmap are
+	 * reversed if mirrored.
+	 */
+	bool transposed;
+	bool mirrored_x;
+	bool mirrored_y;
+
+	/**
+	 * Bytes from a pixel in the bitmap to the one where the next pixel within the same row of
+	 * the image goes. Negative if mirrored or bottom up.
+	 */
+	std::ptrdiff_t column_step;
+
+	/**
+	 * Blocks are stored with values from 0 to 255, whatever the precision of the frame, which is
+	 * only needed to take the whole range of 16 bits components.
+	 */
+	rgb_layout(const bitmap &bitmap, unsigned int precision, exif::orientation_e orientation) :
+			packed(find_packed_format(bitmap))
+	{
+		transposed = orientation >= exif::LEFT_TOP;
+		mirrored_x = orientation == exif::TOP_RIGHT || orientation == exif::BOTTOM_RIGHT ||
+				orientation == exif::RIGHT_TOP || orientation == exif::RIGHT_BOTTOM;
+		mirrored_y = orientation == exif::BOTTOM_RIGHT || orientation == exif::BOTTOM_LEFT ||
+				orientation == exif::RIGHT_BOTTOM || orientation == exif::LEFT_BOTTOM;
+		width = transposed? bitmap.height : bitmap.width;
+		height = transposed? bitmap.width : bitmap.height;
+
+		const std::ptrdiff_t row_step = bitmap.bottom_up? -static_cast<std::ptrdiff_t>(bitmap.bytes_per_scanline) :
+				static_cast<std::ptrdiff_t>(bitmap.bytes_per_scanline);
+		const std::ptrdiff_t pixel_step = bitmap.bytes_per_pixel;
+		column_step = transposed? (mirrored_y? -row_step : row_step) : (mirrored_x? -pixel_step : pixel_step);
+
+		byte_aligned = true;
+		word_aligned = true;
+		for (unsigned int position = 0; position < RGB_COMPONENTS; position++)
 		{
-			const frame_channel &frame_channel = frame.channels[channel];
-			for (frame_channel::uint_fast4_t v_sample = 0; v_sample < frame_channel.vertical_sample; v_sample++)
-			{
-				for (frame_channel::uint_fast4_t h_sample = 0; h_sample < frame_channel.horizontal_sample; h_sample++)
-				{
-					const scan_channel &scan_channel = scan.channels[channel];
-					huffman_table::symbol_value_t dc_length = scan_channel.dc_table->next_symbol(stream);
-					scan_bit_stream::number_t dc_value = stream.next_number(dc_length);
+			unsigned int index;
+			indexes[position] = bitmap.find_component(rgb_types[position], index)? index : -1;
+			byte_aligned = byte_aligned && bitmap.find_byte_component(rgb_types[position], offsets[position]);
+			word_aligned = word_aligned && bitmap.find_word_component(rgb_types[position], word_offsets[position]);
+		}
 
-					dc_value += dc_values[channel];
-					dc_values[channel] = dc_value;
+		luminance = bitmap.find_byte_component(bitmap_component::LUMINANCE, luminance_offset);
+		word_luminance = bitmap.find_word_component(bitmap_component::LUMINANCE, word_luminance_offset);
 
-					block_matrix dct_matrix;
-					dct_matrix.set_at_zigzag(0, dc_value);
+		// The highest sample, 255.9375 for 12 bits, becomes 65535
+		word_scale = 65535.0 * (1 << (precision - 8)) / ((1 << precision) - 1);
 
-					unsigned char ac_length;
-					unsigned char previous_zeroes;
-					block_matrix::cell_index_fast_t read_cells = 0;
-					do
-					{
-						huffman_table::symbol_value_t ac_symbol = scan_channel.ac_table->next_symbol(stream);
-						ac_length = ac_symbol & 0x0F;
-						previous_zeroes = (ac_symbol >> 4) & 0x0F;
+		cmyk = bitmap.find_byte_component(bitmap_component::CYAN, cmyk_offsets[color_conversion::CYAN]) &&
+				bitmap.find_byte_component(bitmap_component::MAGENTA, cmyk_offsets[color_conversion::MAGENTA]) &&
+				bitmap.find_byte_component(bitmap_component::YELLOW, cmyk_offsets[color_conversion::YELLOW]) &&
+				bitmap.find_byte_component(bitmap_component::BLACK, cmyk_offsets[color_conversion::BLACK]);
+	}
 
-						if (previous_zeroes + read_cells + 1 >= block_matrix::CELLS)
-						{
-							throw jpeg::invalid_file_format();
-						}
-						read_cells += previous_zeroes + 1;
+	/**
+	 * Sets the column and the row in the bitmap where the given position of the image goes.
+	 */
+	void destination(const bitmap &bitmap, unsigned int x, unsigned int y, unsigned int &column,
+			unsigned int &row) const
+	{
+		const unsigned int bitmap_column = transposed? y : x;
+		const unsigned int bitmap_row = transposed? x : y;
+		column = mirrored_x? bitmap.width - 1 - bitmap_column : bitmap_column;
+		row = mirrored_y? bitmap.height - 1 - bitmap_row : bitmap_row;
+	}
 
-						if (ac_length != 0)
-						{
-							const scan_bit_stream::number_t ac_value = stream.next_number(ac_length);
-							dct_matrix.set_at_zigzag(read_cells, ac_value);
-						}
-					} while((ac_length > 0 || previous_zeroes > 0) && read_cells < block_matrix::CELLS - 1);
+	/**
+	 * Position within the bitmap data where the given position of the image goes.
+	 */
+	unsigned char *pixel(const bitmap &bitmap, unsigned int x, unsigned int y) const
+	{
+		unsigned int column;
+		unsigned int row;
+		destination(bitmap, x, y, column, row);
+		return bitmap.scanline(row) + static_cast<std::size_t>(column) * bitmap.bytes_per_pixel;
+	}
+};
 
-					frame_channel.table->multiply_block(dct_matrix);
-					matrices[matrix_index++] = dct_matrix.extract_inverse_dct();
-				}
-			}
-		}
+/**
+ * How the components of a frame become the colours stored in the bitmap.
+ */
+enum colour_model_e
+{
+	MODEL_GRAY, // Luminance alone: the only component, or the first one when the rest are not wanted
+	MODEL_YCBCR,
+	MODEL_RGB, // 3 components that the Adobe segment tells are not transformed
+	MODEL_CMYK, // 4 components without Adobe segment, where 255 is full ink
+	MODEL_INVERTED_CMYK, // 4 components not transformed, inverted as Adobe applications write them
+	MODEL_YCCK, // 4 components, cyan, magenta and yellow transformed as YCbCr
+	MODEL_UNSUPPORTED // Components are decoded, but nothing is stored
+};
+
+/**
+ * True for the models whose components are ink amounts.
+ */
+inline bool ink_model(colour_model_e model)
+{
+	return model == MODEL_CMYK || model == MODEL_INVERTED_CMYK || model == MODEL_YCCK;
+}
 
-		// Assumed it is YCbCr
-		if (scan.channels_amount == 3)
-		{
-			block_matrix ycbcr_components[3];
-			block_matrix rgb_components[3];
+inline unsigned char clamp_to_byte(const block_matrix::element_t value)
+{
+	return (value > 0 && value < 255)? static_cast<unsigned char>(value) : ((value < 128)? 0 : 255);
+}
 
-			for (unsigned int y_on_iteration = 0; y_on_iteration < v_matrices_per_iteration; y_on_iteration++)
-			{
-				for (unsigned int x_on_iteration = 0; x_on_iteration < h_matrices_per_iteration; x_on_iteration++)
-				{
-					// TODO: ycbcr should be filled stretching matrices
-					unsigned int channel_matrix_index = 0;
-					for (frame_info::channel_count_t channel_index = 0; channel_index < frame.channels_amount; channel_index++)
-					{
-						const frame_channel &channel = frame.channels[channel_index];
-						const frame_channel::uint_fast4_t h_sample = channel.horizontal_sample;
-						const frame_channel::uint_fast4_t v_sample = channel.vertical_sample;
+/**
+ * Writes the value, clamped to 16 bits, in 2 bytes with the least significant one first.
+ */
+inline void store_clamped_word(unsigned char *position, const block_matrix::element_t value)
+{
+	const unsigned int word = (value > 0 && value < 65535)? static_cast<unsigned int>(value) :
+			((value < 32768)? 0 : 65535);
+	position[0] = word & 0xFF;
+	position[1] = word >> 8;
+}
 
-						for (block_matrix::side_count_fast_t row = 0; row < block_matrix::SIDE; row++)
-						{
-							for (block_matrix::side_count_fast_t column = 0; column < block_matrix::SIDE; column++)
-							{
-								unsigned int whole_x_pos = x_on_iteration * block_matrix::SIDE + column;
-								unsigned int matrix_x_pos = (whole_x_pos * h_sample) / h_matrices_per_iteration;
+/**
+ * Writes a pixel of each output format from its red, green and blue bytes.
+ */
+template<jpeg::output_format_e FORMAT>
+struct packed_pixel;
 
-								unsigned int whole_y_pos = y_on_iteration * block_matrix::SIDE + row;
-								unsigned int matrix_y_pos = (whole_y_pos * v_sample) / v_matrices_per_iteration;
+template<>
+struct packed_pixel<jpeg::OUTPUT_RGB888>
+{
+	enum { BYTES = 3 };
 
-								unsigned int matrix_to_check = channel_matrix_index +
-										((matrix_y_pos / block_matrix::SIDE) * h_sample) + (matrix_x_pos / block_matrix::SIDE);
+	static void store(unsigned char *pixel, unsigned char red, unsigned char green, unsigned char blue)
+	{
+		pixel[0] = red;
+		pixel[1] = green;
+		pixel[2] = blue;
+	}
+};
 
-								ycbcr_components[channel_index].set(column, row, matrices[matrix_to_check]
-								        .get(matrix_x_pos % block_matrix::SIDE, matrix_y_pos % block_matrix::SIDE));
-							}
-						}
-						channel_matrix_index += h_sample * v_sample;
-					}
+template<>
+struct packed_pixel<jpeg::OUTPUT_BGR888>
+{
+	enum { BYTES = 3 };
 
-					ycbcr_components[0] += 128;
+	static void store(unsigned char *pixel, unsigned char red, unsigned char green, unsigned char blue)
+	{
+		pixel[0] = blue;
+		pixel[1] = green;
+		pixel[2] = red;
+	}
+};
 
-					rgb_components[0] = ycbcr_components[0] + (ycbcr_components[2] * 1.402);
-					rgb_components[1] = ycbcr_components[0] - (ycbcr_components[1] * 0.034414) - (ycbcr_components[2] * 0.71414);
-					rgb_components[2] = ycbcr_components[0] + (ycbcr_components[1] * 1.772);
+template<>
+struct packed_pixel<jpeg::OUTPUT_RGBA8888>
+{
+	enum { BYTES = 4 };
 
-					// Normalizing values from 0..255 to 0..1
-					for (scan_info::channel_count_t channel = 0; channel < scan.channels_amount; channel++)
-					{
-						rgb_components[channel] /= 255;
-					}
+	static void store(unsigned char *pixel, unsigned char red, unsigned char green, unsigned char blue)
+	{
+		pixel[0] = red;
+		pixel[1] = green;
+		pixel[2] = blue;
+		pixel[3] = 0;
+	}
+};
 
-					setImageBlock(bitmap, x_position + x_on_iteration * block_matrix::SIDE, y_position + y_on_iteration * block_matrix::SIDE, rgb_components);
-				}
-			}
-		}
+template<>
+struct packed_pixel<jpeg::OUTPUT_BGRX8888>
+{
+	enum { BYTES = 4 };
 
-		x_position += block_matrix::SIDE * h_matrices_per_iteration;
-		if (x_position >= frame.width)
+	static void store(unsigned char *pixel, unsigned char red, unsigned char green, unsigned char blue)
+	{
+		pixel[0] = blue;
+		pixel[1] = green;
+		pixel[2] = red;
+		pixel[3] = 0xFF;
+	}
+};
+
+template<>
+struct packed_pixel<jpeg::OUTPUT_RGB565>
+{
+	enum { BYTES = 2 };
+
+	static void store(unsigned char *pixel, unsigned char red, unsigned char green, unsigned char blue)
+	{
+		const unsigned int value = ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3);
+		pixel[0] = value & 0xFF;
+		pixel[1] = value >> 8;
+	}
+};
+
+/**
+ * Stores the given rows and columns of a block in a bitmap in the given output format.
+ */
+template<jpeg::output_format_e FORMAT>
+void store_packed_block(const bitmap &bitmap, const rgb_layout &layout, int x_pos, int y_pos,
+		unsigned int first_column, unsigned int first_row, unsigned int columns, unsigned int rows,
+		const block_matrix * const components)
+{
+	const std::ptrdiff_t column_step = layout.column_step;
+	for (block_matrix::side_count_fast_t row = first_row; row < rows; row++)
+	{
+		unsigned char *pixel = layout.pixel(bitmap, x_pos + first_column, row + y_pos);
+		for (block_matrix::side_count_fast_t column = first_column; column < columns; column++)
 		{
-			x_position = 0;
-			y_position += block_matrix::SIDE * v_matrices_per_iteration;
+			packed_pixel<FORMAT>::store(pixel, clamp_to_byte(components[RGB_RED].get(column, row)),
+					clamp_to_byte(components[RGB_GREEN].get(column, row)),
+					clamp_to_byte(components[RGB_BLUE].get(column, row)));
+			pixel += column_step;
 		}
 	}
 }
-}
 
-void jpeg::decode_image(bitmap &bitmap, std::istream &stream) throw(invalid_file_format)
+/**
+ * Stores a block whose red, green and blue components have values from 0 to 255 in the bitmap.
+ * The position can be negative when decoding a region, and then only the part of the block
+ * within the bitmap is stored.
+ */
+void setImageBlock(const bitmap &bitmap, const rgb_layout &layout, int x_pos, int y_pos, const block_matrix * const components)
 {
-	if (stream.get() != jpeg_marker::MARKER || stream.get() != jpeg_marker::START_OF_IMAGE)
+	const int width = layout.width;
+	const int height = layout.height;
+
+	if (x_pos >= width || y_pos >= height || x_pos + block_matrix::SIDE <= 0 || y_pos + block_matrix::SIDE <= 0)
 	{
-		throw invalid_file_format();
+		return;
 	}
 
-	table_list<quantization_table> tables;
-	table_list<huffman_table> dc_tables;
-	table_list<huffman_table> ac_tables;
-
-	frame_info *current_frame = NULL;
-	scan_info *current_scan = NULL;
+	const unsigned int first_column = (x_pos < 0)? -x_pos : 0;
+	const unsigned int first_row = (y_pos < 0)? -y_pos : 0;
+	const unsigned int columns = (x_pos + block_matrix::SIDE <= width)? block_matrix::SIDE : width - x_pos;
+	const unsigned int rows = (y_pos + block_matrix::SIDE <= height)? block_matrix::SIDE : height - y_pos;
 
-	unsigned char value;
-	while (stream.good() && (value = stream.get()) == jpeg_marker::MARKER)
+	// Checked before the output formats, as it also covers RGB161616
+	const std::ptrdiff_t column_step = layout.column_step;
+	if (layout.word_aligned)
 	{
-		const uint_fast8_t marker_type = stream.get();
-		const uint_fast16_t size = read_big_endian_unsigned_int(stream, 2);
-
-		switch (marker_type)
+		for (block_matrix::side_count_fast_t row = first_row; row < rows; row++)
 		{
-		case jpeg_marker::COMMENT:
-			do
-			{
-				shared_array<char> comment = shared_array<char>::make(new char[size - 1]);
-				stream.read(comment.get(), size - 2);
-				comment[size - 2] = '\0';
-
-				std::cout << "Found comment: " << comment << std::endl;
-			} while(0);
-			break;
-
-		case jpeg_marker::QUANTIZATION_TABLE:
-			if (size == quantization_table::CELL_AMOUNT + 3)
+			unsigned char *pixel = layout.pixel(bitmap, x_pos + first_column, row + y_pos);
+			for (block_matrix::side_count_fast_t column = first_column; column < columns; column++)
 			{
-				const table_list<quantization_table>::count_fast_t max_tables =
-						table_list<quantization_table>::MAX_TABLES;
-
-				const uint_fast8_t table_id = stream.get();
-				if (table_id >= max_tables)
-				{
-					std::cerr << "Found invalid quantization table id. It is "
-							<< static_cast<unsigned int>(table_id) << " but id can be only between 0 and "
-							<< static_cast<unsigned int>(max_tables - 1) << std::endl;
-				}
-				else
+				for (unsigned int position = 0; position < RGB_COMPONENTS; position++)
 				{
-					tables.list[table_id] = new quantization_table(stream);
+					store_clamped_word(pixel + layout.word_offsets[position],
+							components[position].get(column, row) * layout.word_scale);
 				}
+				pixel += column_step;
 			}
-			else
+		}
+
+		return;
+	}
+
+	if (layout.packed != NULL)
+	{
+		switch (layout.packed->format)
+		{
+		case jpeg::OUTPUT_BGR888:
+			store_packed_block<jpeg::OUTPUT_BGR888>(bitmap, layout, x_pos, y_pos, first_column, first_row, columns,
+					rows, components);
+			return;
+
+		case jpeg::OUTPUT_RGBA8888:
+			store_packed_block<jpeg::OUTPUT_RGBA8888>(bitmap, layout, x_pos, y_pos, first_column, first_row, columns,
+					rows, components);
+			return;
+
+		case jpeg::OUTPUT_BGRX8888:
+			store_packed_block<jpeg::OUTPUT_BGRX8888>(bitmap, layout, x_pos, y_pos, first_column, first_row, columns,
+					rows, components);
+			return;
+
+		case jpeg::OUTPUT_RGB565:
+			store_packed_block<jpeg::OUTPUT_RGB565>(bitmap, layout, x_pos, y_pos, first_column, first_row, columns,
+					rows, components);
+			return;
+
+		default:
+			store_packed_block<jpeg::OUTPUT_RGB888>(bitmap, layout, x_pos, y_pos, first_column, first_row, columns,
+					rows, components);
+			return;
+		}
+	}
+
+	if (layout.byte_aligned)
+	{
+		for (block_matrix::side_count_fast_t row = first_row; row < rows; row++)
+		{
+			unsigned char *pixel = layout.pixel(bitmap, x_pos + first_column, row + y_pos);
+			for (block_matrix::side_count_fast_t column = first_column; column < columns; column++)
 			{
-				std::cerr << "Found invalid quantization table. Expected size was "
-						<< static_cast<unsigned int>(quantization_table::SIDE) << 'x'
-						<< static_cast<unsigned int>(quantization_table::SIDE) << std::endl;
+				pixel[layout.offsets[RGB_RED]] = clamp_to_byte(components[RGB_RED].get(column, row));
+				pixel[layout.offsets[RGB_GREEN]] = clamp_to_byte(components[RGB_GREEN].get(column, row));
+				pixel[layout.offsets[RGB_BLUE]] = clamp_to_byte(components[RGB_BLUE].get(column, row));
+				pixel += column_step;
 			}
-			break;
+		}
 
-		case jpeg_marker::START_OF_FRAME_BASELINE_DCT:
-			do
-			{
-				current_frame = new frame_info(stream, tables);
+		return;
+	}
 
-				if (current_frame->expected_byte_size() == size)
-				{
-					std::cout << "Found frame for an image with "
-							<< static_cast<unsigned int>(current_frame->channels_amount)
-							<< " channels and resolution "
-							<< static_cast<unsigned int>(current_frame->width) << 'x'
-							<< static_cast<unsigned int>(current_frame->height) << std::endl;
-				}
-				else
-				{
-					std::cerr << "Found invalid frame. Expected size was "
-							<< static_cast<unsigned int>(current_frame->expected_byte_size()) << " but actually was "
-							<< static_cast<unsigned int>(size) << std::endl;
-				}
-			} while(0);
-			break;
+	const unsigned int component_amount = bitmap.components_amount;
+	bitmap::component_value_t *component_buffer = allocation::new_array<bitmap::component_value_t>(component_amount);
+	for (unsigned int index = 0; index < component_amount; index++)
+	{
+		component_buffer[index] = 0;
+	}
 
-		case jpeg_marker::HUFFMAN_TABLE:
-			do
+	for (block_matrix::side_count_fast_t row = first_row; row < rows; row++)
+	{
+		for (block_matrix::side_count_fast_t column = first_column; column < columns; column++)
+		{
+			for (unsigned int position = 0; position < RGB_COMPONENTS; position++)
 			{
-				const uint_fast8_t table_ref = stream.get();
-				const table_list<huffman_table>::index_fast_t table_id = table_ref & 0x0F;
-				bool is_ac = (table_ref & 0x10) != 0;
-
-				huffman_table *table = new huffman_table(stream);
-				const uint_fast16_t expected_size = table->expected_byte_size();
-				if (size == expected_size)
+				if (layout.indexes[position] >= 0)
 				{
-					(is_ac? ac_tables : dc_tables).list[table_id] = table;
+					component_buffer[layout.indexes[position]] = components[position].get(column, row) / 255;
 				}
-				else
-				{
-					std::cerr << "Found invalid huffman table. Expected size for it was "
-							<< expected_size << " but size is actually " << size << std::endl;
-				}
-			} while(0);
-			break;
+			}
+			unsigned int bitmap_column;
+			unsigned int bitmap_row;
+			layout.destination(bitmap, column + x_pos, row + y_pos, bitmap_column, bitmap_row);
+			bitmap.setPixel(bitmap_column, bitmap_row, component_buffer);
+		}
+	}
 
-		case jpeg_marker::JFIF:
-			do
-			{
-				jfif::info jfif_info(stream);
-				stream.ignore(size - 2 - jfif::info::SIZE_IN_FILE);
-				if (jfif_info.is_valid())
-				{
-					const char *density_units = "unknown";
-					switch (jfif_info.density_units())
-					{
-					case jfif::PIXELS_PER_CENTIMETRE:
-						density_units = "pixels/cm";
+	allocation::delete_array(component_buffer, component_amount);
+}
+
+/**
+ * Stores a grayscale block, as it comes out of the inverse DCT (centered on 0), in the luminance
+ * component of the bitmap, or in its red, green and blue components if it has no luminance of 1
+ * or 2 bytes. The position can be negative as in setImageBlock.
+ */
+void store_gray_block(const bitmap &bitmap, const rgb_layout &layout, int x_pos, int y_pos,
+		const block_matrix &luminance, decode_stats *stats)
+{
+	DECODE_STATS_CLOCK(clock, stats, PIXEL_STORE);
+	if (!layout.luminance && !layout.word_luminance)
+	{
+		block_matrix components[RGB_COMPONENTS];
+		components[RGB_RED] = luminance;
+		components[RGB_RED] += 128;
+		components[RGB_GREEN] = components[RGB_RED];
+		components[RGB_BLUE] = components[RGB_RED];
+		setImageBlock(bitmap, layout, x_pos, y_pos, components);
+		return;
+	}
+
+	const int width = layout.width;
+	const int height = layout.height;
+
+	if (x_pos >= width || y_pos >= height || x_pos + block_matrix::SIDE <= 0 || y_pos + block_matrix::SIDE <= 0)
+	{
+		return;
+	}
+
+	const unsigned int first_column = (x_pos < 0)? -x_pos : 0;
+	const unsigned int first_row = (y_pos < 0)? -y_pos : 0;
+	const unsigned int columns = (x_pos + block_matrix::SIDE <= width)? block_matrix::SIDE : width - x_pos;
+	const unsigned int rows = (y_pos + block_matrix::SIDE <= height)? block_matrix::SIDE : height - y_pos;
+
+	const std::ptrdiff_t column_step = layout.column_step;
+	if (!layout.luminance)
+	{
+		for (block_matrix::side_count_fast_t row = first_row; row < rows; row++)
+		{
+			unsigned char *pixel = layout.pixel(bitmap, x_pos + first_column, row + y_pos) +
+					layout.word_luminance_offset;
+			for (block_matrix::side_count_fast_t column = first_column; column < columns; column++)
+			{
+				store_clamped_word(pixel, (luminance.get(column, row) + 128) * layout.word_scale);
+				pixel += column_step;
+			}
+		}
+
+		return;
+	}
+
+	for (block_matrix::side_count_fast_t row = first_row; row < rows; row++)
+	{
+		unsigned char *pixel = layout.pixel(bitmap, x_pos + first_column, row + y_pos) + layout.luminance_offset;
+		for (block_matrix::side_count_fast_t column = first_column; column < columns; column++)
+		{
+			*pixel = clamp_to_byte(luminance.get(column, row) + 128);
+			pixel += column_step;
+		}
+	}
+}
+
+/**
+ * Stores a block of each ink, with values from 0 to 255, in the cyan, magenta, yellow and black
+ * components of the bitmap. The position can be negative as in setImageBlock.
+ */
+void store_ink_block(const bitmap &bitmap, const rgb_layout &layout, int x_pos, int y_pos,
+		const block_matrix * const ink)
+{
+	const int width = layout.width;
+	const int height = layout.height;
+
+	if (x_pos >= width || y_pos >= height || x_pos + block_matrix::SIDE <= 0 || y_pos + block_matrix::SIDE <= 0)
+	{
+		return;
+	}
+
+	const unsigned int first_column = (x_pos < 0)? -x_pos : 0;
+	const unsigned int first_row = (y_pos < 0)? -y_pos : 0;
+	const unsigned int columns = (x_pos + block_matrix::SIDE <= width)? block_matrix::SIDE : width - x_pos;
+	const unsigned int rows = (y_pos + block_matrix::SIDE <= height)? block_matrix::SIDE : height - y_pos;
+
+	const std::ptrdiff_t column_step = layout.column_step;
+	for (block_matrix::side_count_fast_t row = first_row; row < rows; row++)
+	{
+		unsigned char *pixel = layout.pixel(bitmap, x_pos + first_column, row + y_pos);
+		for (block_matrix::side_count_fast_t column = first_column; column < columns; column++)
+		{
+			for (unsigned int component = 0; component < color_conversion::CMYK_COMPONENTS; component++)
+			{
+				pixel[layout.cmyk_offsets[component]] = clamp_to_byte(ink[component].get(column, row));
+			}
+			pixel += column_step;
+		}
+	}
+}
+
+/**
+ * Converts a block of each component, as they come out of the inverse DCT, into the colours of the
+ * given model and stores them in the bitmap. Only the first block is used if gray. The position
+ * can be negative as in setImageBlock.
+ */
+void store_colour_block(const bitmap &bitmap, const rgb_layout &layout, colour_model_e model, int x_pos, int y_pos,
+		const block_matrix *components, decode_stats *stats)
+{
+	if (model == MODEL_GRAY)
+	{
+		store_gray_block(bitmap, layout, x_pos, y_pos, components[0], stats);
+		return;
+	}
+
+	DECODE_STATS_CLOCK(clock, stats, COLOR_CONVERSION);
+	block_matrix rgb_components[RGB_COMPONENTS];
+	if (model == MODEL_YCBCR)
+	{
+		color_conversion::ycbcr_to_rgb(components, rgb_components);
+	}
+	else if (model == MODEL_RGB)
+	{
+		for (unsigned int component = 0; component < RGB_COMPONENTS; component++)
+		{
+			rgb_components[component] = components[component];
+			rgb_components[component] += 128;
+		}
+	}
+	else
+	{
+		block_matrix ink[color_conversion::CMYK_COMPONENTS];
+		if (model == MODEL_YCCK)
+		{
+			color_conversion::ycck_to_ink(components, ink);
+		}
+		else
+		{
+			color_conversion::cmyk_to_ink(components, model == MODEL_INVERTED_CMYK, ink);
+		}
+
+		if (layout.cmyk)
+		{
+			DECODE_STATS_ENTER(clock, PIXEL_STORE);
+			store_ink_block(bitmap, layout, x_pos, y_pos, ink);
+			return;
+		}
+
+		color_conversion::ink_to_rgb(ink, rgb_components);
+	}
+
+	DECODE_STATS_ENTER(clock, PIXEL_STORE);
+	setImageBlock(bitmap, layout, x_pos, y_pos, rgb_components);
+}
+
+/**
+ * Bytes per pixel of the bitmap allocated when no allocator is given in the given format, as
+ * returned by default_packed_format with the same wide.
+ */
+unsigned int default_bytes_per_pixel(const packed_format *format, bool wide)
+{
+	return (format != NULL)? format->bytes_per_pixel : (wide? 2 : 1);
+}
+
+/**
+ * Bytes per scanline of the bitmap allocated when no allocator is given. Scanlines are aligned to
+ * 4 bytes.
+ */
+uint_fast64_t default_scanline_size(uint_fast64_t width, unsigned int bytes_per_pixel)
+{
+	return ((width * bytes_per_pixel + 3) >> 2) << 2;
+}
+
+/**
+ * Returns the part of the image to decode: the given region clipped to the frame, or the whole
+ * frame if the region is empty. The result is empty if the region is outside the frame.
+ *
+ * The region is given in the image as the orientation shows it, while the result is in the image
+ * as stored in the file, which is what decoding works with.
+ */
+jpeg::region clip_region(const jpeg::region &crop, const frame_info &frame, exif::orientation_e orientation)
+{
+	const bool transposed = orientation >= exif::LEFT_TOP;
+	const unsigned int width = transposed? frame.height : frame.width;
+	const unsigned int height = transposed? frame.width : frame.height;
+	if (crop.empty())
+	{
+		return jpeg::region(0, 0, frame.width, frame.height);
+	}
+
+	if (crop.x >= width || crop.y >= height)
+	{
+		return jpeg::region();
+	}
+
+	// Computed in 64 bits, as x + width could overflow
+	const uint_fast64_t right = static_cast<uint_fast64_t>(crop.x) + crop.width;
+	const uint_fast64_t bottom = static_cast<uint_fast64_t>(crop.y) + crop.height;
+	const unsigned int clipped_width = ((right < width)? right : width) - crop.x;
+	const unsigned int clipped_height = ((bottom < height)? bottom : height) - crop.y;
+
+	// Columns and rows of the region are counted from the opposite side when mirrored
+	const bool mirrored_x = orientation == exif::TOP_RIGHT || orientation == exif::BOTTOM_RIGHT ||
+			orientation == exif::RIGHT_TOP || orientation == exif::RIGHT_BOTTOM;
+	const bool mirrored_y = orientation == exif::BOTTOM_RIGHT || orientation == exif::BOTTOM_LEFT ||
+			orientation == exif::RIGHT_BOTTOM || orientation == exif::LEFT_BOTTOM;
+	const unsigned int column = mirrored_x? width - crop.x - clipped_width : crop.x;
+	const unsigned int row = mirrored_y? height - crop.y - clipped_height : crop.y;
+	return transposed? jpeg::region(row, column, clipped_height, clipped_width) :
+			jpeg::region(column, row, clipped_width, clipped_height);
+}
+
+/**
+ * True for frames whose samples take more than 8 bits, which are decoded into 16 bits components
+ * by default.
+ */
+inline bool wide_samples(const frame_info &frame)
+{
+	return frame.precision > 8;
+}
+
+/**
+ * Factor applied while dequantizing, so that blocks come out of the inverse DCT in the range of
+ * 8 bits samples, which conversion and storing work with. 12 bits samples are divided by 16,
+ * keeping their fraction, and their level shift becomes 128 as well.
+ */
+inline block_matrix::element_t sample_scale(const frame_info &frame)
+{
+	return 1.0 / (1 << (frame.precision - 8));
+}
+
+/**
+ * Size of the preview for the given frame: 1/8 of the image, rounded up.
+ */
+jpeg::region preview_region(const frame_info &frame)
+{
+	return jpeg::region(0, 0, (frame.width + block_matrix::SIDE - 1) / block_matrix::SIDE,
+			(frame.height + block_matrix::SIDE - 1) / block_matrix::SIDE);
+}
+
+/**
+ * Finds out how the components of the frame become colours, from the Adobe segment if one was
+ * found and the options. Frames with a single component are gray, as YCbCr frames are when only
+ * their luminance is requested, unless decoding into planes. Frames with 4 components are YCCK
+ * if the Adobe segment says any transform, as other decoders take them.
+ */
+colour_model_e decoded_model(const frame_info &frame, const jpeg::decode_options &options, bool adobe_found,
+		adobe::transform_e adobe_transform)
+{
+	const bool not_transformed = adobe_found && adobe_transform == adobe::NO_TRANSFORM;
+	switch (static_cast<unsigned int>(frame.channels_amount))
+	{
+	case 1:
+		return MODEL_GRAY;
+
+	case 3:
+		if (not_transformed)
+		{
+			return MODEL_RGB;
+		}
+		return (options.luminance_only && options.planar == NULL)? MODEL_GRAY : MODEL_YCBCR;
+
+	case 4:
+		if (!adobe_found)
+		{
+			return MODEL_CMYK;
+		}
+		return not_transformed? MODEL_INVERTED_CMYK : MODEL_YCCK;
+
+	default:
+		return MODEL_UNSUPPORTED;
+	}
+}
+
+/**
+ * Finds the planar format holding each component of the frame at the resolution it has in the
+ * file. Returns false if the frame is not YCbCr, or if its chrominance is not sampled as any of
+ * them.
+ */
+bool native_planar_format(const frame_info &frame, jpeg::planar_format_e &format)
+{
+	if (frame.channels_amount != 3)
+	{
+		return false;
+	}
+
+	const unsigned int h_luminance = frame.channels[0].horizontal_sample;
+	const unsigned int v_luminance = frame.channels[0].vertical_sample;
+	const unsigned int h_chrominance = frame.channels[1].horizontal_sample;
+	const unsigned int v_chrominance = frame.channels[1].vertical_sample;
+	if (h_chrominance != frame.channels[2].horizontal_sample || v_chrominance != frame.channels[2].vertical_sample)
+	{
+		return false;
+	}
+
+	if (h_luminance == h_chrominance && v_luminance == v_chrominance)
+	{
+		format = jpeg::PLANAR_I444;
+	}
+	else if (h_luminance == 2 * h_chrominance && v_luminance == v_chrominance)
+	{
+		format = jpeg::PLANAR_I422;
+	}
+	else if (h_luminance == 2 * h_chrominance && v_luminance == 2 * v_chrominance)
+	{
+		format = jpeg::PLANAR_I420;
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Sets up the planes for the frame from the allocator, checking that the format it leaves is
+ * still valid for the frame.
+ */
+void allocate_planes(jpeg::planar_image &image, jpeg::planar_allocator *allocator, const frame_info &frame,
+		jpeg::planar_format_e format)
+{
+	image = jpeg::planar_image();
+	image.format = format;
+	image.width = frame.width;
+	image.height = frame.height;
+	allocator->allocate(image);
+
+	const unsigned int planes_amount = (image.format == jpeg::PLANAR_NV12)? 2 : 3;
+	bool planes_given = true;
+	for (unsigned int index = 0; index < planes_amount; index++)
+	{
+		planes_given = planes_given && image.planes[index] != NULL;
+	}
+
+	if (!planes_given || image.width != frame.width || image.height != frame.height ||
+			(image.format != format && (format != jpeg::PLANAR_I420 || image.format != jpeg::PLANAR_NV12)))
+	{
+		throw jpeg::unable_to_allocate();
+	}
+}
+
+/**
+ * Bytes that the decoder allocates for the given frame, including the bitmaps for the given
+ * region and the preview if allocating them, and the coefficients of the whole image for
+ * progressive frames. Computed in 64 bits, as it exceeds 32 bits for large but valid frames.
+ */
+uint_fast64_t required_bytes(const frame_info &frame, const jpeg::region &area, unsigned int bytes_per_pixel,
+		bool allocating_bitmap, bool allocating_preview)
+{
+	uint_fast64_t blocks_per_mcu = 0;
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		blocks_per_mcu += frame.channels[index].horizontal_sample * frame.channels[index].vertical_sample;
+	}
+
+	uint_fast64_t bytes = blocks_per_mcu * sizeof(block_matrix);
+	if (frame.progressive)
+	{
+		bytes += coefficient_buffer::required_bytes(frame);
+	}
+
+	if (allocating_bitmap)
+	{
+		bytes += default_scanline_size(area.width, bytes_per_pixel) * area.height;
+	}
+
+	if (allocating_preview && frame.progressive)
+	{
+		const jpeg::region preview = preview_region(frame);
+		bytes += default_scanline_size(preview.width, bytes_per_pixel) * preview.height;
+	}
+
+	return bytes;
+}
+
+/**
+ * Bytes that the decoder allocates for the given frame, model and options, as counted above.
+ */
+uint_fast64_t required_bytes(const frame_info &frame, const jpeg::region &area, colour_model_e model,
+		const jpeg::decode_options &options)
+{
+	const bool allocating_bitmap = options.allocator == NULL && options.planar == NULL && !options.entropy_only;
+	const bool wide = wide_samples(frame);
+	return required_bytes(frame, area, default_bytes_per_pixel(default_packed_format(options.output_format,
+			model == MODEL_GRAY, wide), wide), allocating_bitmap, allocating_bitmap && options.preview != NULL);
+}
+
+/**
+ * Sets up the bitmap for an image with the given size and model, from the allocator or, if it is
+ * NULL, in the given output format (see default_packed_format).
+ */
+void allocate_bitmap(bitmap &bitmap, jpeg::bitmap_allocator *allocator, unsigned int width, unsigned int height,
+		colour_model_e model, jpeg::output_format_e output_format, bool wide)
+{
+	const bool gray = model == MODEL_GRAY;
+	if (allocator != NULL)
+	{
+		if (gray)
+		{
+			allocator->allocate_gray(bitmap, width, height);
+		}
+		else if (ink_model(model))
+		{
+			allocator->allocate_cmyk(bitmap, width, height);
+		}
+		else
+		{
+			allocator->allocate(bitmap, width, height);
+		}
+		return;
+	}
+
+	// It may not fit in memory even if there is no limit
+	const packed_format * const format = default_packed_format(output_format, gray, wide);
+	const unsigned int bytes_per_pixel = default_bytes_per_pixel(format, wide);
+	const uint_fast64_t data_size = default_scanline_size(width, bytes_per_pixel) * height;
+	if (data_size > std::numeric_limits<std::size_t>::max())
+	{
+		throw jpeg::unable_to_allocate();
+	}
+
+	const unsigned int components_amount = (format != NULL)? format->components_amount : 1;
+	shared_array<bitmap_component> bitmap_components;
+	shared_array<unsigned char> data;
+	try
+	{
+		bitmap_components = shared_array<bitmap_component>::allocate(components_amount);
+		data = shared_array<unsigned char>::allocate(data_size);
+	}
+	catch (std::bad_alloc &)
+	{
+		throw jpeg::unable_to_allocate();
+	}
+
+	if (format != NULL)
+	{
+		std::copy(format->components, format->components + components_amount, bitmap_components.get());
+	}
+	else
+	{
+		bitmap_components[0].type = bitmap_component::LUMINANCE;
+		bitmap_components[0].bits_per_pixel = wide? 16 : 8;
+	}
+
+	bitmap.bytes_per_pixel = bytes_per_pixel;
+	bitmap.width = width;
+	bitmap.height = height;
+	bitmap.bytes_per_scanline = default_scanline_size(bitmap.width, bytes_per_pixel);
+	bitmap.components_amount = components_amount;
+	bitmap.components = bitmap_components;
+	bitmap.data = data;
+	bitmap.bottom_up = false;
+}
+
+/**
+ * Upsamples an MCU whose blocks are already transformed, converts it into the colours of the
+ * model, and stores the part of it within the area in the bitmap. matrices holds the blocks of
+ * each component in order. If gray, only the luminance blocks are there, and they are stored
+ * without conversion.
+ */
+void store_mcu(const bitmap &bitmap, const rgb_layout &layout, const frame_info &frame, colour_model_e model,
+		const block_matrix *matrices, unsigned int h_matrices_per_iteration, unsigned int v_matrices_per_iteration,
+		unsigned int x_position, unsigned int y_position, const jpeg::region &area, decode_stats *stats)
+{
+	const unsigned int channels_amount = (model == MODEL_GRAY)? 1 : static_cast<unsigned int>(frame.channels_amount);
+	DECODE_STATS_CLOCK(clock, stats, UPSAMPLING);
+	const int area_right = area.x + area.width;
+	const int area_bottom = area.y + area.height;
+
+	block_matrix components[color_conversion::CMYK_COMPONENTS];
+
+	for (unsigned int y_on_iteration = 0; y_on_iteration < v_matrices_per_iteration; y_on_iteration++)
+	{
+		for (unsigned int x_on_iteration = 0; x_on_iteration < h_matrices_per_iteration; x_on_iteration++)
+		{
+			const int block_x = x_position + x_on_iteration * block_matrix::SIDE;
+			const int block_y = y_position + y_on_iteration * block_matrix::SIDE;
+			if (block_x >= area_right || block_x + block_matrix::SIDE <= static_cast<int>(area.x) ||
+					block_y >= area_bottom || block_y + block_matrix::SIDE <= static_cast<int>(area.y))
+			{
+				continue;
+			}
+
+			// TODO: ycbcr should be filled stretching matrices
+			DECODE_STATS_ENTER(clock, UPSAMPLING);
+			unsigned int channel_matrix_index = 0;
+			for (frame_info::channel_count_t channel_index = 0; channel_index < channels_amount; channel_index++)
+			{
+				const frame_channel &channel = frame.channels[channel_index];
+				const frame_channel::uint_fast4_t h_sample = channel.horizontal_sample;
+				const frame_channel::uint_fast4_t v_sample = channel.vertical_sample;
+
+				for (block_matrix::side_count_fast_t row = 0; row < block_matrix::SIDE; row++)
+				{
+					for (block_matrix::side_count_fast_t column = 0; column < block_matrix::SIDE; column++)
+					{
+						unsigned int whole_x_pos = x_on_iteration * block_matrix::SIDE + column;
+						unsigned int matrix_x_pos = (whole_x_pos * h_sample) / h_matrices_per_iteration;
+
+						unsigned int whole_y_pos = y_on_iteration * block_matrix::SIDE + row;
+						unsigned int matrix_y_pos = (whole_y_pos * v_sample) / v_matrices_per_iteration;
+
+						unsigned int matrix_to_check = channel_matrix_index +
+								((matrix_y_pos / block_matrix::SIDE) * h_sample) + (matrix_x_pos / block_matrix::SIDE);
+
+						components[channel_index].set(column, row, matrices[matrix_to_check]
+						        .get(matrix_x_pos % block_matrix::SIDE, matrix_y_pos % block_matrix::SIDE));
+					}
+				}
+				channel_matrix_index += h_sample * v_sample;
+			}
+
+			DECODE_STATS_PAUSE(clock);
+			store_colour_block(bitmap, layout, model, block_x - area.x, block_y - area.y, components, stats);
+		}
+	}
+}
+
+/**
+ * Stores the luminance blocks of an MCU, the first ones in matrices, when they cover the whole
+ * MCU. Unlike store_mcu, no pixel has to be upsampled, so blocks go straight to the bitmap.
+ */
+void store_luminance(const bitmap &bitmap, const rgb_layout &layout, const block_matrix *matrices,
+		unsigned int h_matrices_per_iteration, unsigned int v_matrices_per_iteration,
+		unsigned int x_position, unsigned int y_position, const jpeg::region &area, decode_stats *stats)
+{
+	for (unsigned int y_on_iteration = 0; y_on_iteration < v_matrices_per_iteration; y_on_iteration++)
+	{
+		for (unsigned int x_on_iteration = 0; x_on_iteration < h_matrices_per_iteration; x_on_iteration++)
+		{
+			store_gray_block(bitmap, layout, x_position + x_on_iteration * block_matrix::SIDE - area.x,
+					y_position + y_on_iteration * block_matrix::SIDE - area.y, *(matrices++), stats);
+		}
+	}
+}
+
+/**
+ * Stores the blocks of an MCU, already transformed, in the planes of the image. Each component
+ * keeps its own resolution, so blocks are only shifted to 0-255 and clamped. Rows and columns
+ * beyond each plane are dropped.
+ */
+void store_planar_mcu(const jpeg::planar_image &image, const frame_info &frame, const block_matrix *matrices,
+		unsigned int h_matrices_per_iteration, unsigned int v_matrices_per_iteration,
+		unsigned int x_position, unsigned int y_position, decode_stats *stats)
+{
+	DECODE_STATS_CLOCK(clock, stats, PIXEL_STORE);
+	for (unsigned int channel_index = 0; channel_index < 3; channel_index++)
+	{
+		const frame_channel &channel = frame.channels[channel_index];
+		const unsigned int h_sample = channel.horizontal_sample;
+		const unsigned int v_sample = channel.vertical_sample;
+		const unsigned int h_ratio = h_matrices_per_iteration / h_sample;
+		const unsigned int v_ratio = v_matrices_per_iteration / v_sample;
+		const unsigned int plane_width = (image.width + h_ratio - 1) / h_ratio;
+		const unsigned int plane_height = (image.height + v_ratio - 1) / v_ratio;
+
+		// NV12 keeps both chrominance components in the second plane, one byte each
+		const bool interleaved = image.format == jpeg::PLANAR_NV12 && channel_index > 0;
+		const unsigned int plane_index = interleaved? 1 : channel_index;
+		const unsigned int step = interleaved? 2 : 1;
+		unsigned char * const plane = image.planes[plane_index] + (interleaved? channel_index - 1 : 0);
+		const unsigned int stride = image.strides[plane_index];
+
+		for (unsigned int v_block = 0; v_block < v_sample; v_block++)
+		{
+			for (unsigned int h_block = 0; h_block < h_sample; h_block++)
+			{
+				const block_matrix &block = *(matrices++);
+				const unsigned int block_x = x_position / h_ratio + h_block * block_matrix::SIDE;
+				const unsigned int block_y = y_position / v_ratio + v_block * block_matrix::SIDE;
+				if (block_x >= plane_width || block_y >= plane_height)
+				{
+					continue;
+				}
+
+				const unsigned int columns = std::min<unsigned int>(block_matrix::SIDE, plane_width - block_x);
+				const unsigned int rows = std::min<unsigned int>(block_matrix::SIDE, plane_height - block_y);
+				for (block_matrix::side_count_fast_t row = 0; row < rows; row++)
+				{
+					unsigned char *sample = plane + static_cast<std::size_t>(block_y + row) * stride + block_x * step;
+					for (block_matrix::side_count_fast_t column = 0; column < columns; column++)
+					{
+						*sample = clamp_to_byte(block.get(column, row) + 128);
+						sample += step;
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Copies the decoder state at the next bit of the stream into the entry.
+ */
+void save_state(mcu_index::entry &entry, const scan_bit_stream &stream, const int *dc_values,
+		unsigned int channels_amount, unsigned int restart_index, unsigned int mcus_to_restart)
+{
+	stream.tell(entry.position);
+	for (unsigned int channel = 0; channel < mcu_index::MAX_CHANNELS; channel++)
+	{
+		entry.dc_values[channel] = (channel < channels_amount)? dc_values[channel] : 0;
+	}
+	entry.restart_index = restart_index;
+	entry.mcus_to_restart = mcus_to_restart;
+}
+
+/**
+ * Frame and output of a decode, set up once the headers are parsed and the output allocated.
+ */
+struct decode_context
+{
+	const frame_info *frame;
+
+	/**
+	 * Scan whose entropy-coded data follows the headers. Only for baseline frames.
+	 */
+	const scan_info *scan;
+
+	colour_model_e model;
+	exif::orientation_e orientation;
+
+	/**
+	 * Planes where the image is stored instead of the bitmap, or NULL.
+	 */
+	const jpeg::planar_image *planar;
+
+	unsigned int restart_interval;
+
+	/**
+	 * Part of the image stored, in the image as stored in the file.
+	 */
+	jpeg::region area;
+
+	const mcu_index *index;
+	mcu_index *build_index;
+	jpeg::scan_resume *resume;
+	decode_stats *stats;
+
+	decode_context() : frame(NULL), scan(NULL), model(MODEL_UNSUPPORTED), orientation(exif::TOP_LEFT), planar(NULL),
+			restart_interval(0), index(NULL), build_index(NULL), resume(NULL), stats(NULL) { }
+};
+
+/**
+ * Decodes all MCUs in the scan of the context. If restart_interval is not 0, a restart marker is
+ * expected after that amount of MCUs, and the DC predictions are reset.
+ *
+ * Only the given area of the image is stored in the bitmap, at its top-left corner. MCUs outside
+ * it are entropy decoded to keep the DC predictions, but nothing else. The area is in the image
+ * as stored in the file, and each pixel is moved to the bitmap as the orientation says. Once the last row of MCUs
+ * within the area is done, the rest of the entropy-coded data is skipped.
+ *
+ * Components are converted into colours as the model says. If gray, the image is stored as
+ * grayscale from the first component, and the rest are entropy decoded, as their bits are
+ * interleaved with it, but not dequantized nor transformed. If planar
+ * is given, the image is stored in its planes instead of the bitmap, and the area must be the
+ * whole image.
+ *
+ * If index is given and belongs to this image, decoding starts at the last indexed row before the
+ * area. Otherwise, build_index is filled if given. If resume is given, decoding starts after the
+ * MCUs it holds instead, and it is updated every scan_resume::SAVE_PERIOD MCUs.
+ */
+void decode_scan_data(bitmap &bitmap, scan_bit_stream &stream, const decode_context &context)
+{
+	trace::span scan_span("scan data", "stage");
+
+	const frame_info &frame = *context.frame;
+	const scan_info &scan = *context.scan;
+	const colour_model_e model = context.model;
+	const jpeg::planar_image * const planar = context.planar;
+	const unsigned int restart_interval = context.restart_interval;
+	const jpeg::region &area = context.area;
+	const mcu_index * const index = context.index;
+	decode_stats * const stats = context.stats;
+
+	// Not used when decoding starts at a row taken from elsewhere
+	mcu_index *build_index = context.build_index;
+	jpeg::scan_resume *resume = context.resume;
+
+	uint_fast16_t x_position = 0;
+	uint_fast16_t y_position = 0;
+
+	unsigned int matrices_per_iteration = 0;
+	unsigned int h_matrices_per_iteration = 1;
+	unsigned int v_matrices_per_iteration = 1;
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		const frame_channel &channel = frame.channels[index];
+		const frame_channel::uint_fast4_t h_sample = channel.horizontal_sample;
+		const frame_channel::uint_fast4_t v_sample = channel.vertical_sample;
+
+		matrices_per_iteration += h_sample * v_sample;
+
+		if (h_sample > h_matrices_per_iteration)
+		{
+			h_matrices_per_iteration = h_sample;
+		}
+
+		if (v_sample > v_matrices_per_iteration)
+		{
+			v_matrices_per_iteration = v_sample;
+		}
+	}
+
+	const unsigned int mcu_width = block_matrix::SIDE * h_matrices_per_iteration;
+	const unsigned int mcu_height = block_matrix::SIDE * v_matrices_per_iteration;
+	const unsigned int area_right = area.x + area.width;
+	const unsigned int area_bottom = area.y + area.height;
+
+	// Components after the first one are only transformed when in colour
+	const bool gray = model == MODEL_GRAY;
+	const unsigned int transformed_channels = gray? 1 : static_cast<unsigned int>(scan.channels_amount);
+	const bool full_luminance = gray && frame.channels[0].horizontal_sample == h_matrices_per_iteration &&
+			frame.channels[0].vertical_sample == v_matrices_per_iteration;
+
+	// Scans without all components of the frame cannot be converted
+	const bool stored = gray || (model != MODEL_UNSUPPORTED && scan.channels_amount == frame.channels_amount);
+
+	// 8 bits frames keep the dequantization without scale
+	const block_matrix::element_t scale = sample_scale(frame);
+	const bool scaled = wide_samples(frame);
+
+	const rgb_layout layout(bitmap, frame.precision, context.orientation);
+	shared_array<block_matrix> matrices = shared_array<block_matrix>::allocate(matrices_per_iteration);
+	shared_array<int> dc_values = shared_array<int>::allocate(scan.channels_amount);
+	for (scan_info::channel_count_t index = 0; index < scan.channels_amount; index++)
+	{
+		dc_values[index] = 0;
+	}
+
+	unsigned int mcus_to_restart = restart_interval;
+	unsigned int restart_index = 0;
+	unsigned int mcu_row = 0;
+
+	scan_bit_stream::position scan_start;
+	const bool indexable = scan.channels_amount <= mcu_index::MAX_CHANNELS && stream.tell(scan_start);
+	if (build_index != NULL)
+	{
+		build_index->clear();
+	}
+
+	if (index != NULL && indexable && index->width == frame.width && index->height == frame.height &&
+			index->channels_amount == scan.channels_amount && index->scan_offset == scan_start.byte_offset &&
+			index->rows_per_entry != 0 && !index->entries.empty())
+	{
+		const unsigned int wanted_entry = area.y / mcu_height / index->rows_per_entry;
+		const unsigned int entry_number = (wanted_entry < index->entries.size())? wanted_entry : index->entries.size() - 1;
+		if (entry_number > 0)
+		{
+			const mcu_index::entry &entry = index->entries[entry_number];
+			if (!stream.seek(entry.position))
+			{
+				throw jpeg::invalid_file_format();
+			}
+
+			for (scan_info::channel_count_t channel = 0; channel < scan.channels_amount; channel++)
+			{
+				dc_values[channel] = entry.dc_values[channel];
+			}
+
+			restart_index = entry.restart_index;
+			mcus_to_restart = entry.mcus_to_restart;
+			mcu_row = entry_number * index->rows_per_entry;
+			y_position = mcu_row * mcu_height;
+
+			// Rows before are not read, so they cannot be indexed
+			build_index = NULL;
+		}
+	}
+
+	if (resume != NULL && !indexable)
+	{
+		resume = NULL;
+	}
+	else if (resume != NULL && resume->saved())
+	{
+		const mcu_index::entry &entry = resume->state;
+		if (!stream.seek(entry.position))
+		{
+			throw jpeg::invalid_file_format();
+		}
+
+		for (scan_info::channel_count_t channel = 0; channel < scan.channels_amount; channel++)
+		{
+			dc_values[channel] = entry.dc_values[channel];
+		}
+
+		restart_index = entry.restart_index;
+		mcus_to_restart = entry.mcus_to_restart;
+		mcu_row = resume->complete_rows;
+		x_position = resume->row_mcus * mcu_width;
+		y_position = mcu_row * mcu_height;
+		build_index = NULL;
+	}
+
+	if (build_index != NULL && indexable && build_index->rows_per_entry != 0)
+	{
+		build_index->width = frame.width;
+		build_index->height = frame.height;
+		build_index->channels_amount = scan.channels_amount;
+		build_index->scan_offset = scan_start.byte_offset;
+	}
+	else
+	{
+		build_index = NULL;
+	}
+
+	// Each row of MCUs is a span in the trace
+	const bool tracing = trace::recording();
+	uint_fast64_t band_start = tracing? trace::now() : 0;
+
+	// Stages are only measured on some rows, given the stats for the row
+	decode_stats *row_stats = stats;
+	DECODE_STATS_SAMPLER(sampler, stats);
+	DECODE_STATS_CLOCK(clock, stats, HUFFMAN_DECODE);
+	while (y_position < area_bottom)
+	{
+		if (x_position == 0)
+		{
+			DECODE_STATS_BEGIN_ROW(sampler, clock, HUFFMAN_DECODE, row_stats);
+		}
+
+		const bool inside = x_position < area_right && x_position + mcu_width > area.x &&
+				y_position + mcu_height > area.y;
+
+		if (build_index != NULL && x_position == 0 && mcu_row % build_index->rows_per_entry == 0)
+		{
+			mcu_index::entry entry;
+			save_state(entry, stream, dc_values.get(), scan.channels_amount, restart_index, mcus_to_restart);
+			build_index->entries.push_back(entry);
+		}
+
+		// MCUs already stored in the row are kept, the next call continues after them
+		if (resume != NULL && (x_position / mcu_width) % jpeg::scan_resume::SAVE_PERIOD == 0)
+		{
+			save_state(resume->state, stream, dc_values.get(), scan.channels_amount, restart_index, mcus_to_restart);
+			resume->complete_rows = mcu_row;
+			resume->row_mcus = x_position / mcu_width;
+			resume->available_rows = (y_position > area.y)? y_position - area.y : 0;
+		}
+
+		unsigned int matrix_index = 0;
+		DECODE_STATS_ENTER(clock, HUFFMAN_DECODE);
+
+		for (scan_info::channel_count_t channel=0; channel<scan.channels_amount; channel++)
+		{
+			const frame_channel &frame_channel = frame.channels[channel];
+			const bool transformed = inside && channel < transformed_channels;
+			for (frame_channel::uint_fast4_t v_sample = 0; v_sample < frame_channel.vertical_sample; v_sample++)
+			{
+				for (frame_channel::uint_fast4_t h_sample = 0; h_sample < frame_channel.horizontal_sample; h_sample++)
+				{
+					const scan_channel &scan_channel = scan.channels[channel];
+					huffman_table::symbol_value_t dc_length = scan_channel.dc_table->next_symbol(stream);
+					scan_bit_stream::number_t dc_value = stream.next_number(dc_length);
+
+					dc_value += dc_values[channel];
+					dc_values[channel] = dc_value;
+
+					block_matrix dct_matrix;
+					if (transformed)
+					{
+						dct_matrix.set_at_zigzag(0, dc_value);
+					}
+
+					unsigned char ac_length;
+					unsigned char previous_zeroes;
+					block_matrix::cell_index_fast_t read_cells = 0;
+					do
+					{
+						huffman_table::symbol_value_t ac_symbol = scan_channel.ac_table->next_symbol(stream);
+						ac_length = ac_symbol & 0x0F;
+						previous_zeroes = (ac_symbol >> 4) & 0x0F;
+
+						if (previous_zeroes + read_cells + 1 >= block_matrix::CELLS)
+						{
+							throw jpeg::invalid_file_format();
+						}
+						read_cells += previous_zeroes + 1;
+
+						if (ac_length != 0)
+						{
+							const scan_bit_stream::number_t ac_value = stream.next_number(ac_length);
+							if (transformed)
+							{
+								dct_matrix.set_at_zigzag(read_cells, ac_value);
+							}
+						}
+					} while((ac_length > 0 || previous_zeroes > 0) && read_cells < block_matrix::CELLS - 1);
+
+					DECODE_STATS_ADD(stats, blocks_decoded, 1);
+					DECODE_STATS_ADD(stats, dc_only_blocks, (read_cells == 1 && ac_length == 0)? 1 : 0);
+
+					if (transformed)
+					{
+						DECODE_STATS_ENTER(clock, DEQUANTIZATION);
+						if (scaled)
+						{
+							frame_channel.table->multiply_block(dct_matrix, scale);
+						}
+						else
+						{
+							frame_channel.table->multiply_block(dct_matrix);
+						}
+
+						DECODE_STATS_ENTER(clock, IDCT);
+						matrices[matrix_index++] = dct_matrix.extract_inverse_dct();
+						DECODE_STATS_ENTER(clock, HUFFMAN_DECODE);
+					}
+				}
+			}
+		}
+
+		DECODE_STATS_ADD(stats, mcus_decoded, 1);
+
+		if (inside && planar != NULL)
+		{
+			DECODE_STATS_PAUSE(clock);
+			store_planar_mcu(*planar, frame, matrices.get(), h_matrices_per_iteration, v_matrices_per_iteration,
+					x_position, y_position, row_stats);
+		}
+		else if (inside && full_luminance)
+		{
+			DECODE_STATS_PAUSE(clock);
+			store_luminance(bitmap, layout, matrices.get(), h_matrices_per_iteration, v_matrices_per_iteration,
+					x_position, y_position, area, row_stats);
+		}
+		else if (inside && stored)
+		{
+			DECODE_STATS_PAUSE(clock);
+			store_mcu(bitmap, layout, frame, model, matrices.get(), h_matrices_per_iteration, v_matrices_per_iteration,
+					x_position, y_position, area, row_stats);
+		}
+
+		x_position += block_matrix::SIDE * h_matrices_per_iteration;
+		if (x_position >= frame.width)
+		{
+			x_position = 0;
+			y_position += block_matrix::SIDE * v_matrices_per_iteration;
+
+			if (tracing)
+			{
+				const uint_fast64_t band_end = trace::now();
+				trace::record("MCU row", "band", band_start, band_end, NULL, mcu_row);
+				band_start = band_end;
+			}
+			mcu_row++;
+		}
+
+		if (restart_interval != 0 && --mcus_to_restart == 0 && y_position < area_bottom)
+		{
+			DECODE_STATS_ENTER(clock, MARKER_PARSING);
+			if (!stream.skip_restart_marker(restart_index++))
+			{
+				throw jpeg::invalid_file_format();
+			}
+
+			for (scan_info::channel_count_t index = 0; index < scan.channels_amount; index++)
+			{
+				dc_values[index] = 0;
+			}
+			mcus_to_restart = restart_interval;
+		}
+	}
+
+	DECODE_STATS_FINISH_ROWS(sampler, clock, HUFFMAN_DECODE);
+
+	if (resume != NULL)
+	{
+		save_state(resume->state, stream, dc_values.get(), scan.channels_amount, restart_index, mcus_to_restart);
+		resume->complete_rows = mcu_row;
+		resume->row_mcus = 0;
+		resume->available_rows = area.height;
+	}
+
+	if (area_bottom < frame.height)
+	{
+		DECODE_STATS_ENTER(clock, MARKER_PARSING);
+		stream.skip_entropy_data();
+	}
+}
+
+/**
+ * Stores the whole image at 1/8 of its size in the bitmap, from the DC coefficients alone. Each
+ * DC coefficient is 8 times the average of its block, so blocks become pixels without any
+ * transform. They are converted into colours as the model says, and if gray, only the first
+ * component is used. Pixels are moved to the bitmap as the orientation says.
+ */
+void store_preview(const bitmap &bitmap, const coefficient_buffer &buffer, const frame_info &frame,
+		colour_model_e model, exif::orientation_e orientation, decode_stats *stats)
+{
+	trace::span preview_span("preview", "stage");
+
+	unsigned int h_max = 1;
+	unsigned int v_max = 1;
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		if (frame.channels[index].horizontal_sample > h_max)
+		{
+			h_max = frame.channels[index].horizontal_sample;
+		}
+
+		if (frame.channels[index].vertical_sample > v_max)
+		{
+			v_max = frame.channels[index].vertical_sample;
+		}
+	}
+
+	if (model == MODEL_UNSUPPORTED)
+	{
+		return;
+	}
+
+	const unsigned int channels_amount = (model == MODEL_GRAY)? 1 : static_cast<unsigned int>(frame.channels_amount);
+	const rgb_layout layout(bitmap, frame.precision, orientation);
+	block_matrix components[color_conversion::CMYK_COMPONENTS];
+
+	// Stages are only measured on some rows, as in decode_scan_data
+	decode_stats *row_stats = stats;
+	DECODE_STATS_SAMPLER(sampler, stats);
+	DECODE_STATS_CLOCK(clock, stats, DEQUANTIZATION);
+	for (unsigned int y_position = 0; y_position < layout.height; y_position += block_matrix::SIDE)
+	{
+		DECODE_STATS_BEGIN_ROW(sampler, clock, DEQUANTIZATION, row_stats);
+		for (unsigned int x_position = 0; x_position < layout.width; x_position += block_matrix::SIDE)
+		{
+			DECODE_STATS_ENTER(clock, DEQUANTIZATION);
+			for (frame_info::channel_count_t channel = 0; channel < channels_amount; channel++)
+			{
+				const frame_channel &frame_channel = frame.channels[channel];
+				const coefficient_buffer::component &component = buffer.components[channel];
+				const block_matrix::element_t multiplier = frame_channel.table->dc_multiplier() * sample_scale(frame) /
+						block_matrix::SIDE;
+
+				for (block_matrix::side_count_fast_t row = 0; row < block_matrix::SIDE; row++)
+				{
+					// Pixels beyond the bitmap are not stored, they just repeat the last ones
+					const unsigned int y = std::min<unsigned int>(y_position + row, layout.height - 1);
+					const unsigned int block_row = (y * frame_channel.vertical_sample) / v_max;
+					for (block_matrix::side_count_fast_t column = 0; column < block_matrix::SIDE; column++)
+					{
+						const unsigned int x = std::min<unsigned int>(x_position + column, layout.width - 1);
+						const unsigned int block_column = (x * frame_channel.horizontal_sample) / h_max;
+						components[channel].set(column, row, component.block(block_column, block_row)[0] * multiplier);
+					}
+				}
+			}
+
+			DECODE_STATS_PAUSE(clock);
+			store_colour_block(bitmap, layout, model, x_position, y_position, components, row_stats);
+		}
+	}
+
+	DECODE_STATS_FINISH_ROWS(sampler, clock, DEQUANTIZATION);
+}
+
+/**
+ * Dequantizes and transforms the coefficients of a progressive frame once all its scans are read,
+ * and stores the MCUs within the area of the context in the bitmap, converted as the model says.
+ * Rows below the area are not processed. If gray, only the first component is transformed and
+ * stored. If planar is given, the whole image is stored in its planes instead of the bitmap.
+ * Otherwise, pixels are moved to the bitmap as the orientation says, as in decode_scan_data.
+ */
+void reconstruct_progressive(bitmap &bitmap, const coefficient_buffer &buffer, const decode_context &context)
+{
+	trace::span reconstruction_span("reconstruction", "stage");
+
+	const frame_info &frame = *context.frame;
+	const colour_model_e model = context.model;
+	const jpeg::planar_image * const planar = context.planar;
+	const jpeg::region &area = context.area;
+	decode_stats * const stats = context.stats;
+
+	unsigned int matrices_per_iteration = 0;
+	unsigned int h_matrices_per_iteration = 1;
+	unsigned int v_matrices_per_iteration = 1;
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		const frame_channel &channel = frame.channels[index];
+		matrices_per_iteration += channel.horizontal_sample * channel.vertical_sample;
+
+		if (channel.horizontal_sample > h_matrices_per_iteration)
+		{
+			h_matrices_per_iteration = channel.horizontal_sample;
+		}
+
+		if (channel.vertical_sample > v_matrices_per_iteration)
+		{
+			v_matrices_per_iteration = channel.vertical_sample;
+		}
+	}
+
+	const unsigned int mcu_width = block_matrix::SIDE * h_matrices_per_iteration;
+	const unsigned int mcu_height = block_matrix::SIDE * v_matrices_per_iteration;
+	const unsigned int area_right = area.x + area.width;
+	const unsigned int area_bottom = area.y + area.height;
+
+	const bool gray = model == MODEL_GRAY;
+	const unsigned int transformed_channels = gray? 1 : static_cast<unsigned int>(frame.channels_amount);
+	const bool full_luminance = gray && frame.channels[0].horizontal_sample == h_matrices_per_iteration &&
+			frame.channels[0].vertical_sample == v_matrices_per_iteration;
+
+	const rgb_layout layout(bitmap, frame.precision, context.orientation);
+	shared_array<block_matrix> matrices = shared_array<block_matrix>::allocate(matrices_per_iteration);
+
+	// 8 bits frames keep the dequantization without scale
+	const block_matrix::element_t scale = sample_scale(frame);
+	const bool scaled = wide_samples(frame);
+
+	// Stages are only measured on some rows, as in decode_scan_data
+	decode_stats *row_stats = stats;
+	DECODE_STATS_SAMPLER(sampler, stats);
+	DECODE_STATS_CLOCK(clock, stats, DEQUANTIZATION);
+	for (unsigned int mcu_row = 0; mcu_row < buffer.mcu_rows && mcu_row * mcu_height < area_bottom; mcu_row++)
+	{
+		trace::span band_span("MCU row", "band", NULL, mcu_row);
+
+		const unsigned int y_position = mcu_row * mcu_height;
+		if (y_position + mcu_height <= area.y)
+		{
+			continue;
+		}
+
+		DECODE_STATS_BEGIN_ROW(sampler, clock, DEQUANTIZATION, row_stats);
+
+		for (unsigned int mcu_column = 0; mcu_column < buffer.mcu_columns; mcu_column++)
+		{
+			const unsigned int x_position = mcu_column * mcu_width;
+			if (x_position >= area_right || x_position + mcu_width <= area.x)
+			{
+				continue;
+			}
+
+			unsigned int matrix_index = 0;
+			for (frame_info::channel_count_t channel = 0; channel < transformed_channels; channel++)
+			{
+				const frame_channel &frame_channel = frame.channels[channel];
+				const coefficient_buffer::component &component = buffer.components[channel];
+				for (unsigned int v_sample = 0; v_sample < frame_channel.vertical_sample; v_sample++)
+				{
+					for (unsigned int h_sample = 0; h_sample < frame_channel.horizontal_sample; h_sample++)
+					{
+						const int16_t *coefficients = component.block(
+								mcu_column * frame_channel.horizontal_sample + h_sample,
+								mcu_row * frame_channel.vertical_sample + v_sample);
+
+						DECODE_STATS_ENTER(clock, DEQUANTIZATION);
+						block_matrix dct_matrix;
+						for (block_matrix::cell_count_fast_t index = 0; index < block_matrix::CELLS; index++)
+						{
+							if (coefficients[index] != 0)
+							{
+								dct_matrix.set_at_zigzag(index, coefficients[index]);
+							}
+						}
+						if (scaled)
+						{
+							frame_channel.table->multiply_block(dct_matrix, scale);
+						}
+						else
+						{
+							frame_channel.table->multiply_block(dct_matrix);
+						}
+
+						DECODE_STATS_ENTER(clock, IDCT);
+						matrices[matrix_index++] = dct_matrix.extract_inverse_dct();
+					}
+				}
+			}
+
+			if (planar != NULL)
+			{
+				DECODE_STATS_PAUSE(clock);
+				store_planar_mcu(*planar, frame, matrices.get(), h_matrices_per_iteration, v_matrices_per_iteration,
+						x_position, y_position, row_stats);
+			}
+			else if (full_luminance)
+			{
+				DECODE_STATS_PAUSE(clock);
+				store_luminance(bitmap, layout, matrices.get(), h_matrices_per_iteration, v_matrices_per_iteration,
+						x_position, y_position, area, row_stats);
+			}
+			else if (model != MODEL_UNSUPPORTED)
+			{
+				DECODE_STATS_PAUSE(clock);
+				store_mcu(bitmap, layout, frame, model, matrices.get(), h_matrices_per_iteration,
+						v_matrices_per_iteration, x_position, y_position, area, row_stats);
+			}
+		}
+	}
+
+	DECODE_STATS_FINISH_ROWS(sampler, clock, DEQUANTIZATION);
+}
+}
+
+namespace jpeg
+{
+namespace
+{
+
+/**
+ * Takes the quantization tables not found yet for the frame channels in the scan. Throws
+ * invalid_file_format if the scan has channels not in the frame, or their tables are not defined.
+ */
+void take_quantization_tables(frame_info &frame, const scan_info &scan, const table_list<quantization_table> &tables)
+{
+	unsigned int components[basic_info::MAX_CHANNEL_AMOUNT];
+	scan.find_components(frame, false, false, components);
+	for (scan_info::channel_count_t channel = 0; channel < scan.channels_amount; channel++)
+	{
+		frame_channel &frame_channel = frame.channels[components[channel]];
+		if (frame_channel.table == NULL)
+		{
+			frame_channel.table = tables.list[frame_channel.table_id];
+		}
+
+		if (frame_channel.table == NULL)
+		{
+			throw invalid_file_format();
+		}
+	}
+}
+
+/**
+ * True if all channels in the frame have their quantization table.
+ */
+bool quantization_tables_found(const frame_info &frame)
+{
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		if (frame.channels[index].table == NULL)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Checks that each channel in a baseline scan is the frame channel at the same position, as its
+ * MCUs are decoded in the order of the frame, and that it has both its huffman tables.
+ */
+void check_baseline_scan(const frame_info &frame, const scan_info &scan)
+{
+	unsigned int components[basic_info::MAX_CHANNEL_AMOUNT];
+	scan.find_components(frame, true, true, components);
+	for (scan_info::channel_count_t channel = 0; channel < scan.channels_amount; channel++)
+	{
+		if (components[channel] != channel)
+		{
+			throw invalid_file_format();
+		}
+	}
+}
+
+/**
+ * Everything read from the segments before the entropy-coded data of a baseline frame, or up to
+ * the end of image of a progressive one, whose scans are decoded while reading them.
+ */
+struct header_state
+{
+	table_list<quantization_table> tables;
+	table_list<huffman_table> dc_tables;
+	table_list<huffman_table> ac_tables;
+
+	scoped_object<frame_info> frame;
+	scoped_object<scan_info> scan;
+	unsigned int restart_interval;
+	region area;
+
+	// Without Adobe segment, 3 components are YCbCr and 4 are CMYK
+	bool adobe_found;
+	adobe::transform_e adobe_transform;
+
+	// Only applied when asked for, and fixed once the frame header is read
+	exif::orientation_e orientation;
+
+	// Set up once the frame header is read, when decoding into planes
+	planar_format_e planar_format;
+	planar_image planes;
+
+	// Progressive frames decode each scan as soon as it is found, until the end of image
+	coefficient_buffer coefficients;
+	bool end_of_image;
+
+	// No more scans are read once max_scans is reached or the preview listener asks to stop
+	bool scans_stopped;
+	bool preview_kept;
+
+	header_state() : restart_interval(0), adobe_found(false), adobe_transform(adobe::YCBCR),
+			orientation(exif::TOP_LEFT), planar_format(PLANAR_I444), end_of_image(false), scans_stopped(false),
+			preview_kept(false) { }
+
+private:
+	header_state(const header_state &other);
+	header_state &operator=(const header_state &other);
+};
+
+/**
+ * Reads the segments from the start of image, taking the tables from table_source. Baseline
+ * frames stop at the entropy-coded data of their scan, and progressive ones at the end of image,
+ * unless max_scans or the preview listener stops them before. The preview is stored in the bitmap
+ * if kept. If resuming, nothing is reported to the diagnostics sink.
+ */
+void read_headers(bitmap &bitmap, std::istream &stream, const decode_options &options, bool resuming,
+		table_cache &table_source, header_state &headers)
+{
+	decode_stats * const stats = options.stats;
+	DECODE_STATS_CLOCK(clock, stats, MARKER_PARSING);
+	if (stream.get() != jpeg_marker::MARKER || stream.get() != jpeg_marker::START_OF_IMAGE)
+	{
+		throw invalid_file_format();
+	}
+
+	unsigned int scans_read = 0;
+	bool preview_sent = false;
+
+	// Comments and application segments are only read when someone is listening
+	diagnostics_sink * const sink = resuming? NULL : options.diagnostics;
+	std::vector<unsigned char, allocation::container_allocator<unsigned char> > payload;
+
+	// Baseline frames have a single scan, whose entropy-coded data follows its header
+	bool at_entropy_data = false;
+
+	while (!headers.scans_stopped && !at_entropy_data && stream.good() && stream.get() == jpeg_marker::MARKER)
+	{
+		const int_fast64_t offset = (sink != NULL)? static_cast<int_fast64_t>(stream.tellg()) - 1 : -1;
+		const uint_fast8_t marker_type = stream.get();
+		if (marker_type == jpeg_marker::END_OF_IMAGE)
+		{
+			headers.end_of_image = true;
+			break;
+		}
+
+		// The size includes its own 2 bytes, so anything below is corrupt
+		const uint_fast16_t size = read_big_endian_unsigned_int(stream, 2);
+		if (size < 2)
+		{
+			throw invalid_file_format();
+		}
+
+		diagnostic_event event(marker_type, offset, size);
+
+		switch (marker_type)
+		{
+		case jpeg_marker::QUANTIZATION_TABLE:
+			do
+			{
+				// A single segment can define several tables. Each one starts with the size of its
+				// values in the high nibble (0 for 8 bits, 1 for 16 bits) and its id in the low one.
+				uint_fast16_t remaining = size - 2;
+				while (remaining >= quantization_table::CELL_AMOUNT + 1)
+				{
+					const uint_fast8_t table_ref = stream.get();
+					const uint_fast8_t table_id = table_ref & 0x0F;
+					const bool wide_values = (table_ref & 0xF0) == 0x10;
+					remaining--;
+
+					if ((table_ref & 0xF0) > 0x10)
+					{
+						event.warning = diagnostic_event::INVALID_QUANTIZATION_TABLE_ID;
 						break;
+					}
+
+					const uint_fast16_t table_size = (wide_values? 2 : 1) * quantization_table::CELL_AMOUNT;
+					if (table_size > remaining)
+					{
+						break;
+					}
+
+					headers.tables.list[table_id] = table_source.quantization(stream, wide_values);
+					remaining -= table_size;
+				}
+
+				if (remaining != 0)
+				{
+					if (event.warning == diagnostic_event::NO_WARNING)
+					{
+						event.warning = diagnostic_event::INVALID_QUANTIZATION_TABLE_SIZE;
+					}
+					stream.ignore(remaining);
+				}
+			} while(0);
+			break;
 
-					case jfif::PIXELS_PER_INCH:
-						density_units = "pixels/inch";
-						break;
+		case jpeg_marker::START_OF_FRAME_BASELINE_DCT:
+		case jpeg_marker::START_OF_FRAME_EXTENDED_DCT:
+		case jpeg_marker::START_OF_FRAME_PROGRESSIVE_DCT:
+			if (headers.frame.get() != NULL)
+			{
+				// Only hierarchical files have more than one frame
+				throw invalid_file_format();
+			}
+
+			headers.frame.reset(allocation::counted(new frame_info(stream, headers.tables,
+					marker_type == jpeg_marker::START_OF_FRAME_PROGRESSIVE_DCT)));
+			event.frame = headers.frame.get();
+
+			if (headers.frame->expected_byte_size() != size)
+			{
+				event.warning = diagnostic_event::INVALID_FRAME_SIZE;
+			}
+
+			// DCT frames only have 8 or 12 bits samples
+			if (headers.frame->precision != 8 && headers.frame->precision != 12)
+			{
+				throw invalid_file_format();
+			}
+
+			// Without columns, no MCU is within the area but all rows are read
+			headers.area = options.entropy_only? region(0, 0, 0, headers.frame->height) :
+					clip_region((options.planar != NULL)? region() : options.crop, *headers.frame, headers.orientation);
+			if (!options.entropy_only && options.planar != NULL &&
+					(!native_planar_format(*headers.frame, headers.planar_format) || decoded_model(*headers.frame,
+					options, headers.adobe_found, headers.adobe_transform) != MODEL_YCBCR))
+			{
+				throw unsupported_output();
+			}
+
+			if (!options.entropy_only && headers.area.empty() && headers.frame->width != 0 && headers.frame->height != 0)
+			{
+				throw invalid_region();
+			}
+
+			// Rejected before reading anything else, as a hostile header could ask for gigabytes
+			if ((options.max_pixels != 0 && static_cast<uint_fast64_t>(headers.frame->width) *
+					headers.frame->height > options.max_pixels) || (options.memory_budget != 0 &&
+					required_bytes(*headers.frame, headers.area, decoded_model(*headers.frame, options, headers.adobe_found,
+					headers.adobe_transform), options) > options.memory_budget))
+			{
+				throw limit_exceeded();
+			}
+
+			if (headers.frame->progressive)
+			{
+				try
+				{
+					headers.coefficients.allocate(*headers.frame);
+				}
+				catch (std::bad_alloc &)
+				{
+					throw unable_to_allocate();
+				}
+			}
+			break;
+
+		case jpeg_marker::HUFFMAN_TABLE:
+			do
+			{
+				// A single segment can define several tables. Each one starts with its class in the
+				// high nibble (0 for DC, 1 for AC) and its id in the low one.
+				uint_fast16_t remaining = size - 2;
+				while (remaining > huffman_table::MAX_WORD_SIZE)
+				{
+					const uint_fast8_t table_ref = stream.get();
+					const table_list<huffman_table>::index_fast_t table_id = table_ref & 0x0F;
+					const bool is_ac = (table_ref & 0xF0) == 0x10;
+					remaining--;
+
+					// DCT frames have up to 4 tables of each class
+					if ((table_ref & 0xF0) > 0x10 || table_id > 3)
+					{
+						throw invalid_file_format();
+					}
 
-					default:
-						;
+					// Tables not fitting in the segment are never read beyond it
+					const huffman_table *table = table_source.huffman(stream, remaining);
+					if (table == NULL)
+					{
+						throw invalid_file_format();
 					}
 
-					std::cout << "Found JFIF v" << static_cast<unsigned int>(jfif_info.major_version())
-								<< "." << static_cast<unsigned int>(jfif_info.minor_version())
-								<< " section:" << std::endl
-								<< " X Density: " << jfif_info.x_density() << ' ' << density_units << std::endl
-								<< " Y Density: " << jfif_info.y_density() << ' ' << density_units << std::endl;
+					(is_ac? headers.ac_tables : headers.dc_tables).list[table_id] = table;
+					remaining -= huffman_table::MAX_WORD_SIZE + table->symbol_amount();
 				}
-				else
+
+				if (remaining != 0)
 				{
-					std::cerr << "Found JFIF section but it is not valid" << std::endl;
+					event.warning = diagnostic_event::INVALID_HUFFMAN_TABLE_SIZE;
+					stream.ignore(remaining);
 				}
 			} while(0);
 			break;
 
+		case jpeg_marker::RESTART_INTERVAL:
+			if (size == 4)
+			{
+				headers.restart_interval = read_big_endian_unsigned_int(stream, 2);
+			}
+			else
+			{
+				event.warning = diagnostic_event::INVALID_RESTART_INTERVAL_SIZE;
+				stream.ignore(size - 2);
+			}
+			break;
+
 		case jpeg_marker::START_OF_SCAN:
-			do
+			headers.scan.reset(allocation::counted(new scan_info(stream, headers.dc_tables, headers.ac_tables)));
+			event.scan = headers.scan.get();
+
+			if (headers.scan->expected_byte_size() != size)
+			{
+				event.warning = diagnostic_event::INVALID_SCAN_SIZE;
+			}
+
+			// Each channel in the scan must be one of the frame
+			if (headers.frame.get() != NULL && headers.scan->channels_amount > headers.frame->channels_amount)
+			{
+				throw invalid_file_format();
+			}
+
+			if (headers.frame.get() != NULL)
 			{
-				current_scan = new scan_info(stream, dc_tables, ac_tables);
+				take_quantization_tables(*headers.frame, *headers.scan, headers.tables);
+			}
+
+			if (headers.frame.get() != NULL && headers.frame->progressive)
+			{
+				scan_bit_stream bit_stream(&stream);
+
+				DECODE_STATS_PAUSE(clock);
+				decode_progressive_scan(headers.coefficients, bit_stream, *headers.frame, *headers.scan,
+						headers.restart_interval, stats);
+				DECODE_STATS_ADD(stats, bits_consumed, bit_stream.consumed_bits());
+				DECODE_STATS_ADD(stats, bytes_unstuffed, bit_stream.unstuffed_bytes());
+				DECODE_STATS_ENTER(clock, MARKER_PARSING);
 
-				if (current_scan->expected_byte_size() == size)
+				// Leaves the stream at the marker that follows
+				bit_stream.skip_entropy_data();
+
+				if (options.entropy_only)
 				{
-					std::cout << "Found scan for an image with "
-							<< static_cast<unsigned int>(current_scan->channels_amount)
-							<< " channels" << std::endl;
+					break;
 				}
-				else
+
+				if (options.preview != NULL && options.planar == NULL && !preview_sent && headers.coefficients.dc_read())
 				{
-					std::cerr << "Found invalid scan. Expected size was "
-							<< static_cast<unsigned int>(current_scan->expected_byte_size()) << " but actually was "
-							<< static_cast<unsigned int>(size) << std::endl;
+					preview_sent = true;
+					const region preview_area = preview_region(*headers.frame);
+					const bool transposed = headers.orientation >= exif::LEFT_TOP;
+					const colour_model_e model = decoded_model(*headers.frame, options, headers.adobe_found,
+							headers.adobe_transform);
+
+					::bitmap preview;
+					allocate_bitmap(preview, options.allocator,
+							transposed? preview_area.height : preview_area.width,
+							transposed? preview_area.width : preview_area.height,
+							model, options.output_format, wide_samples(*headers.frame));
+
+					DECODE_STATS_PAUSE(clock);
+					store_preview(preview, headers.coefficients, *headers.frame, model, headers.orientation, stats);
+					DECODE_STATS_ENTER(clock, MARKER_PARSING);
+
+					if (!options.preview->preview(preview))
+					{
+						bitmap = preview;
+						headers.preview_kept = true;
+						headers.scans_stopped = true;
+					}
 				}
-			} while(0);
+
+				if (options.max_scans != 0 && ++scans_read == options.max_scans)
+				{
+					headers.scans_stopped = true;
+				}
+			}
+			else
+			{
+				if (headers.frame.get() != NULL)
+				{
+					check_baseline_scan(*headers.frame, *headers.scan);
+				}
+				at_entropy_data = true;
+			}
 			break;
 
 		default:
-			stream.ignore(size - 2);
-			std::cerr << "Found section with marker " << static_cast<unsigned int>(marker_type) << " and size " << size <<". Ignored!" << std::endl;
+			if (marker_type == jpeg_marker::COMMENT ||
+					(marker_type >= jpeg_marker::APPLICATION_BASELINE && marker_type <= jpeg_marker::APPLICATION_LAST))
+			{
+				// The Adobe segment is always read, as it tells how to convert the components, and so is
+				// the EXIF one when its orientation is applied
+				const bool oriented = options.apply_orientation && options.planar == NULL && headers.frame.get() == NULL;
+				if (sink != NULL || marker_type == jpeg_marker::ADOBE || (marker_type == jpeg_marker::EXIF && oriented))
+				{
+					payload.resize(size - 2);
+					stream.read(reinterpret_cast<char *>(payload.data()), payload.size());
+					event.payload.data = payload.data();
+					event.payload.size = payload.size();
+
+					if (marker_type == jpeg_marker::JFIF && (payload.size() < jfif::info::SIZE_IN_FILE ||
+							!jfif::info(payload.data()).is_valid()))
+					{
+						event.warning = diagnostic_event::INVALID_JFIF;
+					}
+					else if (marker_type == jpeg_marker::ADOBE)
+					{
+						if (payload.size() >= adobe::info::SIZE_IN_FILE && adobe::info(payload.data()).is_valid())
+						{
+							headers.adobe_found = true;
+							headers.adobe_transform = adobe::info(payload.data()).transform();
+						}
+						else
+						{
+							event.warning = diagnostic_event::INVALID_ADOBE;
+						}
+					}
+					else if (marker_type == jpeg_marker::EXIF && exif::info::is_exif(payload.data(), payload.size()))
+					{
+						const exif::info exif_info(payload.data(), payload.size());
+						if (!exif_info.is_valid())
+						{
+							event.warning = diagnostic_event::INVALID_EXIF;
+						}
+						else if (oriented)
+						{
+							headers.orientation = exif_info.orientation();
+						}
+					}
+				}
+				else
+				{
+					stream.ignore(size - 2);
+				}
+			}
+			else
+			{
+				stream.ignore(size - 2);
+				event.warning = diagnostic_event::UNSUPPORTED_SEGMENT;
+			}
 		}
+
+		if (sink != NULL)
+		{
+			sink->notify(event);
+		}
+	}
+
+	// Images whose height is given after the scan (DNL segment) are not supported. Baseline frames
+	// stop at their scan data, while progressive ones must have reached the end of image unless
+	// told to stop before.
+	if (headers.frame.get() == NULL || headers.scan.get() == NULL || headers.frame->width == 0 ||
+			headers.frame->height == 0 || (headers.end_of_image || headers.scans_stopped) != headers.frame->progressive)
+	{
+		throw invalid_file_format();
+	}
+
+	// Progressive components without any scan are reconstructed anyway
+	if (headers.frame->progressive && !options.entropy_only && !headers.preview_kept &&
+			!quantization_tables_found(*headers.frame))
+	{
+		throw invalid_file_format();
 	}
+}
 
-	// Preparing bitmap to allocate the image (RGB, 8 bits per channel)
-	shared_array<unsigned char> image_raw_data = shared_array<unsigned char>::make(new unsigned char[current_frame->width * current_frame->height * 3]);
-	shared_array<bitmap_component> bitmap_components = shared_array<bitmap_component>::make(new bitmap_component[3]);
+/**
+ * Sets up the planes of the context, or the bitmap if there are none, for the frame read.
+ */
+void allocate_output(bitmap &bitmap, const decode_options &options, header_state &headers,
+		const decode_context &context)
+{
+	DECODE_STATS_CLOCK(clock, context.stats, MARKER_PARSING);
+	if (context.planar != NULL)
+	{
+		allocate_planes(headers.planes, options.planar, *context.frame, headers.planar_format);
+	}
+	else
+	{
+		const bool transposed = context.orientation >= exif::LEFT_TOP;
+		allocate_bitmap(bitmap, options.allocator, transposed? context.area.height : context.area.width,
+				transposed? context.area.width : context.area.height, context.model, options.output_format,
+				wide_samples(*context.frame));
+	}
+}
 
-	bitmap_components[0].type = bitmap_component::RED;
-	bitmap_components[0].bits_per_pixel = 8;
-	bitmap_components[1].type = bitmap_component::GREEN;
-	bitmap_components[1].bits_per_pixel = 8;
-	bitmap_components[2].type = bitmap_component::BLUE;
-	bitmap_components[2].bits_per_pixel = 8;
+/**
+ * Stores the image of a progressive frame from the coefficients of its scans, or decodes the
+ * entropy-coded data of a baseline one up to the end of image, which the stream is left after.
+ */
+void decode_image_data(bitmap &bitmap, std::istream &stream, const decode_options &options,
+		const header_state &headers, decode_context &context)
+{
+	jpeg::scan_resume * const resume = context.resume;
+	if (context.frame->progressive)
+	{
+		// Progressive frames are never indexed
+		if (options.build_index != NULL)
+		{
+			options.build_index->clear();
+		}
 
-	bitmap.bytes_per_pixel = 3;
-	bitmap.width = current_frame->width;
-	bitmap.height = current_frame->height;
-	bitmap.bytes_per_scanline = (((bitmap.bytes_per_pixel * bitmap.width) + 3) >> 2) << 2;
-	bitmap.components_amount = 3;
-	bitmap.components = bitmap_components;
-	bitmap.data = image_raw_data;
+		if (!options.entropy_only && !headers.preview_kept)
+		{
+			reconstruct_progressive(bitmap, headers.coefficients, context);
+		}
+		return;
+	}
+
+	// Other files may have the same headers, but not the same size and bytes at each entry
+	if (options.index != NULL && options.index->belongs_to(stream))
+	{
+		context.index = options.index;
+	}
 
 	// Scan of data begins here
 	scan_bit_stream bit_stream = (&stream);
-	bit_stream.prepend(value);
 
-	decode_scan_data(bitmap, bit_stream, *current_frame, *current_scan);
+	bool scan_decoded = false;
+	try
+	{
+		decode_scan_data(bitmap, bit_stream, context);
+		scan_decoded = true;
+	}
+	catch (invalid_file_format &)
+	{ }
+	catch (std::invalid_argument &)
+	{
+		// Code not present in the huffman table
+	}
+	catch (unsupported_feature &)
+	{
+		// Marker within the entropy-coded data
+	}
+	catch (unexpected_end_of_stream &)
+	{ }
+
+	DECODE_STATS_CLOCK(clock, context.stats, MARKER_PARSING);
+	DECODE_STATS_ADD(context.stats, bits_consumed, bit_stream.consumed_bits());
+	DECODE_STATS_ADD(context.stats, bytes_unstuffed, bit_stream.unstuffed_bytes());
+
+	if (!scan_decoded || stream.get() != jpeg_marker::MARKER || stream.get() != jpeg_marker::END_OF_IMAGE)
+	{
+		// Anything may happen when the bytes end, the next call will find the rest
+		if (resume != NULL && stream.eof())
+		{
+			return;
+		}
+
+		throw invalid_file_format();
+	}
+
+	if (options.build_index != NULL && !options.build_index->entries.empty())
+	{
+		options.build_index->sign(stream);
+	}
+
+	if (resume != NULL)
+	{
+		resume->finished = true;
+	}
+}
+
+/**
+ * Decodes the image as decode_image does. If resume is given, it is a call of an incremental
+ * decode: running out of bytes is not an error, and the following call continues from the state
+ * left in resume.
+ */
+void decode(bitmap &bitmap, std::istream &stream, const decode_options &options, scan_resume *resume)
+{
+	trace::span decode_span("jpeg::decode_image", "decode");
+	const uint_fast64_t parsing_start = trace::recording()? trace::now() : 0;
+
+	// Calls that continue an incremental decode have already reported and allocated everything
+	const bool resuming = resume != NULL && resume->started;
+
+	decode_stats * const stats = options.stats;
+	if (stats != NULL && !resuming)
+	{
+		stats->reset();
+	}
 
-	// Freeing JPEG related resources
-	if (current_scan != NULL)
+	DECODE_STATS_ALLOCATIONS(meter, stats);
+
+	// Tables are owned by the cache. Without a shared one, they are freed together with this one.
+	// The lease keeps those found here even if other decodes make the cache evict them.
+	table_cache local_tables;
+	table_cache &table_source = (options.tables != NULL)? *options.tables : local_tables;
+	const table_cache::lease table_lease(table_source);
+
+	header_state headers;
+	read_headers(bitmap, stream, options, resuming, table_source, headers);
+
+	decode_context context;
+	context.frame = headers.frame.get();
+	context.scan = headers.scan.get();
+	context.model = decoded_model(*headers.frame, options, headers.adobe_found, headers.adobe_transform);
+	context.orientation = headers.orientation;
+	context.planar = (options.planar != NULL && !options.entropy_only)? &headers.planes : NULL;
+	context.restart_interval = headers.restart_interval;
+	context.area = headers.area;
+	context.build_index = options.build_index;
+	context.resume = resume;
+	context.stats = stats;
+
+	// Bitmap left untouched, or already holding the preview or the previous rows
+	if (!options.entropy_only && !headers.preview_kept && !resuming)
 	{
-		delete current_scan;
+		allocate_output(bitmap, options, headers, context);
 	}
 
-	if (current_frame != NULL)
+	if (resume != NULL)
 	{
-		delete current_frame;
+		resume->started = true;
 	}
 
-	for (table_list<quantization_table>::count_fast_t i = 0; i < table_list<quantization_table>::MAX_TABLES; i++)
+	trace::record("marker parsing", "stage", parsing_start, trace::now());
+
+	decode_image_data(bitmap, stream, options, headers, context);
+}
+
+}
+}
+
+void jpeg::decode_image(bitmap &bitmap, std::istream &stream) throw(invalid_file_format)
+{
+	decode_image(bitmap, stream, decode_options());
+}
+
+void jpeg::decode_image(bitmap &bitmap, std::istream &stream, const decode_options &options)
+		throw(invalid_file_format, unable_to_allocate, limit_exceeded, invalid_region, unsupported_output)
+{
+	decode(bitmap, stream, options, NULL);
+}
+
+void jpeg::build_index(std::istream &stream, mcu_index &index, const decode_options &options)
+		throw(invalid_file_format, limit_exceeded, unable_to_allocate)
+{
+	decode_options index_options(options);
+	index_options.entropy_only = true;
+	index_options.build_index = &index;
+	index_options.index = NULL;
+
+	bitmap bitmap;
+	decode_image(bitmap, stream, index_options);
+}
+
+jpeg::validation_result jpeg::validate(std::istream &stream, const decode_options &options)
+		throw(limit_exceeded, unable_to_allocate)
+{
+	decode_options validate_options(options);
+	validate_options.entropy_only = true;
+	validate_options.allocator = NULL;
+	validate_options.build_index = NULL;
+	validate_options.index = NULL;
+	validate_options.crop = region();
+
+	validation_result result;
+	try
+	{
+		bitmap bitmap;
+		decode_image(bitmap, stream, validate_options);
+	}
+	catch (invalid_file_format &)
 	{
-		if (tables.list[i] != NULL)
+		result.valid = false;
+
+		// The last byte read is the wrong one, unless there was nothing left to read
+		const bool ended = stream.eof();
+		stream.clear();
+		const std::streampos position = stream.tellg();
+		if (position >= 0)
 		{
-			delete tables.list[i];
+			result.error_offset = static_cast<int_fast64_t>(position) - (ended? 0 : 1);
 		}
 	}
 
-	for (table_list<huffman_table>::count_fast_t i = 0; i < table_list<huffman_table>::MAX_TABLES; i++)
+	return result;
+}
+
+namespace
+{
+
+/**
+ * Advances walked through the segments received up to the first one not complete yet. Returns
+ * true once the received bytes can be decoded: up to the header of the scan in a baseline frame
+ * or, if whole_file is set, up to the end of image. whole_file is set for progressive frames and
+ * for scans that cannot be resumed, whose entropy-coded data is walked looking for the marker
+ * that follows it.
+ */
+bool walk_segments(const unsigned char *data, std::size_t size, std::size_t &walked, bool &in_entropy_data,
+		bool &whole_file)
+{
+	if (walked == 0)
 	{
-		if (dc_tables.list[i] != NULL)
+		if (size < 2)
 		{
-			delete dc_tables.list[i];
+			return false;
 		}
 
-		if (ac_tables.list[i] != NULL)
+		if (data[0] != jpeg_marker::MARKER || data[1] != jpeg_marker::START_OF_IMAGE)
 		{
-			delete ac_tables.list[i];
+			throw jpeg::invalid_file_format();
 		}
+		walked = 2;
 	}
 
-	if (stream.get() != jpeg_marker::MARKER || stream.get() != jpeg_marker::END_OF_IMAGE)
+	while (true)
 	{
-		throw invalid_file_format();
+		if (in_entropy_data)
+		{
+			// 0xFF may be followed by stuffing, a restart marker or more 0xFF used as fill bytes
+			while (walked + 1 < size && (data[walked] != jpeg_marker::MARKER || data[walked + 1] == 0 ||
+					data[walked + 1] == jpeg_marker::MARKER || (data[walked + 1] >= jpeg_marker::RESTART_BASE &&
+					data[walked + 1] < jpeg_marker::RESTART_BASE + 8)))
+			{
+				walked++;
+			}
+
+			if (walked + 1 >= size)
+			{
+				return false;
+			}
+			in_entropy_data = false;
+		}
+
+		if (walked + 2 > size)
+		{
+			return false;
+		}
+
+		const unsigned char marker_type = data[walked + 1];
+		if (marker_type == jpeg_marker::END_OF_IMAGE)
+		{
+			// Files without scan are reported by the decoder
+			walked += 2;
+			whole_file = true;
+			return true;
+		}
+
+		if (walked + 4 > size)
+		{
+			return false;
+		}
+
+		const std::size_t segment_size = (data[walked + 2] << 8) | data[walked + 3];
+		if (segment_size < 2)
+		{
+			throw jpeg::invalid_file_format();
+		}
+
+		const std::size_t segment_end = walked + 2 + segment_size;
+		if (segment_end > size)
+		{
+			return false;
+		}
+
+		if (marker_type == jpeg_marker::START_OF_FRAME_PROGRESSIVE_DCT ||
+				(marker_type == jpeg_marker::START_OF_SCAN && data[walked + 4] > mcu_index::MAX_CHANNELS))
+		{
+			whole_file = true;
+		}
+
+		walked = segment_end;
+		if (marker_type == jpeg_marker::START_OF_SCAN)
+		{
+			if (!whole_file)
+			{
+				return true;
+			}
+			in_entropy_data = true;
+		}
+	}
+}
+
+}
+
+jpeg::incremental_decoder::incremental_decoder(const decode_options &options) : options(options), walked(0),
+		scan_start(0), in_entropy_data(false), whole_file(false), resume(allocation::counted(new scan_resume()))
+{
+	this->options.index = NULL;
+	this->options.build_index = NULL;
+	this->options.planar = NULL;
+	this->options.apply_orientation = false;
+
+	// Tables are parsed again on each call, but only built once
+	if (this->options.tables == NULL)
+	{
+		this->options.tables = &tables;
+	}
+}
+
+jpeg::incremental_decoder::~incremental_decoder()
+{
+	allocation::delete_object(resume);
+}
+
+jpeg::incremental_decoder::status_e jpeg::incremental_decoder::feed(const unsigned char *bytes, std::size_t size)
+		throw(invalid_file_format, unable_to_allocate, limit_exceeded, invalid_region)
+{
+	if (resume->finished)
+	{
+		return COMPLETE;
+	}
+
+	received.insert(received.end(), bytes, bytes + size);
+	if (scan_start == 0)
+	{
+		if (!walk_segments(reinterpret_cast<const unsigned char *>(received.data()), received.size(), walked,
+				in_entropy_data, whole_file))
+		{
+			return NEED_MORE_DATA;
+		}
+
+		if (whole_file)
+		{
+			memory_input_buffer buffer(received.data(), received.size());
+			std::istream stream(&buffer);
+			decode_image(decoded, stream, options);
+
+			resume->finished = true;
+			resume->available_rows = decoded.height;
+			received.clear();
+			return COMPLETE;
+		}
+
+		scan_start = walked;
+	}
+
+	// The first byte of the entropy-coded data is read with the headers
+	if (received.size() <= scan_start)
+	{
+		return NEED_MORE_DATA;
+	}
+
+	memory_input_buffer buffer(received.data(), received.size());
+	std::istream stream(&buffer);
+	decode(decoded, stream, options, resume);
+
+	if (resume->finished)
+	{
+		received.clear();
+		return COMPLETE;
+	}
+
+	// Bytes of the MCUs already decoded are not read again, the next call seeks after them
+	const std::size_t state_offset = resume->state.position.byte_offset;
+	if (resume->saved() && state_offset > scan_start)
+	{
+		received.erase(received.begin() + scan_start, received.begin() + state_offset);
+		resume->state.position.byte_offset = scan_start;
 	}
+
+	return NEED_MORE_DATA;
+}
+
+unsigned int jpeg::incremental_decoder::available_rows() const
+{
+	return resume->available_rows;
 }
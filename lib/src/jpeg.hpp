@@ -6,6 +6,10 @@
 #include "huffman_tables.hpp"
 #include "bitmaps.hpp"
 #include "block_matrix.hpp"
+#include "table_cache.hpp"
+#include "jpeg_diagnostics.hpp"
+#include "decode_stats.hpp"
+#include "mcu_index.hpp"
 
 #include <iostream>
 #include <stdexcept>
@@ -30,13 +34,32 @@ struct quantization_table
 
 private:
 	static cell_index_fast_t zigzag_position(side_index_fast_t x, side_index_fast_t y);
-	unsigned char matrix[CELL_AMOUNT];
+	uint16_t matrix[CELL_AMOUNT];
+
+	void build(const unsigned char *zigzag, bool wide_values);
 
 public:
 	quantization_table(std::istream &stream);
+
+	/**
+	 * Builds the table from its CELL_AMOUNT values in zigzag order, as they are found in a DQT
+	 * segment. If wide_values is set, each value takes 2 bytes, most significant first, as in
+	 * tables for 12 bits samples.
+	 */
+	quantization_table(const unsigned char *zigzag, bool wide_values = false);
 	void print(std::ostream &stream);
 
 	void multiply_block(block_matrix &block) const;
+
+	/**
+	 * Multiplies each cell by its value in the table and by the given scale, in the same pass.
+	 */
+	void multiply_block(block_matrix &block, block_matrix::element_t scale) const;
+
+	/**
+	 * Value that the DC coefficient is multiplied by.
+	 */
+	unsigned int dc_multiplier() const;
 };
 
 template<class TABLE_TYPE>
@@ -53,7 +76,7 @@ struct table_list
 	typedef typename index_t::fast index_fast_t;
 	typedef typename count_t::fast count_fast_t;
 
-	TABLE_TYPE *list[MAX_TABLES];
+	const TABLE_TYPE *list[MAX_TABLES];
 
 	table_list()
 	{
@@ -80,19 +103,28 @@ struct frame_channel : public basic_channel
 {
 	enum
 	{
-		MAX_SAMPLE_ALLOWED = 15
+		MAX_SAMPLE_ALLOWED = 15,
+
+		// Sampling factors allowed by the format, as opposed to what the fields can hold
+		MAX_SAMPLING_FACTOR = 4
 	};
 
 	typedef typename bounded_integer<0, MAX_SAMPLE_ALLOWED>::fast uint_fast4_t;
 
-	quantization_table *table;
+	/**
+	 * Table with the id given in the frame header. Tables may be defined between the frame header
+	 * and the first scan with this channel, so it is NULL until found.
+	 */
+	const quantization_table *table;
+	typename table_list<quantization_table>::index_fast_t table_id;
+
 	uint_fast4_t horizontal_sample;
 	uint_fast4_t vertical_sample;
 };
 
 struct scan_channel : public basic_channel
 {
-	huffman_table *dc_table, *ac_table;
+	const huffman_table *dc_table, *ac_table;
 };
 
 struct basic_info
@@ -106,6 +138,8 @@ struct basic_info
 	typedef bounded_integer<0,MAX_CHANNEL_AMOUNT>::fast channel_count_t;
 
 	channel_count_t channels_amount;
+
+	virtual ~basic_info() { }
 	virtual uint_fast16_t expected_byte_size() const = 0;
 };
 
@@ -116,7 +150,17 @@ struct frame_info : public basic_info
 	uint_fast8_t precision;
 	frame_channel *channels;
 
-	frame_info(std::istream &stream, const table_list<quantization_table> &tables);
+	/**
+	 * True for progressive frames (SOF2), whose coefficients are sent along several scans.
+	 */
+	bool progressive;
+
+	/**
+	 * Throws jpeg::invalid_file_format if there are no channels, or any of them has a sampling
+	 * factor out of the range allowed or a quantization table id beyond the allowed ones.
+	 */
+	frame_info(std::istream &stream, const table_list<quantization_table> &tables, bool progressive = false);
+	~frame_info();
 	virtual uint_fast16_t expected_byte_size() const;
 };
 
@@ -124,9 +168,34 @@ struct scan_info : public basic_info
 {
 	scan_channel *channels;
 
+	/**
+	 * First and last coefficient sent in zigzag order, always 0 and 63 in baseline frames.
+	 */
+	uint_fast8_t spectral_start;
+	uint_fast8_t spectral_end;
+
+	/**
+	 * Successive approximation: the bit position sent in a previous scan for these coefficients
+	 * (0 in the first one) and the bit position sent in this one. Always 0 in baseline frames.
+	 */
+	uint_fast8_t approximation_high;
+	uint_fast8_t approximation_low;
+
+	/**
+	 * Throws jpeg::invalid_file_format if there are no channels.
+	 */
 	scan_info(std::istream &stream, const table_list<huffman_table> &dc_tables,
 			const table_list<huffman_table> &ac_tables);
+	~scan_info();
 	virtual uint_fast16_t expected_byte_size() const;
+
+	/**
+	 * Finds the index of the frame channel for each channel in this scan, by their types.
+	 * Throws jpeg::invalid_file_format if any of them is not in the frame, or refers to an
+	 * undefined DC or AC table when told to need it.
+	 */
+	void find_components(const frame_info &frame, bool needs_dc_table, bool needs_ac_table,
+			unsigned int *components) const;
 };
 
 struct rgb888_color
@@ -140,7 +209,431 @@ namespace jpeg
 {
 	class invalid_file_format { };
 
+	/**
+	 * Thrown when the bitmap for the image cannot be set up, or there is not enough memory to
+	 * decode it.
+	 */
+	class unable_to_allocate { };
+
+	/**
+	 * Thrown when the image is larger than the limits given in decode_options. It is thrown as
+	 * soon as the frame header is read, before allocating anything for the image.
+	 */
+	class limit_exceeded { };
+
+	/**
+	 * Thrown when the region to decode is completely outside the image.
+	 */
+	class invalid_region { };
+
+	/**
+	 * Thrown when the image cannot be decoded into the requested output, like planes for a frame
+	 * whose chrominance is not sampled as any planar format. It is thrown as soon as the frame
+	 * header is read.
+	 */
+	class unsupported_output { };
+
+	/**
+	 * Rectangle within an image, in pixels.
+	 */
+	struct region
+	{
+		unsigned int x;
+		unsigned int y;
+		unsigned int width;
+		unsigned int height;
+
+		region() : x(0), y(0), width(0), height(0) { }
+		region(unsigned int x, unsigned int y, unsigned int width, unsigned int height) :
+				x(x), y(y), width(width), height(height) { }
+
+		bool empty() const
+		{
+			return width == 0 || height == 0;
+		}
+	};
+
+	/**
+	 * Pixel layouts that the decoder stores without going through bitmap::setPixel. Components
+	 * are listed from the first byte of the pixel.
+	 *
+	 * 12 bits images keep their precision in 16 bits components, where each sample is scaled to
+	 * the whole 16 bits range. Formats with 8 bits components take the highest 8 bits of each
+	 * sample.
+	 */
+	enum output_format_e
+	{
+		OUTPUT_DEFAULT, // RGB888, or a single luminance byte for grayscale images. 16 bits each for 12 bits images
+		OUTPUT_RGB888,
+		OUTPUT_BGR888, // As in BMP files
+		OUTPUT_RGBA8888, // Alpha is opaque, as bitmap_component::ALPHA defines it (0)
+		OUTPUT_BGRX8888, // The fourth byte is not a component, and it is set to 0xFF
+		OUTPUT_RGB565, // 16 bits in little endian, blue in the lowest 5 bits and red in the highest 5
+		OUTPUT_RGB161616 // Each component in 2 bytes, little endian
+	};
+
+	/**
+	 * Provides the bitmap where an image is decoded once its size is known.
+	 */
+	class bitmap_allocator
+	{
+	public:
+		virtual ~bitmap_allocator() { }
+
+		/**
+		 * Must set up all fields in the bitmap for an image with the given size. The image will
+		 * be stored in its red, green and blue components. unable_to_allocate must be thrown if
+		 * that is not possible.
+		 *
+		 * Components taking 2 whole bytes, little endian, are stored directly as components
+		 * taking a whole byte are, and keep the precision of 12 bits images.
+		 */
+		virtual void allocate(bitmap &bitmap, unsigned int width, unsigned int height) = 0;
+
+		/**
+		 * Same as allocate, but for grayscale images (a single component). The image will be
+		 * stored in the luminance component if the bitmap has one taking 1 or 2 whole bytes, or
+		 * in its red, green and blue components otherwise, as the default implementation leaves
+		 * them.
+		 */
+		virtual void allocate_gray(bitmap &bitmap, unsigned int width, unsigned int height)
+		{
+			allocate(bitmap, width, height);
+		}
+
+		/**
+		 * Same as allocate, but for CMYK and YCCK images (4 components). The image will be
+		 * stored as ink amounts if the bitmap has cyan, magenta, yellow and black components
+		 * taking a whole byte each, or converted to red, green and blue otherwise, as the default
+		 * implementation leaves them.
+		 */
+		virtual void allocate_cmyk(bitmap &bitmap, unsigned int width, unsigned int height)
+		{
+			allocate(bitmap, width, height);
+		}
+	};
+
+	/**
+	 * Layouts of the planes where YCbCr images are decoded without conversion. Luminance is always
+	 * at full resolution in its own plane, while chrominance keeps the resolution it has in the
+	 * file.
+	 */
+	enum planar_format_e
+	{
+		PLANAR_I444, // Chrominance at full resolution, each component in its own plane
+		PLANAR_I422, // Chrominance at half the width, each component in its own plane
+		PLANAR_I420, // Chrominance at half the width and height, each component in its own plane
+		PLANAR_NV12 // As I420, but both chrominance components interleaved in one plane, blue first
+	};
+
+	/**
+	 * Planes where each component of a YCbCr image is stored as it comes out of the inverse DCT,
+	 * without upsampling nor colour conversion. Chrominance planes take the image size divided by
+	 * their subsampling, rounded up. Samples always take a byte, the highest 8 bits for 12 bits
+	 * images.
+	 */
+	struct planar_image
+	{
+		planar_format_e format;
+		unsigned int width;
+		unsigned int height;
+
+		/**
+		 * Luminance, blue chrominance and red chrominance planes. In NV12, the second one holds
+		 * both chrominance components and the third one is not used.
+		 */
+		unsigned char *planes[3];
+
+		/**
+		 * Bytes from the beginning of a row to the beginning of the next one, in each plane.
+		 */
+		unsigned int strides[3];
+
+		planar_image() : format(PLANAR_I444), width(0), height(0)
+		{
+			for (unsigned int index = 0; index < 3; index++)
+			{
+				planes[index] = NULL;
+				strides[index] = 0;
+			}
+		}
+	};
+
+	/**
+	 * Provides the planes where an image is decoded when decode_options::planar is set.
+	 */
+	class planar_allocator
+	{
+	public:
+		virtual ~planar_allocator() { }
+
+		/**
+		 * Must set up the planes and strides of the image, whose width, height and format are
+		 * already set. The format is the one matching the sampling of the file, and it may only
+		 * be changed from PLANAR_I420 to PLANAR_NV12. unable_to_allocate must be thrown if that
+		 * is not possible.
+		 */
+		virtual void allocate(planar_image &image) = 0;
+	};
+
+	/**
+	 * Receives a reduced image of a progressive frame as soon as all its DC coefficients are read.
+	 */
+	class preview_listener
+	{
+	public:
+		virtual ~preview_listener() { }
+
+		/**
+		 * Called once with the whole image at 1/8 of its size, rounded up, where each pixel is
+		 * the average of an 8x8 block. The bitmap comes from the allocator in decode_options, if
+		 * any. If false is returned, no more scans are read and the preview becomes the decoded
+		 * bitmap.
+		 */
+		virtual bool preview(const bitmap &bitmap) = 0;
+	};
+
+	/**
+	 * Optional settings for decode_image. Default values decode the image in the same way
+	 * decode_image does when no options are given.
+	 */
+	struct decode_options
+	{
+		/**
+		 * Cache where huffman and quantization tables are looked up before building them. It can
+		 * be shared among several decodes, even if they run concurrently. If NULL, tables are
+		 * built for this decode and freed when it finishes.
+		 */
+		table_cache *tables;
+
+		/**
+		 * Receives the segments found and any problem detected while decoding. If NULL, nothing
+		 * is reported and no time is spent preparing the reports.
+		 */
+		diagnostics_sink *diagnostics;
+
+		/**
+		 * Provides the bitmap where the image is decoded, allowing it to be placed anywhere, like
+		 * a mapped file. If NULL, a bitmap in output_format is allocated, where CMYK and YCCK
+		 * images are converted to red, green and blue.
+		 */
+		bitmap_allocator *allocator;
+
+		/**
+		 * Filled with the time spent in each stage of this decode, if not NULL. Any previous
+		 * value is discarded. See decode_stats to know when it is really measured.
+		 */
+		decode_stats *stats;
+
+		/**
+		 * Maximum amount of pixels (width * height) accepted. 0 for no limit.
+		 */
+		uint_fast64_t max_pixels;
+
+		/**
+		 * Maximum amount of bytes that the decoder may allocate for the image, including the
+		 * bitmap unless it is provided by the allocator. 0 for no limit.
+		 */
+		uint_fast64_t memory_budget;
+
+		/**
+		 * Part of the image to decode. The bitmap is allocated with the size of this region,
+		 * clipped to the image. The entropy-coded data is still read up to the last row of MCUs
+		 * within the region, but MCUs outside it are not dequantized, transformed nor converted.
+		 * If empty, the whole image is decoded.
+		 */
+		region crop;
+
+		/**
+		 * If not NULL, it is cleared and filled with the decoder state every
+		 * build_index->rows_per_entry MCU rows. Nothing is added if the stream does not support
+		 * seeking, if the decode starts at a row taken from index, or for progressive frames.
+		 */
+		mcu_index *build_index;
+
+		/**
+		 * If not NULL and built for this same file, the entropy-coded data is read from the last
+		 * indexed row before the crop region instead of from the beginning. The stream must
+		 * support seeking. The file is told by its size and some of its bytes (see
+		 * mcu_index::belongs_to).
+		 */
+		const mcu_index *index;
+
+		/**
+		 * If true, the entropy-coded data is read to the end but nothing is transformed nor
+		 * stored, and the bitmap is left untouched. This checks the whole file or builds an index
+		 * at the cost of huffman decoding alone.
+		 */
+		bool entropy_only;
+
+		/**
+		 * Notified once the DC coefficients of a progressive frame are read, if not NULL. As the
+		 * first scans usually hold them, this gives a usable image after reading a fraction of
+		 * the file. Baseline frames send each block complete, so they have no preview. Ignored when
+		 * entropy_only is set.
+		 */
+		preview_listener *preview;
+
+		/**
+		 * Amount of scans read in progressive frames before reconstructing the image, as if the
+		 * file ended after them. Coefficients not read yet are taken as 0, so the image is
+		 * blurrier the lower this is. 0 reads all of them. Ignored for baseline frames and when
+		 * entropy_only is set.
+		 */
+		unsigned int max_scans;
+
+		/**
+		 * If true, YCbCr images are decoded as grayscale from their luminance, as images with a
+		 * single component are. Chrominance is still read, as it is interleaved with the
+		 * luminance, but never dequantized, transformed nor converted.
+		 */
+		bool luminance_only;
+
+		/**
+		 * If not NULL, the whole image is decoded into the planes it provides, skipping upsampling
+		 * and colour conversion, and the bitmap is left untouched. Only YCbCr frames sampled as
+		 * one of planar_format_e are accepted, otherwise unsupported_output is thrown. crop,
+		 * preview and luminance_only are ignored.
+		 */
+		planar_allocator *planar;
+
+		/**
+		 * Pixel layout of the bitmap allocated when no allocator is given, for the image and its
+		 * preview. Grayscale images are stored in red, green and blue unless it is OUTPUT_DEFAULT.
+		 * Bitmaps given by an allocator are just as fast when their components match any of
+		 * these layouts.
+		 */
+		output_format_e output_format;
+
+		/**
+		 * If true, the image is stored in the bitmap as the orientation tag of its EXIF segment
+		 * says it must be shown, moving each pixel while storing its block instead of rotating
+		 * the bitmap afterwards. The bitmap and its preview have width and height swapped when
+		 * the orientation transposes the image, and crop is a region of the image as shown.
+		 * Only an EXIF segment found before the frame header is taken. Ignored with planar.
+		 */
+		bool apply_orientation;
+
+		decode_options() : tables(NULL), diagnostics(NULL), allocator(NULL), stats(NULL), max_pixels(0),
+				memory_budget(0), build_index(NULL), index(NULL), entropy_only(false), preview(NULL),
+				max_scans(0), luminance_only(false), planar(NULL), output_format(OUTPUT_DEFAULT),
+				apply_orientation(false) { }
+	};
+
 	void decode_image(bitmap &bitmap, std::istream &stream) throw(invalid_file_format);
+	void decode_image(bitmap &bitmap, std::istream &stream, const decode_options &options)
+			throw(invalid_file_format, unable_to_allocate, limit_exceeded, invalid_region, unsupported_output);
+
+	/**
+	 * Reads the whole entropy-coded data to fill the given index, as decode_image does with
+	 * decode_options::entropy_only. The index can be given later to decode_image to decode
+	 * regions starting at the nearest indexed row.
+	 */
+	void build_index(std::istream &stream, mcu_index &index, const decode_options &options = decode_options())
+			throw(invalid_file_format, limit_exceeded, unable_to_allocate);
+
+	/**
+	 * Result of validate.
+	 */
+	struct validation_result
+	{
+		bool valid;
+
+		/**
+		 * Position from the beginning of the stream of the byte where the first error was found,
+		 * or the stream size if it ended before the image. -1 if the file is valid or the stream
+		 * is not able to tell it.
+		 */
+		int_fast64_t error_offset;
+
+		validation_result() : valid(true), error_offset(-1) { }
+	};
+
+	/**
+	 * Checks that the whole file can be decoded, as decode_image does with
+	 * decode_options::entropy_only: all segments are parsed and every block is huffman decoded up
+	 * to the end of image marker, but nothing is dequantized, transformed nor stored. Any crop,
+	 * index or allocator in the options is ignored.
+	 */
+	validation_result validate(std::istream &stream, const decode_options &options = decode_options())
+			throw(limit_exceeded, unable_to_allocate);
+
+	/**
+	 * Decoder state kept between calls to incremental_decoder::feed.
+	 */
+	struct scan_resume;
+
+	/**
+	 * Decodes an image whose bytes arrive in chunks, like an upload, without waiting for the
+	 * whole file. Each call to feed decodes as much as the bytes received so far allow, and
+	 * keeps the decoder state until more bytes arrive.
+	 *
+	 * Baseline frames are stored row by row of MCUs: image returns the bitmap once the frame
+	 * header is received, and available_rows tells how many of its rows are already decoded.
+	 * Only the headers and the entropy-coded data after the last MCUs decoded are kept in memory.
+	 *
+	 * Progressive frames, and scans with more than mcu_index::MAX_CHANNELS channels, are decoded
+	 * once the whole file is received (see decode_options::preview for an earlier image).
+	 */
+	class incremental_decoder
+	{
+	public:
+		enum status_e
+		{
+			NEED_MORE_DATA,
+			COMPLETE
+		};
+
+	private:
+		decode_options options;
+		table_cache tables;
+		std::vector<char, allocation::container_allocator<char> > received;
+
+		/**
+		 * Offset of the first segment not received completely yet, and of the entropy-coded data
+		 * once the scan header of a baseline frame is received (0 before).
+		 */
+		std::size_t walked;
+		std::size_t scan_start;
+		bool in_entropy_data;
+		bool whole_file;
+
+		scan_resume *resume;
+		bitmap decoded;
+
+		// Not copyable, the state is owned
+		incremental_decoder(const incremental_decoder &);
+		incremental_decoder &operator=(const incremental_decoder &);
+
+	public:
+		/**
+		 * index, build_index, planar and apply_orientation in the options are ignored.
+		 */
+		incremental_decoder(const decode_options &options = decode_options());
+		~incremental_decoder();
+
+		/**
+		 * Adds the following bytes of the file and decodes the rows they complete. NEED_MORE_DATA
+		 * is returned until the end of image is read, so a file completely received by then is
+		 * truncated. Bytes given after COMPLETE is returned are ignored. Once an exception is
+		 * thrown, the decoder must not be fed again.
+		 */
+		status_e feed(const unsigned char *bytes, std::size_t size)
+				throw(invalid_file_format, unable_to_allocate, limit_exceeded, invalid_region);
+
+		/**
+		 * Bitmap where the image is decoded, not set up until the frame header is received.
+		 */
+		const bitmap &image() const
+		{
+			return decoded;
+		}
+
+		/**
+		 * Rows of the bitmap, from the top, that are completely decoded.
+		 */
+		unsigned int available_rows() const;
+	};
 }
 
 #endif /* JPEG_HPP_ */
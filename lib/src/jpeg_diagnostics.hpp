@@ -0,0 +1,96 @@
+
+#ifndef JPEG_DIAGNOSTICS_HPP_
+#define JPEG_DIAGNOSTICS_HPP_
+
+#include <stdint.h>
+
+struct frame_info;
+struct scan_info;
+
+namespace jpeg
+{
+	/**
+	 * Read-only reference to bytes owned by the decoder. It is only valid during the call that
+	 * receives it and must be copied if it is required later.
+	 */
+	struct byte_span
+	{
+		const unsigned char *data;
+		uint_fast32_t size;
+
+		byte_span() : data(NULL), size(0) { }
+	};
+
+	/**
+	 * Describes a segment found while decoding a JPEG file.
+	 */
+	struct diagnostic_event
+	{
+		enum warning_e
+		{
+			NO_WARNING = 0,
+			INVALID_QUANTIZATION_TABLE_ID,
+			INVALID_QUANTIZATION_TABLE_SIZE,
+			INVALID_HUFFMAN_TABLE_SIZE,
+			INVALID_FRAME_SIZE,
+			INVALID_SCAN_SIZE,
+			INVALID_JFIF,
+			INVALID_RESTART_INTERVAL_SIZE,
+			UNSUPPORTED_SEGMENT, // The segment has been ignored
+			INVALID_ADOBE, // APP14 segment too short or with an unknown transform, taken as absent
+			INVALID_EXIF // APP1 EXIF segment whose first IFD cannot be read, taken as not oriented
+		};
+
+		/**
+		 * Marker type for the segment, as defined in jpeg_marker::jpeg_marker_e
+		 */
+		uint_fast8_t marker;
+
+		/**
+		 * Position of the marker from the beginning of the stream or -1 if the stream is not
+		 * able to tell it.
+		 */
+		int_fast64_t offset;
+
+		/**
+		 * Segment size as it is written in the file, including the 2 bytes of the size itself.
+		 */
+		uint_fast16_t size;
+
+		warning_e warning;
+
+		/**
+		 * Segment content after the size for comments and application (APPn) segments. Empty for
+		 * any other segment.
+		 */
+		byte_span payload;
+
+		/**
+		 * Parsed frame for START_OF_FRAME markers, NULL otherwise.
+		 */
+		const frame_info *frame;
+
+		/**
+		 * Parsed scan header for START_OF_SCAN markers, NULL otherwise.
+		 */
+		const scan_info *scan;
+
+		diagnostic_event(uint_fast8_t marker, int_fast64_t offset, uint_fast16_t size) :
+				marker(marker), offset(offset), size(size), warning(NO_WARNING), frame(NULL), scan(NULL)
+		{ }
+	};
+
+	/**
+	 * Receives the segments found by decode_image. The decoder does not write anything to any
+	 * console, so installing a sink is the only way to know about comments, application data or
+	 * anything wrong found in the file that did not prevent decoding it.
+	 */
+	class diagnostics_sink
+	{
+	public:
+		virtual ~diagnostics_sink() { }
+		virtual void notify(const diagnostic_event &event) = 0;
+	};
+}
+
+#endif /* JPEG_DIAGNOSTICS_HPP_ */
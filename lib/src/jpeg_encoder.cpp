@@ -0,0 +1,950 @@
+
+#include "jpeg_encoder.hpp"
+#include "jpeg_markers.hpp"
+#include "block_matrix.hpp"
+#include "huffman_tables.hpp"
+
+#include <vector>
+#include <cmath>
+
+namespace
+{
+
+/**
+ * Example quantization tables from the JPEG standard (Annex K.1), in natural order.
+ */
+const unsigned char luminance_quantization[block_matrix::CELLS] =
+{
+	16, 11, 10, 16, 24, 40, 51, 61,
+	12, 12, 14, 19, 26, 58, 60, 55,
+	14, 13, 16, 24, 40, 57, 69, 56,
+	14, 17, 22, 29, 51, 87, 80, 62,
+	18, 22, 37, 56, 68, 109, 103, 77,
+	24, 35, 55, 64, 81, 104, 113, 92,
+	49, 64, 78, 87, 103, 121, 120, 101,
+	72, 92, 95, 98, 112, 100, 103, 99
+};
+
+const unsigned char chrominance_quantization[block_matrix::CELLS] =
+{
+	17, 18, 24, 47, 99, 99, 99, 99,
+	18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99,
+	47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99
+};
+
+/**
+ * Huffman tables from the JPEG standard (Annex K.3), defined as they are written in a DHT
+ * segment: the amount of codes for each size followed by the symbols.
+ */
+const unsigned char dc_luminance_definition[] =
+{
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+const unsigned char dc_chrominance_definition[] =
+{
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+const unsigned char ac_luminance_definition[] =
+{
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+	0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+	0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+	0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA
+};
+
+const unsigned char ac_chrominance_definition[] =
+{
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+	0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+	0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+	0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+	0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+	0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA
+};
+
+enum
+{
+	LUMINANCE = 0,
+	CHROMINANCE = 1,
+	COMPONENTS = 3,
+
+	// Bytes kept before writing them into the stream
+	OUTPUT_BUFFER_SIZE = 1 << 16
+};
+
+/**
+ * Quantization table scaled for the quality requested, in natural order.
+ */
+struct scaled_quantization
+{
+	unsigned char values[block_matrix::CELLS];
+
+	scaled_quantization(const unsigned char *base, unsigned int quality)
+	{
+		const unsigned int scale = (quality < 50)? 5000 / quality : 200 - quality * 2;
+		for (unsigned int index = 0; index < block_matrix::CELLS; index++)
+		{
+			const unsigned int value = (base[index] * scale + 50) / 100;
+			values[index] = (value < 1)? 1 : (value > 255)? 255 : value;
+		}
+	}
+};
+
+/**
+ * Code and size for each symbol, computed as the decoder does from the table definition.
+ */
+struct huffman_codes
+{
+	uint_fast16_t codes[256];
+	uint_fast8_t sizes[256];
+
+	huffman_codes(const unsigned char *definition)
+	{
+		for (unsigned int symbol = 0; symbol < 256; symbol++)
+		{
+			sizes[symbol] = 0;
+		}
+
+		const unsigned char *symbols = definition + huffman_table::MAX_WORD_SIZE;
+		uint_fast16_t code = 0;
+		for (unsigned int size = 1; size <= huffman_table::MAX_WORD_SIZE; size++)
+		{
+			for (unsigned int index = 0; index < definition[size - 1]; index++)
+			{
+				codes[*symbols] = code++;
+				sizes[*symbols++] = size;
+			}
+			code <<= 1;
+		}
+	}
+};
+
+/**
+ * Writes the entropy coded data, inserting a 0x00 after each 0xFF.
+ */
+class bit_writer
+{
+	std::ostream &stream;
+	std::vector<unsigned char> buffer;
+	uint_fast32_t bits;
+	unsigned int bit_amount;
+
+	void put_byte(unsigned char value)
+	{
+		buffer.push_back(value);
+		if (value == jpeg_marker::MARKER)
+		{
+			buffer.push_back(0);
+		}
+	}
+
+public:
+	bit_writer(std::ostream &stream) : stream(stream), bits(0), bit_amount(0)
+	{
+		buffer.reserve(OUTPUT_BUFFER_SIZE + 2);
+	}
+
+	void write(uint_fast32_t value, unsigned int size)
+	{
+		bits = (bits << size) | (value & ((1 << size) - 1));
+		bit_amount += size;
+		while (bit_amount >= 8)
+		{
+			bit_amount -= 8;
+			put_byte(bits >> bit_amount);
+		}
+
+		if (buffer.size() >= OUTPUT_BUFFER_SIZE)
+		{
+			flush();
+		}
+	}
+
+	/**
+	 * Completes the current byte with 1s, as the standard requires before any marker.
+	 */
+	void align()
+	{
+		if (bit_amount > 0)
+		{
+			write(0xFF, 8 - bit_amount);
+		}
+	}
+
+	void write_marker(unsigned char marker)
+	{
+		buffer.push_back(jpeg_marker::MARKER);
+		buffer.push_back(marker);
+	}
+
+	void flush()
+	{
+		stream.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+		buffer.clear();
+	}
+};
+
+/**
+ * Number of bits needed to write the given value as the JPEG standard does.
+ */
+inline unsigned int magnitude_category(int value)
+{
+	unsigned int magnitude = (value < 0)? -value : value;
+	unsigned int category = 0;
+	while (magnitude > 0)
+	{
+		category++;
+		magnitude >>= 1;
+	}
+
+	return category;
+}
+
+inline void write_number(bit_writer &writer, int value, unsigned int category)
+{
+	// Negative values are written as its one's complement
+	writer.write((value < 0)? value - 1 : value, category);
+}
+
+/**
+ * Stores in values the quantized DCT coefficients of the block, in zigzag order.
+ */
+void quantize_block(const block_matrix &block, const scaled_quantization &quantization, int16_t *values)
+{
+	const block_matrix dct = block.extract_dct();
+
+	for (unsigned int index = 0; index < block_matrix::CELLS; index++)
+	{
+		const unsigned int position = block_matrix::zigzag_to_real[index];
+		const int value = static_cast<int>(floor(dct.get(position % block_matrix::SIDE,
+				position / block_matrix::SIDE) / quantization.values[position] + 0.5));
+		values[index] = (value < -1023)? -1023 : (value > 1023)? 1023 : value;
+	}
+}
+
+void encode_block(bit_writer &writer, const int16_t *values, const huffman_codes &dc_codes,
+		const huffman_codes &ac_codes, int &dc_prediction)
+{
+	const int difference = values[0] - dc_prediction;
+	dc_prediction = values[0];
+
+	unsigned int category = magnitude_category(difference);
+	writer.write(dc_codes.codes[category], dc_codes.sizes[category]);
+	write_number(writer, difference, category);
+
+	unsigned int zeroes = 0;
+	for (unsigned int index = 1; index < block_matrix::CELLS; index++)
+	{
+		const int value = values[index];
+		if (value == 0)
+		{
+			zeroes++;
+			continue;
+		}
+
+		// Runs longer than 15 zeroes are written as ZRL symbols
+		while (zeroes > 15)
+		{
+			writer.write(ac_codes.codes[0xF0], ac_codes.sizes[0xF0]);
+			zeroes -= 16;
+		}
+
+		category = magnitude_category(value);
+		const unsigned int symbol = (zeroes << 4) | category;
+		writer.write(ac_codes.codes[symbol], ac_codes.sizes[symbol]);
+		write_number(writer, value, category);
+		zeroes = 0;
+	}
+
+	if (zeroes > 0)
+	{
+		// End of block
+		writer.write(ac_codes.codes[0], ac_codes.sizes[0]);
+	}
+}
+
+/**
+ * Divides by 2^bits rounding towards minus infinity, as successive approximation requires.
+ */
+inline int shift_right(int value, unsigned int bits)
+{
+	return (value >= 0)? value >> bits : ~(~value >> bits);
+}
+
+/**
+ * Scan of a progressive file: a band of coefficients (spectral selection) for one component,
+ * or the DC coefficients for all of them, without the bits below approximation_low. If
+ * approximation_high is not 0, only the bit at approximation_low is sent for coefficients
+ * already sent before.
+ */
+struct progressive_scan
+{
+	unsigned int first_component;
+	unsigned int components_amount;
+	unsigned int spectral_start;
+	unsigned int spectral_end;
+	unsigned int approximation_high;
+	unsigned int approximation_low;
+};
+
+/**
+ * Single scan of a baseline file: all components, spectral selection from 0 to 63 and no
+ * successive approximation.
+ */
+const progressive_scan baseline_scan = {0, 3, 0, 63, 0, 0};
+
+/**
+ * Same scans libjpeg writes by default for YCbCr images.
+ */
+const progressive_scan progressive_scans[] =
+{
+	{0, 3, 0, 0, 0, 1},
+	{0, 1, 1, 5, 0, 2},
+	{2, 1, 1, 63, 0, 1},
+	{1, 1, 1, 63, 0, 1},
+	{0, 1, 6, 63, 0, 2},
+	{0, 1, 1, 63, 2, 1},
+	{0, 3, 0, 0, 1, 0},
+	{2, 1, 1, 63, 1, 0},
+	{1, 1, 1, 63, 1, 0},
+	{0, 1, 1, 63, 1, 0}
+};
+
+void encode_dc_first(bit_writer &writer, const int16_t *values, unsigned int approximation_low,
+		const huffman_codes &dc_codes, int &dc_prediction)
+{
+	const int value = shift_right(values[0], approximation_low);
+	const int difference = value - dc_prediction;
+	dc_prediction = value;
+
+	const unsigned int category = magnitude_category(difference);
+	writer.write(dc_codes.codes[category], dc_codes.sizes[category]);
+	write_number(writer, difference, category);
+}
+
+/**
+ * Sends each band as encode_block does, but ending every block with its own EOB symbol, as the
+ * standard tables have no symbol for longer runs of empty blocks.
+ */
+void encode_ac_first(bit_writer &writer, const int16_t *values, const progressive_scan &scan,
+		const huffman_codes &ac_codes)
+{
+	unsigned int zeroes = 0;
+	for (unsigned int index = scan.spectral_start; index <= scan.spectral_end; index++)
+	{
+		const int magnitude = ((values[index] < 0)? -values[index] : values[index]) >> scan.approximation_low;
+		if (magnitude == 0)
+		{
+			zeroes++;
+			continue;
+		}
+
+		while (zeroes > 15)
+		{
+			writer.write(ac_codes.codes[0xF0], ac_codes.sizes[0xF0]);
+			zeroes -= 16;
+		}
+
+		const unsigned int category = magnitude_category(magnitude);
+		const unsigned int symbol = (zeroes << 4) | category;
+		writer.write(ac_codes.codes[symbol], ac_codes.sizes[symbol]);
+		write_number(writer, (values[index] < 0)? -magnitude : magnitude, category);
+		zeroes = 0;
+	}
+
+	if (zeroes > 0)
+	{
+		writer.write(ac_codes.codes[0], ac_codes.sizes[0]);
+	}
+}
+
+/**
+ * Sends the bit at approximation_low of each coefficient in the band. Coefficients that were
+ * 0 until now are sent with their sign, as symbols of size 1, and the bits of those already
+ * sent are appended after the next symbol (Annex G.1.2.3 of the standard).
+ */
+void encode_ac_refinement(bit_writer &writer, const int16_t *values, const progressive_scan &scan,
+		const huffman_codes &ac_codes)
+{
+	unsigned int magnitudes[block_matrix::CELLS];
+	unsigned int last_new = 0;
+	for (unsigned int index = scan.spectral_start; index <= scan.spectral_end; index++)
+	{
+		magnitudes[index] = ((values[index] < 0)? -values[index] : values[index]) >> scan.approximation_low;
+		if (magnitudes[index] == 1)
+		{
+			last_new = index;
+		}
+	}
+
+	unsigned char pending_bits[block_matrix::CELLS];
+	unsigned int pending_amount = 0;
+	unsigned int zeroes = 0;
+	for (unsigned int index = scan.spectral_start; index <= scan.spectral_end; index++)
+	{
+		const unsigned int magnitude = magnitudes[index];
+		if (magnitude == 0)
+		{
+			zeroes++;
+			continue;
+		}
+
+		// Zeroes after the last new coefficient are left for the EOB
+		while (zeroes > 15 && index <= last_new)
+		{
+			writer.write(ac_codes.codes[0xF0], ac_codes.sizes[0xF0]);
+			for (unsigned int bit = 0; bit < pending_amount; bit++)
+			{
+				writer.write(pending_bits[bit], 1);
+			}
+			pending_amount = 0;
+			zeroes -= 16;
+		}
+
+		if (magnitude > 1)
+		{
+			pending_bits[pending_amount++] = magnitude & 1;
+			continue;
+		}
+
+		const unsigned int symbol = (zeroes << 4) | 1;
+		writer.write(ac_codes.codes[symbol], ac_codes.sizes[symbol]);
+		writer.write((values[index] < 0)? 0 : 1, 1);
+		for (unsigned int bit = 0; bit < pending_amount; bit++)
+		{
+			writer.write(pending_bits[bit], 1);
+		}
+		pending_amount = 0;
+		zeroes = 0;
+	}
+
+	if (zeroes > 0 || pending_amount > 0)
+	{
+		writer.write(ac_codes.codes[0], ac_codes.sizes[0]);
+		for (unsigned int bit = 0; bit < pending_amount; bit++)
+		{
+			writer.write(pending_bits[bit], 1);
+		}
+	}
+}
+
+/**
+ * Quantized coefficients of a whole component, kept to write the scans of a progressive file.
+ * It covers the grid of MCUs, but scans with only this component include just the blocks within
+ * the component size.
+ */
+struct coefficient_plane
+{
+	unsigned int blocks_per_row;
+	unsigned int h_sample;
+	unsigned int v_sample;
+	unsigned int visible_blocks_per_row;
+	unsigned int visible_block_rows;
+	std::vector<int16_t> values;
+
+	int16_t *block(unsigned int column, unsigned int row)
+	{
+		return values.data() + (static_cast<std::size_t>(row) * blocks_per_row + column) * block_matrix::CELLS;
+	}
+};
+
+void encode_progressive_block(bit_writer &writer, const int16_t *values, const progressive_scan &scan,
+		const huffman_codes &dc_codes, const huffman_codes &ac_codes, int &dc_prediction)
+{
+	if (scan.spectral_start != 0)
+	{
+		if (scan.approximation_high == 0)
+		{
+			encode_ac_first(writer, values, scan, ac_codes);
+		}
+		else
+		{
+			encode_ac_refinement(writer, values, scan, ac_codes);
+		}
+	}
+	else if (scan.approximation_high == 0)
+	{
+		encode_dc_first(writer, values, scan.approximation_low, dc_codes, dc_prediction);
+	}
+	else
+	{
+		writer.write(shift_right(values[0], scan.approximation_low) & 1, 1);
+	}
+}
+
+void append_big_endian(std::vector<unsigned char> &segment, unsigned int value, unsigned int bytes)
+{
+	while (bytes-- > 0)
+	{
+		segment.push_back((value >> (bytes * 8)) & 0xFF);
+	}
+}
+
+/**
+ * Writes a marker segment whose content, without the size, is in payload.
+ */
+void write_segment(std::ostream &stream, unsigned char marker, const std::vector<unsigned char> &payload)
+{
+	std::vector<unsigned char> segment;
+	segment.push_back(jpeg_marker::MARKER);
+	segment.push_back(marker);
+	append_big_endian(segment, payload.size() + 2, 2);
+	segment.insert(segment.end(), payload.begin(), payload.end());
+	stream.write(reinterpret_cast<const char *>(segment.data()), segment.size());
+}
+
+void write_scan_header(std::ostream &stream, const progressive_scan &scan)
+{
+	std::vector<unsigned char> payload;
+	payload.push_back(scan.components_amount);
+	for (unsigned int component = scan.first_component;
+			component < scan.first_component + scan.components_amount; component++)
+	{
+		payload.push_back(component + 1);
+		payload.push_back((component == 0)? 0x00 : 0x11);
+	}
+
+	payload.push_back(scan.spectral_start);
+	payload.push_back(scan.spectral_end);
+	payload.push_back((scan.approximation_high << 4) | scan.approximation_low);
+	write_segment(stream, jpeg_marker::START_OF_SCAN, payload);
+}
+
+/**
+ * Writes everything before the first scan. Grayscale files, with a single component, only get the
+ * luminance tables.
+ */
+void write_headers(std::ostream &stream, unsigned int width, unsigned int height,
+		const scaled_quantization * const *quantizations, unsigned int components, unsigned int h_sample,
+		unsigned int v_sample, unsigned int restart_interval, bool progressive)
+{
+	const unsigned int tables = (components == 1)? 1 : 2;
+
+	const unsigned char start_of_image[] = {jpeg_marker::MARKER, jpeg_marker::START_OF_IMAGE};
+	stream.write(reinterpret_cast<const char *>(start_of_image), sizeof(start_of_image));
+
+	// JFIF 1.01, no units, aspect ratio 1:1 and no thumbnail
+	const unsigned char jfif_content[] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+	write_segment(stream, jpeg_marker::JFIF,
+			std::vector<unsigned char>(jfif_content, jfif_content + sizeof(jfif_content)));
+
+	std::vector<unsigned char> payload;
+	for (unsigned int table = 0; table < tables; table++)
+	{
+		payload.push_back(table);
+		for (unsigned int index = 0; index < block_matrix::CELLS; index++)
+		{
+			payload.push_back(quantizations[table]->values[block_matrix::zigzag_to_real[index]]);
+		}
+	}
+	write_segment(stream, jpeg_marker::QUANTIZATION_TABLE, payload);
+
+	payload.clear();
+	payload.push_back(8);
+	append_big_endian(payload, height, 2);
+	append_big_endian(payload, width, 2);
+	payload.push_back(components);
+	for (unsigned int component = 0; component < components; component++)
+	{
+		payload.push_back(component + 1);
+		payload.push_back((component == 0)? (h_sample << 4) | v_sample : 0x11);
+		payload.push_back((component == 0)? LUMINANCE : CHROMINANCE);
+	}
+	write_segment(stream, progressive? jpeg_marker::START_OF_FRAME_PROGRESSIVE_DCT :
+			jpeg_marker::START_OF_FRAME_BASELINE_DCT, payload);
+
+	const struct
+	{
+		unsigned char table_ref;
+		const unsigned char *definition;
+		unsigned int size;
+	} huffman_tables[] = {
+		{0x00, dc_luminance_definition, sizeof(dc_luminance_definition)},
+		{0x10, ac_luminance_definition, sizeof(ac_luminance_definition)},
+		{0x01, dc_chrominance_definition, sizeof(dc_chrominance_definition)},
+		{0x11, ac_chrominance_definition, sizeof(ac_chrominance_definition)}
+	};
+
+	payload.clear();
+	for (unsigned int index = 0; index < tables * 2; index++)
+	{
+		payload.push_back(huffman_tables[index].table_ref);
+		payload.insert(payload.end(), huffman_tables[index].definition,
+				huffman_tables[index].definition + huffman_tables[index].size);
+	}
+	write_segment(stream, jpeg_marker::HUFFMAN_TABLE, payload);
+
+	if (restart_interval != 0)
+	{
+		payload.clear();
+		append_big_endian(payload, restart_interval, 2);
+		write_segment(stream, jpeg_marker::RESTART_INTERVAL, payload);
+	}
+}
+
+/**
+ * Writes all scans in progressive_scans for the given amount of components, skipping those for
+ * components not present. Scans with several components go through the grid of MCUs, while the
+ * rest go through the blocks of their component in raster order.
+ */
+void write_progressive_scans(std::ostream &stream, bit_writer &writer, coefficient_plane *planes,
+		unsigned int components, unsigned int mcu_columns, unsigned int mcu_rows, unsigned int restart_interval,
+		const huffman_codes * const *dc_codes, const huffman_codes * const *ac_codes)
+{
+	for (unsigned int scan_index = 0; scan_index < sizeof(progressive_scans) / sizeof(progressive_scans[0]); scan_index++)
+	{
+		if (progressive_scans[scan_index].first_component >= components)
+		{
+			continue;
+		}
+
+		progressive_scan scan = progressive_scans[scan_index];
+		if (scan.first_component + scan.components_amount > components)
+		{
+			scan.components_amount = components - scan.first_component;
+		}
+
+		writer.flush();
+		write_scan_header(stream, scan);
+
+		const bool interleaved = scan.components_amount > 1;
+		coefficient_plane &first = planes[scan.first_component];
+		const unsigned int units = interleaved? mcu_columns * mcu_rows :
+				first.visible_blocks_per_row * first.visible_block_rows;
+
+		int dc_predictions[COMPONENTS] = {0, 0, 0};
+		unsigned int units_to_restart = restart_interval;
+		unsigned int restart_index = 0;
+		for (unsigned int unit = 0; unit < units; unit++)
+		{
+			if (interleaved)
+			{
+				const unsigned int mcu_column = unit % mcu_columns;
+				const unsigned int mcu_row = unit / mcu_columns;
+				for (unsigned int component = scan.first_component;
+						component < scan.first_component + scan.components_amount; component++)
+				{
+					coefficient_plane &plane = planes[component];
+					for (unsigned int v_block = 0; v_block < plane.v_sample; v_block++)
+					{
+						for (unsigned int h_block = 0; h_block < plane.h_sample; h_block++)
+						{
+							encode_progressive_block(writer, plane.block(mcu_column * plane.h_sample + h_block,
+									mcu_row * plane.v_sample + v_block), scan, *dc_codes[component],
+									*ac_codes[component], dc_predictions[component]);
+						}
+					}
+				}
+			}
+			else
+			{
+				encode_progressive_block(writer, first.block(unit % first.visible_blocks_per_row,
+						unit / first.visible_blocks_per_row), scan, *dc_codes[scan.first_component],
+						*ac_codes[scan.first_component], dc_predictions[scan.first_component]);
+			}
+
+			if (restart_interval != 0 && --units_to_restart == 0 && unit != units - 1)
+			{
+				writer.align();
+				writer.write_marker(jpeg_marker::RESTART_BASE + (restart_index++ & 7));
+				for (unsigned int component = 0; component < COMPONENTS; component++)
+				{
+					dc_predictions[component] = 0;
+				}
+				units_to_restart = restart_interval;
+			}
+		}
+
+		writer.align();
+	}
+}
+
+/**
+ * Reads the red, green and blue bytes from any bitmap.
+ */
+class bitmap_scanline_source : public jpeg::scanline_source
+{
+	const bitmap &image;
+	bool byte_aligned;
+	unsigned int offsets[3];
+	int indexes[3];
+	std::vector<bitmap::component_value_t> values;
+
+public:
+	bitmap_scanline_source(const bitmap &image);
+	virtual void read_scanline(unsigned int row, unsigned char *rgb);
+};
+
+bitmap_scanline_source::bitmap_scanline_source(const bitmap &image) : image(image),
+		values(image.components_amount)
+{
+	const bitmap_component::type_e types[] = {bitmap_component::RED, bitmap_component::GREEN,
+			bitmap_component::BLUE};
+
+	byte_aligned = true;
+	for (unsigned int position = 0; position < 3; position++)
+	{
+		unsigned int index;
+		indexes[position] = image.find_component(types[position], index)? index : -1;
+		byte_aligned = byte_aligned && image.find_byte_component(types[position], offsets[position]);
+	}
+}
+
+void bitmap_scanline_source::read_scanline(unsigned int row, unsigned char *rgb)
+{
+	if (byte_aligned)
+	{
+		const unsigned char *pixel = image.scanline(row);
+		for (unsigned int column = 0; column < image.width; column++)
+		{
+			*rgb++ = pixel[offsets[0]];
+			*rgb++ = pixel[offsets[1]];
+			*rgb++ = pixel[offsets[2]];
+			pixel += image.bytes_per_pixel;
+		}
+
+		return;
+	}
+
+	for (unsigned int column = 0; column < image.width; column++)
+	{
+		image.getPixel(column, row, values.data());
+		for (unsigned int position = 0; position < 3; position++)
+		{
+			*rgb++ = (indexes[position] >= 0)?
+					static_cast<unsigned char>(values[indexes[position]] * 255 + 0.5) : 0;
+		}
+	}
+}
+
+}
+
+void jpeg::encode_image(scanline_source &source, unsigned int width, unsigned int height,
+		std::ostream &stream, const encode_options &options) throw(std::invalid_argument)
+{
+	if (width == 0 || height == 0 || width > 0xFFFF || height > 0xFFFF)
+	{
+		throw std::invalid_argument("Invalid image size");
+	}
+
+	if (options.quality < 1 || options.quality > 100 || options.restart_interval > 0xFFFF)
+	{
+		throw std::invalid_argument("Invalid encode options");
+	}
+
+	// A single component has a block per MCU, whatever its sampling
+	const unsigned int components = options.grayscale? 1 : COMPONENTS;
+	const unsigned int h_sample = (options.grayscale || options.sampling == SAMPLING_444)? 1 : 2;
+	const unsigned int v_sample = (!options.grayscale && options.sampling == SAMPLING_420)? 2 : 1;
+	const unsigned int mcu_width = block_matrix::SIDE * h_sample;
+	const unsigned int mcu_height = block_matrix::SIDE * v_sample;
+	const unsigned int mcu_columns = (width + mcu_width - 1) / mcu_width;
+	const unsigned int mcu_rows = (height + mcu_height - 1) / mcu_height;
+
+	const scaled_quantization luminance(luminance_quantization, options.quality);
+	const scaled_quantization chrominance(chrominance_quantization, options.quality);
+	const scaled_quantization * const quantizations[] = {&luminance, &chrominance};
+	write_headers(stream, width, height, quantizations, components, h_sample, v_sample, options.restart_interval,
+			options.progressive);
+	if (!options.progressive)
+	{
+		progressive_scan scan = baseline_scan;
+		scan.components_amount = components;
+		write_scan_header(stream, scan);
+	}
+
+	const huffman_codes dc_luminance(dc_luminance_definition);
+	const huffman_codes ac_luminance(ac_luminance_definition);
+	const huffman_codes dc_chrominance(dc_chrominance_definition);
+	const huffman_codes ac_chrominance(ac_chrominance_definition);
+
+	// Progressive files keep all coefficients until every block is quantized
+	coefficient_plane coefficients[COMPONENTS];
+	if (options.progressive)
+	{
+		for (unsigned int component = 0; component < components; component++)
+		{
+			coefficient_plane &plane = coefficients[component];
+			plane.h_sample = (component == 0)? h_sample : 1;
+			plane.v_sample = (component == 0)? v_sample : 1;
+			plane.blocks_per_row = mcu_columns * plane.h_sample;
+
+			const unsigned int component_width = (width * plane.h_sample + h_sample - 1) / h_sample;
+			const unsigned int component_height = (height * plane.v_sample + v_sample - 1) / v_sample;
+			plane.visible_blocks_per_row = (component_width + block_matrix::SIDE - 1) / block_matrix::SIDE;
+			plane.visible_block_rows = (component_height + block_matrix::SIDE - 1) / block_matrix::SIDE;
+			plane.values.resize(static_cast<std::size_t>(plane.blocks_per_row) * mcu_rows * plane.v_sample *
+					block_matrix::CELLS);
+		}
+	}
+	int16_t block_values[block_matrix::CELLS];
+
+	// A whole row of MCUs is converted to YCbCr (centered on 0) before encoding it. Pixels out
+	// of the image repeat the last column and row.
+	const unsigned int plane_width = mcu_columns * mcu_width;
+	std::vector<float> planes[COMPONENTS];
+	for (unsigned int component = 0; component < components; component++)
+	{
+		planes[component].resize(plane_width * mcu_height);
+	}
+
+	std::vector<unsigned char> rgb(width * 3);
+	unsigned int last_read_row = 0;
+	source.read_scanline(0, rgb.data());
+
+	bit_writer writer(stream);
+	int dc_predictions[COMPONENTS] = {0, 0, 0};
+	unsigned int mcus_to_restart = options.restart_interval;
+	unsigned int restart_index = 0;
+
+	for (unsigned int mcu_row = 0; mcu_row < mcu_rows; mcu_row++)
+	{
+		for (unsigned int line = 0; line < mcu_height; line++)
+		{
+			const unsigned int row = mcu_row * mcu_height + line;
+			if (row < height && row != last_read_row)
+			{
+				source.read_scanline(row, rgb.data());
+				last_read_row = row;
+			}
+
+			float *y_line = planes[0].data() + line * plane_width;
+			for (unsigned int column = 0; column < plane_width; column++)
+			{
+				const unsigned char *pixel = rgb.data() + ((column < width)? column : width - 1) * 3;
+				y_line[column] = 0.299f * pixel[0] + 0.587f * pixel[1] + 0.114f * pixel[2] - 128;
+			}
+
+			if (components == 1)
+			{
+				continue;
+			}
+
+			float *cb_line = planes[1].data() + line * plane_width;
+			float *cr_line = planes[2].data() + line * plane_width;
+			for (unsigned int column = 0; column < plane_width; column++)
+			{
+				const unsigned char *pixel = rgb.data() + ((column < width)? column : width - 1) * 3;
+				const float red = pixel[0];
+				const float green = pixel[1];
+				const float blue = pixel[2];
+
+				cb_line[column] = -0.168736f * red - 0.331264f * green + 0.5f * blue;
+				cr_line[column] = 0.5f * red - 0.418688f * green - 0.081312f * blue;
+			}
+		}
+
+		for (unsigned int mcu_column = 0; mcu_column < mcu_columns; mcu_column++)
+		{
+			const unsigned int left = mcu_column * mcu_width;
+			block_matrix block;
+
+			for (unsigned int v_block = 0; v_block < v_sample; v_block++)
+			{
+				for (unsigned int h_block = 0; h_block < h_sample; h_block++)
+				{
+					const float *origin = planes[0].data() + v_block * block_matrix::SIDE * plane_width +
+							left + h_block * block_matrix::SIDE;
+					for (unsigned int y = 0; y < block_matrix::SIDE; y++)
+					{
+						for (unsigned int x = 0; x < block_matrix::SIDE; x++)
+						{
+							block.set(x, y, origin[y * plane_width + x]);
+						}
+					}
+
+					int16_t *values = options.progressive? coefficients[0].block(mcu_column * h_sample + h_block,
+							mcu_row * v_sample + v_block) : block_values;
+					quantize_block(block, luminance, values);
+					if (!options.progressive)
+					{
+						encode_block(writer, values, dc_luminance, ac_luminance, dc_predictions[0]);
+					}
+				}
+			}
+
+			// Chrominance blocks take the average of the pixels they cover
+			for (unsigned int component = 1; component < components; component++)
+			{
+				const float *origin = planes[component].data() + left;
+				for (unsigned int y = 0; y < block_matrix::SIDE; y++)
+				{
+					for (unsigned int x = 0; x < block_matrix::SIDE; x++)
+					{
+						float sum = 0;
+						for (unsigned int sample_y = 0; sample_y < v_sample; sample_y++)
+						{
+							for (unsigned int sample_x = 0; sample_x < h_sample; sample_x++)
+							{
+								sum += origin[(y * v_sample + sample_y) * plane_width + x * h_sample + sample_x];
+							}
+						}
+						block.set(x, y, sum / (h_sample * v_sample));
+					}
+				}
+
+				int16_t *values = options.progressive? coefficients[component].block(mcu_column, mcu_row) :
+						block_values;
+				quantize_block(block, chrominance, values);
+				if (!options.progressive)
+				{
+					encode_block(writer, values, dc_chrominance, ac_chrominance, dc_predictions[component]);
+				}
+			}
+
+			const bool last_mcu = mcu_row == mcu_rows - 1 && mcu_column == mcu_columns - 1;
+			if (!options.progressive && options.restart_interval != 0 && --mcus_to_restart == 0 && !last_mcu)
+			{
+				writer.align();
+				writer.write_marker(jpeg_marker::RESTART_BASE + (restart_index++ & 7));
+				for (unsigned int component = 0; component < COMPONENTS; component++)
+				{
+					dc_predictions[component] = 0;
+				}
+				mcus_to_restart = options.restart_interval;
+			}
+		}
+	}
+
+	if (options.progressive)
+	{
+		const huffman_codes * const dc_codes[] = {&dc_luminance, &dc_chrominance, &dc_chrominance};
+		const huffman_codes * const ac_codes[] = {&ac_luminance, &ac_chrominance, &ac_chrominance};
+		write_progressive_scans(stream, writer, coefficients, components, mcu_columns, mcu_rows,
+				options.restart_interval, dc_codes, ac_codes);
+	}
+
+	writer.align();
+	writer.write_marker(jpeg_marker::END_OF_IMAGE);
+	writer.flush();
+}
+
+void jpeg::encode_image(const bitmap &bitmap, std::ostream &stream, const encode_options &options)
+		throw(std::invalid_argument)
+{
+	bitmap_scanline_source source(bitmap);
+	encode_image(source, bitmap.width, bitmap.height, stream, options);
+}
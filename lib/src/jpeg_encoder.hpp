@@ -0,0 +1,89 @@
+
+#ifndef JPEG_ENCODER_HPP_
+#define JPEG_ENCODER_HPP_
+
+#include "bitmaps.hpp"
+
+#include <iostream>
+#include <stdexcept>
+
+namespace jpeg
+{
+	/**
+	 * Provides the pixels of an image to encode, one scanline at a time. This allows encoding
+	 * images without holding them entirely in memory.
+	 */
+	class scanline_source
+	{
+	public:
+		virtual ~scanline_source() { }
+
+		/**
+		 * Fills rgb with 3 bytes per pixel (red, green and blue) for the whole given row.
+		 * Rows are requested from top to bottom, each one once.
+		 */
+		virtual void read_scanline(unsigned int row, unsigned char *rgb) = 0;
+	};
+
+	/**
+	 * Chrominance subsampling. Luminance is always stored at full resolution.
+	 */
+	enum sampling_e
+	{
+		SAMPLING_444, // No subsampling
+		SAMPLING_422, // Half the horizontal resolution
+		SAMPLING_420 // Half the horizontal and vertical resolution
+	};
+
+	/**
+	 * Optional settings for encode_image.
+	 */
+	struct encode_options
+	{
+		/**
+		 * From 1 to 100. The standard quantization tables are scaled as most encoders do, 50
+		 * being the tables as they are.
+		 */
+		unsigned int quality;
+
+		sampling_e sampling;
+
+		/**
+		 * Amount of MCUs between restart markers. 0 for no restart markers.
+		 */
+		unsigned int restart_interval;
+
+		/**
+		 * If true, a progressive file is written instead of a baseline one, with the scans that
+		 * libjpeg writes by default: DC and AC coefficients are sent in spectral bands and
+		 * successive approximations. The whole image is kept in memory while encoding.
+		 */
+		bool progressive;
+
+		/**
+		 * If true, only the luminance is written, in a single component frame, and sampling is
+		 * ignored.
+		 */
+		bool grayscale;
+
+		encode_options() : quality(75), sampling(SAMPLING_420), restart_interval(0), progressive(false),
+				grayscale(false) { }
+	};
+
+	/**
+	 * Encodes a baseline or progressive JPEG file (JFIF, YCbCr or grayscale, 8 bits, standard
+	 * Huffman tables) from the pixels given by the source.
+	 * std::invalid_argument is thrown if the size is 0 or larger than 65535 or the options are
+	 * out of range.
+	 */
+	void encode_image(scanline_source &source, unsigned int width, unsigned int height,
+			std::ostream &stream, const encode_options &options = encode_options()) throw(std::invalid_argument);
+
+	/**
+	 * Encodes the red, green and blue components of the given bitmap.
+	 */
+	void encode_image(const bitmap &bitmap, std::ostream &stream,
+			const encode_options &options = encode_options()) throw(std::invalid_argument);
+}
+
+#endif /* JPEG_ENCODER_HPP_ */
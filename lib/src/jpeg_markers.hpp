@@ -7,6 +7,7 @@ namespace jpeg_marker
 	enum jpeg_marker_e
 	{
 		START_OF_FRAME_BASELINE_DCT = 0xC0,
+		START_OF_FRAME_EXTENDED_DCT = 0xC1, // Sequential as baseline, but allowing 12 bits samples
 		START_OF_FRAME_PROGRESSIVE_DCT = 0xC2,
 		HUFFMAN_TABLE = 0xC4,
 		RESTART_BASE = 0xD0, // RSTn where n goes from 0 to 7 (0xD0 - 0xD7)
@@ -16,9 +17,11 @@ namespace jpeg_marker
 		QUANTIZATION_TABLE = 0xDB,
 		RESTART_INTERVAL = 0xDD,
 
-		APPLICATION_BASELINE = 0xE0, // APPn where n goes from 0 to 7 (0xE0 - 0xE7)
+		APPLICATION_BASELINE = 0xE0, // APPn where n goes from 0 to 15 (0xE0 - 0xEF)
+		APPLICATION_LAST = 0xEF,
 		JFIF = 0xE0, // APP0 = JFIF
 		EXIF = 0xE1, // APP1 = EXIF
+		ADOBE = 0xEE, // APP14 = Adobe, colour transform of the components
 		COMMENT = 0xFE, // Plain text comment
 		MARKER = 0xFF
 	};
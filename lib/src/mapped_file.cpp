@@ -0,0 +1,72 @@
+
+#include "mapped_file.hpp"
+
+#ifdef PROJECT_PLATFORM_UNIX
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif // PROJECT_PLATFORM_UNIX
+
+mapped_file::mapped_file(const char *path, mode_e mode, uint_fast64_t size) throw(unable_to_map) :
+		_data(0), _size(0)
+{
+#ifdef PROJECT_PLATFORM_UNIX
+	const int fd = (mode == CREATE)? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		throw unable_to_map();
+	}
+
+	if (mode == CREATE)
+	{
+		if (ftruncate(fd, size) != 0)
+		{
+			close(fd);
+			throw unable_to_map();
+		}
+	}
+	else
+	{
+		struct stat file_status;
+		if (fstat(fd, &file_status) != 0)
+		{
+			close(fd);
+			throw unable_to_map();
+		}
+
+		size = file_status.st_size;
+	}
+
+	// Empty files cannot be mapped, but there is nothing to map anyway
+	if (size > 0)
+	{
+		void *address = (mode == CREATE)? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+				mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+		if (address == MAP_FAILED)
+		{
+			close(fd);
+			throw unable_to_map();
+		}
+
+		_data = static_cast<unsigned char *>(address);
+		_size = size;
+	}
+
+	// The mapping keeps its own reference to the file
+	close(fd);
+#else // PROJECT_PLATFORM_UNIX
+	throw unable_to_map();
+#endif // PROJECT_PLATFORM_UNIX
+}
+
+mapped_file::~mapped_file()
+{
+#ifdef PROJECT_PLATFORM_UNIX
+	if (_data != 0)
+	{
+		munmap(_data, _size);
+	}
+#endif // PROJECT_PLATFORM_UNIX
+}
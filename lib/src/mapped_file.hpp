@@ -0,0 +1,56 @@
+
+#ifndef MAPPED_FILE_HPP_
+#define MAPPED_FILE_HPP_
+
+#include "conf.h"
+#include "smart_pointers.hpp"
+
+#include <stdint.h>
+
+/**
+ * Maps a whole file in memory. The mapping is released when this object is deleted, which
+ * usually happens when the last shared_array wrapping its content is gone.
+ */
+class mapped_file : public shared_array_owner
+{
+	unsigned char *_data;
+	uint_fast64_t _size;
+
+	mapped_file(const mapped_file &other) = delete;
+	mapped_file &operator=(const mapped_file &other) = delete;
+
+public:
+	/**
+	 * Thrown when the file cannot be opened, created or mapped.
+	 */
+	class unable_to_map { };
+
+	enum mode_e
+	{
+		/**
+		 * Maps an existing file. Pages are copied on write, so the file is never modified.
+		 */
+		READ,
+
+		/**
+		 * Creates the file, or truncates it if already present, with the given size. Anything
+		 * written in the mapping will end up in the file.
+		 */
+		CREATE
+	};
+
+	mapped_file(const char *path, mode_e mode = READ, uint_fast64_t size = 0) throw(unable_to_map);
+	virtual ~mapped_file();
+
+	unsigned char *data() const
+	{
+		return _data;
+	}
+
+	uint_fast64_t size() const
+	{
+		return _size;
+	}
+};
+
+#endif /* MAPPED_FILE_HPP_ */
@@ -0,0 +1,256 @@
+
+#include "mcu_index.hpp"
+
+#include <algorithm>
+
+namespace
+{
+
+const char magic[] = {'J', 'M', 'C', 'U'};
+
+enum
+{
+	VERSION = 2,
+
+	// Bytes of the entropy-coded data taken into the checksum at each entry
+	ENTRY_CHECKSUM_BYTES = 16
+};
+
+/**
+ * Adds up to size bytes from the given offset to a 64 bits FNV-1a hash, or less if the stream
+ * ends before.
+ */
+void hash_bytes(std::istream &stream, uint_fast64_t offset, uint_fast64_t size, uint_fast64_t &hash)
+{
+	stream.clear();
+	stream.seekg(offset);
+
+	char buffer[256];
+	while (size > 0 && stream.good())
+	{
+		stream.read(buffer, (size < sizeof(buffer))? size : sizeof(buffer));
+		const std::streamsize read = stream.gcount();
+		for (std::streamsize index = 0; index < read; index++)
+		{
+			hash ^= static_cast<unsigned char>(buffer[index]);
+			hash = (hash * 0x100000001B3ULL) & 0xFFFFFFFFFFFFFFFFULL;
+		}
+		size -= read;
+	}
+}
+
+/**
+ * Unsigned numbers are stored in groups of 7 bits, least significant first, setting the highest
+ * bit in all bytes but the last one.
+ */
+void write_varint(std::ostream &stream, uint_fast64_t value)
+{
+	while (value >= 0x80)
+	{
+		stream.put(static_cast<char>((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+
+	stream.put(static_cast<char>(value));
+}
+
+uint_fast64_t read_varint(std::istream &stream) throw(mcu_index::invalid_index)
+{
+	uint_fast64_t value = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 7)
+	{
+		const int byte = stream.get();
+		if (byte < 0)
+		{
+			throw mcu_index::invalid_index();
+		}
+
+		value |= static_cast<uint_fast64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return value;
+		}
+	}
+
+	throw mcu_index::invalid_index();
+}
+
+/**
+ * Signed numbers are mapped to unsigned ones so that small magnitudes take few bytes:
+ * 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+ */
+void write_signed_varint(std::ostream &stream, int_fast64_t value)
+{
+	write_varint(stream, (value < 0)? ((static_cast<uint_fast64_t>(-(value + 1)) << 1) | 1) :
+			static_cast<uint_fast64_t>(value) << 1);
+}
+
+int_fast64_t read_signed_varint(std::istream &stream) throw(mcu_index::invalid_index)
+{
+	const uint_fast64_t value = read_varint(stream);
+	return (value & 1)? -static_cast<int_fast64_t>(value >> 1) - 1 : static_cast<int_fast64_t>(value >> 1);
+}
+
+}
+
+mcu_index::mcu_index(unsigned int rows_per_entry) : rows_per_entry(rows_per_entry)
+{
+	clear();
+}
+
+void mcu_index::clear()
+{
+	width = 0;
+	height = 0;
+	channels_amount = 0;
+	scan_offset = 0;
+	file_size = 0;
+	checksum = 0;
+	entries.clear();
+}
+
+void mcu_index::write(std::ostream &stream) const
+{
+	stream.write(magic, sizeof(magic));
+	stream.put(VERSION);
+	write_varint(stream, width);
+	write_varint(stream, height);
+	write_varint(stream, channels_amount);
+	write_varint(stream, rows_per_entry);
+	write_varint(stream, scan_offset);
+	write_varint(stream, file_size);
+	write_varint(stream, checksum);
+	write_varint(stream, entries.size());
+
+	const entry *previous = NULL;
+	for (unsigned int index = 0; index < entries.size(); index++)
+	{
+		const entry &current = entries[index];
+		write_varint(stream, current.position.byte_offset - ((previous != NULL)?
+				previous->position.byte_offset : scan_offset));
+		stream.put(static_cast<char>(current.position.consumed_bits));
+
+		for (unsigned int channel = 0; channel < channels_amount; channel++)
+		{
+			write_signed_varint(stream, static_cast<int_fast64_t>(current.dc_values[channel]) -
+					((previous != NULL)? previous->dc_values[channel] : 0));
+		}
+
+		write_varint(stream, current.restart_index);
+		write_varint(stream, current.mcus_to_restart);
+		previous = &current;
+	}
+}
+
+void mcu_index::read(std::istream &stream) throw(invalid_index)
+{
+	char read_magic[sizeof(magic)];
+	stream.read(read_magic, sizeof(read_magic));
+	if (!stream.good() || !std::equal(magic, magic + sizeof(magic), read_magic) || stream.get() != VERSION)
+	{
+		throw invalid_index();
+	}
+
+	// Filled apart, so that this one is only replaced once the whole index is read
+	mcu_index result;
+	result.width = read_varint(stream);
+	result.height = read_varint(stream);
+	result.channels_amount = read_varint(stream);
+	result.rows_per_entry = read_varint(stream);
+	result.scan_offset = read_varint(stream);
+	result.file_size = read_varint(stream);
+	result.checksum = read_varint(stream);
+	const uint_fast64_t amount = read_varint(stream);
+
+	// Each row has at least one MCU, and then one byte in the file
+	if (result.channels_amount > MAX_CHANNELS || result.rows_per_entry == 0 || amount > result.height)
+	{
+		throw invalid_index();
+	}
+
+	result.entries.resize(amount);
+	for (unsigned int index = 0; index < amount; index++)
+	{
+		entry &current = result.entries[index];
+		const entry *previous = (index > 0)? &result.entries[index - 1] : NULL;
+
+		current.position.byte_offset = read_varint(stream) + ((previous != NULL)?
+				previous->position.byte_offset : result.scan_offset);
+		current.position.consumed_bits = stream.get();
+		if (current.position.consumed_bits >= 8)
+		{
+			throw invalid_index();
+		}
+
+		for (unsigned int channel = 0; channel < MAX_CHANNELS; channel++)
+		{
+			current.dc_values[channel] = (channel < result.channels_amount)? read_signed_varint(stream) +
+					((previous != NULL)? previous->dc_values[channel] : 0) : 0;
+		}
+
+		current.restart_index = read_varint(stream);
+		current.mcus_to_restart = read_varint(stream);
+	}
+
+	rows_per_entry = result.rows_per_entry;
+	width = result.width;
+	height = result.height;
+	channels_amount = result.channels_amount;
+	scan_offset = result.scan_offset;
+	file_size = result.file_size;
+	checksum = result.checksum;
+	entries.swap(result.entries);
+}
+
+void mcu_index::sign(std::istream &stream)
+{
+	if (!measure(stream, file_size, checksum))
+	{
+		file_size = 0;
+		checksum = 0;
+	}
+}
+
+bool mcu_index::belongs_to(std::istream &stream) const
+{
+	uint_fast64_t size;
+	uint_fast64_t sum;
+	return measure(stream, size, sum) && size == file_size && sum == checksum;
+}
+
+/**
+ * Reads the whole headers, but only a few bytes of the entropy-coded data at each entry, as the
+ * index is meant to avoid reading the rest.
+ */
+bool mcu_index::measure(std::istream &stream, uint_fast64_t &size, uint_fast64_t &sum) const
+{
+	const std::istream::iostate state = stream.rdstate();
+	stream.clear();
+	const std::streampos start = stream.tellg();
+	if (start < 0)
+	{
+		stream.setstate(state);
+		return false;
+	}
+
+	stream.seekg(0, std::ios::end);
+	const std::streampos end = stream.tellg();
+
+	sum = 0xCBF29CE484222325ULL;
+	hash_bytes(stream, 0, scan_offset, sum);
+	for (unsigned int index = 0; index < entries.size(); index++)
+	{
+		hash_bytes(stream, entries[index].position.byte_offset, ENTRY_CHECKSUM_BYTES, sum);
+	}
+
+	stream.clear();
+	stream.seekg(start);
+	stream.setstate(state);
+	if (end < 0)
+	{
+		return false;
+	}
+
+	size = static_cast<uint_fast64_t>(end);
+	return true;
+}
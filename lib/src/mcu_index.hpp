@@ -0,0 +1,103 @@
+
+#ifndef MCU_INDEX_HPP_
+#define MCU_INDEX_HPP_
+
+#include "stream_utils.hpp"
+#include "allocation.hpp"
+
+#include <stdint.h>
+#include <iostream>
+#include <vector>
+
+/**
+ * Decoder state at the start of some rows of MCUs, so that a decode can start at any of those
+ * rows instead of reading the whole entropy-coded data from the beginning.
+ *
+ * It is filled while decoding (see jpeg::decode_options) and can be stored in a sidecar file
+ * next to the image. Only images with a single scan of up to MAX_CHANNELS channels are indexed.
+ */
+class mcu_index
+{
+public:
+	enum
+	{
+		MAX_CHANNELS = 4
+	};
+
+	/**
+	 * Thrown when reading something that is not a valid index.
+	 */
+	class invalid_index { };
+
+	struct entry
+	{
+		scan_bit_stream::position position;
+		int dc_values[MAX_CHANNELS];
+
+		/**
+		 * Restart markers found before this row, and MCUs left until the next one.
+		 */
+		unsigned int restart_index;
+		unsigned int mcus_to_restart;
+	};
+
+	/**
+	 * Amount of MCU rows between entries. Entry i is taken at the start of row i * rows_per_entry.
+	 */
+	unsigned int rows_per_entry;
+
+	/**
+	 * Frame size, channels and offset where the entropy-coded data starts. They are checked
+	 * before using the index, to ignore it if it belongs to another image.
+	 */
+	unsigned int width;
+	unsigned int height;
+	unsigned int channels_amount;
+	uint_fast64_t scan_offset;
+
+	/**
+	 * Size of the file and checksum of its bytes before scan_offset and at each entry, set by
+	 * sign and checked by belongs_to, to ignore the index as well for other files whose headers
+	 * give the same image.
+	 */
+	uint_fast64_t file_size;
+	uint_fast64_t checksum;
+
+	std::vector<entry, allocation::container_allocator<entry> > entries;
+
+	mcu_index(unsigned int rows_per_entry = 1);
+
+	/**
+	 * Discards all entries and the image they belong to, keeping rows_per_entry.
+	 */
+	void clear();
+
+	/**
+	 * Writes the index in a compact binary format, with offsets and predictions stored as
+	 * differences from the previous entry.
+	 */
+	void write(std::ostream &stream) const;
+
+	/**
+	 * Replaces this index with the one stored by write in the given stream. It is left untouched
+	 * if invalid_index is thrown.
+	 */
+	void read(std::istream &stream) throw(invalid_index);
+
+	/**
+	 * Sets file_size and checksum from the file in the given stream, once the entries are filled.
+	 * The stream is left at the same position.
+	 */
+	void sign(std::istream &stream);
+
+	/**
+	 * True if the file in the given stream has the size and checksum set by sign. The stream is
+	 * left at the same position.
+	 */
+	bool belongs_to(std::istream &stream) const;
+
+private:
+	bool measure(std::istream &stream, uint_fast64_t &size, uint_fast64_t &sum) const;
+};
+
+#endif /* MCU_INDEX_HPP_ */
@@ -0,0 +1,400 @@
+
+#include "progressive_scan.hpp"
+#include "huffman_tables.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+
+namespace
+{
+
+/**
+ * Largest sampling factors among the frame components, which set the size of the MCU in blocks.
+ */
+void max_samples(const frame_info &frame, unsigned int &h_max, unsigned int &v_max)
+{
+	h_max = 1;
+	v_max = 1;
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		h_max = std::max<unsigned int>(h_max, frame.channels[index].horizontal_sample);
+		v_max = std::max<unsigned int>(v_max, frame.channels[index].vertical_sample);
+	}
+}
+
+/**
+ * Reads the given amount of bits as an unsigned number, as EOB runs are written.
+ */
+unsigned int next_bits(scan_bit_stream &stream, unsigned int bits)
+{
+	unsigned int value = 0;
+	for (unsigned int bit = 0; bit < bits; bit++)
+	{
+		value = (value << 1) | stream.next_bit();
+	}
+
+	return value;
+}
+
+/**
+ * Decodes blocks of a single scan, keeping the DC predictions and the amount of blocks left in
+ * the current EOB run (end of band for several blocks at once).
+ */
+class block_decoder
+{
+	scan_bit_stream &stream;
+	const scan_info &scan;
+	int dc_values[basic_info::MAX_CHANNEL_AMOUNT];
+	unsigned int end_of_band_run;
+
+	void dc_first(int16_t *block, unsigned int channel);
+	void dc_refinement(int16_t *block);
+	void ac_first(int16_t *block, unsigned int channel);
+	void ac_refinement(int16_t *block, unsigned int channel);
+
+	/**
+	 * Reads the bit that follows in a coefficient already found in a previous scan.
+	 */
+	void refine(int16_t &coefficient)
+	{
+		const int bit = 1 << scan.approximation_low;
+		if (stream.next_bit() != 0 && (coefficient & bit) == 0)
+		{
+			coefficient += (coefficient >= 0)? bit : -bit;
+		}
+	}
+
+public:
+	block_decoder(scan_bit_stream &stream, const scan_info &scan) : stream(stream), scan(scan)
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		std::fill(dc_values, dc_values + scan.channels_amount, 0);
+		end_of_band_run = 0;
+	}
+
+	void decode(int16_t *block, unsigned int channel)
+	{
+		if (scan.spectral_start == 0)
+		{
+			if (scan.approximation_high == 0)
+			{
+				dc_first(block, channel);
+			}
+			else
+			{
+				dc_refinement(block);
+			}
+		}
+		else if (scan.approximation_high == 0)
+		{
+			ac_first(block, channel);
+		}
+		else
+		{
+			ac_refinement(block, channel);
+		}
+	}
+};
+
+void block_decoder::dc_first(int16_t *block, unsigned int channel)
+{
+	const huffman_table::symbol_value_t length = scan.channels[channel].dc_table->next_symbol(stream);
+	if (length != 0)
+	{
+		dc_values[channel] += stream.next_number(length);
+	}
+
+	block[0] = dc_values[channel] * (1 << scan.approximation_low);
+}
+
+void block_decoder::dc_refinement(int16_t *block)
+{
+	if (stream.next_bit() != 0)
+	{
+		block[0] |= 1 << scan.approximation_low;
+	}
+}
+
+void block_decoder::ac_first(int16_t *block, unsigned int channel)
+{
+	if (end_of_band_run > 0)
+	{
+		end_of_band_run--;
+		return;
+	}
+
+	const huffman_table &table = *scan.channels[channel].ac_table;
+	for (unsigned int index = scan.spectral_start; index <= scan.spectral_end; index++)
+	{
+		const huffman_table::symbol_value_t symbol = table.next_symbol(stream);
+		const unsigned int zeroes = (symbol >> 4) & 0x0F;
+		const unsigned int length = symbol & 0x0F;
+
+		if (length != 0)
+		{
+			index += zeroes;
+			if (index > scan.spectral_end)
+			{
+				throw jpeg::invalid_file_format();
+			}
+
+			block[index] = stream.next_number(length) * (1 << scan.approximation_low);
+		}
+		else if (zeroes == 15)
+		{
+			// 16 zeroes, the last one skipped by the loop
+			index += 15;
+		}
+		else
+		{
+			// This block is the first one in the run
+			end_of_band_run = (1 << zeroes) - 1 + next_bits(stream, zeroes);
+			return;
+		}
+	}
+}
+
+void block_decoder::ac_refinement(int16_t *block, unsigned int channel)
+{
+	const huffman_table &table = *scan.channels[channel].ac_table;
+	const int bit = 1 << scan.approximation_low;
+
+	unsigned int index = scan.spectral_start;
+	if (end_of_band_run == 0)
+	{
+		for (; index <= scan.spectral_end; index++)
+		{
+			const huffman_table::symbol_value_t symbol = table.next_symbol(stream);
+			unsigned int zeroes = (symbol >> 4) & 0x0F;
+			const unsigned int length = symbol & 0x0F;
+
+			int value = 0;
+			if (length == 1)
+			{
+				value = (stream.next_bit() != 0)? bit : -bit;
+			}
+			else if (length != 0)
+			{
+				throw jpeg::invalid_file_format();
+			}
+			else if (zeroes != 15)
+			{
+				// Coefficients left in this block are refined below
+				end_of_band_run = (1 << zeroes) + next_bits(stream, zeroes);
+				break;
+			}
+
+			// Skips as many zeroes as given, refining the coefficients found in between
+			for (; index <= scan.spectral_end; index++)
+			{
+				if (block[index] != 0)
+				{
+					refine(block[index]);
+				}
+				else if (zeroes-- == 0)
+				{
+					break;
+				}
+			}
+
+			if (value != 0)
+			{
+				if (index > scan.spectral_end)
+				{
+					throw jpeg::invalid_file_format();
+				}
+
+				block[index] = value;
+			}
+		}
+	}
+
+	if (end_of_band_run > 0)
+	{
+		for (; index <= scan.spectral_end; index++)
+		{
+			if (block[index] != 0)
+			{
+				refine(block[index]);
+			}
+		}
+
+		end_of_band_run--;
+	}
+}
+
+/**
+ * Checks the scan parameters and finds the frame component for each scan component.
+ */
+void check_scan(const frame_info &frame, const scan_info &scan, unsigned int *components)
+		throw(jpeg::invalid_file_format)
+{
+	const bool dc_scan = scan.spectral_start == 0;
+	if (scan.channels_amount == 0 || scan.spectral_end >= block_matrix::CELLS ||
+			scan.spectral_start > scan.spectral_end || (dc_scan && scan.spectral_end != 0) ||
+			(!dc_scan && scan.channels_amount != 1) || scan.approximation_low > 13 ||
+			(scan.approximation_high != 0 && scan.approximation_high != scan.approximation_low + 1))
+	{
+		throw jpeg::invalid_file_format();
+	}
+
+	// Refining DC coefficients is the only case where no table is read
+	scan.find_components(frame, dc_scan && scan.approximation_high == 0, !dc_scan, components);
+}
+
+}
+
+uint_fast64_t coefficient_buffer::required_bytes(const frame_info &frame)
+{
+	unsigned int h_max;
+	unsigned int v_max;
+	max_samples(frame, h_max, v_max);
+
+	const uint_fast64_t mcu_columns = (frame.width + block_matrix::SIDE * h_max - 1) / (block_matrix::SIDE * h_max);
+	const uint_fast64_t mcu_rows = (frame.height + block_matrix::SIDE * v_max - 1) / (block_matrix::SIDE * v_max);
+
+	uint_fast64_t bytes = 0;
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		const frame_channel &channel = frame.channels[index];
+		bytes += mcu_columns * channel.horizontal_sample * mcu_rows * channel.vertical_sample *
+				block_matrix::CELLS * sizeof(int16_t);
+	}
+
+	return bytes;
+}
+
+void coefficient_buffer::allocate(const frame_info &frame)
+{
+	unsigned int h_max;
+	unsigned int v_max;
+	max_samples(frame, h_max, v_max);
+
+	mcu_columns = (frame.width + block_matrix::SIDE * h_max - 1) / (block_matrix::SIDE * h_max);
+	mcu_rows = (frame.height + block_matrix::SIDE * v_max - 1) / (block_matrix::SIDE * v_max);
+
+	components.resize(frame.channels_amount);
+	for (frame_info::channel_count_t index = 0; index < frame.channels_amount; index++)
+	{
+		const frame_channel &channel = frame.channels[index];
+		component &component = components[index];
+		component.blocks_per_row = mcu_columns * channel.horizontal_sample;
+		component.block_rows = mcu_rows * channel.vertical_sample;
+
+		// Components with lower sampling cover the image with less pixels
+		const unsigned int width = (frame.width * channel.horizontal_sample + h_max - 1) / h_max;
+		const unsigned int height = (frame.height * channel.vertical_sample + v_max - 1) / v_max;
+		component.visible_blocks_per_row = (width + block_matrix::SIDE - 1) / block_matrix::SIDE;
+		component.visible_block_rows = (height + block_matrix::SIDE - 1) / block_matrix::SIDE;
+
+		const std::size_t amount = static_cast<std::size_t>(component.blocks_per_row) * component.block_rows *
+				block_matrix::CELLS;
+		component.coefficients = shared_array<int16_t>::allocate(amount);
+		std::fill(component.coefficients.get(), component.coefficients.get() + amount, 0);
+		component.dc_read = false;
+	}
+}
+
+bool coefficient_buffer::dc_read() const
+{
+	for (unsigned int index = 0; index < components.size(); index++)
+	{
+		if (!components[index].dc_read)
+		{
+			return false;
+		}
+	}
+
+	return !components.empty();
+}
+
+void decode_progressive_scan(coefficient_buffer &buffer, scan_bit_stream &stream, const frame_info &frame,
+		const scan_info &scan, unsigned int restart_interval, decode_stats *stats) throw(jpeg::invalid_file_format)
+{
+	trace::span scan_span("scan data", "stage");
+
+	unsigned int components[basic_info::MAX_CHANNEL_AMOUNT];
+	check_scan(frame, scan, components);
+
+	// Scans with a single component are not interleaved: they go through its blocks in raster order
+	const bool interleaved = scan.channels_amount > 1;
+	const coefficient_buffer::component &first = buffer.components[components[0]];
+	const unsigned int units = interleaved? buffer.mcu_columns * buffer.mcu_rows :
+			first.visible_blocks_per_row * first.visible_block_rows;
+
+	block_decoder decoder(stream, scan);
+	unsigned int units_to_restart = restart_interval;
+	unsigned int restart_index = 0;
+
+	DECODE_STATS_CLOCK(clock, stats, HUFFMAN_DECODE);
+	try
+	{
+		for (unsigned int unit = 0; unit < units; unit++)
+		{
+			if (interleaved)
+			{
+				const unsigned int mcu_column = unit % buffer.mcu_columns;
+				const unsigned int mcu_row = unit / buffer.mcu_columns;
+				for (scan_info::channel_count_t channel = 0; channel < scan.channels_amount; channel++)
+				{
+					const frame_channel &frame_channel = frame.channels[components[channel]];
+					const coefficient_buffer::component &component = buffer.components[components[channel]];
+					for (unsigned int v_sample = 0; v_sample < frame_channel.vertical_sample; v_sample++)
+					{
+						for (unsigned int h_sample = 0; h_sample < frame_channel.horizontal_sample; h_sample++)
+						{
+							decoder.decode(component.block(mcu_column * frame_channel.horizontal_sample + h_sample,
+									mcu_row * frame_channel.vertical_sample + v_sample), channel);
+							DECODE_STATS_ADD(stats, blocks_decoded, 1);
+						}
+					}
+				}
+				DECODE_STATS_ADD(stats, mcus_decoded, 1);
+			}
+			else
+			{
+				decoder.decode(first.block(unit % first.visible_blocks_per_row, unit / first.visible_blocks_per_row), 0);
+				DECODE_STATS_ADD(stats, blocks_decoded, 1);
+			}
+
+			if (restart_interval != 0 && --units_to_restart == 0 && unit + 1 < units)
+			{
+				DECODE_STATS_ENTER(clock, MARKER_PARSING);
+				if (!stream.skip_restart_marker(restart_index++))
+				{
+					throw jpeg::invalid_file_format();
+				}
+
+				decoder.reset();
+				units_to_restart = restart_interval;
+				DECODE_STATS_ENTER(clock, HUFFMAN_DECODE);
+			}
+		}
+	}
+	catch (std::invalid_argument &)
+	{
+		// Code not present in the huffman table
+		throw jpeg::invalid_file_format();
+	}
+	catch (unsupported_feature &)
+	{
+		// Marker within the entropy-coded data
+		throw jpeg::invalid_file_format();
+	}
+	catch (unexpected_end_of_stream &)
+	{
+		throw jpeg::invalid_file_format();
+	}
+
+	if (scan.spectral_start == 0 && scan.approximation_high == 0)
+	{
+		for (scan_info::channel_count_t channel = 0; channel < scan.channels_amount; channel++)
+		{
+			buffer.components[components[channel]].dc_read = true;
+		}
+	}
+}
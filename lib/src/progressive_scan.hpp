@@ -0,0 +1,84 @@
+
+#ifndef PROGRESSIVE_SCAN_HPP_
+#define PROGRESSIVE_SCAN_HPP_
+
+#include "jpeg.hpp"
+#include "allocation.hpp"
+#include "smart_pointers.hpp"
+#include "stream_utils.hpp"
+#include "decode_stats.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Quantized DCT coefficients of a whole progressive frame, refined by each scan until all of them
+ * are read. Each coefficient takes 2 bytes, and each block keeps them in zigzag order.
+ *
+ * Components are as large as the grid of MCUs, so that interleaved scans and the final
+ * reconstruction can address their blocks as baseline MCUs do.
+ */
+class coefficient_buffer
+{
+public:
+	struct component
+	{
+		unsigned int blocks_per_row;
+		unsigned int block_rows;
+
+		/**
+		 * Blocks within the component size. Scans with a single component only include these.
+		 */
+		unsigned int visible_blocks_per_row;
+		unsigned int visible_block_rows;
+
+		shared_array<int16_t> coefficients;
+
+		/**
+		 * True once a scan has sent the first bits of its DC coefficients.
+		 */
+		bool dc_read;
+
+		int16_t *block(unsigned int column, unsigned int row) const
+		{
+			return coefficients.get() + (static_cast<std::size_t>(row) * blocks_per_row + column) *
+					block_matrix::CELLS;
+		}
+	};
+
+	unsigned int mcu_columns;
+	unsigned int mcu_rows;
+	std::vector<component, allocation::container_allocator<component> > components;
+
+	coefficient_buffer() : mcu_columns(0), mcu_rows(0) { }
+
+	/**
+	 * Bytes that allocate takes for the given frame, computed in 64 bits.
+	 */
+	static uint_fast64_t required_bytes(const frame_info &frame);
+
+	/**
+	 * Sets up a component for each one in the frame, with all its coefficients set to 0.
+	 */
+	void allocate(const frame_info &frame);
+
+	/**
+	 * True if all components have their DC coefficients, even without all their bits.
+	 */
+	bool dc_read() const;
+};
+
+/**
+ * Reads the entropy-coded data of a progressive scan into the buffer. Depending on its spectral
+ * selection and successive approximation, the scan holds the first bits of the DC coefficients or
+ * a band of AC coefficients, or the following bit of those already read. If restart_interval is
+ * not 0, a restart marker is expected after that amount of MCUs, or blocks if the scan has a
+ * single component.
+ *
+ * jpeg::invalid_file_format is thrown if the scan is not valid for the frame or its data is
+ * corrupt. The stream is left at the end of the data read, which may not be the end of the scan.
+ */
+void decode_progressive_scan(coefficient_buffer &buffer, scan_bit_stream &stream, const frame_info &frame,
+		const scan_info &scan, unsigned int restart_interval, decode_stats *stats) throw(jpeg::invalid_file_format);
+
+#endif /* PROGRESSIVE_SCAN_HPP_ */
@@ -2,6 +2,18 @@
 #ifndef SMART_POINTERS_HPP_
 #define SMART_POINTERS_HPP_
 
+#include "allocation.hpp"
+
+/**
+ * Keeps alive memory that was not acquired by calling new[], like a mapped file. It is deleted
+ * by the last shared_array pointing to that memory.
+ */
+class shared_array_owner
+{
+public:
+	virtual ~shared_array_owner() { }
+};
+
 /**
  * Shares ownership of a data on the heap acquired by calling new[].
  * This class will call delete[] on the pointer when no other shared_array will point to it.
@@ -11,6 +23,11 @@ class shared_array
 {
 	unsigned int *shared_counter;
 	TYPE *data;
+	shared_array_owner *owner;
+
+	// Only for arrays created by allocate, whose release must be accounted
+	bool accounted;
+	std::size_t amount;
 
 	void decrease_count()
 	{
@@ -18,15 +35,29 @@ class shared_array
 		{
 			if (--(*shared_counter) == 0)
 			{
-				delete shared_counter;
-				delete[] data;
+				if (owner != 0)
+				{
+					delete shared_counter;
+					delete owner;
+				}
+				else if (accounted)
+				{
+					allocation::delete_object(shared_counter);
+					allocation::delete_array(data, amount);
+				}
+				else
+				{
+					delete shared_counter;
+					delete[] data;
+				}
 			}
 		}
 	}
 
 public:
-	shared_array() : shared_counter(0), data(0) { }
-	shared_array(const shared_array<TYPE> &other) : shared_counter(other.shared_counter), data(data)
+	shared_array() : shared_counter(0), data(0), owner(0), accounted(false), amount(0) { }
+	shared_array(const shared_array<TYPE> &other) : shared_counter(other.shared_counter),
+			data(other.data), owner(other.owner), accounted(other.accounted), amount(other.amount)
 	{
 		if (shared_counter != 0)
 		{
@@ -45,6 +76,9 @@ public:
 
 		shared_counter = other.shared_counter;
 		data = other.data;
+		owner = other.owner;
+		accounted = other.accounted;
+		amount = other.amount;
 
 		if (shared_counter != 0)
 		{
@@ -84,6 +118,87 @@ public:
 
 		return result;
 	}
+
+	/**
+	 * Creates a new array of the given amount of elements through allocation::new_array, so
+	 * that it is accounted until released.
+	 */
+	static shared_array<TYPE> allocate(std::size_t amount)
+	{
+		TYPE *data = allocation::new_array<TYPE>(amount);
+
+		shared_array<TYPE> result;
+		result.shared_counter = allocation::counted(new unsigned int(1));
+		result.data = data;
+		result.accounted = true;
+		result.amount = amount;
+
+		return result;
+	}
+
+	/**
+	 * Shares memory kept alive by the given owner instead of acquired by new[]. data must point
+	 * to memory valid until the owner is deleted, which will happen when no other shared_array
+	 * points to it. The owner is deleted as well if the shared counter cannot be allocated.
+	 */
+	static shared_array<TYPE> wrap(TYPE *data, shared_array_owner *owner)
+	{
+		shared_array<TYPE> result;
+		try
+		{
+			result = make(data);
+		}
+		catch (...)
+		{
+			delete owner;
+			throw;
+		}
+		result.owner = owner;
+
+		return result;
+	}
+};
+
+/**
+ * Owns a single object created through allocation::counted, and deletes it through
+ * allocation::delete_object when replaced or when going out of scope.
+ */
+template<class TYPE>
+class scoped_object
+{
+	TYPE *object;
+
+	scoped_object(const scoped_object<TYPE> &other);
+	scoped_object<TYPE> &operator=(const scoped_object<TYPE> &other);
+
+public:
+	scoped_object() : object(0) { }
+
+	~scoped_object()
+	{
+		allocation::delete_object(object);
+	}
+
+	void reset(TYPE *other = 0)
+	{
+		allocation::delete_object(object);
+		object = other;
+	}
+
+	TYPE *get() const
+	{
+		return object;
+	}
+
+	TYPE *operator->() const
+	{
+		return object;
+	}
+
+	TYPE &operator*() const
+	{
+		return *object;
+	}
 };
 
 
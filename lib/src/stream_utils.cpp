@@ -64,8 +64,64 @@ void write_little_endian_unsigned_int(std::ostream &stream, unsigned int value,
 	stream.write(buffer, bytes);
 }
 
-bit_stream::bit_stream(std::istream *stream) : stream(stream), valid_bits(0)
-{ }
+unsigned char *store_little_endian_unsigned_int(unsigned char *buffer, unsigned int value, unsigned int bytes)
+{
+	for (unsigned int index = 0; index < bytes; index++)
+	{
+		*(buffer++) = value & 0xFF;
+		value >>= 8;
+	}
+
+	return buffer;
+}
+
+unsigned int load_little_endian_unsigned_int(const unsigned char *buffer, unsigned int bytes)
+{
+	unsigned int result = 0;
+	for (unsigned int index = 0; index < bytes; index++)
+	{
+		result |= static_cast<unsigned int>(buffer[index]) << (index * 8);
+	}
+
+	return result;
+}
+
+memory_input_buffer::memory_input_buffer(const char *data, std::size_t size)
+{
+	// Never written, get area pointers are just not const
+	char * const begin = const_cast<char *>(data);
+	setg(begin, begin, begin + size);
+}
+
+memory_input_buffer::pos_type memory_input_buffer::seekoff(off_type offset, std::ios_base::seekdir direction,
+		std::ios_base::openmode mode)
+{
+	const off_type size = egptr() - eback();
+	off_type target = offset;
+	if (direction == std::ios_base::cur)
+	{
+		target += gptr() - eback();
+	}
+	else if (direction == std::ios_base::end)
+	{
+		target += size;
+	}
+
+	if ((mode & std::ios_base::in) == 0 || target < 0 || target > size)
+	{
+		return pos_type(off_type(-1));
+	}
+
+	setg(eback(), eback() + target, egptr());
+	return pos_type(target);
+}
+
+memory_input_buffer::pos_type memory_input_buffer::seekpos(pos_type position, std::ios_base::openmode mode)
+{
+	return seekoff(off_type(position), std::ios_base::beg, mode);
+}
+
+bit_stream::bit_stream(std::istream *stream) : stream(stream), valid_bits(0) { }
 
 void bit_stream::prepend(const unsigned char value)
 {
@@ -114,23 +170,155 @@ bit_stream::number_t bit_stream::next_number(const number_bit_amount_t bits)
 	return result;
 }
 
-unsigned char scan_bit_stream::next_bit() throw(unsupported_feature)
+scan_bit_stream::scan_bit_stream(std::istream *stream) : bit_stream(stream)
+#ifdef PROJECT_DECODE_STATS
+		, bytes_read(0), bytes_unstuffed(0)
+#endif // PROJECT_DECODE_STATS
+{
+#ifdef PROJECT_DECODE_STATS
+	start_run();
+#endif // PROJECT_DECODE_STATS
+}
+
+unsigned char scan_bit_stream::next_bit() throw(unsupported_feature, unexpected_end_of_stream)
 {
 	if (valid_bits == 0)
 	{
-		last = stream->get();
+		const int value = stream->get();
+		if (value == std::char_traits<char>::eof())
+		{
+			throw unexpected_end_of_stream();
+		}
+
+		last = value;
 		valid_bits = 8;
 
 		if (last == jpeg_marker::MARKER)
 		{
-			unsigned char marker_type = stream->get();
+			const int marker_type = stream->get();
+			if (marker_type == std::char_traits<char>::eof())
+			{
+				throw unexpected_end_of_stream();
+			}
+
 			if (marker_type != 0)
 			{
+				stream->unget();
+
 				// TODO: Supporting marker within the the scan data should be allowed
 				throw unsupported_feature();
 			}
+#ifdef PROJECT_DECODE_STATS
+			bytes_unstuffed++;
+#endif // PROJECT_DECODE_STATS
 		}
 	}
 
 	return (last >> --valid_bits) & 1;
 }
+
+bool scan_bit_stream::skip_restart_marker(unsigned int index)
+{
+	valid_bits = 0;
+	if (stream->get() != jpeg_marker::MARKER)
+	{
+		return false;
+	}
+
+	// Any amount of 0xFF can be used as fill bytes before the marker type
+	int marker_type = stream->get();
+	while (marker_type == jpeg_marker::MARKER)
+	{
+		marker_type = stream->get();
+	}
+
+	return marker_type == static_cast<int>(jpeg_marker::RESTART_BASE + (index & 7));
+}
+
+void scan_bit_stream::skip_entropy_data()
+{
+#ifdef PROJECT_DECODE_STATS
+	end_run();
+#endif // PROJECT_DECODE_STATS
+
+	valid_bits = 0;
+	while (stream->good())
+	{
+		if (stream->get() != jpeg_marker::MARKER)
+		{
+			continue;
+		}
+
+		// 0xFF may be followed by stuffing, a restart marker or more 0xFF used as fill bytes
+		const int next = stream->peek();
+		if (next == 0 || (next >= jpeg_marker::RESTART_BASE && next < jpeg_marker::RESTART_BASE + 8))
+		{
+			stream->get();
+		}
+		else if (next != jpeg_marker::MARKER)
+		{
+			stream->unget();
+			return;
+		}
+	}
+}
+
+bool scan_bit_stream::tell(position &position) const
+{
+	const std::streampos next_byte = stream->tellg();
+	if (next_byte < 0)
+	{
+		return false;
+	}
+
+	// A buffered 0xFF was followed by a stuffed 0x00, already read as well
+	const uint_fast64_t buffered_bytes = (valid_bits == 0)? 0 : (last == jpeg_marker::MARKER)? 2 : 1;
+	position.byte_offset = static_cast<uint_fast64_t>(next_byte) - buffered_bytes;
+	position.consumed_bits = (valid_bits == 0)? 0 : BUFFER_BITS - valid_bits;
+	return true;
+}
+
+bool scan_bit_stream::seek(const position &position)
+{
+#ifdef PROJECT_DECODE_STATS
+	end_run();
+#endif // PROJECT_DECODE_STATS
+
+	stream->clear();
+	if (!stream->seekg(position.byte_offset).good())
+	{
+		return false;
+	}
+
+#ifdef PROJECT_DECODE_STATS
+	start_run();
+#endif // PROJECT_DECODE_STATS
+
+	valid_bits = 0;
+	for (unsigned int bit = 0; bit < position.consumed_bits; bit++)
+	{
+		next_bit();
+	}
+
+	return true;
+}
+
+#ifdef PROJECT_DECODE_STATS
+uint_fast64_t scan_bit_stream::consumed_bits() const
+{
+	uint_fast64_t bytes = bytes_read;
+	const std::streamoff current = stream->tellg();
+	if (run_start >= 0 && current >= run_start)
+	{
+		bytes += current - run_start;
+	}
+
+	// Bytes of the last run are unknown if the stream failed
+	if (bytes * BUFFER_BITS < bytes_unstuffed * BUFFER_BITS + valid_bits)
+	{
+		return 0;
+	}
+
+	return (bytes - bytes_unstuffed) * BUFFER_BITS - valid_bits;
+}
+#endif // PROJECT_DECODE_STATS
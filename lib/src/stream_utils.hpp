@@ -12,6 +12,37 @@ unsigned int read_little_endian_unsigned_int(std::istream &stream, unsigned int
 
 void write_little_endian_unsigned_int(std::ostream &stream, unsigned int value, unsigned int bytes) throw(std::invalid_argument);
 
+/**
+ * Stores the value in the given buffer in little endian, using as many bytes as specified.
+ * Returns the position just after the last byte written.
+ */
+unsigned char *store_little_endian_unsigned_int(unsigned char *buffer, unsigned int value, unsigned int bytes);
+
+/**
+ * Returns the value stored in little endian in the given buffer, using as many bytes as specified.
+ */
+unsigned int load_little_endian_unsigned_int(const unsigned char *buffer, unsigned int bytes);
+
+/**
+ * Thrown when the stream ends before all the expected data has been read.
+ */
+class unexpected_end_of_stream { };
+
+/**
+ * Reads bytes already in memory without copying them. Seeking is supported, so that
+ * scan_bit_stream can tell and seek positions on it. The bytes must be kept alive and unchanged
+ * while the buffer is in use.
+ */
+class memory_input_buffer : public std::streambuf
+{
+public:
+	memory_input_buffer(const char *data, std::size_t size);
+
+protected:
+	virtual pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode mode);
+	virtual pos_type seekpos(pos_type position, std::ios_base::openmode mode);
+};
+
 class bit_stream
 {
 protected:
@@ -68,12 +99,91 @@ public:
 class scan_bit_stream : public bit_stream
 {
 public:
-	scan_bit_stream(std::istream *stream) : bit_stream(stream) { }
+	/**
+	 * Location of a bit within the stream: the offset of the byte holding it and the amount of
+	 * bits of that byte that come before it.
+	 */
+	struct position
+	{
+		uint_fast64_t byte_offset;
+		unsigned int consumed_bits;
+	};
+
+private:
+#ifdef PROJECT_DECODE_STATS
+	/**
+	 * Bytes are not counted one by one while reading. Instead, the stream position is taken when
+	 * reading starts and whenever it is moved for other reasons than reading bits.
+	 */
+	uint_fast64_t bytes_read;
+	std::streamoff run_start;
+	uint_fast64_t bytes_unstuffed;
+
+	void start_run()
+	{
+		run_start = stream->tellg();
+	}
+
+	void end_run()
+	{
+		const std::streamoff run_end = stream->tellg();
+		if (run_start >= 0 && run_end >= run_start)
+		{
+			bytes_read += run_end - run_start;
+		}
+		run_start = -1;
+	}
+#endif // PROJECT_DECODE_STATS
+
+public:
+	scan_bit_stream(std::istream *stream);
+
+	/**
+	 * Sets position to the location of the next bit to be read. Returns false if the stream
+	 * does not support seeking.
+	 */
+	bool tell(position &position) const;
+
+	/**
+	 * Moves to a position returned by tell, discarding anything buffered. Returns false if the
+	 * stream does not support seeking.
+	 */
+	bool seek(const position &position);
 
 	/**
 	 * Does that same that its parent method but skipping every 0x00 byte after 0xFF.
+	 * unsupported_feature is thrown if a marker is found, leaving the stream just after its 0xFF.
 	 */
-	virtual unsigned char next_bit() throw(unsupported_feature);
+	virtual unsigned char next_bit() throw(unsupported_feature, unexpected_end_of_stream);
+
+	/**
+	 * Discards the bits left in the current byte and reads the restart marker that must follow
+	 * it. index is the amount of restart markers found before in the scan. Returns false if the
+	 * following bytes are not the expected RSTn marker.
+	 */
+	bool skip_restart_marker(unsigned int index);
+
+	/**
+	 * Discards the rest of the entropy-coded data, including any restart marker, and leaves the
+	 * stream just at the marker that follows it.
+	 */
+	void skip_entropy_data();
+
+#ifdef PROJECT_DECODE_STATS
+	/**
+	 * Number of bits returned so far, including the ones of restart markers. It is only known
+	 * for streams supporting tellg.
+	 */
+	uint_fast64_t consumed_bits() const;
+
+	/**
+	 * Number of bytes skipped so far because of being 0x00 after 0xFF.
+	 */
+	uint_fast64_t unstuffed_bytes() const
+	{
+		return bytes_unstuffed;
+	}
+#endif // PROJECT_DECODE_STATS
 };
 
 #endif /* STREAM_UTILS_HPP_ */
@@ -0,0 +1,110 @@
+
+#include "synthetic_image.hpp"
+
+#include <sstream>
+
+namespace
+{
+
+enum
+{
+	FLAT_TILE_SIDE = 64
+};
+
+/**
+ * Mixes the bits of the given values, so that close positions result in unrelated numbers.
+ */
+inline uint32_t hash(uint32_t x, uint32_t y, uint32_t seed)
+{
+	uint32_t value = x * 0x9E3779B1u ^ y * 0x85EBCA77u ^ seed * 0xC2B2AE3Du;
+	value ^= value >> 15;
+	value *= 0x2C1B3C6Du;
+	value ^= value >> 12;
+	value *= 0x297A2D39u;
+	value ^= value >> 15;
+	return value;
+}
+
+}
+
+void synthetic_image::pixel(unsigned int x, unsigned int y, unsigned char *rgb) const
+{
+	switch (content)
+	{
+	case NOISE:
+		do
+		{
+			const uint32_t value = hash(x, y, seed);
+			rgb[0] = value & 0xFF;
+			rgb[1] = (value >> 8) & 0xFF;
+			rgb[2] = (value >> 16) & 0xFF;
+		} while(0);
+		break;
+
+	case GRADIENT:
+		rgb[0] = (width > 1)? (x * 255) / (width - 1) : 0;
+		rgb[1] = (height > 1)? (y * 255) / (height - 1) : 0;
+		rgb[2] = (width + height > 2)? ((x + y) * 255) / (width + height - 2) : 0;
+		break;
+
+	case FLAT:
+		do
+		{
+			const uint32_t value = hash(x / FLAT_TILE_SIDE, y / FLAT_TILE_SIDE, seed);
+			rgb[0] = value & 0xFF;
+			rgb[1] = (value >> 8) & 0xFF;
+			rgb[2] = (value >> 16) & 0xFF;
+		} while(0);
+		break;
+
+	case COORDINATES:
+		rgb[0] = x & 0xFF;
+		rgb[1] = y & 0xFF;
+		rgb[2] = 0x80;
+		break;
+	}
+}
+
+void synthetic_image::read_scanline(unsigned int row, unsigned char *rgb)
+{
+	for (unsigned int column = 0; column < width; column++)
+	{
+		pixel(column, row, rgb);
+		rgb += 3;
+	}
+}
+
+void synthetic_image::fill(bitmap &bitmap) const
+{
+	bitmap.width = width;
+	bitmap.height = height;
+	bitmap.bytes_per_pixel = 3;
+	bitmap.bytes_per_scanline = width * 3;
+	bitmap.components_amount = 3;
+	bitmap.components = shared_array<bitmap_component>::make(new bitmap_component[3]);
+	bitmap.components[0].type = bitmap_component::RED;
+	bitmap.components[0].bits_per_pixel = 8;
+	bitmap.components[1].type = bitmap_component::GREEN;
+	bitmap.components[1].bits_per_pixel = 8;
+	bitmap.components[2].type = bitmap_component::BLUE;
+	bitmap.components[2].bits_per_pixel = 8;
+	bitmap.data = shared_array<unsigned char>::make(new unsigned char[width * height * 3]);
+	bitmap.bottom_up = false;
+
+	for (unsigned int row = 0; row < height; row++)
+	{
+		unsigned char *rgb = bitmap.scanline(row);
+		for (unsigned int column = 0; column < width; column++)
+		{
+			pixel(column, row, rgb);
+			rgb += 3;
+		}
+	}
+}
+
+std::string synthetic_image::encode(const jpeg::encode_options &options)
+{
+	std::ostringstream file;
+	jpeg::encode_image(*this, width, height, file, options);
+	return file.str();
+}
@@ -0,0 +1,54 @@
+
+#ifndef SYNTHETIC_IMAGE_HPP_
+#define SYNTHETIC_IMAGE_HPP_
+
+#include "jpeg_encoder.hpp"
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Generates deterministic images to measure and test the codecs. Pixels are computed from their
+ * position when each scanline is requested, so images as large as JPEG allows can be encoded
+ * without holding them in memory.
+ */
+class synthetic_image : public jpeg::scanline_source
+{
+public:
+	enum content_e
+	{
+		NOISE, // Every pixel is random. Worst case for entropy coding
+		GRADIENT, // Smooth changes in all components
+		FLAT, // Tiles of 64x64 pixels, each one with a single random color
+		COORDINATES // Red is the column and green the row, both wrapping at 256, and blue is 0x80
+	};
+
+private:
+	unsigned int width;
+	unsigned int height;
+	content_e content;
+	uint_fast32_t seed;
+
+public:
+	synthetic_image(unsigned int width, unsigned int height, content_e content, uint_fast32_t seed = 1) :
+			width(width), height(height), content(content), seed(seed) { }
+
+	/**
+	 * Returns the red, green and blue values for the given pixel.
+	 */
+	void pixel(unsigned int x, unsigned int y, unsigned char *rgb) const;
+
+	virtual void read_scanline(unsigned int row, unsigned char *rgb);
+
+	/**
+	 * Allocates the given bitmap as RGB with 8 bits per component and stores the whole image in it.
+	 */
+	void fill(bitmap &bitmap) const;
+
+	/**
+	 * Encodes the whole image as a JPEG file with the given options and returns its bytes.
+	 */
+	std::string encode(const jpeg::encode_options &options = jpeg::encode_options());
+};
+
+#endif /* SYNTHETIC_IMAGE_HPP_ */
@@ -0,0 +1,379 @@
+
+#include "table_cache.hpp"
+#include "huffman_tables.hpp"
+#include "jpeg.hpp"
+#include "allocation.hpp"
+
+#include <cstring>
+#include <limits>
+
+namespace
+{
+
+/**
+ * 64 bits FNV-1a hash
+ */
+uint_fast64_t hash_definition(const unsigned char *definition, unsigned int size)
+{
+	uint_fast64_t hash = 0xCBF29CE484222325ULL;
+	for (unsigned int index = 0; index < size; index++)
+	{
+		hash ^= definition[index];
+		hash = (hash * 0x100000001B3ULL) & 0xFFFFFFFFFFFFFFFFULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Builds the table for a definition. Quantization tables need its size, which tells whether their
+ * values take 1 or 2 bytes.
+ */
+template<class TABLE_TYPE>
+TABLE_TYPE *build_table(const unsigned char *definition, unsigned int size)
+{
+	return new TABLE_TYPE(definition);
+}
+
+template<>
+quantization_table *build_table<quantization_table>(const unsigned char *definition, unsigned int size)
+{
+	return new quantization_table(definition, size == 2 * quantization_table::CELL_AMOUNT);
+}
+
+/**
+ * Bytes counted against the cache limit for a table. Huffman tables keep a copy of their
+ * symbols, which take most of their definition.
+ */
+template<class TABLE_TYPE>
+std::size_t table_bytes(std::size_t definition_size)
+{
+	return sizeof(TABLE_TYPE) + 2 * definition_size;
+}
+
+template<class MUTEX>
+class shared_guard
+{
+	MUTEX &mutex;
+
+public:
+	shared_guard(MUTEX &mutex) : mutex(mutex)
+	{
+		mutex.lock_shared();
+	}
+
+	~shared_guard()
+	{
+		mutex.unlock_shared();
+	}
+};
+
+template<class MUTEX>
+class exclusive_guard
+{
+	MUTEX &mutex;
+
+public:
+	exclusive_guard(MUTEX &mutex) : mutex(mutex)
+	{
+		mutex.lock_exclusive();
+	}
+
+	~exclusive_guard()
+	{
+		mutex.unlock_exclusive();
+	}
+};
+
+}
+
+#ifdef PROJECT_PLATFORM_UNIX
+
+table_cache::read_write_mutex::read_write_mutex()
+{
+	pthread_rwlock_init(&lock, NULL);
+}
+
+table_cache::read_write_mutex::~read_write_mutex()
+{
+	pthread_rwlock_destroy(&lock);
+}
+
+void table_cache::read_write_mutex::lock_shared()
+{
+	pthread_rwlock_rdlock(&lock);
+}
+
+void table_cache::read_write_mutex::unlock_shared()
+{
+	pthread_rwlock_unlock(&lock);
+}
+
+void table_cache::read_write_mutex::lock_exclusive()
+{
+	pthread_rwlock_wrlock(&lock);
+}
+
+void table_cache::read_write_mutex::unlock_exclusive()
+{
+	pthread_rwlock_unlock(&lock);
+}
+
+#else // PROJECT_PLATFORM_UNIX
+
+table_cache::read_write_mutex::read_write_mutex()
+{ }
+
+table_cache::read_write_mutex::~read_write_mutex()
+{ }
+
+// Without a shared lock available, lookups are exclusive as well
+void table_cache::read_write_mutex::lock_shared()
+{
+	lock.lock();
+}
+
+void table_cache::read_write_mutex::unlock_shared()
+{
+	lock.unlock();
+}
+
+void table_cache::read_write_mutex::lock_exclusive()
+{
+	lock.lock();
+}
+
+void table_cache::read_write_mutex::unlock_exclusive()
+{
+	lock.unlock();
+}
+
+#endif // PROJECT_PLATFORM_UNIX
+
+table_cache::lease::lease(table_cache &cache) : cache(cache)
+{
+	std::lock_guard<std::mutex> lock(cache.lease_mutex);
+	epoch = cache.epoch;
+	++cache.leases[epoch];
+}
+
+table_cache::lease::~lease()
+{
+	std::lock_guard<std::mutex> lock(cache.lease_mutex);
+	const lease_map_t::iterator it = cache.leases.find(epoch);
+	if (--it->second == 0)
+	{
+		cache.leases.erase(it);
+	}
+
+	cache.release_retired();
+}
+
+table_cache::table_cache(std::size_t max_tables, std::size_t max_bytes) : max_tables(max_tables),
+		max_bytes(max_bytes), bytes(0), _hits(0), _misses(0), _evictions(0), epoch(0)
+{ }
+
+table_cache::~table_cache()
+{
+	for (huffman_map_t::iterator it = huffman_tables.begin(); it != huffman_tables.end(); ++it)
+	{
+		allocation::delete_object(it->second.table);
+	}
+
+	for (quantization_map_t::iterator it = quantization_tables.begin(); it != quantization_tables.end(); ++it)
+	{
+		allocation::delete_object(it->second.table);
+	}
+
+	for (retired_list_t::iterator it = retired.begin(); it != retired.end(); ++it)
+	{
+		allocation::delete_object(it->huffman);
+		allocation::delete_object(it->quantization);
+	}
+}
+
+template<class TABLE_TYPE, class MAP_TYPE>
+const TABLE_TYPE *table_cache::find(MAP_TYPE &map, uint_fast64_t hash, const unsigned char *definition,
+		unsigned int size)
+{
+	std::pair<typename MAP_TYPE::iterator, typename MAP_TYPE::iterator> range = map.equal_range(hash);
+	for (typename MAP_TYPE::iterator it = range.first; it != range.second; ++it)
+	{
+		const definition_t &cached = it->second.definition;
+		if (cached.size() == size && memcmp(cached.data(), definition, size) == 0)
+		{
+			it->second.used.value.store(true, std::memory_order_relaxed);
+			return it->second.table;
+		}
+	}
+
+	return NULL;
+}
+
+template<class TABLE_TYPE, class MAP_TYPE>
+const TABLE_TYPE *table_cache::find_or_build(MAP_TYPE &map, const unsigned char *definition, unsigned int size)
+{
+	const uint_fast64_t hash = hash_definition(definition, size);
+
+	do
+	{
+		shared_guard<read_write_mutex> lock(tables_mutex);
+		const TABLE_TYPE *table = find<TABLE_TYPE>(map, hash, definition, size);
+		if (table != NULL)
+		{
+			++_hits;
+			return table;
+		}
+	} while(0);
+
+	// Another thread may have built it while no lock was held
+	exclusive_guard<read_write_mutex> lock(tables_mutex);
+	const TABLE_TYPE *table = find<TABLE_TYPE>(map, hash, definition, size);
+	if (table != NULL)
+	{
+		++_hits;
+		return table;
+	}
+
+	++_misses;
+	entry<TABLE_TYPE> new_entry;
+	new_entry.definition.assign(reinterpret_cast<const char *>(definition), size);
+	new_entry.table = allocation::counted(build_table<TABLE_TYPE>(definition, size));
+	map.insert(typename MAP_TYPE::value_type(hash, new_entry));
+	bytes += table_bytes<TABLE_TYPE>(size);
+
+	// Tables used since the previous eviction get a second chance
+	const bool unused_only[] = {true, false};
+	for (unsigned int pass = 0; pass < 2 && !within_limits(); pass++)
+	{
+		evict<huffman_table>(huffman_tables, new_entry.table, unused_only[pass]);
+		evict<quantization_table>(quantization_tables, new_entry.table, unused_only[pass]);
+	}
+
+	return new_entry.table;
+}
+
+bool table_cache::within_limits() const
+{
+	return huffman_tables.size() + quantization_tables.size() <= max_tables && bytes <= max_bytes;
+}
+
+template<class TABLE_TYPE, class MAP_TYPE>
+void table_cache::evict(MAP_TYPE &map, const void *kept, bool unused_only)
+{
+	typename MAP_TYPE::iterator it = map.begin();
+	while (it != map.end() && !within_limits())
+	{
+		if (it->second.table == kept || (unused_only && it->second.used.value.exchange(false)))
+		{
+			++it;
+			continue;
+		}
+
+		bytes -= table_bytes<TABLE_TYPE>(it->second.definition.size());
+		retire(it->second.table);
+		++_evictions;
+		it = map.erase(it);
+	}
+}
+
+void table_cache::retire(const huffman_table *table)
+{
+	retired_table retired_entry = {table, NULL, 0};
+	retire(retired_entry);
+}
+
+void table_cache::retire(const quantization_table *table)
+{
+	retired_table retired_entry = {NULL, table, 0};
+	retire(retired_entry);
+}
+
+void table_cache::retire(retired_table &table)
+{
+	std::lock_guard<std::mutex> lock(lease_mutex);
+
+	// Leases taken from now on cannot get this table
+	table.epoch = epoch++;
+	retired.push_back(table);
+	release_retired();
+}
+
+void table_cache::release_retired()
+{
+	const uint_fast64_t oldest_lease = leases.empty()? std::numeric_limits<uint_fast64_t>::max() :
+			leases.begin()->first;
+
+	retired_list_t::iterator kept = retired.begin();
+	for (retired_list_t::iterator it = retired.begin(); it != retired.end(); ++it)
+	{
+		if (it->epoch < oldest_lease)
+		{
+			allocation::delete_object(it->huffman);
+			allocation::delete_object(it->quantization);
+		}
+		else
+		{
+			*kept++ = *it;
+		}
+	}
+	retired.erase(kept, retired.end());
+}
+
+const huffman_table *table_cache::huffman(std::istream &stream, unsigned int max_size)
+{
+	unsigned char definition[huffman_table::MAX_WORD_SIZE + huffman_table::MAX_DEFINED_SYMBOLS];
+	if (max_size < huffman_table::MAX_WORD_SIZE)
+	{
+		return NULL;
+	}
+
+	stream.read(reinterpret_cast<char *>(definition), huffman_table::MAX_WORD_SIZE);
+	if (stream.gcount() != huffman_table::MAX_WORD_SIZE)
+	{
+		return NULL;
+	}
+
+	unsigned int symbols = 0;
+	for (unsigned int index = 0; index < huffman_table::MAX_WORD_SIZE; index++)
+	{
+		symbols += definition[index];
+	}
+
+	// Checked before reading the symbols, as they could belong to the following segment
+	if (symbols > huffman_table::MAX_DEFINED_SYMBOLS || symbols > max_size - huffman_table::MAX_WORD_SIZE)
+	{
+		return NULL;
+	}
+
+	stream.read(reinterpret_cast<char *>(definition + huffman_table::MAX_WORD_SIZE), symbols);
+	if (stream.gcount() != static_cast<std::streamsize>(symbols))
+	{
+		return NULL;
+	}
+
+	return find_or_build<huffman_table>(huffman_tables, definition, huffman_table::MAX_WORD_SIZE + symbols);
+}
+
+const quantization_table *table_cache::quantization(std::istream &stream, bool wide_values)
+{
+	unsigned char definition[2 * quantization_table::CELL_AMOUNT];
+	const unsigned int size = (wide_values? 2 : 1) * quantization_table::CELL_AMOUNT;
+	stream.read(reinterpret_cast<char *>(definition), size);
+	return find_or_build<quantization_table>(quantization_tables, definition, size);
+}
+
+uint_fast32_t table_cache::hits() const
+{
+	return _hits;
+}
+
+uint_fast32_t table_cache::misses() const
+{
+	return _misses;
+}
+
+uint_fast32_t table_cache::evictions() const
+{
+	return _evictions;
+}
@@ -0,0 +1,205 @@
+#ifndef TABLE_CACHE_HPP_
+#define TABLE_CACHE_HPP_
+
+#include <stdint.h>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <unordered_map>
+
+#ifdef PROJECT_PLATFORM_UNIX
+# include <pthread.h>
+#endif // PROJECT_PLATFORM_UNIX
+
+#include "allocation.hpp"
+
+class huffman_table;
+struct quantization_table;
+
+/**
+ * Keeps fully built huffman and quantization tables indexed by the content of the segment they
+ * were defined in. Images coming from the same source usually repeat byte-identical tables, so
+ * sharing a cache across decodes reduces the cost of each table segment to a hash and a lookup.
+ *
+ * All methods are thread-safe. Lookups finding their table only take a shared lock, so decodes
+ * on several threads do not wait for each other unless a table has to be built.
+ *
+ * The cache holds at most max_tables tables taking about max_bytes. Beyond that, tables not used
+ * since the previous eviction go first, and then any other. Returned tables are owned by the
+ * cache and must be treated as read-only. They remain valid while the lease taken before
+ * requesting them is alive, even if evicted meanwhile.
+ */
+class table_cache
+{
+public:
+	enum limits_e
+	{
+		DEFAULT_MAX_TABLES = 1024,
+		DEFAULT_MAX_BYTES = 4 << 20
+	};
+
+	/**
+	 * Keeps the tables returned while it is alive, as decode does for its whole duration.
+	 */
+	class lease
+	{
+		table_cache &cache;
+		uint_fast64_t epoch;
+
+		lease(const lease &other) = delete;
+		lease &operator=(const lease &other) = delete;
+
+	public:
+		lease(table_cache &cache);
+		~lease();
+	};
+
+private:
+	typedef std::basic_string<char, std::char_traits<char>, allocation::container_allocator<char> > definition_t;
+
+	/**
+	 * Set on each hit, which only holds the shared lock, and cleared by evictions.
+	 */
+	struct usage_flag
+	{
+		std::atomic<bool> value;
+
+		usage_flag() : value(true) { }
+		usage_flag(const usage_flag &other) : value(other.value.load(std::memory_order_relaxed)) { }
+	};
+
+	template<class TABLE_TYPE>
+	struct entry
+	{
+		definition_t definition;
+		const TABLE_TYPE *table;
+		mutable usage_flag used;
+	};
+
+	template<class TABLE_TYPE>
+	struct map
+	{
+		typedef std::pair<const uint_fast64_t, entry<TABLE_TYPE> > value_t;
+		typedef std::unordered_multimap<uint_fast64_t, entry<TABLE_TYPE>, std::hash<uint_fast64_t>,
+				std::equal_to<uint_fast64_t>, allocation::container_allocator<value_t> > type;
+	};
+
+	typedef map<huffman_table>::type huffman_map_t;
+	typedef map<quantization_table>::type quantization_map_t;
+
+	/**
+	 * Evicted table, released once no lease taken before its eviction is alive.
+	 */
+	struct retired_table
+	{
+		const huffman_table *huffman;
+		const quantization_table *quantization;
+		uint_fast64_t epoch;
+	};
+
+	typedef std::vector<retired_table, allocation::container_allocator<retired_table> > retired_list_t;
+	typedef std::map<uint_fast64_t, unsigned int, std::less<uint_fast64_t>,
+			allocation::container_allocator<std::pair<const uint_fast64_t, unsigned int> > > lease_map_t;
+
+	/**
+	 * Shared for lookups, exclusive for insertions and evictions.
+	 */
+	class read_write_mutex
+	{
+#ifdef PROJECT_PLATFORM_UNIX
+		pthread_rwlock_t lock;
+#else // PROJECT_PLATFORM_UNIX
+		std::mutex lock;
+#endif // PROJECT_PLATFORM_UNIX
+
+	public:
+		read_write_mutex();
+		~read_write_mutex();
+		void lock_shared();
+		void unlock_shared();
+		void lock_exclusive();
+		void unlock_exclusive();
+	};
+
+	const std::size_t max_tables;
+	const std::size_t max_bytes;
+
+	mutable read_write_mutex tables_mutex;
+	huffman_map_t huffman_tables;
+	quantization_map_t quantization_tables;
+	std::size_t bytes;
+
+	std::atomic<uint_fast32_t> _hits;
+	std::atomic<uint_fast32_t> _misses;
+	std::atomic<uint_fast32_t> _evictions;
+
+	// Guards the leases and the retired tables
+	std::mutex lease_mutex;
+	lease_map_t leases;
+	retired_list_t retired;
+	uint_fast64_t epoch;
+
+	template<class TABLE_TYPE, class MAP_TYPE>
+	const TABLE_TYPE *find(MAP_TYPE &map, uint_fast64_t hash, const unsigned char *definition, unsigned int size);
+
+	template<class TABLE_TYPE, class MAP_TYPE>
+	const TABLE_TYPE *find_or_build(MAP_TYPE &map, const unsigned char *definition, unsigned int size);
+
+	bool within_limits() const;
+
+	template<class TABLE_TYPE, class MAP_TYPE>
+	void evict(MAP_TYPE &map, const void *kept, bool unused_only);
+
+	void retire(const huffman_table *table);
+	void retire(const quantization_table *table);
+	void retire(retired_table &table);
+
+	/**
+	 * Deletes the retired tables that no lease can hold. lease_mutex must be held.
+	 */
+	void release_retired();
+
+	table_cache(const table_cache &other) = delete;
+	table_cache &operator=(const table_cache &other) = delete;
+
+public:
+	table_cache(std::size_t max_tables = DEFAULT_MAX_TABLES, std::size_t max_bytes = DEFAULT_MAX_BYTES);
+	~table_cache();
+
+	/**
+	 * Reads a huffman table definition (symbols per size followed by the symbols) of at most
+	 * max_size bytes from the stream and returns the table for it. The table is only built the
+	 * first time its definition is found, unless evicted since then. NULL is returned, and
+	 * nothing built, if the definition has more than huffman_table::MAX_DEFINED_SYMBOLS symbols,
+	 * takes more than max_size bytes or the stream ends before it.
+	 */
+	const huffman_table *huffman(std::istream &stream, unsigned int max_size);
+
+	/**
+	 * Reads the values of a quantization table from the stream, taking 2 bytes each if
+	 * wide_values is set or a byte otherwise, and returns the table for them. The table is only
+	 * built the first time its values are found, unless evicted since then.
+	 */
+	const quantization_table *quantization(std::istream &stream, bool wide_values = false);
+
+	/**
+	 * Number of tables requested that were already in the cache.
+	 */
+	uint_fast32_t hits() const;
+
+	/**
+	 * Number of tables requested that had to be built.
+	 */
+	uint_fast32_t misses() const;
+
+	/**
+	 * Number of tables removed to keep the cache within its limits.
+	 */
+	uint_fast32_t evictions() const;
+};
+
+#endif /* TABLE_CACHE_HPP_ */
@@ -0,0 +1,204 @@
+
+#include "trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+
+namespace
+{
+
+enum
+{
+	CHUNK_EVENTS = 4096
+};
+
+/**
+ * Fixed amount of events. Only the owner thread writes them, and publishes each one by
+ * increasing size once it is complete.
+ */
+struct chunk
+{
+	trace::event events[CHUNK_EVENTS];
+	std::atomic<unsigned int> size;
+	std::atomic<chunk *> next;
+
+	chunk() : size(0), next(NULL) { }
+};
+
+/**
+ * Events recorded by a single thread. Buffers are never released, so that threads can keep
+ * their pointer to them.
+ */
+struct thread_buffer
+{
+	unsigned int thread_id;
+	chunk *first;
+	chunk *last;
+	thread_buffer *next;
+};
+
+typedef std::chrono::steady_clock trace_clock;
+
+std::atomic<bool> is_recording(false);
+std::atomic<trace_clock::rep> origin(0);
+std::atomic<thread_buffer *> buffers(NULL);
+std::atomic<unsigned int> thread_amount(0);
+
+thread_local thread_buffer *current_buffer = NULL;
+
+thread_buffer *register_thread()
+{
+	thread_buffer *buffer = new thread_buffer;
+	buffer->thread_id = ++thread_amount;
+	buffer->first = new chunk;
+	buffer->last = buffer->first;
+
+	// Lock-free push at the front of the list
+	buffer->next = buffers.load();
+	while (!buffers.compare_exchange_weak(buffer->next, buffer))
+	{ }
+
+	return buffer;
+}
+
+void write_json_string(std::ostream &stream, const char *text)
+{
+	stream << '"';
+	for (; *text != '\0'; text++)
+	{
+		const unsigned char character = *text;
+		if (character == '"' || character == '\\')
+		{
+			stream << '\\' << character;
+		}
+		else if (character < 0x20)
+		{
+			stream << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+					<< static_cast<unsigned int>(character) << std::dec << std::setfill(' ');
+		}
+		else
+		{
+			stream << character;
+		}
+	}
+	stream << '"';
+}
+
+}
+
+void trace::start()
+{
+	for (thread_buffer *buffer = buffers.load(); buffer != NULL; buffer = buffer->next)
+	{
+		chunk *extra = buffer->first->next.load();
+		while (extra != NULL)
+		{
+			chunk *next = extra->next.load();
+			delete extra;
+			extra = next;
+		}
+
+		buffer->first->next = NULL;
+		buffer->first->size = 0;
+		buffer->last = buffer->first;
+	}
+
+	origin = trace_clock::now().time_since_epoch().count();
+	is_recording = true;
+}
+
+void trace::stop()
+{
+	is_recording = false;
+}
+
+bool trace::recording()
+{
+	return is_recording.load(std::memory_order_relaxed);
+}
+
+uint_fast64_t trace::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(trace_clock::duration(
+			trace_clock::now().time_since_epoch().count() - origin.load(std::memory_order_relaxed))).count();
+}
+
+void trace::record(const char *name, const char *category, uint_fast64_t start, uint_fast64_t end,
+		const char *detail, int_fast64_t index)
+{
+	if (!recording())
+	{
+		return;
+	}
+
+	if (current_buffer == NULL)
+	{
+		current_buffer = register_thread();
+	}
+
+	chunk *target = current_buffer->last;
+	unsigned int size = target->size.load(std::memory_order_relaxed);
+	if (size == CHUNK_EVENTS)
+	{
+		chunk *next = new chunk;
+		target->next.store(next, std::memory_order_release);
+		current_buffer->last = next;
+		target = next;
+		size = 0;
+	}
+
+	event &slot = target->events[size];
+	slot.name = name;
+	slot.category = category;
+	slot.detail = detail;
+	slot.index = index;
+	slot.start = start;
+	slot.duration = (end > start)? end - start : 0;
+	target->size.store(size + 1, std::memory_order_release);
+}
+
+void trace::write_chrome_json(std::ostream &stream)
+{
+	stream << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+
+	bool first = true;
+	for (thread_buffer *buffer = buffers.load(); buffer != NULL; buffer = buffer->next)
+	{
+		stream << (first? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+				<< buffer->thread_id << ", \"args\": {\"name\": \"thread " << buffer->thread_id << "\"}}";
+		first = false;
+
+		for (chunk *current = buffer->first; current != NULL; current = current->next.load(std::memory_order_acquire))
+		{
+			const unsigned int size = current->size.load(std::memory_order_acquire);
+			for (unsigned int index = 0; index < size; index++)
+			{
+				const event &event = current->events[index];
+
+				// Chrome expects microseconds
+				stream << ",\n{\"name\": ";
+				write_json_string(stream, event.name);
+				stream << ", \"cat\": ";
+				write_json_string(stream, event.category);
+				stream << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->thread_id << std::fixed
+						<< std::setprecision(3) << ", \"ts\": " << event.start / 1000.0 << ", \"dur\": "
+						<< event.duration / 1000.0 << ", \"args\": {";
+
+				if (event.detail != NULL)
+				{
+					stream << "\"detail\": ";
+					write_json_string(stream, event.detail);
+				}
+
+				if (event.index >= 0)
+				{
+					stream << ((event.detail != NULL)? ", " : "") << "\"index\": " << event.index;
+				}
+				stream << "}}";
+			}
+		}
+	}
+
+	stream << std::endl << "]}" << std::endl;
+}
@@ -0,0 +1,103 @@
+
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#include <stdint.h>
+#include <iostream>
+
+/**
+ * Timeline of spans recorded by any thread, to be exported in the Chrome trace format (readable
+ * by chrome://tracing and Perfetto).
+ *
+ * Each thread appends its spans to its own buffer without locking, so recording costs a clock
+ * read and a few stores. When not recording, each instrumented point costs a single atomic load.
+ *
+ * Names, categories and details are not copied: they must be kept alive until the trace is
+ * written. String literals are the expected usage.
+ */
+namespace trace
+{
+	struct event
+	{
+		const char *name;
+		const char *category;
+
+		/**
+		 * Optional text shown among the span arguments, or NULL.
+		 */
+		const char *detail;
+
+		/**
+		 * Optional number shown among the span arguments, or -1.
+		 */
+		int_fast64_t index;
+
+		/**
+		 * Nanoseconds since recording started.
+		 */
+		uint_fast64_t start;
+		uint_fast64_t duration;
+	};
+
+	/**
+	 * Discards any previous event and starts recording on all threads.
+	 * No span should be open while calling this.
+	 */
+	void start();
+
+	/**
+	 * Stops recording. Events are kept until written or recording starts again.
+	 */
+	void stop();
+
+	bool recording();
+
+	/**
+	 * Nanoseconds since recording started. Only meaningful while recording.
+	 */
+	uint_fast64_t now();
+
+	/**
+	 * Adds a span to the calling thread's buffer, if recording.
+	 */
+	void record(const char *name, const char *category, uint_fast64_t start, uint_fast64_t end,
+			const char *detail = NULL, int_fast64_t index = -1);
+
+	/**
+	 * Writes all recorded events as a Chrome trace JSON document. Events still being recorded by
+	 * other threads may be left out.
+	 */
+	void write_chrome_json(std::ostream &stream);
+
+	/**
+	 * Records the time elapsed between its construction and its destruction.
+	 */
+	class span
+	{
+		const char *name;
+		const char *category;
+		const char *detail;
+		int_fast64_t index;
+		bool active;
+		uint_fast64_t start;
+
+		// Not copyable, it would be recorded twice
+		span(const span &);
+		span &operator=(const span &);
+
+	public:
+		span(const char *name, const char *category, const char *detail = NULL, int_fast64_t index = -1) :
+				name(name), category(category), detail(detail), index(index), active(recording()),
+				start(active? now() : 0) { }
+
+		~span()
+		{
+			if (active)
+			{
+				record(name, category, start, now(), detail, index);
+			}
+		}
+	};
+}
+
+#endif /* TRACE_HPP_ */
@@ -2,10 +2,20 @@
 #include "conf.h"
 
 #include "jpeg.hpp"
+#include "jpeg_markers.hpp"
+#include "jfif.hpp"
+#include "adobe.hpp"
+#include "exif.hpp"
 #include "bmp.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+#include "mcu_index.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
 
 namespace program_result
 {
@@ -14,60 +24,428 @@ namespace program_result
 		OK = 0,
 		INVALID_ARGUMENTS = 1,
 		IO_ERROR = 2,
-		INVALID_FILE_FORMAT = 3
+		INVALID_FILE_FORMAT = 3,
+		IMAGE_TOO_LARGE = 4
 	};
 }
 
+/**
+ * Prints in the console what the decoder finds in the file.
+ */
+class console_diagnostics : public jpeg::diagnostics_sink
+{
+public:
+	virtual void notify(const jpeg::diagnostic_event &event);
+};
+
+void console_diagnostics::notify(const jpeg::diagnostic_event &event)
+{
+	switch (event.warning)
+	{
+	case jpeg::diagnostic_event::NO_WARNING:
+		break;
+
+	case jpeg::diagnostic_event::INVALID_QUANTIZATION_TABLE_ID:
+		std::cerr << "Found invalid quantization table id. Id can be only between 0 and 15" << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_QUANTIZATION_TABLE_SIZE:
+		std::cerr << "Found invalid quantization table. Expected size was 8x8" << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_HUFFMAN_TABLE_SIZE:
+		std::cerr << "Found invalid huffman table. Segment size is " << event.size << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_FRAME_SIZE:
+		std::cerr << "Found invalid frame. Expected size was "
+				<< static_cast<unsigned int>(event.frame->expected_byte_size()) << " but actually was "
+				<< static_cast<unsigned int>(event.size) << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_SCAN_SIZE:
+		std::cerr << "Found invalid scan. Expected size was "
+				<< static_cast<unsigned int>(event.scan->expected_byte_size()) << " but actually was "
+				<< static_cast<unsigned int>(event.size) << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_JFIF:
+		std::cerr << "Found JFIF section but it is not valid" << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_RESTART_INTERVAL_SIZE:
+		std::cerr << "Found invalid restart interval. Expected size was 4 but actually was "
+				<< static_cast<unsigned int>(event.size) << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::UNSUPPORTED_SEGMENT:
+		std::cerr << "Found section with marker " << static_cast<unsigned int>(event.marker)
+				<< " and size " << event.size << ". Ignored!" << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_ADOBE:
+		std::cerr << "Found Adobe section but it is not valid" << std::endl;
+		return;
+
+	case jpeg::diagnostic_event::INVALID_EXIF:
+		std::cerr << "Found EXIF section but it is not valid" << std::endl;
+		return;
+	}
+
+	if (event.marker == jpeg_marker::COMMENT)
+	{
+		const std::string comment(reinterpret_cast<const char *>(event.payload.data), event.payload.size);
+		std::cout << "Found comment: " << comment.c_str() << std::endl;
+	}
+	else if (event.marker == jpeg_marker::JFIF)
+	{
+		const jfif::info jfif_info(event.payload.data);
+
+		const char *density_units = "unknown";
+		switch (jfif_info.density_units())
+		{
+		case jfif::PIXELS_PER_CENTIMETRE:
+			density_units = "pixels/cm";
+			break;
+
+		case jfif::PIXELS_PER_INCH:
+			density_units = "pixels/inch";
+			break;
+
+		default:
+			;
+		}
+
+		std::cout << "Found JFIF v" << static_cast<unsigned int>(jfif_info.major_version())
+					<< "." << static_cast<unsigned int>(jfif_info.minor_version())
+					<< " section:" << std::endl
+					<< " X Density: " << jfif_info.x_density() << ' ' << density_units << std::endl
+					<< " Y Density: " << jfif_info.y_density() << ' ' << density_units << std::endl;
+	}
+	else if (event.marker == jpeg_marker::ADOBE)
+	{
+		const char *transforms[] = {"none", "YCbCr", "YCCK"};
+		const adobe::info adobe_info(event.payload.data);
+		std::cout << "Found Adobe v" << adobe_info.version() << " section with colour transform "
+				<< transforms[adobe_info.transform()] << std::endl;
+	}
+	else if (event.marker == jpeg_marker::EXIF && exif::info::is_exif(event.payload.data, event.payload.size))
+	{
+		const exif::info exif_info(event.payload.data, event.payload.size);
+		std::cout << "Found EXIF section with orientation " << exif_info.orientation() << std::endl;
+	}
+	else if (event.frame != NULL)
+	{
+		std::cout << "Found frame for an image with "
+				<< static_cast<unsigned int>(event.frame->channels_amount)
+				<< " channels of " << static_cast<unsigned int>(event.frame->precision)
+				<< " bits and resolution "
+				<< static_cast<unsigned int>(event.frame->width) << 'x'
+				<< static_cast<unsigned int>(event.frame->height) << std::endl;
+	}
+	else if (event.scan != NULL)
+	{
+		std::cout << "Found scan for an image with "
+				<< static_cast<unsigned int>(event.scan->channels_amount)
+				<< " channels" << std::endl;
+	}
+}
+
+/**
+ * Places the decoded image directly in a BMP file mapped in memory, so no intermediate bitmap
+ * is required. Grayscale images are written as 8 bits BMP files.
+ */
+class bmp_file_allocator : public jpeg::bitmap_allocator
+{
+	const char *path;
+
+	void map(bitmap &bitmap, unsigned int width, unsigned int height, bool gray);
+
+public:
+	bmp_file_allocator(const char *path) : path(path) { }
+
+	virtual void allocate(bitmap &bitmap, unsigned int width, unsigned int height)
+	{
+		map(bitmap, width, height, false);
+	}
+
+	virtual void allocate_gray(bitmap &bitmap, unsigned int width, unsigned int height)
+	{
+		map(bitmap, width, height, true);
+	}
+};
+
+void bmp_file_allocator::map(bitmap &bitmap, unsigned int width, unsigned int height, bool gray)
+{
+	std::cout << "Writing file " << path << std::endl;
+
+	try
+	{
+		bmp::map_output(bitmap, path, width, height, gray);
+	}
+	catch (mapped_file::unable_to_map)
+	{
+		throw jpeg::unable_to_allocate();
+	}
+}
+
+/**
+ * Stops decoding once the preview is available, so that it becomes the decoded image.
+ */
+class stop_at_preview : public jpeg::preview_listener
+{
+public:
+	virtual bool preview(const bitmap &bitmap)
+	{
+		return false;
+	}
+};
+
 int main(int argc, char *argv[])
 {
 	std::cout << "C++ Media Loader" << std::endl
 			<< "This software is under the MIT License" << std::endl
 			<< "Version " PROJECT_VERSION_STR << std::endl << std::endl;
 
-	if (argc < 3)
+	bool print_stats = false;
+	bool validate_only = false;
+	bool preview_only = false;
+	bool luminance_only = false;
+	bool apply_orientation = false;
+	unsigned int max_scans = 0;
+	const char *trace_path = NULL;
+	uint_fast64_t max_pixels = 0;
+	jpeg::region crop;
+	const char *index_path = NULL;
+	const char *origin = NULL;
+	const char *destination = NULL;
+	for (int index = 1; index < argc; index++)
 	{
-		std::cout << "Syntax: " << argv[0] << " <origin-file-name> <destination-file-name>" << std::endl;
+		const std::string argument(argv[index]);
+		if (argument == "--stats")
+		{
+			print_stats = true;
+		}
+		else if (argument == "--validate")
+		{
+			validate_only = true;
+		}
+		else if (argument == "--preview")
+		{
+			preview_only = true;
+		}
+		else if (argument == "--luminance")
+		{
+			luminance_only = true;
+		}
+		else if (argument == "--orientation")
+		{
+			apply_orientation = true;
+		}
+		else if (argument == "--max-scans" && index + 1 < argc)
+		{
+			max_scans = strtoul(argv[++index], NULL, 10);
+		}
+		else if (argument == "--trace" && index + 1 < argc)
+		{
+			trace_path = argv[++index];
+		}
+		else if (argument == "--max-pixels" && index + 1 < argc)
+		{
+			max_pixels = strtoull(argv[++index], NULL, 10);
+		}
+		else if (argument == "--index" && index + 1 < argc)
+		{
+			index_path = argv[++index];
+		}
+		else if (argument == "--crop" && index + 1 < argc)
+		{
+			if (sscanf(argv[++index], "%u,%u,%u,%u", &crop.x, &crop.y, &crop.width, &crop.height) != 4)
+			{
+				crop = jpeg::region();
+			}
+		}
+		else if (origin == NULL)
+		{
+			origin = argv[index];
+		}
+		else if (destination == NULL)
+		{
+			destination = argv[index];
+		}
+	}
+
+	if (origin == NULL || (destination == NULL && !validate_only))
+	{
+		std::cout << "Syntax: " << argv[0] << " [--stats] [--trace <trace-file-name>] [--max-pixels <amount>]"
+				" [--crop <x>,<y>,<width>,<height>] [--index <index-file-name>] [--preview] [--max-scans <amount>]"
+				" [--luminance] [--orientation] <origin-file-name> <destination-file-name>" << std::endl
+				<< "        " << argv[0] << " --validate [--max-pixels <amount>] <origin-file-name>" << std::endl
+				<< "  --stats  Prints the time spent in each decoding stage and the memory allocated" << std::endl
+				<< "  --trace  Writes a timeline of the decoding in the Chrome trace format" << std::endl
+				<< "  --max-pixels  Rejects images with more pixels than the given amount" << std::endl
+				<< "  --crop  Decodes only the given region of the image" << std::endl
+				<< "  --index  Reads the MCU index from the given file to decode the region faster, or builds it there"
+				<< std::endl
+				<< "  --preview  Writes the image at 1/8 of its size, reading only its first scans (progressive files only)"
+				<< std::endl
+				<< "  --max-scans  Stops after the given amount of scans (progressive files only)" << std::endl
+				<< "  --luminance  Writes a grayscale image from the luminance alone" << std::endl
+				<< "  --orientation  Writes the image rotated as its EXIF section says it must be shown" << std::endl
+				<< "  --validate  Only checks that the file can be decoded, without writing anything" << std::endl;
 		return program_result::INVALID_ARGUMENTS;
 	}
 
-	std::ifstream in_stream(argv[1]);
+	std::ifstream in_stream(origin);
 	if (in_stream.fail())
 	{
-		std::cout << "Unable to process file " << argv[1] << std::endl;
+		std::cout << "Unable to process file " << origin << std::endl;
 		return program_result::IO_ERROR;
 	}
 	else
 	{
-		std::cout << "Processing file " << argv[1] << std::endl;
+		std::cout << "Processing file " << origin << std::endl;
 	}
 
-	bitmap bitmap;
+	if (validate_only)
+	{
+		jpeg::decode_options options;
+		options.max_pixels = max_pixels;
+
+		try
+		{
+			const jpeg::validation_result validation = jpeg::validate(in_stream, options);
+			if (validation.valid)
+			{
+				std::cout << "File " << origin << " is valid" << std::endl;
+				return program_result::OK;
+			}
+
+			std::cerr << "File " << origin << " is not a valid JPEG file. First error at byte "
+					<< validation.error_offset << std::endl;
+			return program_result::INVALID_FILE_FORMAT;
+		}
+		catch (jpeg::limit_exceeded)
+		{
+			std::cerr << "File " << origin << " has more than " << max_pixels << " pixels" << std::endl;
+			return program_result::IMAGE_TOO_LARGE;
+		}
+		catch (jpeg::unable_to_allocate)
+		{
+			std::cerr << "Not enough memory to validate file " << origin << std::endl;
+			return program_result::IMAGE_TOO_LARGE;
+		}
+	}
+
+	console_diagnostics diagnostics;
+	bmp_file_allocator allocator(destination);
+	decode_stats stats;
+	jpeg::decode_options options;
+	options.diagnostics = &diagnostics;
+	options.allocator = &allocator;
+	options.stats = print_stats? &stats : NULL;
+	options.max_pixels = max_pixels;
+	options.crop = crop;
+	options.max_scans = max_scans;
+	options.luminance_only = luminance_only;
+	options.apply_orientation = apply_orientation;
+
+	stop_at_preview preview_listener;
+	if (preview_only)
+	{
+		options.preview = &preview_listener;
+	}
+
+	// An index missing or not valid is built and stored for the next time
+	mcu_index index(4);
+	if (index_path != NULL)
+	{
+		std::ifstream index_stream(index_path, std::ios::in | std::ios::binary);
+		try
+		{
+			index.read(index_stream);
+		}
+		catch (mcu_index::invalid_index)
+		{
+			std::ifstream index_input(origin, std::ios::in | std::ios::binary);
+			try
+			{
+				jpeg::build_index(index_input, index);
+
+				std::ofstream index_output(index_path, std::ios::out | std::ios::binary);
+				index.write(index_output);
+				std::cout << "Writing index " << index_path << std::endl;
+			}
+			catch (jpeg::invalid_file_format)
+			{
+				// Reported when decoding
+			}
+			catch (jpeg::limit_exceeded)
+			{ }
+			catch (jpeg::unable_to_allocate)
+			{ }
+		}
+		options.index = &index;
+	}
+
+	// The file is written while decoding and completed when the bitmap is released
+	if (trace_path != NULL)
+	{
+		trace::start();
+	}
+
+	int result = program_result::OK;
 	try
 	{
-		jpeg::decode_image(bitmap, in_stream);
+		trace::span file_span("jpg2bmp", "file", origin);
+		bitmap bitmap;
+		jpeg::decode_image(bitmap, in_stream, options);
 	}
 	catch (jpeg::invalid_file_format)
 	{
-		in_stream.close();
-		std::cerr << "File " << argv[1] << " is not a valid JPEG file" << std::endl;
-		return program_result::INVALID_FILE_FORMAT;
+		std::cerr << "File " << origin << " is not a valid JPEG file" << std::endl;
+		remove(destination);
+		result = program_result::INVALID_FILE_FORMAT;
+	}
+	catch (jpeg::limit_exceeded)
+	{
+		std::cerr << "File " << origin << " has more than " << max_pixels << " pixels" << std::endl;
+		result = program_result::IMAGE_TOO_LARGE;
+	}
+	catch (jpeg::invalid_region)
+	{
+		std::cerr << "The region to decode is outside the image" << std::endl;
+		result = program_result::INVALID_ARGUMENTS;
+	}
+	catch (jpeg::unable_to_allocate)
+	{
+		std::cout << "Unable to create file " << destination << std::endl;
+		result = program_result::IO_ERROR;
 	}
 
 	in_stream.close();
 
-	// Write the result in BMP format
-	std::ofstream out_stream(argv[2]);
-	int result = program_result::OK;
-	if (out_stream.fail())
+	if (trace_path != NULL)
 	{
-		std::cout << "Unable to create file " << argv[2] << std::endl;
-		result = program_result::IO_ERROR;
+		trace::stop();
+
+		std::ofstream trace_stream(trace_path);
+		trace::write_chrome_json(trace_stream);
+		if (trace_stream.fail())
+		{
+			std::cout << "Unable to write trace file " << trace_path << std::endl;
+		}
 	}
-	else
+
+	if (print_stats && result == program_result::OK)
 	{
-		std::cout << "Writing file " << argv[2] << std::endl;
-		bmp::encode_image(bitmap, out_stream);
-		out_stream.close();
+		if (!decode_stats::ENABLED)
+		{
+			std::cout << "Stage times are not available in this build, compile it with STATS_FLAGS=-DPROJECT_DECODE_STATS" << std::endl;
+		}
+
+		std::cout << "Decoding stats:" << std::endl;
+		stats.print(std::cout);
 	}
 
 	return result;
@@ -22,5 +22,8 @@
 
 TEST_BENCH_DECLARATION(jpeg)
 TEST_BENCH_DECLARATION(huffman_tables)
+TEST_BENCH_DECLARATION(bmp)
+TEST_BENCH_DECLARATION(jpeg_encoder)
+TEST_BENCH_DECLARATION(trace)
 
 #endif /* BENCHES_HPP_ */
@@ -0,0 +1,418 @@
+/*
+ * bmp.cpp
+ */
+
+#include "benches.hpp"
+
+#include "bmp.hpp"
+#include "stream_utils.hpp"
+#include "synthetic_image.hpp"
+
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+
+namespace
+{
+
+#define ASSERT(CONDITION, MESSAGE, STREAM) \
+	if (!(CONDITION)) \
+	{ \
+		STREAM << MESSAGE << std::endl; \
+		throw 0; \
+	}
+
+/**
+ * Creates a gray bitmap with a single luminance component whose value is column + row * 16.
+ */
+void make_gray_bitmap(bitmap &bitmap, unsigned int width, unsigned int height)
+{
+	bitmap.width = width;
+	bitmap.height = height;
+	bitmap.bytes_per_pixel = 1;
+	bitmap.bytes_per_scanline = width;
+	bitmap.components_amount = 1;
+	bitmap.components = shared_array<bitmap_component>::make(new bitmap_component[1]);
+	bitmap.components[0].type = bitmap_component::LUMINANCE;
+	bitmap.components[0].bits_per_pixel = 8;
+	bitmap.data = shared_array<unsigned char>::make(new unsigned char[width * height]);
+
+	for (unsigned int row = 0; row < height; row++)
+	{
+		for (unsigned int column = 0; column < width; column++)
+		{
+			bitmap.scanline(row)[column] = column + row * 16;
+		}
+	}
+}
+
+void check_encoded_file(std::ostream &stream, const std::string &file, unsigned int width,
+		unsigned int height, bool top_down)
+{
+	const unsigned int scanline_size = ((width * 3 + 3) / 4) * 4;
+	const unsigned int expected_size = 54 + scanline_size * height;
+	ASSERT(file.size() == expected_size, "Expected file size " << expected_size << " but it was " << file.size(), stream);
+
+	std::stringstream file_stream(file);
+	bmp_header header(file_stream);
+	ASSERT(header.signature[0] == 'B' && header.signature[1] == 'M', "Invalid signature", stream);
+	ASSERT(header.file_size == expected_size, "Invalid file size in header", stream);
+	ASSERT(header.bitmap_offset == 54, "Invalid bitmap offset", stream);
+
+	file_stream.ignore(4);
+	const int32_t file_width = read_little_endian_unsigned_int(file_stream, 4);
+	const int32_t file_height = read_little_endian_unsigned_int(file_stream, 4);
+	ASSERT(file_width == static_cast<int32_t>(width), "Invalid width in header", stream);
+	ASSERT(file_height == (top_down? -static_cast<int32_t>(height) : static_cast<int32_t>(height)),
+			"Invalid height in header", stream);
+
+	for (unsigned int row = 0; row < height; row++)
+	{
+		const unsigned int file_row = top_down? row : height - 1 - row;
+		const unsigned int position = 54 + file_row * scanline_size;
+		for (unsigned int column = 0; column < width; column++)
+		{
+			const unsigned char *pixel = reinterpret_cast<const unsigned char *>(file.data()) + position + column * 3;
+			ASSERT(pixel[0] == 0x80 && pixel[1] == row && pixel[2] == column,
+					"Wrong pixel at (" << column << ',' << row << ')', stream);
+		}
+
+		for (unsigned int padding = width * 3; padding < scanline_size; padding++)
+		{
+			ASSERT(file[position + padding] == 0, "Padding bytes expected to be 0", stream);
+		}
+	}
+}
+
+void test_encode_padded_scanlines(std::ostream &stream)
+{
+	bitmap bitmap;
+	synthetic_image(3, 2, synthetic_image::COORDINATES).fill(bitmap);
+
+	std::stringstream out;
+	bmp::encode_image(bitmap, out);
+	check_encoded_file(stream, out.str(), 3, 2, false);
+}
+
+void test_encode_top_down(std::ostream &stream)
+{
+	bitmap bitmap;
+	synthetic_image(5, 3, synthetic_image::COORDINATES).fill(bitmap);
+
+	bmp::encode_options options;
+	options.top_down = true;
+
+	std::stringstream out;
+	bmp::encode_image(bitmap, out, options);
+	check_encoded_file(stream, out.str(), 5, 3, true);
+}
+
+void check_same_pixels(std::ostream &stream, const bitmap &expected, const bitmap &actual)
+{
+	ASSERT(actual.width == expected.width && actual.height == expected.height, "Invalid size", stream);
+
+	std::vector<bitmap::component_value_t> expected_values(expected.components_amount);
+	std::vector<bitmap::component_value_t> actual_values(actual.components_amount);
+	unsigned int indexes[3];
+	for (unsigned int index = 0; index < actual.components_amount; index++)
+	{
+		for (unsigned int expected_index = 0; expected_index < expected.components_amount; expected_index++)
+		{
+			if (expected.components[expected_index].type == actual.components[index].type)
+			{
+				indexes[index] = expected_index;
+			}
+		}
+	}
+
+	for (unsigned int row = 0; row < expected.height; row++)
+	{
+		for (unsigned int column = 0; column < expected.width; column++)
+		{
+			expected.getPixel(column, row, expected_values.data());
+			actual.getPixel(column, row, actual_values.data());
+			for (unsigned int index = 0; index < actual.components_amount; index++)
+			{
+				ASSERT(actual_values[index] == expected_values[indexes[index]],
+						"Wrong pixel at (" << column << ',' << row << ')', stream);
+			}
+		}
+	}
+}
+
+void test_encode_gray(std::ostream &stream)
+{
+	bitmap bitmap;
+	make_gray_bitmap(bitmap, 5, 3);
+
+	std::stringstream out;
+	bmp::encode_image(bitmap, out);
+	const std::string file = out.str();
+
+	// Headers, 256 colours of 4 bytes and 3 scanlines of 8 bytes
+	const unsigned int expected_size = 54 + 1024 + 8 * 3;
+	ASSERT(file.size() == expected_size, "Expected file size " << expected_size << " but it was " << file.size(), stream);
+
+	std::stringstream file_stream(file);
+	bmp_header header(file_stream);
+	ASSERT(header.file_size == expected_size && header.bitmap_offset == 54 + 1024, "Invalid header", stream);
+
+	const unsigned char *data = reinterpret_cast<const unsigned char *>(file.data());
+	const dib_header info(data + bmp_header::HEADER_SIZE);
+	ASSERT(info.bits_per_pixel == 8 && info.colors_in_palette == 256 &&
+			info.compression_method == dib_header::BI_RGB, "Expected 8 bits per pixel and 256 colours", stream);
+
+	for (unsigned int index = 0; index < 256; index++)
+	{
+		const unsigned char *colour = data + 54 + index * 4;
+		ASSERT(colour[0] == index && colour[1] == index && colour[2] == index && colour[3] == 0,
+				"Palette entry " << index << " is not its gray level", stream);
+	}
+
+	for (unsigned int row = 0; row < 3; row++)
+	{
+		const unsigned char *scanline = data + 54 + 1024 + (2 - row) * 8;
+		for (unsigned int column = 0; column < 5; column++)
+		{
+			ASSERT(scanline[column] == column + row * 16, "Wrong pixel at (" << column << ',' << row << ')', stream);
+		}
+
+		ASSERT(scanline[5] == 0 && scanline[6] == 0 && scanline[7] == 0, "Padding bytes expected to be 0", stream);
+	}
+}
+
+void test_map_gray_output(std::ostream &stream)
+{
+	bitmap original;
+	make_gray_bitmap(original, 7, 4);
+
+	std::stringstream expected;
+	bmp::encode_image(original, expected);
+
+	char path[] = "/tmp/cpp_media_loader_XXXXXX";
+	const int fd = mkstemp(path);
+	ASSERT(fd >= 0, "Unable to create a temporary file", stream);
+	close(fd);
+
+	do
+	{
+		bitmap mapped;
+		bmp::map_output(mapped, path, 7, 4, true);
+		ASSERT(mapped.components_amount == 1 && mapped.components[0].type == bitmap_component::LUMINANCE &&
+				mapped.bytes_per_pixel == 1, "Expected a single luminance component", stream);
+
+		for (unsigned int row = 0; row < 4; row++)
+		{
+			std::copy(original.scanline(row), original.scanline(row) + 7, mapped.scanline(row));
+		}
+	} while(0);
+
+	std::ifstream in_stream(path);
+	std::stringstream written;
+	written << in_stream.rdbuf();
+	in_stream.close();
+	unlink(path);
+
+	ASSERT(written.str() == expected.str(), "Mapped file differs from the one encoded", stream);
+}
+
+void test_decode_encoded_file(std::ostream &stream)
+{
+	bitmap original;
+	synthetic_image(5, 3, synthetic_image::COORDINATES).fill(original);
+
+	std::stringstream file;
+	bmp::encode_image(original, file);
+
+	bitmap decoded;
+	bmp::decode_image(decoded, file);
+
+	ASSERT(decoded.components_amount == 3, "Invalid amount of components", stream);
+	ASSERT(decoded.bottom_up, "Bottom-up file expected to be decoded bottom-up", stream);
+	ASSERT(decoded.bytes_per_scanline == 16, "Scanline size expected to match the file", stream);
+	check_same_pixels(stream, original, decoded);
+}
+
+void test_map_encoded_file(std::ostream &stream)
+{
+	bitmap original;
+	synthetic_image(7, 4, synthetic_image::COORDINATES).fill(original);
+
+	char path[] = "/tmp/cpp_media_loader_XXXXXX";
+	const int fd = mkstemp(path);
+	ASSERT(fd >= 0, "Unable to create a temporary file", stream);
+	close(fd);
+
+	bmp::encode_options options;
+	options.top_down = true;
+
+	std::ofstream out_stream(path);
+	bmp::encode_image(original, out_stream, options);
+	out_stream.close();
+
+	bitmap mapped;
+	try
+	{
+		bmp::map_image(mapped, path);
+	}
+	catch (...)
+	{
+		unlink(path);
+		stream << "Unable to map file " << path << std::endl;
+		throw;
+	}
+
+	// The mapping is still alive after removing the file
+	unlink(path);
+
+	ASSERT(!mapped.bottom_up, "Top-down file expected to be decoded top-down", stream);
+	check_same_pixels(stream, original, mapped);
+}
+
+void test_decode_bitfields(std::ostream &stream)
+{
+	// 2x1 RGB565 with pure red and pure blue pixels
+	bitmap reference;
+	synthetic_image(2, 1, synthetic_image::COORDINATES).fill(reference);
+
+	dib_header info;
+	info.width = 2;
+	info.height = 1;
+	info.bits_per_pixel = 16;
+	info.compression_method = dib_header::BI_BITFIELDS;
+	info.raw_data_size = 4;
+
+	bmp_header header;
+	header.bitmap_offset = bmp_header::HEADER_SIZE + dib_header::HEADER_SIZE + 12;
+	header.file_size = header.bitmap_offset + 4;
+
+	std::stringstream file;
+	header.write_into_stream(file);
+	info.write_into_stream(file);
+	write_little_endian_unsigned_int(file, 0xF800, 4);
+	write_little_endian_unsigned_int(file, 0x07E0, 4);
+	write_little_endian_unsigned_int(file, 0x001F, 4);
+	write_little_endian_unsigned_int(file, 0xF800, 2);
+	write_little_endian_unsigned_int(file, 0x001F, 2);
+
+	bitmap decoded;
+	bmp::decode_image(decoded, file);
+
+	ASSERT(decoded.bytes_per_pixel == 2, "Invalid bytes per pixel", stream);
+	ASSERT(decoded.components[0].type == bitmap_component::BLUE && decoded.components[0].bits_per_pixel == 5 &&
+			decoded.components[1].type == bitmap_component::GREEN && decoded.components[1].bits_per_pixel == 6 &&
+			decoded.components[2].type == bitmap_component::RED && decoded.components[2].bits_per_pixel == 5,
+			"Components do not match the masks", stream);
+
+	bitmap::component_value_t values[3];
+	decoded.getPixel(0, 0, values);
+	ASSERT(values[0] == 0 && values[1] == 0 && values[2] == 1, "First pixel expected to be red", stream);
+	decoded.getPixel(1, 0, values);
+	ASSERT(values[0] == 1 && values[1] == 0 && values[2] == 0, "Second pixel expected to be blue", stream);
+}
+
+/**
+ * Encodes a small RGB file, replaces the 4 bytes at the given position with the given value and
+ * checks that decoding it is rejected as an invalid file.
+ */
+void check_invalid_field(std::ostream &stream, unsigned int position, uint32_t value)
+{
+	bitmap original;
+	synthetic_image(3, 2, synthetic_image::COORDINATES).fill(original);
+
+	std::stringstream encoded;
+	bmp::encode_image(original, encoded);
+	std::string content = encoded.str();
+
+	unsigned char field[4];
+	store_little_endian_unsigned_int(field, value, 4);
+	content.replace(position, 4, reinterpret_cast<const char *>(field), 4);
+
+	std::stringstream file(content);
+	bitmap decoded;
+	try
+	{
+		bmp::decode_image(decoded, file);
+	}
+	catch (bmp::invalid_file_format &)
+	{
+		return;
+	}
+
+	stream << "Value " << value << " at position " << position << " expected to be rejected" << std::endl;
+	throw 0;
+}
+
+void test_invalid_bitmap_offset(std::ostream &stream)
+{
+	// Pixels overlapping the headers
+	check_invalid_field(stream, 10, bmp_header::HEADER_SIZE);
+
+	// Pixels starting beyond the end of the file
+	check_invalid_field(stream, 10, 0xFFFFFFF0);
+}
+
+void test_invalid_height(std::ostream &stream)
+{
+	check_invalid_field(stream, bmp_header::HEADER_SIZE + 8, 0x80000000);
+}
+
+void test_invalid_width(std::ostream &stream)
+{
+	// Scanlines of 3 * width bytes, which wrap around to 4 if taken as 32 bits
+	check_invalid_field(stream, bmp_header::HEADER_SIZE + 4, 1431655766);
+
+	// Scanlines beyond 4 GiB
+	check_invalid_field(stream, bmp_header::HEADER_SIZE + 4, 0x7FFFFFFF);
+}
+
+void test_encode_into_mapped_file(std::ostream &stream)
+{
+	bitmap original;
+	synthetic_image(6, 5, synthetic_image::COORDINATES).fill(original);
+
+	std::stringstream expected;
+	bmp::encode_image(original, expected);
+
+	char path[] = "/tmp/cpp_media_loader_XXXXXX";
+	const int fd = mkstemp(path);
+	ASSERT(fd >= 0, "Unable to create a temporary file", stream);
+	close(fd);
+
+	bmp::encode_image(original, path);
+
+	std::ifstream in_stream(path);
+	std::stringstream written;
+	written << in_stream.rdbuf();
+	in_stream.close();
+	unlink(path);
+
+	ASSERT(written.str() == expected.str(), "Mapped file differs from the one written in a stream", stream);
+}
+
+}
+
+const test_bench_results bmp::test_bench::run() throw()
+{
+	std::vector<test_result> vector;
+	vector.push_back(test("test for BMP scanlines padded to 4 bytes", test_encode_padded_scanlines));
+	vector.push_back(test("test for top-down BMP encoding", test_encode_top_down));
+	vector.push_back(test("test for BMP encoding into a mapped file", test_encode_into_mapped_file));
+	vector.push_back(test("test for 8 bits BMP encoding of gray bitmaps", test_encode_gray));
+	vector.push_back(test("test for mapping a gray BMP file to write into it", test_map_gray_output));
+	vector.push_back(test("test for decoding an encoded BMP file", test_decode_encoded_file));
+	vector.push_back(test("test for mapping an encoded BMP file", test_map_encoded_file));
+	vector.push_back(test("test for decoding 16 bits BI_BITFIELDS BMP file", test_decode_bitfields));
+	vector.push_back(test("test for rejecting BMP pixels out of the file", test_invalid_bitmap_offset));
+	vector.push_back(test("test for rejecting the lowest negative BMP height", test_invalid_height));
+	vector.push_back(test("test for rejecting BMP widths whose scanlines overflow", test_invalid_width));
+
+	test_result *tests = new test_result[vector.size()];
+	test_bench_results result(vector.size(), tests);
+
+	std::copy(vector.begin(), vector.end(), tests);
+	return result;
+}
@@ -8,18 +8,29 @@
 #include "benches.hpp"
 
 #include "jpeg.hpp"
+#include "jpeg_markers.hpp"
+#include "bmp.hpp"
 #include "bitmaps.hpp"
 #include "smart_pointers.hpp"
+#include "allocation.hpp"
+#include "jpeg_encoder.hpp"
+#include "synthetic_image.hpp"
 
 #include <fstream>
 #include <vector>
 #include <algorithm>
 #include <sstream>
+#include <functional>
+#include <cstdlib>
+#include <cmath>
+#include <thread>
+#include <unistd.h>
 
 namespace
 {
 
-void decode_image(bitmap &bitmap, std::ostream &stream, const std::string &filename)
+void decode_image(bitmap &bitmap, std::ostream &stream, const std::string &filename,
+		const jpeg::decode_options &options = jpeg::decode_options())
 {
 	std::stringstream path;
 	path << "test" PROJECT_PATH_FOLDER_SEPARATOR "res" PROJECT_PATH_FOLDER_SEPARATOR;
@@ -35,7 +46,7 @@ void decode_image(bitmap &bitmap, std::ostream &stream, const std::string &filen
 
 	try
 	{
-		jpeg::decode_image(bitmap, in_stream);
+		jpeg::decode_image(bitmap, in_stream, options);
 	}
 	catch (jpeg::invalid_file_format)
 	{
@@ -228,6 +239,2343 @@ void test_black_white_8x8_file(std::ostream &stream)
 	});
 }
 
+void test_shared_table_cache(std::ostream &stream)
+{
+	table_cache cache;
+	jpeg::decode_options options;
+	options.tables = &cache;
+
+	bitmap first_bitmap;
+	decode_image(first_bitmap, stream, "colors_dc16x16.jpg", options);
+
+	const uint_fast32_t built_tables = cache.misses();
+	const uint_fast32_t requested_tables = built_tables + cache.hits();
+	ASSERT(built_tables > 0, "No table was built on the first decode", stream);
+
+	bitmap second_bitmap;
+	decode_image(second_bitmap, stream, "colors_dc16x16.jpg", options);
+
+	ASSERT(cache.misses() == built_tables, "Tables were built again on the second decode", stream);
+	ASSERT(cache.hits() + built_tables == 2 * requested_tables, "Not all tables were reused on the second decode", stream);
+
+	const unsigned int data_size = first_bitmap.bytes_per_scanline * first_bitmap.height;
+	for (unsigned int index = 0; index < data_size; index++)
+	{
+		ASSERT(first_bitmap.data[index] == second_bitmap.data[index],
+				"Decoding with cached tables gives a different result", stream);
+	}
+}
+
+class recording_diagnostics : public jpeg::diagnostics_sink
+{
+public:
+	std::vector<jpeg::diagnostic_event> events;
+	std::string comment;
+
+	virtual void notify(const jpeg::diagnostic_event &event)
+	{
+		events.push_back(event);
+		if (event.marker == jpeg_marker::COMMENT)
+		{
+			comment.assign(reinterpret_cast<const char *>(event.payload.data), event.payload.size);
+		}
+	}
+};
+
+void test_diagnostics_sink(std::ostream &stream)
+{
+	recording_diagnostics diagnostics;
+	jpeg::decode_options options;
+	options.diagnostics = &diagnostics;
+
+	bitmap bitmap;
+	decode_image(bitmap, stream, "colors_dc16x16.jpg", options);
+
+	ASSERT(!diagnostics.events.empty(), "No segment reported", stream);
+	ASSERT(diagnostics.comment == "Created with GIMP", "Unexpected comment: " << diagnostics.comment, stream);
+
+	bool frame_found = false;
+	int_fast64_t previous_offset = 0;
+	for (unsigned int index = 0; index < diagnostics.events.size(); index++)
+	{
+		const jpeg::diagnostic_event &event = diagnostics.events[index];
+		ASSERT(event.warning == jpeg::diagnostic_event::NO_WARNING, "Unexpected warning reported", stream);
+		ASSERT(event.offset > previous_offset, "Segment offsets are not increasing", stream);
+		previous_offset = event.offset;
+
+		if (event.marker == jpeg_marker::START_OF_FRAME_BASELINE_DCT)
+		{
+			frame_found = true;
+		}
+	}
+
+	ASSERT(frame_found, "Frame not reported", stream);
+	ASSERT(diagnostics.events[0].offset == 2, "First segment expected just after the start of image", stream);
+}
+
+class mapped_bmp_allocator : public jpeg::bitmap_allocator
+{
+	const char *path;
+
+public:
+	mapped_bmp_allocator(const char *path) : path(path) { }
+
+	virtual void allocate(bitmap &bitmap, unsigned int width, unsigned int height)
+	{
+		bmp::map_output(bitmap, path, width, height);
+	}
+};
+
+void test_decode_into_mapped_bmp(std::ostream &stream)
+{
+	const char filename[] = "colors_dc16x16.jpg";
+
+	bitmap expected;
+	decode_image(expected, stream, filename);
+
+	char path[] = "/tmp/cpp_media_loader_XXXXXX";
+	const int fd = mkstemp(path);
+	ASSERT(fd >= 0, "Unable to create a temporary file", stream);
+	close(fd);
+
+	mapped_bmp_allocator allocator(path);
+	jpeg::decode_options options;
+	options.allocator = &allocator;
+
+	do
+	{
+		bitmap decoded;
+		decode_image(decoded, stream, filename, options);
+	} while(0);
+
+	bitmap written;
+	bmp::map_image(written, path);
+	unlink(path);
+
+	ASSERT(written.width == expected.width && written.height == expected.height, "Invalid size", stream);
+
+	unsigned char expected_pixel[3];
+	unsigned char written_pixel[3];
+	for (unsigned int row = 0; row < expected.height; row++)
+	{
+		for (unsigned int column = 0; column < expected.width; column++)
+		{
+			expected.getRawPixel(column, row, expected_pixel);
+			written.getRawPixel(column, row, written_pixel);
+			ASSERT(expected_pixel[0] == written_pixel[2] && expected_pixel[1] == written_pixel[1] &&
+					expected_pixel[2] == written_pixel[0], "Wrong pixel at (" << column << ',' << row << ')', stream);
+		}
+	}
+}
+
+void test_decode_stats(std::ostream &stream)
+{
+	decode_stats stats;
+	jpeg::decode_options options;
+	options.stats = &stats;
+
+	bitmap bitmap;
+	decode_image(bitmap, stream, "black_white_plain_block_compressed_16x16.jpg", options);
+
+	if (!decode_stats::ENABLED)
+	{
+		ASSERT(stats.total_nanoseconds() == 0 && stats.blocks_decoded == 0,
+				"Stats filled when they are not enabled", stream);
+		return;
+	}
+
+	// 2 MCUs with 2 luminance blocks and 1 block for each chrominance
+	ASSERT(stats.mcus_decoded == 2, "Expected 2 MCUs but found " << stats.mcus_decoded, stream);
+	ASSERT(stats.blocks_decoded == 8, "Expected 8 blocks but found " << stats.blocks_decoded, stream);
+	ASSERT(stats.dc_only_blocks <= stats.blocks_decoded, "More DC only blocks than blocks", stream);
+	ASSERT(stats.bits_consumed > 0, "No bit consumed", stream);
+	ASSERT(stats.stage_nanoseconds[decode_stats::HUFFMAN_DECODE] > 0, "No time spent decoding huffman", stream);
+	ASSERT(stats.stage_nanoseconds[decode_stats::IDCT] > 0, "No time spent in IDCT", stream);
+	ASSERT(stats.stage_nanoseconds[decode_stats::BMP_ENCODE] == 0, "Time spent encoding while decoding", stream);
+
+	// Stats are reset on every decode
+	decode_image(bitmap, stream, "black_white_plain_block_compressed_16x16.jpg", options);
+	ASSERT(stats.blocks_decoded == 8, "Stats not reset between decodes", stream);
+}
+
+/**
+ * Counts how many times each stage finishes.
+ */
+class counting_listener : public decode_stats::stage_listener
+{
+public:
+	unsigned int finished[decode_stats::STAGE_AMOUNT + 1];
+
+	counting_listener()
+	{
+		std::fill(finished, finished + decode_stats::STAGE_AMOUNT + 1, 0);
+	}
+
+	virtual void stage_finished(decode_stats::stage_e stage)
+	{
+		finished[stage]++;
+	}
+};
+
+void test_decode_stats_listener(std::ostream &stream)
+{
+	counting_listener listener;
+	decode_stats stats;
+	stats.listener = &listener;
+
+	jpeg::decode_options options;
+	options.stats = &stats;
+
+	bitmap bitmap;
+	decode_image(bitmap, stream, "black_white_plain_block_compressed_16x16.jpg", options);
+	ASSERT(stats.listener == &listener, "Listener lost when stats were reset", stream);
+
+	if (!decode_stats::ENABLED)
+	{
+		ASSERT(std::count(listener.finished, listener.finished + decode_stats::STAGE_AMOUNT + 1, 0u) ==
+				decode_stats::STAGE_AMOUNT + 1, "Listener notified when stats are not enabled", stream);
+		return;
+	}
+
+	// Only the blocks of the first row of MCUs are measured one by one in such a small image
+	ASSERT(listener.finished[decode_stats::IDCT] > 0 && listener.finished[decode_stats::IDCT] < stats.blocks_decoded,
+			"IDCT finished " << listener.finished[decode_stats::IDCT] << " times for "
+			<< stats.blocks_decoded << " blocks", stream);
+	ASSERT(listener.finished[decode_stats::COLOR_CONVERSION] > 0, "Color conversion never finished", stream);
+	ASSERT(listener.finished[decode_stats::STAGE_AMOUNT] > 0, "Measuring start not notified", stream);
+}
+
+/**
+ * Counts all allocations and releases notified.
+ */
+class counting_allocation_listener : public allocation::listener
+{
+public:
+	unsigned int allocations;
+	uint_fast64_t allocated_bytes;
+	uint_fast64_t released_bytes;
+
+	counting_allocation_listener() : allocations(0), allocated_bytes(0), released_bytes(0) { }
+
+	virtual void allocated(std::size_t bytes)
+	{
+		allocations++;
+		allocated_bytes += bytes;
+	}
+
+	virtual void released(std::size_t bytes)
+	{
+		released_bytes += bytes;
+	}
+};
+
+void test_decode_allocations(std::ostream &stream)
+{
+	decode_stats stats;
+	jpeg::decode_options options;
+	options.stats = &stats;
+
+	counting_allocation_listener listener;
+	allocation::listener * const previous = allocation::set_listener(&listener);
+	uint_fast64_t image_bytes = 0;
+	{
+		bitmap bitmap;
+		decode_image(bitmap, stream, "black_white_plain_block_compressed_16x16.jpg", options);
+		image_bytes = bitmap.bytes_per_scanline * bitmap.height;
+	}
+	allocation::set_listener(previous);
+
+	ASSERT(listener.allocations > 0, "No allocation accounted", stream);
+	ASSERT(listener.allocated_bytes >= image_bytes, "Only " << listener.allocated_bytes
+			<< " bytes accounted for an image of " << image_bytes << " bytes", stream);
+	ASSERT(listener.allocated_bytes == listener.released_bytes, listener.allocated_bytes << " bytes allocated but "
+			<< listener.released_bytes << " bytes released", stream);
+
+	// The bitmap is released after decoding, so it is the only difference
+	ASSERT(stats.allocations == listener.allocations, "Expected " << listener.allocations
+			<< " allocations in stats but found " << stats.allocations, stream);
+	ASSERT(stats.bytes_allocated == listener.allocated_bytes, "Bytes allocated differ from the listener", stream);
+	ASSERT(stats.peak_bytes >= static_cast<int_fast64_t>(image_bytes) &&
+			static_cast<uint_fast64_t>(stats.peak_bytes) <= stats.bytes_allocated,
+			"Wrong peak of " << stats.peak_bytes << " bytes", stream);
+	ASSERT(stats.live_bytes > 0 && static_cast<uint_fast64_t>(stats.live_bytes) >= image_bytes,
+			"The decoded image should remain allocated", stream);
+}
+
+/**
+ * Returns true if decoding the given file with the given options throws limit_exceeded.
+ */
+bool exceeds_limits(std::ostream &stream, const std::string &filename, const jpeg::decode_options &options)
+{
+	try
+	{
+		bitmap bitmap;
+		decode_image(bitmap, stream, filename, options);
+	}
+	catch (jpeg::limit_exceeded)
+	{
+		return true;
+	}
+
+	return false;
+}
+
+void test_pixel_limit(std::ostream &stream)
+{
+	jpeg::decode_options options;
+	options.max_pixels = 16 * 16 - 1;
+	ASSERT(exceeds_limits(stream, "colors_dc16x16.jpg", options), "16x16 image accepted with a limit of "
+			<< options.max_pixels << " pixels", stream);
+
+	options.max_pixels = 16 * 16;
+	ASSERT(!exceeds_limits(stream, "colors_dc16x16.jpg", options), "16x16 image rejected with a limit of "
+			<< options.max_pixels << " pixels", stream);
+}
+
+void test_memory_budget(std::ostream &stream)
+{
+	// The bitmap alone takes 16 * 16 * 3 bytes
+	jpeg::decode_options options;
+	options.memory_budget = 16 * 16 * 3;
+	ASSERT(exceeds_limits(stream, "colors_dc16x16.jpg", options), "Image accepted with a budget of "
+			<< options.memory_budget << " bytes", stream);
+
+	options.memory_budget = 1024 * 1024;
+	ASSERT(!exceeds_limits(stream, "colors_dc16x16.jpg", options), "Image rejected with a budget of "
+			<< options.memory_budget << " bytes", stream);
+}
+
+void test_huge_frame_rejected(std::ostream &stream)
+{
+	// Start of image and a frame header for a 65535x65535 YCbCr image, and nothing else
+	const unsigned char header[] = {
+		0xFF, 0xD8, 0xFF, 0xC0, 0x00, 0x11, 0x08, 0xFF, 0xFF, 0xFF, 0xFF, 0x03,
+		0x01, 0x22, 0x00, 0x02, 0x11, 0x00, 0x03, 0x11, 0x00
+	};
+	std::istringstream file(std::string(reinterpret_cast<const char *>(header), sizeof(header)));
+
+	jpeg::decode_options options;
+	options.memory_budget = 256 * 1024 * 1024;
+
+	counting_allocation_listener listener;
+	allocation::listener * const previous = allocation::set_listener(&listener);
+	bool rejected = false;
+	try
+	{
+		bitmap bitmap;
+		jpeg::decode_image(bitmap, file, options);
+	}
+	catch (jpeg::limit_exceeded)
+	{
+		rejected = true;
+	}
+	catch (jpeg::invalid_file_format)
+	{ }
+	allocation::set_listener(previous);
+
+	ASSERT(rejected, "Frame of 65535x65535 pixels not rejected", stream);
+	ASSERT(listener.allocated_bytes < 64 * 1024, listener.allocated_bytes << " bytes allocated before rejecting", stream);
+}
+
+/**
+ * Encodes a noisy image, so that every block has AC coefficients.
+ */
+std::string encode_noise(unsigned int width, unsigned int height,
+		const jpeg::encode_options &options = jpeg::encode_options())
+{
+	return synthetic_image(width, height, synthetic_image::NOISE).encode(options);
+}
+
+bool same_pixels(const bitmap &first, const bitmap &second)
+{
+	if (first.width != second.width || first.height != second.height ||
+			first.bytes_per_pixel != second.bytes_per_pixel)
+	{
+		return false;
+	}
+
+	for (unsigned int row = 0; row < first.height; row++)
+	{
+		if (!std::equal(first.scanline(row), first.scanline(row) + first.width * first.bytes_per_pixel,
+				second.scanline(row)))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Decodes the given region and checks that it matches the same pixels in the whole image.
+ */
+void check_crop(std::ostream &stream, const std::string &file, const bitmap &whole, const jpeg::region &crop,
+		unsigned int expected_width, unsigned int expected_height)
+{
+	std::istringstream input(file);
+	jpeg::decode_options options;
+	options.crop = crop;
+
+	bitmap cropped;
+	jpeg::decode_image(cropped, input, options);
+	ASSERT(cropped.width == expected_width && cropped.height == expected_height, "Expected size "
+			<< expected_width << 'x' << expected_height << " but was " << cropped.width << 'x' << cropped.height, stream);
+
+	for (unsigned int row = 0; row < cropped.height; row++)
+	{
+		const unsigned char *cropped_pixel = cropped.scanline(row);
+		const unsigned char *whole_pixel = whole.scanline(row + crop.y) + crop.x * whole.bytes_per_pixel;
+		for (unsigned int index = 0; index < cropped.width * cropped.bytes_per_pixel; index++)
+		{
+			ASSERT(cropped_pixel[index] == whole_pixel[index], "Wrong pixel at (" << index / 3 << ',' << row
+					<< ") for region at (" << crop.x << ',' << crop.y << ')', stream);
+		}
+	}
+}
+
+void test_crop(std::ostream &stream)
+{
+	const unsigned int restart_intervals[] = {0, 3};
+	for (unsigned int index = 0; index < 2; index++)
+	{
+		jpeg::encode_options encoding;
+		encoding.restart_interval = restart_intervals[index];
+		const std::string file = encode_noise(80, 64, encoding);
+
+		std::istringstream input(file);
+		bitmap whole;
+		jpeg::decode_image(whole, input);
+
+		// Not aligned to MCUs, aligned, at the top (skipping the rest of the data) and at the bottom
+		check_crop(stream, file, whole, jpeg::region(13, 21, 30, 9), 30, 9);
+		check_crop(stream, file, whole, jpeg::region(16, 16, 32, 16), 32, 16);
+		check_crop(stream, file, whole, jpeg::region(0, 0, 7, 5), 7, 5);
+		check_crop(stream, file, whole, jpeg::region(70, 60, 10, 4), 10, 4);
+
+		// Clipped to the image
+		check_crop(stream, file, whole, jpeg::region(50, 40, 1000, 1000), 30, 24);
+	}
+}
+
+void test_crop_outside(std::ostream &stream)
+{
+	std::istringstream input(encode_noise(32, 32));
+	jpeg::decode_options options;
+	options.crop = jpeg::region(32, 0, 8, 8);
+
+	try
+	{
+		bitmap bitmap;
+		jpeg::decode_image(bitmap, input, options);
+	}
+	catch (jpeg::invalid_region)
+	{
+		return;
+	}
+
+	stream << "Region outside the image accepted" << std::endl;
+	throw 0;
+}
+
+void test_crop_stats(std::ostream &stream)
+{
+	if (!decode_stats::ENABLED)
+	{
+		return;
+	}
+
+	const std::string file = encode_noise(256, 256);
+	decode_stats whole_stats;
+	decode_stats cropped_stats;
+	jpeg::decode_options options;
+
+	std::istringstream whole_input(file);
+	options.stats = &whole_stats;
+	bitmap whole;
+	jpeg::decode_image(whole, whole_input, options);
+
+	std::istringstream cropped_input(file);
+	options.stats = &cropped_stats;
+	options.crop = jpeg::region(100, 100, 16, 16);
+	bitmap cropped;
+	jpeg::decode_image(cropped, cropped_input, options);
+
+	// Only MCU rows up to the region are read, and few blocks are transformed
+	ASSERT(cropped_stats.mcus_decoded < whole_stats.mcus_decoded, "All MCUs were decoded for a region", stream);
+	ASSERT(cropped_stats.stage_nanoseconds[decode_stats::IDCT] * 10 < whole_stats.stage_nanoseconds[decode_stats::IDCT],
+			"IDCT took " << cropped_stats.stage_nanoseconds[decode_stats::IDCT] << " ns for a region and "
+			<< whole_stats.stage_nanoseconds[decode_stats::IDCT] << " ns for the whole image", stream);
+}
+
+void test_index_serialization(std::ostream &stream)
+{
+	// 4:2:0 MCUs are 16 pixels high, so there are 10 rows of MCUs
+	std::istringstream input(encode_noise(48, 160));
+	mcu_index index(2);
+	jpeg::build_index(input, index);
+	ASSERT(index.entries.size() == 5, "Expected 5 entries but found " << index.entries.size(), stream);
+	ASSERT(index.width == 48 && index.height == 160 && index.channels_amount == 3, "Wrong image in index", stream);
+
+	std::stringstream file;
+	index.write(file);
+
+	mcu_index read_index;
+	read_index.read(file);
+	ASSERT(read_index.rows_per_entry == 2 && read_index.scan_offset == index.scan_offset &&
+			read_index.file_size == index.file_size && read_index.checksum == index.checksum &&
+			read_index.entries.size() == index.entries.size(), "Index read does not match the one written", stream);
+
+	for (unsigned int entry = 0; entry < index.entries.size(); entry++)
+	{
+		const mcu_index::entry &expected = index.entries[entry];
+		const mcu_index::entry &found = read_index.entries[entry];
+		ASSERT(expected.position.byte_offset == found.position.byte_offset &&
+				expected.position.consumed_bits == found.position.consumed_bits &&
+				std::equal(expected.dc_values, expected.dc_values + 3, found.dc_values),
+				"Entry " << entry << " read does not match the one written", stream);
+	}
+
+	std::istringstream truncated(file.str().substr(0, file.str().size() - 1));
+	bool rejected = false;
+	try
+	{
+		read_index.read(truncated);
+	}
+	catch (mcu_index::invalid_index)
+	{
+		rejected = true;
+	}
+	ASSERT(rejected, "Truncated index accepted", stream);
+	ASSERT(read_index.width == 48 && read_index.entries.size() == index.entries.size() &&
+			read_index.entries.back().position.byte_offset == index.entries.back().position.byte_offset,
+			"Index changed by a truncated one", stream);
+}
+
+void test_index_region(std::ostream &stream)
+{
+	const unsigned int restart_intervals[] = {0, 4};
+	for (unsigned int index_number = 0; index_number < 2; index_number++)
+	{
+		jpeg::encode_options encoding;
+		encoding.restart_interval = restart_intervals[index_number];
+		const std::string file = encode_noise(80, 160, encoding);
+		mcu_index index(3);
+		std::istringstream index_input(file);
+		jpeg::build_index(index_input, index);
+
+		const jpeg::region regions[] = {jpeg::region(5, 100, 40, 30), jpeg::region(0, 144, 80, 16),
+				jpeg::region(30, 10, 8, 8)};
+		for (unsigned int region = 0; region < 3; region++)
+		{
+			jpeg::decode_options options;
+			options.crop = regions[region];
+
+			std::istringstream plain_input(file);
+			bitmap plain;
+			jpeg::decode_image(plain, plain_input, options);
+
+			std::istringstream indexed_input(file);
+			decode_stats stats;
+			options.index = &index;
+			options.stats = &stats;
+			bitmap indexed;
+			jpeg::decode_image(indexed, indexed_input, options);
+
+			const unsigned int data_size = plain.bytes_per_scanline * plain.height;
+			ASSERT(indexed.width == plain.width && indexed.height == plain.height &&
+					std::equal(plain.data.get(), plain.data.get() + data_size, indexed.data.get()),
+					"Region " << region << " differs when decoded from the index", stream);
+
+			// Decoding starts at the last row multiple of 3 before the region, with 5 MCUs per row
+			const uint_fast64_t skipped_mcus = (regions[region].y / 16 / 3) * 3 * 5;
+			const uint_fast64_t expected_mcus = ((regions[region].y + regions[region].height + 15) / 16) * 5 - skipped_mcus;
+			ASSERT(!decode_stats::ENABLED || stats.mcus_decoded == expected_mcus, "Expected " << expected_mcus
+					<< " MCUs decoded but were " << stats.mcus_decoded, stream);
+		}
+	}
+}
+
+void test_index_from_other_image(std::ostream &stream)
+{
+	mcu_index index(1);
+	std::istringstream index_input(encode_noise(64, 64));
+	jpeg::build_index(index_input, index);
+
+	// Same encoder settings and then same headers, but different size
+	const std::string file = encode_noise(64, 80);
+	jpeg::decode_options options;
+	options.crop = jpeg::region(0, 48, 16, 16);
+
+	std::istringstream plain_input(file);
+	bitmap plain;
+	jpeg::decode_image(plain, plain_input, options);
+
+	std::istringstream indexed_input(file);
+	options.index = &index;
+	bitmap indexed;
+	jpeg::decode_image(indexed, indexed_input, options);
+
+	ASSERT(std::equal(plain.data.get(), plain.data.get() + plain.bytes_per_scanline * plain.height, indexed.data.get()),
+			"Index from another image was used", stream);
+}
+
+void test_index_from_other_file(std::ostream &stream)
+{
+	// Same size and encoder settings give the same headers, and only the entropy-coded data differs
+	const unsigned int width = 64;
+	const unsigned int height = 80;
+	mcu_index index(1);
+	std::istringstream index_input(encode_noise(width, height));
+	jpeg::build_index(index_input, index);
+
+	const std::string file = synthetic_image(width, height, synthetic_image::COORDINATES).encode();
+
+	jpeg::decode_options options;
+	options.crop = jpeg::region(0, 48, 16, 16);
+
+	std::istringstream plain_input(file);
+	bitmap plain;
+	jpeg::decode_image(plain, plain_input, options);
+
+	std::istringstream indexed_input(file);
+	options.index = &index;
+	bitmap indexed;
+	jpeg::decode_image(indexed, indexed_input, options);
+
+	ASSERT(same_pixels(plain, indexed), "Index from another file with the same headers was used", stream);
+}
+
+void check_validation(std::ostream &stream, const std::string &file, bool expected_valid,
+		int_fast64_t expected_offset)
+{
+	std::istringstream input(file);
+	const jpeg::validation_result result = jpeg::validate(input);
+	ASSERT(result.valid == expected_valid && result.error_offset == expected_offset, "Expected "
+			<< (expected_valid? "valid" : "invalid") << " with offset " << expected_offset << " but was "
+			<< (result.valid? "valid" : "invalid") << " with offset " << result.error_offset, stream);
+}
+
+void test_validate(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.restart_interval = 4;
+	const std::string file = encode_noise(64, 48, encoding);
+	check_validation(stream, file, true, -1);
+
+	// Truncated within the entropy-coded data and just before the end of image marker
+	check_validation(stream, file.substr(0, file.size() / 2), false, file.size() / 2);
+	check_validation(stream, file.substr(0, file.size() - 2), false, file.size() - 2);
+	check_validation(stream, file.substr(0, 100), false, 100);
+}
+
+void test_validate_marker_in_scan(std::ostream &stream)
+{
+	std::string file = encode_noise(64, 48);
+	std::string::size_type position = file.size() / 2;
+	while (static_cast<unsigned char>(file[position - 1]) == 0xFF)
+	{
+		position++;
+	}
+
+	file[position] = static_cast<char>(0xFF);
+	file[position + 1] = static_cast<char>(0xD9);
+	check_validation(stream, file, false, position);
+
+	// Decoding must reject it as well, instead of leaving the exception escape
+	std::istringstream input(file);
+	try
+	{
+		bitmap bitmap;
+		jpeg::decode_image(bitmap, input);
+	}
+	catch (jpeg::invalid_file_format &)
+	{
+		return;
+	}
+
+	stream << "Marker within the entropy-coded data accepted" << std::endl;
+	throw 0;
+}
+
+/**
+ * Inserts a segment just after the start of image whose length field tells the given size, which
+ * includes the length field itself. No other byte of the segment is written.
+ */
+std::string with_segment_length(const std::string &file, unsigned char marker, unsigned int size)
+{
+	const char segment[] = {static_cast<char>(0xFF), static_cast<char>(marker), static_cast<char>(size >> 8),
+			static_cast<char>(size & 0xFF)};
+	return file.substr(0, 2) + std::string(segment, 4) + file.substr(2);
+}
+
+void test_segment_length_below_2(std::ostream &stream)
+{
+	const std::string file = encode_noise(16, 16);
+	recording_diagnostics diagnostics;
+	jpeg::decode_options options;
+	options.diagnostics = &diagnostics;
+
+	for (unsigned int size = 0; size < 2; size++)
+	{
+		const std::string corrupt = with_segment_length(file, jpeg_marker::COMMENT, size);
+		bool rejected = false;
+		try
+		{
+			std::istringstream input(corrupt);
+			bitmap bitmap;
+			jpeg::decode_image(bitmap, input, options);
+		}
+		catch (jpeg::invalid_file_format &)
+		{
+			rejected = true;
+		}
+		ASSERT(rejected, "Comment segment of size " << size << " accepted with a diagnostics sink", stream);
+
+		rejected = false;
+		try
+		{
+			jpeg::incremental_decoder decoder;
+			decoder.feed(reinterpret_cast<const unsigned char *>(corrupt.data()), corrupt.size());
+		}
+		catch (jpeg::invalid_file_format &)
+		{
+			rejected = true;
+		}
+		ASSERT(rejected, "Comment segment of size " << size << " accepted by the incremental decoder", stream);
+	}
+}
+
+/**
+ * Overwrites a byte of the first segment with the given marker, counting from the marker itself.
+ */
+std::string with_segment_byte(const std::string &file, unsigned char marker, unsigned int position,
+		unsigned char value)
+{
+	const char marker_bytes[] = {static_cast<char>(jpeg_marker::MARKER), static_cast<char>(marker)};
+	std::string result(file);
+	result[file.find(std::string(marker_bytes, 2)) + position] = static_cast<char>(value);
+	return result;
+}
+
+/**
+ * Checks that the file is rejected as invalid by both decode_image and validate.
+ */
+void check_rejected(std::ostream &stream, const std::string &file, const char *description)
+{
+	bool rejected = false;
+	try
+	{
+		std::istringstream input(file);
+		bitmap bitmap;
+		jpeg::decode_image(bitmap, input);
+	}
+	catch (jpeg::invalid_file_format &)
+	{
+		rejected = true;
+	}
+	ASSERT(rejected, description << " accepted when decoding", stream);
+
+	std::istringstream input(file);
+	ASSERT(!jpeg::validate(input).valid, description << " accepted when validating", stream);
+}
+
+void test_invalid_headers(std::ostream &stream)
+{
+	const std::string file = encode_noise(16, 16);
+	const unsigned char frame = jpeg_marker::START_OF_FRAME_BASELINE_DCT;
+	const unsigned char scan = jpeg_marker::START_OF_SCAN;
+
+	// The frame channels follow the marker, the length, the precision, the size and their amount
+	const unsigned int first_channel = 10;
+	check_rejected(stream, with_segment_byte(file, frame, first_channel - 1, 0), "Frame without channels");
+	check_rejected(stream, with_segment_byte(file, frame, first_channel + 1, 0x01), "Horizontal sampling factor of 0");
+	check_rejected(stream, with_segment_byte(file, frame, first_channel + 1, 0x10), "Vertical sampling factor of 0");
+	check_rejected(stream, with_segment_byte(file, frame, first_channel + 1, 0x51), "Horizontal sampling factor of 5");
+	check_rejected(stream, with_segment_byte(file, frame, first_channel + 1, 0x15), "Vertical sampling factor of 5");
+	check_rejected(stream, with_segment_byte(file, frame, first_channel + 2, table_list<quantization_table>::MAX_TABLES),
+			"Quantization table id beyond the allowed ones");
+
+	// The amount of scan channels follows the marker and the length
+	check_rejected(stream, with_segment_byte(file, scan, 4, 0), "Scan without channels");
+	check_rejected(stream, with_segment_byte(file, scan, 4, 4), "Scan with more channels than its frame");
+}
+
+void test_invalid_huffman_tables(std::ostream &stream)
+{
+	const std::string file = encode_noise(16, 16);
+	const unsigned char tables = jpeg_marker::HUFFMAN_TABLE;
+
+	// The class and id of the first table follow the marker and the length, then its symbols per size
+	check_rejected(stream, with_segment_byte(file, tables, 4, 0x20), "Huffman table class beyond AC");
+	check_rejected(stream, with_segment_byte(file, tables, 4, 0x04), "Huffman table id beyond 3");
+	check_rejected(stream, with_segment_byte(file, tables, 5, 0xFF), "Huffman table with more than 256 symbols");
+
+	// Nothing is read beyond the given size, nor built from a truncated definition
+	table_cache cache;
+	const std::string definition = std::string(15, '\0') + '\x04' + "\x01\x02\x03\x04";
+	std::istringstream oversized(definition);
+	ASSERT(cache.huffman(oversized, definition.size() - 1) == NULL, "Table beyond its segment accepted", stream);
+	ASSERT(oversized.tellg() == huffman_table::MAX_WORD_SIZE, "Symbols read beyond the segment", stream);
+
+	std::istringstream truncated(definition.substr(0, definition.size() - 1));
+	ASSERT(cache.huffman(truncated, definition.size()) == NULL, "Truncated table accepted", stream);
+	ASSERT(cache.misses() == 0, "Table built from an invalid definition", stream);
+
+	std::istringstream valid(definition);
+	ASSERT(cache.huffman(valid, definition.size()) != NULL && cache.misses() == 1, "Valid table rejected", stream);
+}
+
+/**
+ * Returns the content of a file in the test resources.
+ */
+std::string read_resource(std::ostream &stream, const std::string &filename)
+{
+	const std::string path = "test" PROJECT_PATH_FOLDER_SEPARATOR "res" PROJECT_PATH_FOLDER_SEPARATOR + filename;
+	std::ifstream in_stream(path.c_str(), std::ios::in | std::ios::binary);
+	if (in_stream.fail())
+	{
+		stream << "Unable to open file " << path << std::endl;
+		throw 0;
+	}
+
+	std::ostringstream content;
+	content << in_stream.rdbuf();
+	return content.str();
+}
+
+void test_undefined_tables(std::ostream &stream)
+{
+	const std::string file = read_resource(stream, "colors_dc16x16.jpg");
+	const unsigned char frame = jpeg_marker::START_OF_FRAME_BASELINE_DCT;
+	const unsigned char scan = jpeg_marker::START_OF_SCAN;
+
+	// The first frame channel takes its quantization table after its id and sampling
+	check_rejected(stream, with_segment_byte(file, frame, 12, 200), "Frame selecting quantization table 200");
+	check_rejected(stream, with_segment_byte(file, frame, 12, 5), "Frame selecting an undefined quantization table");
+
+	// The first scan channel takes its huffman tables after its id
+	check_rejected(stream, with_segment_byte(file, scan, 6, 0x33), "Scan selecting undefined huffman tables");
+
+	// Baseline MCUs are decoded in the order of the frame channels
+	check_rejected(stream, with_segment_byte(with_segment_byte(file, scan, 5, 2), scan, 7, 1),
+			"Scan with its channels in another order than its frame");
+}
+
+void test_validate_stats(std::ostream &stream)
+{
+	if (!decode_stats::ENABLED)
+	{
+		return;
+	}
+
+	std::istringstream input(encode_noise(64, 64));
+	decode_stats stats;
+	jpeg::decode_options options;
+	options.stats = &stats;
+
+	ASSERT(jpeg::validate(input, options).valid, "Valid file rejected", stream);
+	ASSERT(stats.blocks_decoded == 8 * 8 * 6 / 4, "Expected all blocks to be huffman decoded but were "
+			<< stats.blocks_decoded, stream);
+	ASSERT(stats.stage_nanoseconds[decode_stats::IDCT] == 0 &&
+			stats.stage_nanoseconds[decode_stats::COLOR_CONVERSION] == 0, "Blocks transformed while validating",
+			stream);
+}
+
+void test_restart_fill_bytes(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.restart_interval = 3;
+	const std::string file = encode_noise(80, 64, encoding);
+
+	// Restart markers can only be found in the entropy-coded data, as 0xFF is stuffed there
+	std::string filled;
+	unsigned int markers = 0;
+	for (std::string::size_type index = 0; index < file.size(); index++)
+	{
+		const unsigned char next = (index + 1 < file.size())? file[index + 1] : 0;
+		if (static_cast<unsigned char>(file[index]) == jpeg_marker::MARKER &&
+				next >= jpeg_marker::RESTART_BASE && next < jpeg_marker::RESTART_BASE + 8)
+		{
+			filled.append("\xFF\xFF");
+			markers++;
+		}
+		filled.push_back(file[index]);
+	}
+	ASSERT(markers > 0, "No restart marker found", stream);
+
+	std::istringstream input(file);
+	bitmap expected;
+	jpeg::decode_image(expected, input);
+
+	std::istringstream filled_input(filled);
+	bitmap decoded;
+	jpeg::decode_image(decoded, filled_input);
+	ASSERT(same_pixels(decoded, expected), "Fill bytes before restart markers changed the image", stream);
+}
+
+void decode_with_cache(const std::vector<std::string> *files, table_cache *cache,
+		std::vector<bitmap> *decoded)
+{
+	jpeg::decode_options options;
+	options.tables = cache;
+	for (unsigned int round = 0; round < 4; round++)
+	{
+		for (unsigned int index = 0; index < files->size(); index++)
+		{
+			std::istringstream input((*files)[index]);
+			jpeg::decode_image((*decoded)[index], input, options);
+		}
+	}
+}
+
+void test_table_cache_limits(std::ostream &stream)
+{
+	// Each quality gives different quantization tables, while huffman tables are always the same
+	std::vector<std::string> files;
+	std::vector<bitmap> expected;
+	const unsigned int qualities[] = {20, 50, 75, 95};
+	for (unsigned int index = 0; index < 4; index++)
+	{
+		jpeg::encode_options encoding;
+		encoding.quality = qualities[index];
+		files.push_back(encode_noise(32, 16, encoding));
+
+		std::istringstream input(files.back());
+		expected.push_back(bitmap());
+		jpeg::decode_image(expected.back(), input);
+	}
+
+	// Fewer tables than a single image needs, so decodes running together evict each other's
+	table_cache cache(3);
+	std::vector<std::vector<bitmap> > decoded(4, std::vector<bitmap>(files.size()));
+	std::vector<std::thread> threads;
+	for (unsigned int index = 0; index < decoded.size(); index++)
+	{
+		threads.push_back(std::thread(decode_with_cache, &files, &cache, &decoded[index]));
+	}
+
+	for (unsigned int index = 0; index < threads.size(); index++)
+	{
+		threads[index].join();
+	}
+
+	ASSERT(cache.evictions() > 0, "No table evicted with a limit of 3 tables", stream);
+	for (unsigned int thread = 0; thread < decoded.size(); thread++)
+	{
+		for (unsigned int index = 0; index < files.size(); index++)
+		{
+			ASSERT(same_pixels(decoded[thread][index], expected[index]), "Wrong image for quality "
+					<< qualities[index] << " in thread " << thread, stream);
+		}
+	}
+}
+
+void test_progressive(std::ostream &stream)
+{
+	const jpeg::sampling_e samplings[] = {jpeg::SAMPLING_444, jpeg::SAMPLING_422, jpeg::SAMPLING_420};
+	const unsigned int restart_intervals[] = {0, 3};
+	for (unsigned int sampling = 0; sampling < 3; sampling++)
+	{
+		for (unsigned int restart = 0; restart < 2; restart++)
+		{
+			// Sizes that are not multiple of the MCU leave blocks out of single component scans
+			jpeg::encode_options encoding;
+			encoding.sampling = samplings[sampling];
+			encoding.restart_interval = restart_intervals[restart];
+			std::istringstream baseline_input(encode_noise(70, 37, encoding));
+			encoding.progressive = true;
+			std::istringstream progressive_input(encode_noise(70, 37, encoding));
+
+			// Same coefficients once all scans are read, so same pixels
+			bitmap baseline;
+			bitmap progressive;
+			jpeg::decode_image(baseline, baseline_input);
+			jpeg::decode_image(progressive, progressive_input);
+			ASSERT(same_pixels(baseline, progressive), "Progressive image differs from baseline for sampling "
+					<< sampling << " and restart interval " << restart_intervals[restart], stream);
+		}
+	}
+}
+
+void test_progressive_crop(std::ostream &stream)
+{
+	std::istringstream baseline_input(encode_noise(96, 80));
+	jpeg::encode_options encoding;
+	encoding.progressive = true;
+	std::istringstream progressive_input(encode_noise(96, 80, encoding));
+
+	jpeg::decode_options options;
+	options.crop = jpeg::region(21, 35, 40, 30);
+
+	bitmap baseline;
+	bitmap progressive;
+	jpeg::decode_image(baseline, baseline_input, options);
+	jpeg::decode_image(progressive, progressive_input, options);
+	ASSERT(progressive.width == 40 && progressive.height == 30, "Wrong size for the region", stream);
+	ASSERT(same_pixels(baseline, progressive), "Progressive region differs from baseline", stream);
+}
+
+void test_progressive_memory(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.sampling = jpeg::SAMPLING_444;
+	encoding.progressive = true;
+	std::istringstream input(encode_noise(256, 256, encoding));
+	decode_stats stats;
+	jpeg::decode_options options;
+	options.stats = &stats;
+
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, input, options);
+
+	// 2 bytes per coefficient, besides the bitmap and some tables
+	const int_fast64_t coefficient_bytes = 256 * 256 * 3 * 2;
+	const int_fast64_t image_bytes = bitmap.bytes_per_scanline * bitmap.height;
+	ASSERT(stats.peak_bytes >= coefficient_bytes + image_bytes &&
+			stats.peak_bytes < coefficient_bytes + image_bytes + 64 * 1024, "Peak of " << stats.peak_bytes
+			<< " bytes for " << coefficient_bytes << " bytes of coefficients", stream);
+}
+
+void test_progressive_validate(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.progressive = true;
+	const std::string file = encode_noise(64, 48, encoding);
+	check_validation(stream, file, true, -1);
+	check_validation(stream, file.substr(0, file.size() - 2), false, file.size() - 2);
+
+	// Bytes within the refinement scans
+	check_validation(stream, file.substr(0, file.size() - 100), false, file.size() - 100);
+}
+
+/**
+ * Keeps the preview it receives, and asks to go on decoding or not.
+ */
+class keeping_preview_listener : public jpeg::preview_listener
+{
+	bool go_on;
+
+public:
+	unsigned int calls;
+	bitmap kept;
+
+	keeping_preview_listener(bool go_on) : go_on(go_on), calls(0) { }
+
+	virtual bool preview(const bitmap &bitmap)
+	{
+		calls++;
+		kept = bitmap;
+		return go_on;
+	}
+};
+
+void test_progressive_preview(std::ostream &stream)
+{
+	// Tiles of a single colour, so each block is as its DC coefficient says
+	synthetic_image image(130, 100, synthetic_image::FLAT);
+	jpeg::encode_options encoding;
+	encoding.progressive = true;
+	const std::string file = image.encode(encoding);
+
+	std::istringstream whole_input(file);
+	bitmap whole;
+	jpeg::decode_image(whole, whole_input);
+
+	keeping_preview_listener listener(true);
+	jpeg::decode_options options;
+	options.preview = &listener;
+
+	std::istringstream input(file);
+	bitmap refined;
+	jpeg::decode_image(refined, input, options);
+
+	ASSERT(listener.calls == 1, "Preview notified " << listener.calls << " times", stream);
+	ASSERT(listener.kept.width == 17 && listener.kept.height == 13, "Expected preview of 17x13 but was "
+			<< listener.kept.width << 'x' << listener.kept.height, stream);
+	ASSERT(same_pixels(whole, refined), "Image refined after the preview differs", stream);
+
+	for (unsigned int y = 0; y < listener.kept.height; y++)
+	{
+		const unsigned char *preview_pixel = listener.kept.scanline(y);
+		for (unsigned int x = 0; x < listener.kept.width * 3; x++)
+		{
+			const unsigned char *whole_pixel = whole.scanline(std::min(y * 8 + 4, whole.height - 1)) +
+					std::min((x / 3) * 8 + 4, whole.width - 1) * 3 + x % 3;
+			const int difference = static_cast<int>(preview_pixel[x]) - *whole_pixel;
+			ASSERT(difference >= -4 && difference <= 4, "Preview pixel at (" << x / 3 << ',' << y << ") is "
+					<< static_cast<unsigned int>(preview_pixel[x]) << " but the block is "
+					<< static_cast<unsigned int>(*whole_pixel), stream);
+		}
+	}
+
+	// Stopping at the preview leaves the rest of the file unread, most of it with detailed content
+	const std::string noise_file = encode_noise(128, 96, encoding);
+	keeping_preview_listener stopping_listener(false);
+	options.preview = &stopping_listener;
+
+	std::istringstream stopped_input(noise_file);
+	bitmap preview;
+	jpeg::decode_image(preview, stopped_input, options);
+
+	ASSERT(stopping_listener.calls == 1, "Preview notified " << stopping_listener.calls << " times", stream);
+	ASSERT(preview.width == 16 && preview.height == 12 && same_pixels(preview, stopping_listener.kept),
+			"Decoded image is not the preview", stream);
+	ASSERT(stopped_input.tellg() < static_cast<std::streampos>(noise_file.size() / 4), "Read up to byte "
+			<< stopped_input.tellg() << " of " << noise_file.size(), stream);
+}
+
+void test_max_scans(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.progressive = true;
+	const std::string file = encode_noise(64, 48, encoding);
+
+	std::istringstream whole_input(file);
+	bitmap whole;
+	jpeg::decode_image(whole, whole_input);
+
+	jpeg::decode_options options;
+	options.max_scans = 1;
+
+	std::istringstream input(file);
+	bitmap blurry;
+	jpeg::decode_image(blurry, input, options);
+	ASSERT(blurry.width == 64 && blurry.height == 48, "Wrong size for the image", stream);
+	ASSERT(!same_pixels(whole, blurry), "Image from the first scan is the same as the whole image", stream);
+
+	// More scans than in the file
+	options.max_scans = 100;
+	std::istringstream all_input(file);
+	bitmap all;
+	jpeg::decode_image(all, all_input, options);
+	ASSERT(same_pixels(whole, all), "Image differs with a limit above the amount of scans", stream);
+
+	// Baseline files have a single scan whatever the limit
+	const std::string baseline_file = encode_noise(64, 48);
+	std::istringstream baseline_input(baseline_file);
+	bitmap baseline;
+	jpeg::decode_image(baseline, baseline_input);
+
+	options.max_scans = 1;
+	std::istringstream limited_input(baseline_file);
+	bitmap limited;
+	jpeg::decode_image(limited, limited_input, options);
+	ASSERT(same_pixels(baseline, limited), "Baseline image differs with a scan limit", stream);
+}
+
+
+/**
+ * Feeds the file in chunks of the given size, checking that each row is final once it is
+ * available. Returns the status after the last chunk.
+ */
+jpeg::incremental_decoder::status_e feed_in_chunks(std::ostream &stream, const std::string &file,
+		const bitmap &whole, jpeg::incremental_decoder &decoder, std::size_t chunk_size)
+{
+	jpeg::incremental_decoder::status_e status = jpeg::incremental_decoder::NEED_MORE_DATA;
+	unsigned int rows = 0;
+	for (std::size_t offset = 0; offset < file.size(); offset += chunk_size)
+	{
+		const std::size_t size = std::min(chunk_size, file.size() - offset);
+		ASSERT(status == jpeg::incremental_decoder::NEED_MORE_DATA, "Complete before byte " << offset, stream);
+		status = decoder.feed(reinterpret_cast<const unsigned char *>(file.data() + offset), size);
+
+		ASSERT(decoder.available_rows() >= rows, "Available rows went from " << rows << " to "
+				<< decoder.available_rows(), stream);
+		for (; rows < decoder.available_rows(); rows++)
+		{
+			const bitmap &image = decoder.image();
+			ASSERT(std::equal(image.scanline(rows), image.scanline(rows) + image.width * 3, whole.scanline(rows)),
+					"Row " << rows << " differs once available at byte " << offset + size, stream);
+		}
+	}
+
+	return status;
+}
+
+void test_incremental(std::ostream &stream)
+{
+	const unsigned int restart_intervals[] = {0, 3};
+	const std::size_t chunk_sizes[] = {3, 37, 1000};
+	for (unsigned int restart = 0; restart < 2; restart++)
+	{
+		jpeg::encode_options encoding;
+		encoding.restart_interval = restart_intervals[restart];
+		const std::string file = encode_noise(80, 64, encoding);
+		std::istringstream input(file);
+		bitmap whole;
+		jpeg::decode_image(whole, input);
+
+		for (unsigned int chunk = 0; chunk < 3; chunk++)
+		{
+			jpeg::incremental_decoder decoder;
+			ASSERT(feed_in_chunks(stream, file, whole, decoder, chunk_sizes[chunk]) ==
+					jpeg::incremental_decoder::COMPLETE, "Not complete in chunks of " << chunk_sizes[chunk], stream);
+			ASSERT(decoder.available_rows() == 64, "Only " << decoder.available_rows() << " rows available", stream);
+			ASSERT(same_pixels(whole, decoder.image()), "Image differs in chunks of " << chunk_sizes[chunk]
+					<< " and restart interval " << restart_intervals[restart], stream);
+		}
+	}
+
+	// Rows are made available as soon as their data arrives
+	const std::string file = encode_noise(64, 256);
+	jpeg::incremental_decoder decoder;
+	decoder.feed(reinterpret_cast<const unsigned char *>(file.data()), file.size() / 2);
+	ASSERT(decoder.available_rows() >= 96 && decoder.available_rows() < 160 && decoder.available_rows() % 16 == 0,
+			decoder.available_rows() << " rows available with half the file", stream);
+
+	// A single wide row arrives in many chunks, each continuing after the last 8 MCUs decoded
+	const std::string wide_file = encode_noise(1024, 16);
+	std::istringstream wide_input(wide_file);
+	bitmap wide;
+	jpeg::decode_image(wide, wide_input);
+
+	decode_stats wide_stats;
+	jpeg::decode_options wide_options;
+	wide_options.stats = &wide_stats;
+	jpeg::incremental_decoder wide_decoder(wide_options);
+	ASSERT(feed_in_chunks(stream, wide_file, wide, wide_decoder, 64) == jpeg::incremental_decoder::COMPLETE,
+			"Wide row not complete", stream);
+	ASSERT(same_pixels(wide, wide_decoder.image()), "Wide row differs", stream);
+
+	const uint_fast64_t calls = (wide_file.size() + 63) / 64;
+	ASSERT(!decode_stats::ENABLED || wide_stats.mcus_decoded <= 64 + calls * 8, wide_stats.mcus_decoded
+			<< " MCUs decoded for a row of 64 in " << calls << " calls", stream);
+
+	// Region at the middle, so that rows before it are decoded but not stored
+	jpeg::decode_options options;
+	options.crop = jpeg::region(8, 40, 48, 72);
+	std::istringstream crop_input(file);
+	bitmap cropped;
+	jpeg::decode_image(cropped, crop_input, options);
+
+	jpeg::incremental_decoder crop_decoder(options);
+	ASSERT(feed_in_chunks(stream, file, cropped, crop_decoder, 100) == jpeg::incremental_decoder::COMPLETE,
+			"Region not complete", stream);
+	ASSERT(same_pixels(cropped, crop_decoder.image()), "Region differs", stream);
+}
+
+void test_incremental_progressive(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.progressive = true;
+	const std::string file = encode_noise(70, 37, encoding);
+	std::istringstream input(file);
+	bitmap whole;
+	jpeg::decode_image(whole, input);
+
+	jpeg::incremental_decoder decoder;
+	ASSERT(feed_in_chunks(stream, file, whole, decoder, 50) == jpeg::incremental_decoder::COMPLETE,
+			"Progressive image not complete", stream);
+	ASSERT(decoder.available_rows() == 37 && same_pixels(whole, decoder.image()), "Progressive image differs", stream);
+}
+
+void test_incremental_errors(std::ostream &stream)
+{
+	const std::string file = encode_noise(64, 48);
+	std::istringstream input(file);
+	bitmap whole;
+	jpeg::decode_image(whole, input);
+
+	// Waiting for the end of image forever
+	jpeg::incremental_decoder truncated;
+	ASSERT(feed_in_chunks(stream, file.substr(0, file.size() - 1), whole, truncated, 64) ==
+			jpeg::incremental_decoder::NEED_MORE_DATA, "Truncated file reported complete", stream);
+
+	// Anything but a marker after the scan data
+	std::string corrupt = file;
+	corrupt[corrupt.size() - 2] = 0x12;
+	jpeg::incremental_decoder corrupt_decoder;
+	bool thrown = false;
+	try
+	{
+		corrupt_decoder.feed(reinterpret_cast<const unsigned char *>(corrupt.data()), corrupt.size());
+	}
+	catch (jpeg::invalid_file_format &)
+	{
+		thrown = true;
+	}
+	ASSERT(thrown, "Corrupt file not rejected", stream);
+
+	thrown = false;
+	try
+	{
+		jpeg::incremental_decoder not_jpeg;
+		not_jpeg.feed(reinterpret_cast<const unsigned char *>("BM"), 2);
+	}
+	catch (jpeg::invalid_file_format &)
+	{
+		thrown = true;
+	}
+	ASSERT(thrown, "File not starting as a JPEG file not rejected", stream);
+}
+
+void test_grayscale(std::ostream &stream)
+{
+	// Tiles of a single colour, so each pixel is as the luminance of its tile
+	synthetic_image image(130, 100, synthetic_image::FLAT);
+	jpeg::encode_options encoding;
+	encoding.grayscale = true;
+	std::istringstream input(image.encode(encoding));
+
+	bitmap gray;
+	jpeg::decode_image(gray, input);
+
+	ASSERT(gray.components_amount == 1 && gray.components[0].type == bitmap_component::LUMINANCE &&
+			gray.components[0].bits_per_pixel == 8 && gray.bytes_per_pixel == 1,
+			"Expected a single luminance component of 8 bits", stream);
+	ASSERT(gray.width == 130 && gray.height == 100 && gray.bytes_per_scanline == 132, "Expected 130x100 with "
+			"scanlines of 132 bytes but was " << gray.width << 'x' << gray.height << " with "
+			<< gray.bytes_per_scanline, stream);
+
+	for (unsigned int y = 0; y < gray.height; y++)
+	{
+		for (unsigned int x = 0; x < gray.width; x++)
+		{
+			unsigned char rgb[3];
+			image.pixel(x, y, rgb);
+			const int luminance = 0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2] + 0.5f;
+			const int difference = gray.scanline(y)[x] - luminance;
+			ASSERT(difference >= -2 && difference <= 2, "Pixel at (" << x << ',' << y << ") is "
+					<< static_cast<unsigned int>(gray.scanline(y)[x]) << " instead of " << luminance, stream);
+		}
+	}
+}
+
+void test_grayscale_progressive(std::ostream &stream)
+{
+	const unsigned int restart_intervals[] = {0, 3};
+	for (unsigned int restart = 0; restart < 2; restart++)
+	{
+		jpeg::encode_options encoding;
+		encoding.grayscale = true;
+		encoding.restart_interval = restart_intervals[restart];
+		std::istringstream baseline_input(encode_noise(70, 37, encoding));
+		encoding.progressive = true;
+		std::istringstream progressive_input(encode_noise(70, 37, encoding));
+
+		bitmap baseline;
+		bitmap progressive;
+		jpeg::decode_image(baseline, baseline_input);
+		jpeg::decode_image(progressive, progressive_input);
+		ASSERT(baseline.bytes_per_pixel == 1 && same_pixels(baseline, progressive),
+				"Progressive image differs from baseline for restart interval " << restart_intervals[restart], stream);
+	}
+
+	jpeg::encode_options encoding;
+	encoding.grayscale = true;
+	encoding.progressive = true;
+	const std::string file = encode_noise(70, 37, encoding);
+	std::istringstream input(file);
+	bitmap whole;
+	jpeg::decode_image(whole, input);
+	check_crop(stream, file, whole, jpeg::region(13, 9, 40, 20), 40, 20);
+
+	keeping_preview_listener listener(true);
+	jpeg::decode_options options;
+	options.preview = &listener;
+
+	std::istringstream preview_input(file);
+	bitmap refined;
+	jpeg::decode_image(refined, preview_input, options);
+	ASSERT(listener.calls == 1 && listener.kept.width == 9 && listener.kept.height == 5 &&
+			listener.kept.bytes_per_pixel == 1, "Expected a gray preview of 9x5", stream);
+}
+
+/**
+ * Allocates RGB bitmaps for any image, as allocators unaware of grayscale images do.
+ */
+class rgb_allocator : public jpeg::bitmap_allocator
+{
+public:
+	virtual void allocate(bitmap &bitmap, unsigned int width, unsigned int height)
+	{
+		bitmap.width = width;
+		bitmap.height = height;
+		bitmap.bytes_per_pixel = 3;
+		bitmap.bytes_per_scanline = width * 3;
+		bitmap.components_amount = 3;
+		bitmap.components = shared_array<bitmap_component>::make(new bitmap_component[3]);
+		bitmap.components[0].type = bitmap_component::RED;
+		bitmap.components[0].bits_per_pixel = 8;
+		bitmap.components[1].type = bitmap_component::GREEN;
+		bitmap.components[1].bits_per_pixel = 8;
+		bitmap.components[2].type = bitmap_component::BLUE;
+		bitmap.components[2].bits_per_pixel = 8;
+		bitmap.data = shared_array<unsigned char>::make(new unsigned char[width * height * 3]);
+	}
+};
+
+void test_grayscale_into_rgb_bitmap(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.grayscale = true;
+	const std::string file = encode_noise(37, 21, encoding);
+	std::istringstream gray_input(file);
+	bitmap gray;
+	jpeg::decode_image(gray, gray_input);
+
+	rgb_allocator allocator;
+	jpeg::decode_options options;
+	options.allocator = &allocator;
+
+	std::istringstream rgb_input(file);
+	bitmap rgb;
+	jpeg::decode_image(rgb, rgb_input, options);
+
+	for (unsigned int y = 0; y < gray.height; y++)
+	{
+		for (unsigned int x = 0; x < gray.width; x++)
+		{
+			const unsigned char luminance = gray.scanline(y)[x];
+			const unsigned char *pixel = rgb.scanline(y) + x * 3;
+			ASSERT(pixel[0] == luminance && pixel[1] == luminance && pixel[2] == luminance, "Pixel at (" << x
+					<< ',' << y << ") is not the gray level " << static_cast<unsigned int>(luminance), stream);
+		}
+	}
+}
+
+void test_grayscale_memory(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.grayscale = true;
+	std::istringstream input(encode_noise(512, 512, encoding));
+	decode_stats stats;
+	jpeg::decode_options options;
+	options.stats = &stats;
+
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, input, options);
+
+	// A byte per pixel, besides some tables
+	const int_fast64_t image_bytes = 512 * 512;
+	ASSERT(stats.peak_bytes >= image_bytes && stats.peak_bytes < image_bytes + 64 * 1024, "Peak of "
+			<< stats.peak_bytes << " bytes for " << image_bytes << " pixels", stream);
+	ASSERT(!decode_stats::ENABLED || stats.stage_nanoseconds[decode_stats::COLOR_CONVERSION] == 0,
+			"Time spent converting colours", stream);
+}
+
+void test_luminance_only(std::ostream &stream)
+{
+	const jpeg::sampling_e samplings[] = {jpeg::SAMPLING_444, jpeg::SAMPLING_422, jpeg::SAMPLING_420};
+	jpeg::decode_options options;
+	options.luminance_only = true;
+
+	// Same luminance blocks in both files, so same pixels
+	jpeg::encode_options gray;
+	gray.grayscale = true;
+	std::istringstream gray_input(encode_noise(70, 37, gray));
+	bitmap expected;
+	jpeg::decode_image(expected, gray_input);
+
+	for (unsigned int sampling = 0; sampling < 3; sampling++)
+	{
+		for (unsigned int progressive = 0; progressive < 2; progressive++)
+		{
+			jpeg::encode_options encoding;
+			encoding.sampling = samplings[sampling];
+			encoding.restart_interval = 3;
+			encoding.progressive = progressive != 0;
+			std::istringstream input(encode_noise(70, 37, encoding));
+			bitmap luminance;
+			jpeg::decode_image(luminance, input, options);
+			ASSERT(luminance.components_amount == 1 && luminance.components[0].type == bitmap_component::LUMINANCE,
+					"Expected a single luminance component", stream);
+			ASSERT(same_pixels(expected, luminance), "Luminance differs from the grayscale image for sampling "
+					<< sampling << (progressive? " in progressive" : ""), stream);
+		}
+	}
+
+	std::istringstream crop_input(encode_noise(70, 37));
+	options.crop = jpeg::region(21, 5, 30, 20);
+	bitmap cropped;
+	jpeg::decode_image(cropped, crop_input, options);
+	for (unsigned int row = 0; row < cropped.height; row++)
+	{
+		ASSERT(std::equal(cropped.scanline(row), cropped.scanline(row) + cropped.width, expected.scanline(row + 5) + 21),
+				"Wrong row " << row << " in the region", stream);
+	}
+}
+
+void test_luminance_only_stats(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.sampling = jpeg::SAMPLING_444;
+	std::istringstream input(encode_noise(256, 256, encoding));
+	decode_stats stats;
+	jpeg::decode_options options;
+	options.stats = &stats;
+	options.luminance_only = true;
+
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, input, options);
+
+	ASSERT(stats.peak_bytes < 256 * 256 + 64 * 1024, "Peak of " << stats.peak_bytes << " bytes", stream);
+	if (!decode_stats::ENABLED)
+	{
+		return;
+	}
+
+	// All blocks read, but only the luminance ones go further
+	ASSERT(stats.blocks_decoded == 32 * 32 * 3, "Expected all blocks to be huffman decoded but were "
+			<< stats.blocks_decoded, stream);
+	ASSERT(stats.stage_nanoseconds[decode_stats::UPSAMPLING] == 0 &&
+			stats.stage_nanoseconds[decode_stats::COLOR_CONVERSION] == 0, "Chrominance upsampled or converted", stream);
+}
+
+/**
+ * Allocates planes with some padding at the end of each row, in NV12 if asked to and the image is
+ * I420.
+ */
+class padded_planar_allocator : public jpeg::planar_allocator
+{
+	bool nv12;
+
+public:
+	std::vector<unsigned char> planes[3];
+	jpeg::planar_format_e native_format;
+
+	padded_planar_allocator(bool nv12 = false) : nv12(nv12), native_format(jpeg::PLANAR_I444) { }
+
+	virtual void allocate(jpeg::planar_image &image)
+	{
+		native_format = image.format;
+		if (nv12 && image.format == jpeg::PLANAR_I420)
+		{
+			image.format = jpeg::PLANAR_NV12;
+		}
+
+		const unsigned int h_ratio = (image.format == jpeg::PLANAR_I444)? 1 : 2;
+		const unsigned int v_ratio = (image.format == jpeg::PLANAR_I420 || image.format == jpeg::PLANAR_NV12)? 2 : 1;
+		const unsigned int chroma_width = (image.width + h_ratio - 1) / h_ratio;
+		const unsigned int chroma_height = (image.height + v_ratio - 1) / v_ratio;
+
+		image.strides[0] = image.width + 5;
+		planes[0].assign(image.strides[0] * image.height, 0);
+		for (unsigned int index = 1; index < ((image.format == jpeg::PLANAR_NV12)? 2 : 3); index++)
+		{
+			image.strides[index] = chroma_width * ((image.format == jpeg::PLANAR_NV12)? 2 : 1) + 3;
+			planes[index].assign(image.strides[index] * chroma_height, 0);
+		}
+
+		for (unsigned int index = 0; index < 3; index++)
+		{
+			image.planes[index] = planes[index].empty()? NULL : &planes[index][0];
+		}
+	}
+};
+
+void test_planar(std::ostream &stream)
+{
+	const jpeg::sampling_e samplings[] = {jpeg::SAMPLING_444, jpeg::SAMPLING_422, jpeg::SAMPLING_420};
+	const jpeg::planar_format_e formats[] = {jpeg::PLANAR_I444, jpeg::PLANAR_I422, jpeg::PLANAR_I420};
+	const unsigned int width = 70;
+	const unsigned int height = 37;
+
+	for (unsigned int sampling = 0; sampling < 3; sampling++)
+	{
+		for (unsigned int progressive = 0; progressive < 2; progressive++)
+		{
+			jpeg::encode_options encoding;
+			encoding.sampling = samplings[sampling];
+			encoding.restart_interval = 3;
+			encoding.progressive = progressive != 0;
+			const std::string file = encode_noise(width, height, encoding);
+			padded_planar_allocator allocator;
+			jpeg::decode_options options;
+			options.planar = &allocator;
+
+			std::istringstream input(file);
+			bitmap untouched;
+			jpeg::decode_image(untouched, input, options);
+			ASSERT(allocator.native_format == formats[sampling], "Wrong format for sampling " << sampling, stream);
+			ASSERT(untouched.data.get() == NULL, "Bitmap set up for planar output", stream);
+
+			// Luminance is the same as decoding it alone
+			std::istringstream luminance_input(file);
+			jpeg::decode_options luminance_options;
+			luminance_options.luminance_only = true;
+			bitmap luminance;
+			jpeg::decode_image(luminance, luminance_input, luminance_options);
+			for (unsigned int row = 0; row < height; row++)
+			{
+				ASSERT(std::equal(luminance.scanline(row), luminance.scanline(row) + width,
+						allocator.planes[0].begin() + row * (width + 5)), "Wrong luminance at row " << row
+						<< " for sampling " << sampling << (progressive? " in progressive" : ""), stream);
+			}
+
+			// Converting the planes gives the same colours the decoder gives, as it upsamples
+			// chrominance by repeating it
+			std::istringstream rgb_input(file);
+			bitmap rgb;
+			jpeg::decode_image(rgb, rgb_input);
+
+			const unsigned int h_ratio = (sampling == 0)? 1 : 2;
+			const unsigned int v_ratio = (sampling == 2)? 2 : 1;
+			const unsigned int chroma_stride = (width + h_ratio - 1) / h_ratio + 3;
+			for (unsigned int y = 0; y < height; y++)
+			{
+				for (unsigned int x = 0; x < width; x++)
+				{
+					const std::size_t chroma_position = (y / v_ratio) * chroma_stride + x / h_ratio;
+					const int luminance_value = allocator.planes[0][y * (width + 5) + x];
+					const int blue_value = allocator.planes[1][chroma_position];
+					const int red_value = allocator.planes[2][chroma_position];
+					if (luminance_value == 0 || luminance_value == 255 || blue_value == 0 || blue_value == 255 ||
+							red_value == 0 || red_value == 255)
+					{
+						// Clamped, the colour cannot be computed back
+						continue;
+					}
+
+					const double expected[] = {luminance_value + 1.402 * (red_value - 128),
+							luminance_value - 0.344136 * (blue_value - 128) - 0.71414 * (red_value - 128),
+							luminance_value + 1.772 * (blue_value - 128)};
+					const unsigned char *pixel = rgb.scanline(y) + x * 3;
+					for (unsigned int component = 0; component < 3; component++)
+					{
+						const double clamped = std::min(255.0, std::max(0.0, expected[component]));
+						ASSERT(std::abs(clamped - pixel[component]) <= 4, "Wrong chrominance at " << x << 'x' << y
+								<< " for sampling " << sampling << (progressive? " in progressive" : ""), stream);
+					}
+				}
+			}
+		}
+	}
+}
+
+void test_planar_nv12(std::ostream &stream)
+{
+	const std::string file = encode_noise(37, 21);
+	padded_planar_allocator planar_allocator;
+	padded_planar_allocator interleaved_allocator(true);
+	jpeg::decode_options options;
+	bitmap bitmap;
+
+	std::istringstream planar_input(file);
+	options.planar = &planar_allocator;
+	jpeg::decode_image(bitmap, planar_input, options);
+
+	std::istringstream interleaved_input(file);
+	options.planar = &interleaved_allocator;
+	jpeg::decode_image(bitmap, interleaved_input, options);
+
+	ASSERT(planar_allocator.planes[0] == interleaved_allocator.planes[0], "Luminance differs in NV12", stream);
+	ASSERT(interleaved_allocator.planes[2].empty(), "Third plane allocated in NV12", stream);
+
+	// 19x11 samples of each chrominance component
+	for (unsigned int row = 0; row < 11; row++)
+	{
+		for (unsigned int column = 0; column < 19; column++)
+		{
+			const unsigned char *pair = &interleaved_allocator.planes[1][row * (19 * 2 + 3) + column * 2];
+			ASSERT(pair[0] == planar_allocator.planes[1][row * (19 + 3) + column] &&
+					pair[1] == planar_allocator.planes[2][row * (19 + 3) + column],
+					"Wrong chrominance pair at " << column << 'x' << row, stream);
+		}
+	}
+
+	// Padding is not written
+	ASSERT(interleaved_allocator.planes[1][19 * 2] == 0 && interleaved_allocator.planes[0][37] == 0,
+			"Padding written", stream);
+}
+
+void test_planar_unsupported(std::ostream &stream)
+{
+	padded_planar_allocator allocator;
+	jpeg::decode_options options;
+	options.planar = &allocator;
+
+	bool thrown = false;
+	try
+	{
+		jpeg::encode_options encoding;
+		encoding.grayscale = true;
+		std::istringstream input(encode_noise(16, 16, encoding));
+		bitmap bitmap;
+		jpeg::decode_image(bitmap, input, options);
+	}
+	catch (jpeg::unsupported_output &)
+	{
+		thrown = true;
+	}
+	ASSERT(thrown, "Expected grayscale images to be rejected", stream);
+
+	thrown = false;
+	try
+	{
+		bitmap bitmap;
+		decode_image(bitmap, stream, "black_white_plain_block_compressed_16x16_Y12.jpg", options);
+	}
+	catch (jpeg::unsupported_output &)
+	{
+		thrown = true;
+	}
+	ASSERT(thrown, "Expected chrominance sampled 4:4:0 to be rejected", stream);
+}
+
+void test_planar_stats(std::ostream &stream)
+{
+	std::istringstream input(encode_noise(256, 256));
+	decode_stats stats;
+	padded_planar_allocator allocator;
+	jpeg::decode_options options;
+	options.stats = &stats;
+	options.planar = &allocator;
+
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, input, options);
+
+	ASSERT(!decode_stats::ENABLED || (stats.stage_nanoseconds[decode_stats::UPSAMPLING] == 0 &&
+			stats.stage_nanoseconds[decode_stats::COLOR_CONVERSION] == 0), "Chrominance upsampled or converted", stream);
+
+	// Planes are given by the allocator, so only a MCU of blocks is allocated
+	ASSERT(stats.peak_bytes < 64 * 1024, "Peak of " << stats.peak_bytes << " bytes", stream);
+}
+
+/**
+ * Reads red, green and blue from a pixel in the given output format, expanding RGB565 values to
+ * 8 bits by shifting them.
+ */
+void read_packed_pixel(jpeg::output_format_e format, const unsigned char *pixel, unsigned char *rgb)
+{
+	switch (format)
+	{
+	case jpeg::OUTPUT_BGR888:
+	case jpeg::OUTPUT_BGRX8888:
+		rgb[0] = pixel[2];
+		rgb[1] = pixel[1];
+		rgb[2] = pixel[0];
+		break;
+
+	case jpeg::OUTPUT_RGB565:
+		rgb[0] = (pixel[1] >> 3) << 3;
+		rgb[1] = (((pixel[1] & 7) << 3) | (pixel[0] >> 5)) << 2;
+		rgb[2] = (pixel[0] & 0x1F) << 3;
+		break;
+
+	default:
+		std::copy(pixel, pixel + 3, rgb);
+	}
+}
+
+void test_output_formats(std::ostream &stream)
+{
+	const jpeg::output_format_e formats[] = {jpeg::OUTPUT_RGB888, jpeg::OUTPUT_BGR888, jpeg::OUTPUT_RGBA8888,
+			jpeg::OUTPUT_BGRX8888, jpeg::OUTPUT_RGB565};
+	const unsigned int bytes_per_pixel[] = {3, 3, 4, 4, 2};
+	const unsigned int components_amount[] = {3, 3, 4, 3, 3};
+
+	const std::string file = encode_noise(37, 21);
+	std::istringstream rgb_input(file);
+	bitmap rgb;
+	jpeg::decode_image(rgb, rgb_input);
+
+	for (unsigned int index = 0; index < sizeof(formats) / sizeof(formats[0]); index++)
+	{
+		jpeg::decode_options options;
+		options.output_format = formats[index];
+		std::istringstream input(file);
+		bitmap packed;
+		jpeg::decode_image(packed, input, options);
+
+		ASSERT(packed.width == 37 && packed.height == 21 && packed.bytes_per_pixel == bytes_per_pixel[index] &&
+				packed.components_amount == components_amount[index], "Wrong layout for format " << index, stream);
+		ASSERT(packed.bytes_per_scanline % 4 == 0 && packed.bytes_per_scanline >= 37 * bytes_per_pixel[index],
+				"Wrong scanline size for format " << index, stream);
+
+		const unsigned char mask = (formats[index] == jpeg::OUTPUT_RGB565)? 0xF8 : 0xFF;
+		const unsigned char green_mask = (formats[index] == jpeg::OUTPUT_RGB565)? 0xFC : 0xFF;
+		for (unsigned int y = 0; y < packed.height; y++)
+		{
+			for (unsigned int x = 0; x < packed.width; x++)
+			{
+				const unsigned char *expected = rgb.scanline(y) + x * 3;
+				const unsigned char *pixel = packed.scanline(y) + x * bytes_per_pixel[index];
+				unsigned char values[3];
+				read_packed_pixel(formats[index], pixel, values);
+				ASSERT(values[0] == (expected[0] & mask) && values[1] == (expected[1] & green_mask) &&
+						values[2] == (expected[2] & mask), "Wrong pixel at " << x << 'x' << y << " for format "
+						<< index, stream);
+
+				// Opaque for bitmap_component::ALPHA is 0, while the unused byte of BGRX is 0xFF
+				ASSERT(formats[index] != jpeg::OUTPUT_RGBA8888 || pixel[3] == 0, "Alpha is not opaque", stream);
+				ASSERT(formats[index] != jpeg::OUTPUT_BGRX8888 || pixel[3] == 0xFF, "Unused byte is not set", stream);
+			}
+		}
+	}
+}
+
+bool close_to(unsigned int value, unsigned int expected, unsigned int tolerance)
+{
+	return value + tolerance >= expected && value <= expected + tolerance;
+}
+
+/**
+ * Reads a 16 bits component, least significant byte first.
+ */
+unsigned int read_word(const unsigned char *position)
+{
+	return position[0] | (position[1] << 8);
+}
+
+/**
+ * 12 bits samples in the files with that precision, scaled to 16 bits. Grayscale files have the
+ * first one, and colour ones have red, green and blue.
+ */
+void precision_12_fixture_pixel(unsigned int x, unsigned int y, unsigned int *pixel)
+{
+	const unsigned int samples[] = {x * 100 + y * 25, x * 120, y * 120, 4095 - x * 60 - y * 60};
+	for (unsigned int index = 0; index < 4; index++)
+	{
+		pixel[index] = samples[index] * 65535 / 4095;
+	}
+}
+
+void test_precision_12(std::ostream &stream)
+{
+	// Steps of 25 and 100 would be lost in 8 bits, so 2 levels of 12 bits are the tolerance
+	const char *gray_files[] = {"gray12_32x32.jpg", "gray12_progressive_32x32.jpg"};
+	for (unsigned int file = 0; file < sizeof(gray_files) / sizeof(gray_files[0]); file++)
+	{
+		bitmap gray;
+		decode_image(gray, stream, gray_files[file]);
+		ASSERT(gray.width == 32 && gray.height == 32 && gray.bytes_per_pixel == 2 && gray.components_amount == 1 &&
+				gray.components[0].type == bitmap_component::LUMINANCE && gray.components[0].bits_per_pixel == 16,
+				"Expected a 16 bits luminance bitmap for " << gray_files[file], stream);
+
+		for (unsigned int y = 0; y < gray.height; y++)
+		{
+			for (unsigned int x = 0; x < gray.width; x++)
+			{
+				unsigned int expected[4];
+				precision_12_fixture_pixel(x, y, expected);
+				const unsigned int value = read_word(gray.scanline(y) + x * 2);
+				ASSERT(close_to(value, expected[0], 32), "Wrong luminance at " << x << 'x' << y << " for "
+						<< gray_files[file] << ": " << value << " instead of " << expected[0], stream);
+			}
+		}
+	}
+
+	bitmap rgb;
+	decode_image(rgb, stream, "ycbcr12_32x32.jpg");
+	ASSERT(rgb.bytes_per_pixel == 6 && rgb.components_amount == 3 && rgb.components[0].type == bitmap_component::RED &&
+			rgb.components[0].bits_per_pixel == 16, "Expected a RGB bitmap of 16 bits each", stream);
+
+	for (unsigned int y = 0; y < rgb.height; y++)
+	{
+		for (unsigned int x = 0; x < rgb.width; x++)
+		{
+			unsigned int expected[4];
+			precision_12_fixture_pixel(x, y, expected);
+			for (unsigned int component = 0; component < 3; component++)
+			{
+				const unsigned int value = read_word(rgb.scanline(y) + x * 6 + component * 2);
+				ASSERT(close_to(value, expected[component + 1], 64), "Wrong colour at " << x << 'x' << y << ": "
+						<< value << " instead of " << expected[component + 1], stream);
+			}
+		}
+	}
+}
+
+void test_precision_12_reduced(std::ostream &stream)
+{
+	// Components of 8 bits take the highest 8 bits of each sample
+	jpeg::decode_options options;
+	options.output_format = jpeg::OUTPUT_RGB888;
+
+	bitmap gray;
+	decode_image(gray, stream, "gray12_32x32.jpg", options);
+	bitmap rgb;
+	decode_image(rgb, stream, "ycbcr12_32x32.jpg", options);
+	ASSERT(gray.bytes_per_pixel == 3 && rgb.bytes_per_pixel == 3, "Expected RGB888 bitmaps", stream);
+
+	for (unsigned int y = 0; y < rgb.height; y++)
+	{
+		for (unsigned int x = 0; x < rgb.width; x++)
+		{
+			unsigned int expected[4];
+			precision_12_fixture_pixel(x, y, expected);
+			for (unsigned int component = 0; component < 3; component++)
+			{
+				ASSERT(close_to(gray.scanline(y)[x * 3 + component], expected[0] >> 8, 1),
+						"Wrong luminance at " << x << 'x' << y, stream);
+				ASSERT(close_to(rgb.scanline(y)[x * 3 + component], expected[component + 1] >> 8, 1),
+						"Wrong colour at " << x << 'x' << y, stream);
+			}
+		}
+	}
+}
+
+void test_output_format_rgb161616(std::ostream &stream)
+{
+	// 8 bits samples are scaled to the whole 16 bits range
+	jpeg::encode_options encoding;
+	encoding.sampling = jpeg::SAMPLING_422;
+	const std::string file = encode_noise(21, 13, encoding);
+	std::istringstream rgb_input(file);
+	bitmap rgb;
+	jpeg::decode_image(rgb, rgb_input);
+
+	jpeg::decode_options options;
+	options.output_format = jpeg::OUTPUT_RGB161616;
+	std::istringstream wide_input(file);
+	bitmap wide;
+	jpeg::decode_image(wide, wide_input, options);
+	ASSERT(wide.width == 21 && wide.height == 13 && wide.bytes_per_pixel == 6 && wide.components_amount == 3,
+			"Wrong layout for RGB161616", stream);
+
+	for (unsigned int y = 0; y < wide.height; y++)
+	{
+		for (unsigned int x = 0; x < wide.width; x++)
+		{
+			for (unsigned int component = 0; component < 3; component++)
+			{
+				const unsigned int value = read_word(wide.scanline(y) + x * 6 + component * 2);
+				const unsigned int expected = rgb.scanline(y)[x * 3 + component];
+				ASSERT(close_to(value >> 8, expected, 1), "Wrong pixel at " << x << 'x' << y << ": " << value
+						<< " for " << expected, stream);
+			}
+		}
+	}
+
+	// Only 8 and 12 bits samples are valid for DCT frames
+	std::string invalid = file;
+	const std::size_t frame = invalid.find("\xFF\xC0");
+	ASSERT(frame != std::string::npos, "Frame header not found", stream);
+	invalid[frame + 4] = 16;
+
+	bool thrown = false;
+	try
+	{
+		std::istringstream input(invalid);
+		bitmap bitmap;
+		jpeg::decode_image(bitmap, input);
+	}
+	catch (jpeg::invalid_file_format &)
+	{
+		thrown = true;
+	}
+	ASSERT(thrown, "Expected a precision of 16 bits to be rejected", stream);
+}
+
+/**
+ * Ink amounts of each pixel in the CMYK and YCCK files, 255 meaning full ink. They are written
+ * inverted, as Adobe applications do.
+ */
+void adobe_fixture_ink(unsigned int x, unsigned int y, unsigned int *ink)
+{
+	ink[0] = x * 8;
+	ink[1] = y * 8;
+	ink[2] = 248 - x * 8;
+	ink[3] = (x + y) * 4;
+}
+
+void test_adobe_cmyk(std::ostream &stream)
+{
+	// Chroma in the YCCK files is subsampled, losing part of the horizontal and vertical gradients
+	const char *files[] = {"cmyk_adobe_32x32.jpg", "ycck_adobe_32x32.jpg", "ycck_adobe_progressive_32x32.jpg"};
+	const unsigned int tolerances[] = {4, 10, 10};
+	for (unsigned int file = 0; file < sizeof(files) / sizeof(files[0]); file++)
+	{
+		bitmap bitmap;
+		decode_image(bitmap, stream, files[file]);
+		ASSERT(bitmap.width == 32 && bitmap.height == 32 && bitmap.bytes_per_pixel == 3,
+				"Expected a RGB bitmap of 32x32 for " << files[file], stream);
+
+		for (unsigned int y = 0; y < bitmap.height; y++)
+		{
+			for (unsigned int x = 0; x < bitmap.width; x++)
+			{
+				unsigned int ink[4];
+				adobe_fixture_ink(x, y, ink);
+				const unsigned char *pixel = bitmap.scanline(y) + x * 3;
+				for (unsigned int component = 0; component < 3; component++)
+				{
+					const unsigned int expected = (255 - ink[component]) * (255 - ink[3]) / 255;
+					ASSERT(close_to(pixel[component], expected, tolerances[file]), "Wrong colour at " << x << 'x' << y << " for "
+							<< files[file] << ": " << static_cast<unsigned int>(pixel[component]) << " instead of "
+							<< expected, stream);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Allocates bitmaps with cyan, magenta, yellow and black bytes for CMYK images, and RGB ones for
+ * the rest.
+ */
+class cmyk_allocator : public rgb_allocator
+{
+public:
+	virtual void allocate_cmyk(bitmap &bitmap, unsigned int width, unsigned int height)
+	{
+		const bitmap_component::type_e types[] = {bitmap_component::CYAN, bitmap_component::MAGENTA,
+				bitmap_component::YELLOW, bitmap_component::BLACK};
+
+		bitmap.width = width;
+		bitmap.height = height;
+		bitmap.bytes_per_pixel = 4;
+		bitmap.bytes_per_scanline = width * 4;
+		bitmap.components_amount = 4;
+		bitmap.components = shared_array<bitmap_component>::make(new bitmap_component[4]);
+		for (unsigned int index = 0; index < 4; index++)
+		{
+			bitmap.components[index].type = types[index];
+			bitmap.components[index].bits_per_pixel = 8;
+		}
+		bitmap.data = shared_array<unsigned char>::make(new unsigned char[width * height * 4]);
+	}
+};
+
+void test_adobe_cmyk_bitmap(std::ostream &stream)
+{
+	cmyk_allocator allocator;
+	jpeg::decode_options options;
+	options.allocator = &allocator;
+
+	const char *files[] = {"cmyk_adobe_32x32.jpg", "ycck_adobe_32x32.jpg"};
+	const unsigned int tolerances[] = {3, 10};
+	for (unsigned int file = 0; file < sizeof(files) / sizeof(files[0]); file++)
+	{
+		bitmap bitmap;
+		decode_image(bitmap, stream, files[file], options);
+		ASSERT(bitmap.bytes_per_pixel == 4 && bitmap.components[0].type == bitmap_component::CYAN,
+				"Expected a CMYK bitmap for " << files[file], stream);
+
+		for (unsigned int y = 0; y < bitmap.height; y++)
+		{
+			for (unsigned int x = 0; x < bitmap.width; x++)
+			{
+				unsigned int ink[4];
+				adobe_fixture_ink(x, y, ink);
+				const unsigned char *pixel = bitmap.scanline(y) + x * 4;
+				for (unsigned int component = 0; component < 4; component++)
+				{
+					ASSERT(close_to(pixel[component], ink[component], tolerances[file]), "Wrong ink " << component << " at " << x
+							<< 'x' << y << " for " << files[file] << ": " << static_cast<unsigned int>(pixel[component])
+							<< " instead of " << ink[component], stream);
+				}
+			}
+		}
+	}
+
+	// Images in other colour models are not affected by allocate_cmyk
+	bitmap rgb;
+	decode_image(rgb, stream, "rgb_adobe_32x32.jpg", options);
+	ASSERT(rgb.bytes_per_pixel == 3 && rgb.components[0].type == bitmap_component::RED,
+			"Expected a RGB bitmap for an image in RGB", stream);
+}
+
+void test_adobe_rgb(std::ostream &stream)
+{
+	// Red, green and blue are written without any transform, as an Adobe segment tells
+	bitmap bitmap;
+	decode_image(bitmap, stream, "rgb_adobe_32x32.jpg");
+	for (unsigned int y = 0; y < bitmap.height; y++)
+	{
+		for (unsigned int x = 0; x < bitmap.width; x++)
+		{
+			unsigned int ink[4];
+			adobe_fixture_ink(x, y, ink);
+			const unsigned int expected[] = {ink[0], ink[1], ink[3]};
+			const unsigned char *pixel = bitmap.scanline(y) + x * 3;
+			for (unsigned int component = 0; component < 3; component++)
+			{
+				ASSERT(close_to(pixel[component], expected[component], 3), "Wrong colour at " << x << 'x' << y,
+						stream);
+			}
+		}
+	}
+
+	padded_planar_allocator allocator;
+	jpeg::decode_options options;
+	options.planar = &allocator;
+
+	bool thrown = false;
+	try
+	{
+		decode_image(bitmap, stream, "rgb_adobe_32x32.jpg", options);
+	}
+	catch (jpeg::unsupported_output &)
+	{
+		thrown = true;
+	}
+	ASSERT(thrown, "Expected RGB images to be rejected for planar output", stream);
+}
+
+void test_adobe_short_segment(std::ostream &stream)
+{
+	// The Adobe segment is read even without a diagnostics sink, so its length is always checked
+	const std::string file = encode_noise(16, 16);
+	for (unsigned int size = 0; size < 2; size++)
+	{
+		std::istringstream input(with_segment_length(file, jpeg_marker::ADOBE, size));
+		ASSERT(!jpeg::validate(input).valid, "Adobe segment of size " << size << " accepted", stream);
+	}
+
+	// An empty one is only reported, and the image is decoded as if it was not there
+	recording_diagnostics diagnostics;
+	jpeg::decode_options options;
+	options.diagnostics = &diagnostics;
+	std::istringstream input(with_segment_length(file, jpeg_marker::ADOBE, 2));
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, input, options);
+	ASSERT(diagnostics.events[0].marker == jpeg_marker::ADOBE &&
+			diagnostics.events[0].warning == jpeg::diagnostic_event::INVALID_ADOBE,
+			"Expected the empty Adobe segment to be reported as invalid", stream);
+	ASSERT(bitmap.width == 16 && bitmap.height == 16, "Wrong size for the image", stream);
+}
+
+void test_output_format_gray(std::ostream &stream)
+{
+	jpeg::encode_options encoding;
+	encoding.grayscale = true;
+	encoding.progressive = true;
+	const std::string file = encode_noise(21, 13, encoding);
+	std::istringstream gray_input(file);
+	bitmap gray;
+	jpeg::decode_image(gray, gray_input);
+
+	keeping_preview_listener listener(true);
+	jpeg::decode_options options;
+	options.output_format = jpeg::OUTPUT_BGRX8888;
+	options.preview = &listener;
+	std::istringstream input(file);
+	bitmap packed;
+	jpeg::decode_image(packed, input, options);
+
+	ASSERT(packed.bytes_per_pixel == 4 && packed.components_amount == 3 &&
+			packed.components[0].type == bitmap_component::BLUE, "Expected a BGRX bitmap", stream);
+	ASSERT(listener.kept.bytes_per_pixel == 4, "Expected a BGRX preview", stream);
+	for (unsigned int y = 0; y < packed.height; y++)
+	{
+		for (unsigned int x = 0; x < packed.width; x++)
+		{
+			const unsigned char *pixel = packed.scanline(y) + x * 4;
+			const unsigned char luminance = gray.scanline(y)[x];
+			ASSERT(pixel[0] == luminance && pixel[1] == luminance && pixel[2] == luminance,
+					"Wrong pixel at " << x << 'x' << y, stream);
+		}
+	}
+}
+
+/**
+ * Inserts an EXIF segment with the given orientation just after the start of image, as cameras
+ * write it, with its TIFF structure in little or big endian.
+ */
+std::string with_exif(const std::string &file, unsigned int orientation, bool little_endian)
+{
+	const unsigned char little_tiff[] = {'I', 'I', 42, 0, 8, 0, 0, 0, 1, 0, 0x12, 0x01, 3, 0, 1, 0, 0, 0,
+			static_cast<unsigned char>(orientation), 0, 0, 0, 0, 0, 0, 0};
+	const unsigned char big_tiff[] = {'M', 'M', 0, 42, 0, 0, 0, 8, 0, 1, 0x01, 0x12, 0, 3, 0, 0, 0, 1,
+			0, static_cast<unsigned char>(orientation), 0, 0, 0, 0, 0, 0};
+	const unsigned char *tiff = little_endian? little_tiff : big_tiff;
+
+	std::string segment("\xFF\xE1\x00\x22" "Exif", 8);
+	segment.append(2, '\0');
+	segment.append(reinterpret_cast<const char *>(tiff), sizeof(little_tiff));
+	return file.substr(0, 2) + segment + file.substr(2);
+}
+
+/**
+ * Position where the pixel at (x, y) of an image of the given size is shown for each orientation,
+ * as the EXIF specification draws them.
+ */
+void oriented_position(unsigned int orientation, unsigned int width, unsigned int height, unsigned int x,
+		unsigned int y, unsigned int &oriented_x, unsigned int &oriented_y)
+{
+	const unsigned int positions[][2] = {
+			{x, y}, {width - 1 - x, y}, {width - 1 - x, height - 1 - y}, {x, height - 1 - y},
+			{y, x}, {height - 1 - y, x}, {height - 1 - y, width - 1 - x}, {y, width - 1 - x}};
+	oriented_x = positions[orientation - 1][0];
+	oriented_y = positions[orientation - 1][1];
+}
+
+/**
+ * Checks that each pixel of the plain decode is found where the orientation moves it.
+ */
+bool oriented_pixels(const bitmap &plain, const bitmap &oriented, unsigned int orientation)
+{
+	const bool transposed = orientation >= 5;
+	if (oriented.width != (transposed? plain.height : plain.width) ||
+			oriented.height != (transposed? plain.width : plain.height) ||
+			oriented.bytes_per_pixel != plain.bytes_per_pixel)
+	{
+		return false;
+	}
+
+	for (unsigned int y = 0; y < plain.height; y++)
+	{
+		for (unsigned int x = 0; x < plain.width; x++)
+		{
+			unsigned int oriented_x;
+			unsigned int oriented_y;
+			oriented_position(orientation, plain.width, plain.height, x, y, oriented_x, oriented_y);
+			const unsigned char *pixel = plain.scanline(y) + x * plain.bytes_per_pixel;
+			if (!std::equal(pixel, pixel + plain.bytes_per_pixel,
+					oriented.scanline(oriented_y) + oriented_x * oriented.bytes_per_pixel))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+class bottom_up_allocator : public rgb_allocator
+{
+public:
+	virtual void allocate(bitmap &bitmap, unsigned int width, unsigned int height)
+	{
+		rgb_allocator::allocate(bitmap, width, height);
+		bitmap.bottom_up = true;
+	}
+};
+
+void test_exif_orientation(std::ostream &stream)
+{
+	jpeg::encode_options progressive;
+	progressive.sampling = jpeg::SAMPLING_422;
+	progressive.progressive = true;
+	jpeg::encode_options gray;
+	gray.grayscale = true;
+	const std::string files[] = {encode_noise(37, 21), encode_noise(37, 21, progressive), encode_noise(37, 21, gray)};
+	const jpeg::output_format_e formats[] = {jpeg::OUTPUT_DEFAULT, jpeg::OUTPUT_RGB565, jpeg::OUTPUT_DEFAULT};
+	bottom_up_allocator allocator;
+	for (unsigned int file = 0; file < 3; file++)
+	{
+		for (unsigned int orientation = 1; orientation <= 8; orientation++)
+		{
+			jpeg::decode_options options;
+			options.output_format = formats[file];
+
+			std::istringstream plain_input(files[file]);
+			bitmap plain;
+			jpeg::decode_image(plain, plain_input, options);
+
+			options.apply_orientation = true;
+			std::istringstream oriented_input(with_exif(files[file], orientation, orientation % 2 == 0));
+			bitmap oriented;
+			jpeg::decode_image(oriented, oriented_input, options);
+			ASSERT(oriented_pixels(plain, oriented, orientation), "Wrong image for file " << file
+					<< " and orientation " << orientation, stream);
+
+			// Rows are stepped backwards in bottom up bitmaps
+			if (file == 2)
+			{
+				rgb_allocator top_down_allocator;
+				jpeg::decode_options top_down_options;
+				top_down_options.allocator = &top_down_allocator;
+				std::istringstream top_down_input(files[file]);
+				jpeg::decode_image(plain, top_down_input, top_down_options);
+
+				options.allocator = &allocator;
+				std::istringstream bottom_up_input(with_exif(files[file], orientation, true));
+				jpeg::decode_image(oriented, bottom_up_input, options);
+				ASSERT(oriented_pixels(plain, oriented, orientation),
+						"Wrong bottom up image for orientation " << orientation, stream);
+			}
+		}
+	}
+
+	// Without the option, the segment is just reported
+	std::istringstream input(with_exif(files[0], 6, true));
+	bitmap unrotated;
+	jpeg::decode_image(unrotated, input);
+	ASSERT(unrotated.width == 37 && unrotated.height == 21, "Image oriented without being asked", stream);
+}
+
+void test_exif_orientation_crop(std::ostream &stream)
+{
+	const std::string file = encode_noise(70, 37);
+	jpeg::encode_options encoding;
+	encoding.progressive = true;
+	const std::string progressive_file = encode_noise(70, 37, encoding);
+	for (unsigned int orientation = 1; orientation <= 8; orientation++)
+	{
+		jpeg::decode_options options;
+		options.apply_orientation = true;
+
+		std::istringstream whole_input(with_exif(file, orientation, true));
+		bitmap whole;
+		jpeg::decode_image(whole, whole_input, options);
+
+		// The region is taken from the image as shown, and clipped to it
+		options.crop = jpeg::region(13, 9, 21, 100);
+		std::istringstream crop_input(with_exif(file, orientation, true));
+		bitmap cropped;
+		jpeg::decode_image(cropped, crop_input, options);
+
+		const unsigned int expected_height = whole.height - 9;
+		ASSERT(cropped.width == 21 && cropped.height == expected_height, "Expected region of 21x"
+				<< expected_height << " but was " << cropped.width << 'x' << cropped.height
+				<< " for orientation " << orientation, stream);
+		for (unsigned int y = 0; y < cropped.height; y++)
+		{
+			ASSERT(std::equal(cropped.scanline(y), cropped.scanline(y) + cropped.width * 3,
+					whole.scanline(y + 9) + 13 * 3), "Wrong row " << y << " for orientation " << orientation,
+					stream);
+		}
+
+		// The preview is oriented as well
+		keeping_preview_listener listener(true);
+		options.crop = jpeg::region();
+		options.preview = &listener;
+		std::istringstream progressive_input(with_exif(progressive_file, orientation, false));
+		bitmap progressive;
+		jpeg::decode_image(progressive, progressive_input, options);
+		ASSERT(same_pixels(whole, progressive), "Progressive image differs for orientation " << orientation,
+				stream);
+
+		const bool transposed = orientation >= 5;
+		ASSERT(listener.kept.width == (transposed? 5u : 9u) && listener.kept.height == (transposed? 9u : 5u),
+				"Wrong preview size " << listener.kept.width << 'x' << listener.kept.height
+				<< " for orientation " << orientation, stream);
+	}
+}
+
+void test_exif_diagnostics(std::ostream &stream)
+{
+	const std::string file = encode_noise(37, 21);
+	std::string invalid = with_exif(file, 9, true);
+
+	recording_diagnostics diagnostics;
+	jpeg::decode_options options;
+	options.diagnostics = &diagnostics;
+	options.apply_orientation = true;
+
+	// An unknown orientation makes the whole segment invalid, and the image is not oriented
+	std::istringstream input(invalid);
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, input, options);
+	ASSERT(!diagnostics.events.empty() && diagnostics.events[0].marker == jpeg_marker::EXIF &&
+			diagnostics.events[0].warning == jpeg::diagnostic_event::INVALID_EXIF,
+			"Expected the EXIF segment to be reported as invalid", stream);
+	ASSERT(bitmap.width == 37 && bitmap.height == 21, "Image oriented from an invalid segment", stream);
+
+	// An IFD beyond the segment
+	invalid = with_exif(file, 6, true);
+	invalid[16] = 0x7F;
+	diagnostics.events.clear();
+	std::istringstream beyond_input(invalid);
+	jpeg::decode_image(bitmap, beyond_input, options);
+	ASSERT(diagnostics.events[0].warning == jpeg::diagnostic_event::INVALID_EXIF,
+			"Expected an IFD beyond the segment to be reported", stream);
+	ASSERT(bitmap.width == 37 && bitmap.height == 21, "Image oriented from an invalid segment", stream);
+
+	// Other APP1 segments, like XMP, are not EXIF
+	std::string xmp = with_exif(file, 6, true);
+	xmp[6] = 'X';
+	diagnostics.events.clear();
+	std::istringstream xmp_input(xmp);
+	jpeg::decode_image(bitmap, xmp_input, options);
+	ASSERT(diagnostics.events[0].warning == jpeg::diagnostic_event::NO_WARNING,
+			"Unexpected warning for a segment that is not EXIF", stream);
+	ASSERT(bitmap.width == 37 && bitmap.height == 21, "Image oriented from a segment that is not EXIF", stream);
+}
+
 }
 
 const test_bench_results jpeg::test_bench::run() throw()
@@ -241,6 +2589,63 @@ const test_bench_results jpeg::test_bench::run() throw()
 	vector.push_back(test("test for mixed black white 8x8 jpeg file", test_black_white_8x8_file));
 	vector.push_back(test("test for YCbCr JPEG with subsample 2x1, 1x1, 1x1 (4:2:2) and 70% compression", test_subsample_422_file));
 	vector.push_back(test("test for YCbCr JPEG with subsample 1x2, 1x1, 1x1 and 70% compression", test_subsample_422_Y12_file));
+	vector.push_back(test("test for tables reused from a shared cache", test_shared_table_cache));
+	vector.push_back(test("test for evicting tables from a shared cache in use", test_table_cache_limits));
+	vector.push_back(test("test for segments reported to the diagnostics sink", test_diagnostics_sink));
+	vector.push_back(test("test for decoding straight into a mapped BMP file", test_decode_into_mapped_bmp));
+	vector.push_back(test("test for stats filled while decoding", test_decode_stats));
+	vector.push_back(test("test for stage changes notified while decoding", test_decode_stats_listener));
+	vector.push_back(test("test for allocations accounted while decoding", test_decode_allocations));
+	vector.push_back(test("test for images over the pixel limit", test_pixel_limit));
+	vector.push_back(test("test for images over the memory budget", test_memory_budget));
+	vector.push_back(test("test for rejecting a huge frame before allocating it", test_huge_frame_rejected));
+	vector.push_back(test("test for decoding a region of the image", test_crop));
+	vector.push_back(test("test for skipping fill bytes before restart markers", test_restart_fill_bytes));
+	vector.push_back(test("test for rejecting a region outside the image", test_crop_outside));
+	vector.push_back(test("test for skipping work outside the region", test_crop_stats));
+	vector.push_back(test("test for writing and reading an MCU index", test_index_serialization));
+	vector.push_back(test("test for decoding regions from an MCU index", test_index_region));
+	vector.push_back(test("test for ignoring an MCU index from another image", test_index_from_other_image));
+	vector.push_back(test("test for ignoring an MCU index from another file", test_index_from_other_file));
+	vector.push_back(test("test for validating truncated files", test_validate));
+	vector.push_back(test("test for validating a marker within the scan data", test_validate_marker_in_scan));
+	vector.push_back(test("test for validating without transforming blocks", test_validate_stats));
+	vector.push_back(test("test for rejecting segments whose length is below 2", test_segment_length_below_2));
+	vector.push_back(test("test for rejecting invalid frame and scan headers", test_invalid_headers));
+	vector.push_back(test("test for rejecting huffman tables beyond their segment or the allowed ones",
+			test_invalid_huffman_tables));
+	vector.push_back(test("test for rejecting tables not defined", test_undefined_tables));
+	vector.push_back(test("test for decoding progressive images", test_progressive));
+	vector.push_back(test("test for decoding a region of a progressive image", test_progressive_crop));
+	vector.push_back(test("test for keeping progressive coefficients in 2 bytes", test_progressive_memory));
+	vector.push_back(test("test for validating progressive images", test_progressive_validate));
+	vector.push_back(test("test for previewing progressive images from their DC coefficients", test_progressive_preview));
+	vector.push_back(test("test for decoding only the first scans", test_max_scans));
+	vector.push_back(test("test for decoding rows as their bytes arrive", test_incremental));
+	vector.push_back(test("test for decoding progressive images as their bytes arrive", test_incremental_progressive));
+	vector.push_back(test("test for truncated and corrupt files fed in chunks", test_incremental_errors));
+	vector.push_back(test("test for decoding grayscale images into a single component", test_grayscale));
+	vector.push_back(test("test for decoding progressive grayscale images", test_grayscale_progressive));
+	vector.push_back(test("test for decoding grayscale images into RGB bitmaps", test_grayscale_into_rgb_bitmap));
+	vector.push_back(test("test for decoding grayscale images in a byte per pixel", test_grayscale_memory));
+	vector.push_back(test("test for decoding only the luminance of colour images", test_luminance_only));
+	vector.push_back(test("test for skipping chrominance work when decoding the luminance", test_luminance_only_stats));
+	vector.push_back(test("test for decoding into planes at native resolution", test_planar));
+	vector.push_back(test("test for decoding into NV12 planes", test_planar_nv12));
+	vector.push_back(test("test for rejecting planar output without a planar format", test_planar_unsupported));
+	vector.push_back(test("test for skipping upsampling and conversion in planar output", test_planar_stats));
+	vector.push_back(test("test for decoding into packed output formats", test_output_formats));
+	vector.push_back(test("test for decoding grayscale images into a packed output format", test_output_format_gray));
+	vector.push_back(test("test for converting CMYK and YCCK images into RGB", test_adobe_cmyk));
+	vector.push_back(test("test for decoding CMYK and YCCK images into CMYK bitmaps", test_adobe_cmyk_bitmap));
+	vector.push_back(test("test for decoding RGB images told by the Adobe segment", test_adobe_rgb));
+	vector.push_back(test("test for rejecting Adobe segments shorter than their length", test_adobe_short_segment));
+	vector.push_back(test("test for decoding 12 bits images into 16 bits components", test_precision_12));
+	vector.push_back(test("test for decoding 12 bits images into 8 bits components", test_precision_12_reduced));
+	vector.push_back(test("test for decoding into the RGB161616 output format", test_output_format_rgb161616));
+	vector.push_back(test("test for applying the EXIF orientation while decoding", test_exif_orientation));
+	vector.push_back(test("test for decoding a region of an oriented image", test_exif_orientation_crop));
+	vector.push_back(test("test for reporting invalid EXIF segments", test_exif_diagnostics));
 
 	test_result *tests = new test_result[vector.size()];
 	test_bench_results result(vector.size(), tests);
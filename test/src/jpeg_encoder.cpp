@@ -0,0 +1,290 @@
+/*
+ * jpeg_encoder.cpp
+ */
+
+#include "benches.hpp"
+
+#include "jpeg.hpp"
+#include "jpeg_encoder.hpp"
+#include "jpeg_markers.hpp"
+#include "synthetic_image.hpp"
+
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+namespace
+{
+
+#define ASSERT(CONDITION, MESSAGE, STREAM) \
+	if (!(CONDITION)) \
+	{ \
+		STREAM << MESSAGE << std::endl; \
+		throw 0; \
+	}
+
+void encode_and_decode(std::ostream &stream, bitmap &bitmap, synthetic_image &image, unsigned int width,
+		unsigned int height, const jpeg::encode_options &options)
+{
+	std::stringstream file;
+	jpeg::encode_image(image, width, height, file, options);
+
+	try
+	{
+		jpeg::decode_image(bitmap, file);
+	}
+	catch (jpeg::invalid_file_format &)
+	{
+		stream << "Encoded file cannot be decoded" << std::endl;
+		throw 0;
+	}
+
+	ASSERT(bitmap.width == width && bitmap.height == height, "Invalid size " << bitmap.width << 'x'
+			<< bitmap.height << " for an image of " << width << 'x' << height, stream);
+}
+
+/**
+ * Returns the average difference per component between the decoded bitmap and the synthetic image.
+ */
+double average_error(const bitmap &bitmap, const synthetic_image &image)
+{
+	uint_fast64_t total = 0;
+	for (unsigned int row = 0; row < bitmap.height; row++)
+	{
+		const unsigned char *decoded = bitmap.scanline(row);
+		for (unsigned int column = 0; column < bitmap.width; column++)
+		{
+			unsigned char expected[3];
+			image.pixel(column, row, expected);
+			for (unsigned int component = 0; component < 3; component++)
+			{
+				total += std::abs(static_cast<int>(decoded[component]) - expected[component]);
+			}
+			decoded += bitmap.bytes_per_pixel;
+		}
+	}
+
+	return static_cast<double>(total) / (bitmap.width * bitmap.height * 3);
+}
+
+void test_gradient(std::ostream &stream, jpeg::sampling_e sampling)
+{
+	// Sizes that are not multiple of the MCU size on purpose
+	const unsigned int width = 75;
+	const unsigned int height = 45;
+	synthetic_image image(width, height, synthetic_image::GRADIENT);
+
+	jpeg::encode_options options;
+	options.quality = 90;
+	options.sampling = sampling;
+
+	bitmap bitmap;
+	encode_and_decode(stream, bitmap, image, width, height, options);
+
+	const double error = average_error(bitmap, image);
+	ASSERT(error < 3, "Average error per component is " << error, stream);
+}
+
+void test_gradient_444(std::ostream &stream)
+{
+	test_gradient(stream, jpeg::SAMPLING_444);
+}
+
+void test_gradient_422(std::ostream &stream)
+{
+	test_gradient(stream, jpeg::SAMPLING_422);
+}
+
+void test_gradient_420(std::ostream &stream)
+{
+	test_gradient(stream, jpeg::SAMPLING_420);
+}
+
+void test_grayscale(std::ostream &stream)
+{
+	const unsigned int width = 75;
+	const unsigned int height = 45;
+	synthetic_image image(width, height, synthetic_image::GRADIENT);
+
+	jpeg::encode_options options;
+	options.quality = 90;
+	options.sampling = jpeg::SAMPLING_444;
+
+	std::stringstream colour_file;
+	jpeg::encode_image(image, width, height, colour_file, options);
+
+	options.grayscale = true;
+	std::stringstream gray_file;
+	jpeg::encode_image(image, width, height, gray_file, options);
+	ASSERT(gray_file.str().size() < colour_file.str().size(), "Grayscale file is not smaller", stream);
+
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, gray_file);
+	ASSERT(bitmap.components_amount == 1 && bitmap.components[0].type == bitmap_component::LUMINANCE,
+			"Grayscale file not decoded as gray", stream);
+
+	uint_fast64_t total = 0;
+	for (unsigned int row = 0; row < height; row++)
+	{
+		for (unsigned int column = 0; column < width; column++)
+		{
+			unsigned char rgb[3];
+			image.pixel(column, row, rgb);
+			const int luminance = 0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2] + 0.5f;
+			total += std::abs(bitmap.scanline(row)[column] - luminance);
+		}
+	}
+
+	const double error = static_cast<double>(total) / (width * height);
+	ASSERT(error < 2, "Average error is " << error, stream);
+}
+
+void test_quality(std::ostream &stream)
+{
+	const unsigned int side = 64;
+	synthetic_image image(side, side, synthetic_image::NOISE);
+
+	jpeg::encode_options options;
+	options.sampling = jpeg::SAMPLING_444;
+
+	std::stringstream low_file;
+	options.quality = 10;
+	jpeg::encode_image(image, side, side, low_file, options);
+
+	std::stringstream high_file;
+	options.quality = 95;
+	jpeg::encode_image(image, side, side, high_file, options);
+
+	ASSERT(low_file.str().size() < high_file.str().size(), "Lower quality should result in smaller files", stream);
+
+	bitmap low_bitmap;
+	jpeg::decode_image(low_bitmap, low_file);
+
+	bitmap high_bitmap;
+	jpeg::decode_image(high_bitmap, high_file);
+
+	const double low_error = average_error(low_bitmap, image);
+	const double high_error = average_error(high_bitmap, image);
+	ASSERT(high_error < low_error, "Average error for quality 95 is " << high_error
+			<< " but for quality 10 is " << low_error, stream);
+}
+
+void test_restart_interval(std::ostream &stream)
+{
+	const unsigned int width = 200;
+	const unsigned int height = 72;
+	synthetic_image image(width, height, synthetic_image::FLAT, 7);
+
+	jpeg::encode_options options;
+	bitmap expected;
+	encode_and_decode(stream, expected, image, width, height, options);
+
+	// 13 MCUs per row and 5 rows. So that markers go through all RSTn values and
+	// some intervals start in the middle of a row.
+	options.restart_interval = 3;
+	std::stringstream file;
+	jpeg::encode_image(image, width, height, file, options);
+
+	const std::string content = file.str();
+	unsigned int markers = 0;
+	for (unsigned int index = 0; index + 1 < content.size(); index++)
+	{
+		if (static_cast<unsigned char>(content[index]) == jpeg_marker::MARKER &&
+				static_cast<unsigned char>(content[index + 1]) == jpeg_marker::RESTART_BASE + (markers & 7))
+		{
+			markers++;
+		}
+	}
+	ASSERT(markers == 21, "Expected 21 restart markers but found " << markers, stream);
+
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, file);
+
+	for (unsigned int row = 0; row < height; row++)
+	{
+		ASSERT(std::equal(bitmap.scanline(row), bitmap.scanline(row) + width * 3, expected.scanline(row)),
+				"Row " << row << " is different when decoded with restart markers", stream);
+	}
+}
+
+void test_bitmap_source(std::ostream &stream)
+{
+	const unsigned int width = 24;
+	const unsigned int height = 16;
+	synthetic_image image(width, height, synthetic_image::GRADIENT);
+
+	jpeg::encode_options options;
+	options.quality = 100;
+	options.sampling = jpeg::SAMPLING_444;
+
+	bitmap original;
+	encode_and_decode(stream, original, image, width, height, options);
+
+	std::stringstream file;
+	jpeg::encode_image(original, file, options);
+
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, file);
+
+	const double error = average_error(bitmap, image);
+	ASSERT(error < 2, "Average error per component is " << error, stream);
+}
+
+void test_wide_image(std::ostream &stream)
+{
+	// As wide as the largest images expected in the benchmarks
+	const unsigned int width = 16384;
+	const unsigned int height = 64;
+	synthetic_image image(width, height, synthetic_image::GRADIENT);
+
+	jpeg::encode_options options;
+	options.quality = 90;
+	options.restart_interval = 64;
+
+	bitmap bitmap;
+	encode_and_decode(stream, bitmap, image, width, height, options);
+
+	const double error = average_error(bitmap, image);
+	ASSERT(error < 3, "Average error per component is " << error, stream);
+}
+
+void test_invalid_size(std::ostream &stream)
+{
+	synthetic_image image(70000, 8, synthetic_image::FLAT);
+	std::stringstream file;
+
+	try
+	{
+		jpeg::encode_image(image, 70000, 8, file);
+	}
+	catch (std::invalid_argument &)
+	{
+		return;
+	}
+
+	stream << "Images wider than 65535 pixels should not be encoded" << std::endl;
+	throw 0;
+}
+
+}
+
+const test_bench_results jpeg_encoder::test_bench::run() throw()
+{
+	std::vector<test_result> vector;
+	vector.push_back(test("test for encoding gradient without subsampling (4:4:4)", test_gradient_444));
+	vector.push_back(test("test for encoding gradient with subsample 2x1 (4:2:2)", test_gradient_422));
+	vector.push_back(test("test for encoding gradient with subsample 2x2 (4:2:0)", test_gradient_420));
+	vector.push_back(test("test for encoding only the luminance", test_grayscale));
+	vector.push_back(test("test for encoding with different qualities", test_quality));
+	vector.push_back(test("test for encoding with restart markers", test_restart_interval));
+	vector.push_back(test("test for encoding a bitmap", test_bitmap_source));
+	vector.push_back(test("test for encoding a 16384 pixels wide image", test_wide_image));
+	vector.push_back(test("test for rejecting images too large for JPEG", test_invalid_size));
+
+	test_result *tests = new test_result[vector.size()];
+	test_bench_results result(vector.size(), tests);
+
+	std::copy(vector.begin(), vector.end(), tests);
+	return result;
+}
@@ -38,6 +38,26 @@ bool test(const std::string title, void (*function)(std::ostream &))
 	return false;
 }
 
+/**
+ * Prints the results of the given test bench and adds them to the totals.
+ */
+void report(const test_bench_results &results)
+{
+	const unsigned int total_tests = results.total();
+	for (unsigned int index = 0; index < total_tests; index++)
+	{
+		const test_result result = results.tests[index];
+		std::cout << result.title << "... " << (result.passed? "ok" : "ko") << std::endl;
+		if (!result.passed)
+		{
+			std::cerr << result.log << std::endl;
+		}
+	}
+
+	passed_tests += results.passed();
+	failed_tests += results.failed();
+}
+
 }
 
 void testOK(std::ostream &stream)
@@ -123,35 +143,11 @@ int main(int argc, char *argv[])
 	test("test plain block_matrix DCT", test_plain_block_matrix_dct);
 	test("test black and white block_matrix DCT", test_black_white_block_matrix_dct);
 
-	const test_bench_results huffman_tables_results = huffman_tables::test_bench().run();
-	const unsigned int total_huffman_tables_tests = huffman_tables_results.total();
-	for (unsigned int index = 0; index < total_huffman_tables_tests; index++)
-	{
-		const test_result result = huffman_tables_results.tests[index];
-		std::cout << result.title << "... " << (result.passed? "ok" : "ko") << std::endl;
-		if (!result.passed)
-		{
-			std::cerr << result.log << std::endl;
-		}
-	}
-
-	passed_tests += huffman_tables_results.passed();
-	failed_tests += huffman_tables_results.failed();
-
-	const test_bench_results jpeg_results = jpeg::test_bench().run();
-	const unsigned int total_jpeg_tests = jpeg_results.total();
-	for (unsigned int index = 0; index < total_jpeg_tests; index++)
-	{
-		const test_result result = jpeg_results.tests[index];
-		std::cout << result.title << "... " << (result.passed? "ok" : "ko") << std::endl;
-		if (!result.passed)
-		{
-			std::cerr << result.log << std::endl;
-		}
-	}
-
-	passed_tests += jpeg_results.passed();
-	failed_tests += jpeg_results.failed();
+	report(huffman_tables::test_bench().run());
+	report(jpeg::test_bench().run());
+	report(bmp::test_bench().run());
+	report(jpeg_encoder::test_bench().run());
+	report(trace::test_bench().run());
 
 	std::cout << "Total amount of tests run: " << passed_tests + failed_tests << std::endl
 			<< "Total amount of passed tests: " << passed_tests << std::endl
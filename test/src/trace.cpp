@@ -0,0 +1,165 @@
+/*
+ * trace.cpp
+ */
+
+#include "benches.hpp"
+
+#include "trace.hpp"
+#include "jpeg.hpp"
+#include "jpeg_encoder.hpp"
+#include "synthetic_image.hpp"
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace
+{
+
+#define ASSERT(CONDITION, MESSAGE, STREAM) \
+	if (!(CONDITION)) \
+	{ \
+		STREAM << MESSAGE << std::endl; \
+		throw 0; \
+	}
+
+std::string recorded_json()
+{
+	std::ostringstream json;
+	trace::write_chrome_json(json);
+	return json.str();
+}
+
+unsigned int occurrences(const std::string &text, const std::string &pattern)
+{
+	unsigned int amount = 0;
+	for (std::string::size_type position = text.find(pattern); position != std::string::npos;
+			position = text.find(pattern, position + pattern.size()))
+	{
+		amount++;
+	}
+
+	return amount;
+}
+
+/**
+ * Returns the thread id of the first span with the given name, or an empty string if missing.
+ */
+std::string span_thread(const std::string &json, const std::string &name)
+{
+	const std::string::size_type span_position = json.find("{\"name\": \"" + name + "\"");
+	if (span_position == std::string::npos)
+	{
+		return std::string();
+	}
+
+	const std::string tid_key("\"tid\": ");
+	const std::string::size_type tid_position = json.find(tid_key, span_position) + tid_key.size();
+	return json.substr(tid_position, json.find(',', tid_position) - tid_position);
+}
+
+void record_span_in_other_thread()
+{
+	trace::span span("other thread span", "test");
+}
+
+void test_not_recording(std::ostream &stream)
+{
+	trace::start();
+	trace::stop();
+
+	{
+		trace::span span("ignored span", "test");
+	}
+	trace::record("ignored record", "test", 0, 1);
+
+	const std::string json = recorded_json();
+	ASSERT(json.find("ignored") == std::string::npos, "Spans recorded while stopped", stream);
+}
+
+void test_threads(std::ostream &stream)
+{
+	trace::start();
+	{
+		trace::span span("main thread span", "test", "detail \"quoted\"", 7);
+		std::thread other(record_span_in_other_thread);
+		other.join();
+	}
+	trace::stop();
+
+	const std::string json = recorded_json();
+	const std::string main_thread = span_thread(json, "main thread span");
+	const std::string other_thread = span_thread(json, "other thread span");
+	ASSERT(!main_thread.empty() && !other_thread.empty(), "Missing spans in " << json, stream);
+	ASSERT(main_thread != other_thread, "Both threads share the id " << main_thread, stream);
+	ASSERT(json.find("\"args\": {\"detail\": \"detail \\\"quoted\\\"\", \"index\": 7}") != std::string::npos,
+			"Wrong arguments in " << json, stream);
+}
+
+void test_restart(std::ostream &stream)
+{
+	trace::start();
+	trace::record("old span", "test", 0, 1);
+	trace::start();
+	trace::record("new span", "test", 0, 1);
+	trace::stop();
+
+	const std::string json = recorded_json();
+	ASSERT(json.find("old span") == std::string::npos, "Starting again should discard old spans", stream);
+	ASSERT(json.find("new span") != std::string::npos, "Missing span in " << json, stream);
+}
+
+void test_many_spans(std::ostream &stream)
+{
+	// More than a single chunk of events
+	const unsigned int amount = 10000;
+	trace::start();
+	for (unsigned int index = 0; index < amount; index++)
+	{
+		trace::record("repeated span", "test", index, index + 1, NULL, index);
+	}
+	trace::stop();
+
+	const unsigned int found = occurrences(recorded_json(), "\"repeated span\"");
+	ASSERT(found == amount, "Expected " << amount << " spans but found " << found, stream);
+}
+
+void test_decode(std::ostream &stream)
+{
+	const unsigned int width = 64;
+	const unsigned int height = 48;
+	// 4:2:0 sampling gives MCUs of 16x16 pixels
+	std::istringstream file(synthetic_image(width, height, synthetic_image::GRADIENT).encode());
+
+	trace::start();
+	bitmap bitmap;
+	jpeg::decode_image(bitmap, file);
+	trace::stop();
+
+	const std::string json = recorded_json();
+	const unsigned int rows = occurrences(json, "\"MCU row\"");
+	ASSERT(rows == height / 16, "Expected " << height / 16 << " MCU rows but found " << rows, stream);
+	ASSERT(occurrences(json, "\"jpeg::decode_image\"") == 1, "Missing decode span", stream);
+	ASSERT(occurrences(json, "\"marker parsing\"") == 1, "Missing marker parsing span", stream);
+	ASSERT(occurrences(json, "\"scan data\"") == 1, "Missing scan data span", stream);
+}
+
+}
+
+const test_bench_results trace::test_bench::run() throw()
+{
+	std::vector<test_result> vector;
+	vector.push_back(test("test for nothing being recorded while stopped", test_not_recording));
+	vector.push_back(test("test for spans from different threads", test_threads));
+	vector.push_back(test("test for discarding spans when starting again", test_restart));
+	vector.push_back(test("test for recording more spans than a chunk holds", test_many_spans));
+	vector.push_back(test("test for spans recorded while decoding", test_decode));
+
+	test_result *tests = new test_result[vector.size()];
+	test_bench_results result(vector.size(), tests);
+
+	std::copy(vector.begin(), vector.end(), tests);
+	return result;
+}